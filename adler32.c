@@ -7,6 +7,10 @@
 
 #include "zutil.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define local static
 
 local uLong adler32_combine_(uLong adler1, uLong adler2, z_off64_t len2);
@@ -56,6 +60,51 @@ local uLong adler32_combine_(uLong adler1, uLong adler2, z_off64_t len2);
 #  define MOD4(a) a %= BASE
 #endif
 
+#if defined(__SSE2__)
+/* =========================================================================
+ * Add n blocks of 16 bytes (n * 16 <= NMAX) to the sums, with SSE2.  For
+ * each block, adler grows by the sum of its bytes, and sum2 by 16 times
+ * adler before it plus the bytes weighted 16, 15, ..., 1.  So sum2 grows
+ * by 16 * n * adler, 16 times the running byte sums before each block,
+ * and the weighted sums; none of it can exceed what the scalar loop adds.
+ */
+local void adler32_sse2 OF((unsigned long *adler, unsigned long *sum2,
+                            const Bytef *buf, unsigned n));
+local void adler32_sse2(adler, sum2, buf, n)
+    unsigned long *adler;
+    unsigned long *sum2;
+    const Bytef *buf;
+    unsigned n;
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wlo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i whi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i vs1 = zero, vps = zero, vs2 = zero, v;
+    unsigned k;
+    unsigned long s1, ps, w;
+
+    for (k = 0; k < n; k++) {
+        v = _mm_loadu_si128((const __m128i *)(buf + 16 * k));
+        vps = _mm_add_epi32(vps, vs1);
+        vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+        vs2 = _mm_add_epi32(vs2,
+                            _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo));
+        vs2 = _mm_add_epi32(vs2,
+                            _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+    }
+    /* the byte sums are in the low words of the two halves */
+    s1 = (unsigned long)_mm_cvtsi128_si32(vs1) +
+         (unsigned long)_mm_cvtsi128_si32(_mm_srli_si128(vs1, 8));
+    ps = (unsigned long)_mm_cvtsi128_si32(vps) +
+         (unsigned long)_mm_cvtsi128_si32(_mm_srli_si128(vps, 8));
+    vs2 = _mm_add_epi32(vs2, _mm_srli_si128(vs2, 8));
+    vs2 = _mm_add_epi32(vs2, _mm_srli_si128(vs2, 4));
+    w = (unsigned long)(unsigned)_mm_cvtsi128_si32(vs2);
+    *sum2 += 16UL * n * *adler + 16UL * (ps % BASE) + w;
+    *adler += s1;
+}
+#endif /* __SSE2__ */
+
 /* ========================================================================= */
 uLong ZEXPORT adler32(adler, buf, len)
     uLong adler;
@@ -100,16 +149,28 @@ uLong ZEXPORT adler32(adler, buf, len)
     while (len >= NMAX) {
         len -= NMAX;
         n = NMAX / 16;          /* NMAX is divisible by 16 */
+#if defined(__SSE2__)
+        adler32_sse2(&adler, &sum2, buf, n);
+        buf += NMAX;
+#else
         do {
             ADO16(buf);          /* 16 sums unrolled */
             buf += 16;
         } while (--n);
+#endif
         MOD(adler);
         MOD(sum2);
     }
 
     /* do remaining bytes (less than NMAX, still just one modulo) */
     if (len) {                  /* avoid modulos if none remaining */
+#if defined(__SSE2__)
+        if (len >= 16) {
+            adler32_sse2(&adler, &sum2, buf, len / 16);
+            buf += len & ~15U;
+            len &= 15;
+        }
+#endif
         while (len >= 16) {
             len -= 16;
             ADO16(buf);
@@ -0,0 +1,34 @@
+#! /bin/bash --
+#
+# c-bench.sh: Build jbig2bench, the kernel microbenchmarks, and jbig2corpus,
+# the end-to-end corpus benchmark.
+# Uses the zlib and libpng in this tree, so that they are what is measured.
+#
+set -ex
+rm -f *.o
+gcc -O2 -c \
+    -W -Wall \
+    -I. \
+    zall.c
+gcc -O2 -c \
+    -W -Wall -Wno-uninitialized -Wno-sign-compare \
+    -I. \
+    pngall.c
+gcc -O2 -c \
+    -W -Wall -Wno-uninitialized -Wno-unused-parameter -Wno-sign-compare \
+    -Wno-strict-aliasing -fno-strict-aliasing \
+    -I. \
+    leptonica.c
+g++ -fno-exceptions -fno-rtti -O2 -c \
+    -W -Wall \
+    -I. \
+    jbig2arith.cc jbig2comps.cc jbig2mmr.cc jbig2bench.cc
+g++ -fno-exceptions -fno-rtti -o jbig2bench \
+    zall.o pngall.o leptonica.o jbig2arith.o jbig2comps.o jbig2mmr.o \
+    jbig2bench.o \
+    -lpthread
+g++ -fno-exceptions -fno-rtti -O2 -o jbig2corpus \
+    -W -Wall \
+    jbig2corpus.cc
+echo OK.
+: OK.
@@ -36,7 +36,7 @@ $CXXC -fno-exceptions -fno-rtti -O2 -c \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc
+    jbig2arith.cc jbig2.cc jbig2comps.cc jbig2enc.cc jbig2mmr.cc jbig2sym.cc jbig2tiff.cc
 
 # ld: unknown option: --gc-sections
 # -Wl,-dead_strip instead of -l,-gc-sections
@@ -2,20 +2,34 @@
 # by pts@fazekas.hu at Tue Jul 17 13:45:54 CEST 2012
 set -ex
 rm -f *.o
+
+gcc -g -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall \
+    -I. \
+    zall.c
+
+gcc -g -c \
+    -ffunction-sections -fdata-sections \
+    -W -Wall -Wno-uninitialized -Wno-sign-compare \
+    -I. \
+    pngall.c
+
 gcc -g -c \
     -ffunction-sections -fdata-sections \
     -W -Wall -Wno-uninitialized -Wno-sign-compare -Wno-unused-parameter \
+    -I. \
     leptonica.c
 
 g++ -fno-exceptions -fno-rtti -g -c \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc
+    jbig2arith.cc jbig2.cc jbig2comps.cc jbig2enc.cc jbig2mmr.cc jbig2sym.cc jbig2tiff.cc
 
 #g++ -Wl,--gc-sections,--print-gc-sections
 g++ -Wl,--gc-sections \
     -fno-exceptions -fno-rtti -o jbig2.debug *.o \
-    -lpng -lz
+    -lpthread
 
 : OK.
@@ -33,7 +33,7 @@ g++ -fno-stack-protector \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc
+    jbig2arith.cc jbig2.cc jbig2comps.cc jbig2enc.cc jbig2mmr.cc jbig2sym.cc jbig2tiff.cc
 
 # Example stdin line: /usr/bin/ld: Removing unused section '.text._Z6answerv' in file 'jbig2.o'  
 demangle() {
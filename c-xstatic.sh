@@ -66,11 +66,11 @@ xstatic g++ -static -fno-stack-protector \
     -ffunction-sections -fdata-sections \
     -W -Wall \
     -I. \
-    jbig2arith.cc jbig2.cc jbig2enc.cc
+    jbig2arith.cc jbig2.cc jbig2comps.cc jbig2enc.cc jbig2mmr.cc jbig2sym.cc jbig2tiff.cc
 
 #g++ -Wl,--gc-sections,--print-gc-sections
 xstatic g++ -static -Wl,--gc-sections \
-    -fno-exceptions -fno-rtti -s -o jbig2.xstatic.uncompressed *.o
+    -fno-exceptions -fno-rtti -s -o jbig2.xstatic.uncompressed *.o -lpthread
 
 do_elfosfix jbig2.xstatic.uncompressed
 cp -a jbig2.xstatic.uncompressed jbig2.xstatic
@@ -64,6 +64,31 @@
 #  define TBLS 1
 #endif /* BYFOUR */
 
+/* Carry-less multiply folding (PCLMULQDQ) on x86, and the CRC32 instructions
+   of ARMv8 on AArch64: both are compiled in where the compiler can target
+   them, and used if the processor has them. */
+#if !defined(NO_CRC32_SIMD) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || \
+     defined(__clang__))
+#  if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#    define CRC32_PCLMUL
+#    include <cpuid.h>
+#    include <emmintrin.h>
+#    include <wmmintrin.h>
+#    include "jbig2simd.h"
+   local unsigned long crc32_pclmul OF((unsigned long,
+                        const unsigned char FAR *, unsigned));
+#  elif defined(__aarch64__) && defined(__linux__) && __GNUC__ >= 6
+#    define CRC32_ARMV8
+#    include <arm_acle.h>
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#    include "jbig2simd.h"
+   local unsigned long crc32_armv8 OF((unsigned long,
+                        const unsigned char FAR *, unsigned));
+#  endif
+#endif
+
 /* Local functions for crc concatenation */
 local unsigned long gf2_matrix_times OF((unsigned long *mat,
                                          unsigned long vec));
@@ -230,6 +255,30 @@ unsigned long ZEXPORT crc32(crc, buf, len)
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
+#if defined(CRC32_PCLMUL) || defined(CRC32_ARMV8)
+    {
+        static int simd = -1;   /* same answer on every thread */
+        if (simd < 0) {
+#  ifdef CRC32_PCLMUL
+            unsigned int eax, ebx, ecx, edx;
+            simd = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+                   (ecx & bit_PCLMUL) != 0;
+#  else
+            simd = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#  endif
+            if (simd_level() == SIMD_SCALAR)    /* forced, for benchmarks */
+                simd = 0;
+        }
+#  ifdef CRC32_PCLMUL
+        if (simd && len >= 64)
+            return crc32_pclmul(crc, buf, len);
+#  else
+        if (simd)
+            return crc32_armv8(crc, buf, len);
+#  endif
+    }
+#endif
+
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         u4 endian;
@@ -338,6 +387,142 @@ local unsigned long crc32_big(crc, buf, len)
 
 #endif /* BYFOUR */
 
+#ifdef CRC32_PCLMUL
+
+/* =========================================================================
+ * CRC-32 of len >= 64 bytes by folding 64 bytes at a time with carry-less
+ * multiplies, then reducing to 32 bits with a Barrett reduction, as in
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+ * (Gopal et al., Intel, 2009).  The constants are for the bit-reflected
+ * CRC-32 polynomial.  The last len % 16 bytes are done with the tables.
+ */
+__attribute__((target("sse2,pclmul")))
+local unsigned long crc32_pclmul(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    static const unsigned long long k1k2[2] __attribute__((aligned(16))) =
+        {0x0154442bd4ULL, 0x01c6e41596ULL};
+    static const unsigned long long k3k4[2] __attribute__((aligned(16))) =
+        {0x01751997d0ULL, 0x00ccaa009eULL};
+    static const unsigned long long k5k0[2] __attribute__((aligned(16))) =
+        {0x0163cd6124ULL, 0x0000000000ULL};
+    static const unsigned long long poly[2] __attribute__((aligned(16))) =
+        {0x01db710641ULL, 0x01f7011641ULL};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    unsigned c;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)(crc ^ 0xffffffffUL)));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four blocks of 16 in parallel */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold in the remaining blocks of 16 */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits to 64, then Barrett reduce to 32 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    while (len--)
+        c = (unsigned)crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return (unsigned long)(c ^ 0xffffffffU);
+}
+
+#endif /* CRC32_PCLMUL */
+
+#ifdef CRC32_ARMV8
+
+/* =========================================================================
+ * CRC-32 with the ARMv8 CRC32 instructions, eight bytes at a time.
+ */
+__attribute__((target("+crc")))
+local unsigned long crc32_armv8(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    unsigned c;
+    unsigned long long v;
+
+    c = (unsigned)crc ^ 0xffffffffU;
+    while (len && ((ptrdiff_t)buf & 7)) {
+        c = __crc32b(c, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        zmemcpy((Bytef *)&v, buf, 8);
+        c = __crc32d(c, v);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = __crc32b(c, *buf++);
+    return (unsigned long)(c ^ 0xffffffffU);
+}
+
+#endif /* CRC32_ARMV8 */
+
 #define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
 
 /* ========================================================================= */
@@ -24,6 +24,7 @@
  *
  *          Simple (pixelwise) binarization with fixed threshold
  *              PIX    *pixThresholdToBinary()
+ *              l_int32  pixThresholdToBinaryInPlace()
  *
  *          Binarization with variable threshold
  *              PIX    *pixVarThresholdToBinary()
@@ -137,3 +138,57 @@ PIX       *pixt, *pixd;
     pixDestroy(&pixt);
     return pixd;
 }
+
+
+/*!
+ *  pixThresholdToBinaryInPlace()
+ *
+ *      Input:  pixs (4 or 8 bpp, without a colormap; the only reference)
+ *              threshold value
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) As pixThresholdToBinary(), but pixs itself is made 1 bpp,
+ *          in its own buffer, which is then shrunk (see
+ *          pixShrinkImageData()).  This saves making a second image.
+ *      (2) Each dest row is narrower than its source row and starts no
+ *          later, and each dest word is written after the source words
+ *          it comes from are read, so nothing is overwritten before it
+ *          is used.
+ *      (3) As the data changes under them, there must be no clones of
+ *          pixs.  On error, pixs is not changed.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+pixThresholdToBinaryInPlace(PIX     *pixs,
+                            l_int32  thresh)
+{
+l_int32    d, w, h, wpls, wpld;
+l_uint32  *data;
+
+    PROCNAME("pixThresholdToBinaryInPlace");
+
+    if (!pixs)
+        return ERROR_INT("pixs not defined", procName, 1);
+    pixGetDimensions(pixs, &w, &h, &d);
+    if (d != 4 && d != 8)
+        return ERROR_INT("pixs must be 4 or 8 bpp", procName, 1);
+    if (pixGetColormap(pixs))
+        return ERROR_INT("pixs has a colormap", procName, 1);
+    if (pixGetRefcount(pixs) != 1)
+        return ERROR_INT("pixs is shared", procName, 1);
+    if (thresh < 0)
+        return ERROR_INT("thresh must be non-negative", procName, 1);
+    if (d == 4 && thresh > 16)
+        return ERROR_INT("4 bpp thresh not in {0-16}", procName, 1);
+    if (d == 8 && thresh > 256)
+        return ERROR_INT("8 bpp thresh not in {0-256}", procName, 1);
+
+    data = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
+    wpld = (w + 31) / 32;
+    thresholdToBinaryLow(data, w, h, wpld, data, d, wpls, thresh);
+    pixSetDepth(pixs, 1);
+    pixSetWpl(pixs, wpld);
+    pixShrinkImageData(pixs);
+    return 0;
+}
@@ -25,6 +25,8 @@
  *          Simple (pixelwise) binarization
  *              void       thresholdToBinaryLow()
  *              void       thresholdToBinaryLineLow()
+ *              void       thresholdRGBToBinaryLineLow()
+ *              void       thresholdGray16ToBinaryLineLow()
  *
  *          A slower version of Floyd-Steinberg dithering that uses LUTs
  *              void       ditherToBinaryLUTLow()
@@ -51,6 +53,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "allheaders.h"
+#include "jbig2simd.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  /* __SSE2__ */
 
 #ifndef  NO_CONSOLE_IO
 #define DEBUG_UNROLLING 0
@@ -88,11 +95,48 @@ l_uint32  *lines, *lined;
 }
 
 
+#ifdef SIMD_AVX2_KERNELS
+/*
+ *  thresholdToBinaryLineAVX2()
+ *
+ *  The 8 bpp case of thresholdToBinaryLineLow() for the whole dest
+ *  words of a line, 32 pixels (one 32 byte load) at a time, in the
+ *  same way as with SSE2.  Returns the number of pixels done.
+ */
+__attribute__((target("avx2")))
+static l_int32
+thresholdToBinaryLineAVX2(l_uint32  *lined,
+                          l_int32    w,
+                          l_uint32  *lines,
+                          l_int32    thresh)
+{
+l_int32   j, dcount;
+l_uint32  tmask, dword;
+__m256i   tmax, v;
+
+    tmax = _mm256_set1_epi8((char)(thresh - 1));
+    tmask = (thresh > 0) ? 0xffffffff : 0;
+    for (j = 0, dcount = 0; j + 31 < w; j += 32, dcount++) {
+        v = _mm256_loadu_si256((const __m256i *)(lines + 8 * dcount));
+        dword = (l_uint32)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(_mm256_min_epu8(v, tmax), v));
+        dword = (dword >> 24) | ((dword >> 8) & 0xff00) |
+                ((dword << 8) & 0xff0000) | (dword << 24);
+        dword = ((dword >> 4) & 0x0f0f0f0f) | ((dword & 0x0f0f0f0f) << 4);
+        lined[dcount] = dword & tmask;
+    }
+    return j;
+}
+#endif  /* SIMD_AVX2_KERNELS */
+
+
 /*
  *  thresholdToBinaryLineLow()
  *
+ *  The 8 bpp case compares 32 pixels at a time with AVX2, and 16 with
+ *  SSE2, whichever simd_level() allows.
  */
-LEPTONICA_EXPORT void
+LEPTONICA_REAL_EXPORT void
 thresholdToBinaryLineLow(l_uint32  *lined,
                          l_int32    w,
                          l_uint32  *lines,
@@ -101,6 +145,10 @@ thresholdToBinaryLineLow(l_uint32  *lined,
 {
 l_int32  j, k, gval, scount, dcount;
 l_uint32 sword, dword;
+#if defined(__SSE2__)
+l_uint32 tmask;
+__m128i  tmax, v0, v1;
+#endif  /* __SSE2__ */
 
     PROCNAME("thresholdToBinaryLineLow");
 
@@ -162,8 +210,42 @@ l_uint32 sword, dword;
 #endif
         break;
     case 8:
+        j = scount = dcount = 0;
+#ifdef SIMD_AVX2_KERNELS
+        if (simd_level() >= SIMD_AVX2) {
+            j = thresholdToBinaryLineAVX2(lined, w, lines, thresh);
+            scount = j / 4;
+            dcount = j / 32;
+        }
+#endif  /* SIMD_AVX2_KERNELS */
+#if defined(__SSE2__)
+            /* 8 source words, 1 dest word.  gval < thresh is tested
+             * as gval <= thresh - 1 with unsigned bytes, and masked
+             * off for thresh == 0.  Source byte 4k + 3 - i in memory
+             * is pixel 4k + i, so the bit of pixel j in the movemasks
+             * is j ^ 3; reversing the order of the 8 nibbles moves it
+             * to 31 - j, which puts pixel 0 in the MSB. */
+        if (simd_level() >= SIMD_SSE2) {
+            tmax = _mm_set1_epi8((char)(thresh - 1));
+            tmask = (thresh > 0) ? 0xffffffff : 0;
+            for (; j + 31 < w; j += 32) {
+                v0 = _mm_loadu_si128((const __m128i *)(lines + scount));
+                v1 = _mm_loadu_si128((const __m128i *)(lines + scount + 4));
+                scount += 8;
+                dword = (l_uint32)_mm_movemask_epi8(
+                            _mm_cmpeq_epi8(_mm_min_epu8(v0, tmax), v0)) |
+                        ((l_uint32)_mm_movemask_epi8(
+                            _mm_cmpeq_epi8(_mm_min_epu8(v1, tmax), v1)) << 16);
+                dword = (dword >> 24) | ((dword >> 8) & 0xff00) |
+                        ((dword << 8) & 0xff0000) | (dword << 24);
+                dword = ((dword >> 4) & 0x0f0f0f0f) |
+                        ((dword & 0x0f0f0f0f) << 4);
+                lined[dcount++] = dword & tmask;
+            }
+        }
+#endif  /* __SSE2__ */
             /* Unrolled as 8 source words, 1 dest word */
-        for (j = 0, scount = 0, dcount = 0; j + 31 < w; j += 32) {
+        for (; j + 31 < w; j += 32) {
             dword = 0;
             for (k = 0; k < 8; k++) {
                 sword = lines[scount++];
@@ -206,3 +288,147 @@ l_uint32 sword, dword;
     }
     return;
 }
+
+
+/*
+ *  thresholdRGBToBinaryLineLow()
+ *
+ *  If the green component of the 32 bpp rgb source pixel is less
+ *  than thresh, the dest will be 1; otherwise, it will be 0.
+ *  This is the same as thresholdToBinaryLineLow() on the result of
+ *  pixConvertRGBToGrayFast(), in a single pass.
+ */
+LEPTONICA_EXPORT void
+thresholdRGBToBinaryLineLow(l_uint32  *lined,
+                            l_int32    w,
+                            l_uint32  *lines,
+                            l_int32    thresh)
+{
+l_int32   j, k, gval, dcount;
+l_uint32  dword;
+#if defined(__SSE2__)
+__m128i   vthresh, mask, g[8];
+#endif  /* __SSE2__ */
+
+    j = dcount = 0;
+#if defined(__SSE2__)
+        /* 32 pixels at a time.  The words of each group of 4 are
+         * reversed so that the movemasks give the bits of the last
+         * pixel first, which puts the first pixel in the MSB. */
+    if (simd_level() >= SIMD_SSE2) {
+        vthresh = _mm_set1_epi16(thresh);
+        mask = _mm_set1_epi32(0xff);
+        for (; j + 31 < w; j += 32) {
+            for (k = 0; k < 8; k++) {
+                g[k] = _mm_loadu_si128((const __m128i *)(lines + j + 4 * k));
+                g[k] = _mm_and_si128(_mm_srli_epi32(g[k], L_GREEN_SHIFT),
+                                     mask);
+                g[k] = _mm_shuffle_epi32(g[k], _MM_SHUFFLE(0, 1, 2, 3));
+            }
+            for (k = 0; k < 8; k += 2) {  /* pixels 4k+7 ... 4k as 16 bits */
+                g[k / 2] = _mm_cmplt_epi16(_mm_packs_epi32(g[k + 1], g[k]),
+                                           vthresh);
+            }
+            dword = (l_uint32)_mm_movemask_epi8(
+                        _mm_packs_epi16(g[3], g[2])) |
+                    ((l_uint32)_mm_movemask_epi8(
+                        _mm_packs_epi16(g[1], g[0])) << 16);
+            lined[dcount++] = dword;
+        }
+    }
+#endif  /* __SSE2__ */
+    for (; j + 31 < w; j += 32) {
+        dword = 0;
+        for (k = 0; k < 32; k++) {
+            gval = (lines[j + k] >> L_GREEN_SHIFT) & 0xff;
+            dword |= (((gval - thresh) >> 31) & 1) << (31 - k);
+        }
+        lined[dcount++] = dword;
+    }
+
+    if (j < w) {
+        dword = 0;
+        for (k = 0; j < w; j++, k++) {
+            gval = (lines[j] >> L_GREEN_SHIFT) & 0xff;
+            dword |= (((gval - thresh) >> 31) & 1) << (31 - k);
+        }
+        lined[dcount] = dword;
+    }
+    return;
+}
+
+
+/*
+ *  thresholdGray16ToBinaryLineLow()
+ *
+ *  The source is a row of 16 bpp gray as a png has it, each sample
+ *  two bytes with the most significant first, and the dest is 1 where
+ *  the sample is less than thresh, in [0 ... 65536].  With thresh
+ *  256 times that for 8 bpp, this is the same as thresholding the
+ *  high byte of each sample, which is what png_set_strip_16() keeps.
+ *  The pad bits of the last dest word are cleared.
+ */
+LEPTONICA_EXPORT void
+thresholdGray16ToBinaryLineLow(l_uint32       *lined,
+                               l_int32         w,
+                               const l_uint8  *lines,
+                               l_int32         thresh)
+{
+l_int32   j, k, gval, dcount;
+l_uint32  dword;
+#if defined(__SSE2__)
+l_uint32  tall;
+__m128i   vthresh, bias, g[4];
+#endif  /* __SSE2__ */
+
+    j = dcount = 0;
+#if defined(__SSE2__)
+        /* 32 pixels at a time.  The bytes of each sample are swapped
+         * and the unsigned compare is done signed, with the top bits
+         * flipped; thresh 65536 (everything) doesn't fit in 16 bits,
+         * so it is tall instead.  The samples of each group of 8 are
+         * reversed so that the movemasks give the bits of the last
+         * pixel first, which puts the first pixel in the MSB. */
+    if (simd_level() >= SIMD_SSE2) {
+        bias = _mm_set1_epi16((short)0x8000);
+        vthresh = _mm_set1_epi16((short)((thresh > 0xffff ? 0xffff : thresh)
+                                         ^ 0x8000));
+        tall = (thresh > 0xffff) ? 0xffffffff : 0;
+        for (; j + 31 < w; j += 32) {
+            for (k = 0; k < 4; k++) {
+                g[k] = _mm_loadu_si128(
+                           (const __m128i *)(lines + 2 * j + 16 * k));
+                g[k] = _mm_or_si128(_mm_slli_epi16(g[k], 8),
+                                    _mm_srli_epi16(g[k], 8));
+                g[k] = _mm_cmplt_epi16(_mm_xor_si128(g[k], bias), vthresh);
+                g[k] = _mm_shufflelo_epi16(g[k], _MM_SHUFFLE(0, 1, 2, 3));
+                g[k] = _mm_shufflehi_epi16(g[k], _MM_SHUFFLE(0, 1, 2, 3));
+                g[k] = _mm_shuffle_epi32(g[k], _MM_SHUFFLE(1, 0, 3, 2));
+            }
+            dword = (l_uint32)_mm_movemask_epi8(
+                        _mm_packs_epi16(g[3], g[2])) |
+                    ((l_uint32)_mm_movemask_epi8(
+                        _mm_packs_epi16(g[1], g[0])) << 16);
+            lined[dcount++] = dword | tall;
+        }
+    }
+#endif  /* __SSE2__ */
+    for (; j + 31 < w; j += 32) {
+        dword = 0;
+        for (k = 0; k < 32; k++) {
+            gval = (lines[2 * (j + k)] << 8) | lines[2 * (j + k) + 1];
+            dword |= (l_uint32)((gval - thresh) >> 31 & 1) << (31 - k);
+        }
+        lined[dcount++] = dword;
+    }
+
+    if (j < w) {
+        dword = 0;
+        for (k = 0; j < w; j++, k++) {
+            gval = (lines[2 * j] << 8) | lines[2 * j + 1];
+            dword |= (l_uint32)((gval - thresh) >> 31 & 1) << (31 - k);
+        }
+        lined[dcount] = dword;
+    }
+    return;
+}
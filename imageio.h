@@ -50,7 +50,8 @@ enum {
     IFF_WEBP           = 15,
     IFF_LPDF           = 16,
     IFF_DEFAULT        = 17,
-    IFF_SPIX           = 18
+    IFF_SPIX           = 18,
+    IFF_GZIP           = 19     /* gzip-compressed; only pnm is read */
 };
 
 
@@ -29,6 +29,8 @@
 #  define PUP(a) *++(a)
 #endif
 
+#ifndef INFLATE_FAST64
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -323,6 +325,257 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     return;
 }
 
+#else /* INFLATE_FAST64 */
+
+/*
+   inflate_fast() for 64-bit little-endian machines which allow unaligned
+   loads.  It decodes the same data as the version above, with the same entry
+   assumptions and return states, but:
+
+    - The bit buffer is 64 bits wide, and is refilled once at the top of each
+      loop without branches: eight bytes are loaded and as many whole bytes as
+      fit are added.  That leaves at least 56 bits, enough for the 48 bits of
+      a length/distance pair, or for two literals.  The bits above bits in
+      hold are the next bits of the input, so or-ing the same bytes in again
+      on the next refill does no harm.
+
+    - Matches are copied eight bytes at a time, and may write up to seven
+      bytes past their end.  A distance of less than eight is repeated until
+      it is at least eight, one is a memset, and copies out of the window are
+      exact memcpy's, so that the window is never read past its end.
+
+   So inflate() needs to call it with strm->avail_in >= INFLATE_FAST_MIN_INPUT
+   and strm->avail_out >= INFLATE_FAST_MIN_OUTPUT (see inffast.h), rather than
+   6 and 258.
+ */
+
+typedef unsigned long long hold64;
+
+#define LOAD64(p, v) memcpy(&(v), (p), 8)
+
+void ZLIB_INTERNAL inflate_fast(strm, start)
+z_streamp strm;
+unsigned start;         /* inflate()'s starting value for strm->avail_out */
+{
+    struct inflate_state FAR *state;
+    unsigned char FAR *in;      /* local strm->next_in */
+    unsigned char FAR *last;    /* while in < last, enough input available */
+    unsigned char FAR *out;     /* local strm->next_out */
+    unsigned char FAR *beg;     /* inflate()'s initial strm->next_out */
+    unsigned char FAR *end;     /* while out < end, enough space available */
+#ifdef INFLATE_STRICT
+    unsigned dmax;              /* maximum distance from zlib header */
+#endif
+    unsigned wsize;             /* window size or zero if not using window */
+    unsigned whave;             /* valid bytes in the window */
+    unsigned wnext;             /* window write index */
+    unsigned char FAR *window;  /* allocated sliding window, if wsize != 0 */
+    hold64 hold;                /* local strm->hold */
+    hold64 next;                /* the next eight bytes of input */
+    unsigned bits;              /* local strm->bits */
+    code const FAR *lcode;      /* local strm->lencode */
+    code const FAR *dcode;      /* local strm->distcode */
+    unsigned lmask;             /* mask for first level of length codes */
+    unsigned dmask;             /* mask for first level of distance codes */
+    code here;                  /* retrieved table entry */
+    unsigned op;                /* code bits, operation, extra bits, or */
+                                /*  window position, window bytes to copy */
+    unsigned len;               /* match length, unused bytes */
+    unsigned dist;              /* match distance */
+    unsigned char FAR *from;    /* where to copy match from */
+    unsigned char FAR *stop;    /* end of the match being copied */
+
+    /* copy state to local variables */
+    state = (struct inflate_state FAR *)strm->state;
+    in = strm->next_in;
+    last = in + (strm->avail_in - (INFLATE_FAST_MIN_INPUT - 1));
+    out = strm->next_out;
+    beg = out - (start - strm->avail_out);
+    end = out + (strm->avail_out - (INFLATE_FAST_MIN_OUTPUT - 1));
+#ifdef INFLATE_STRICT
+    dmax = state->dmax;
+#endif
+    wsize = state->wsize;
+    whave = state->whave;
+    wnext = state->wnext;
+    window = state->window;
+    hold = state->hold;
+    bits = state->bits;
+    lcode = state->lencode;
+    dcode = state->distcode;
+    lmask = (1U << state->lenbits) - 1;
+    dmask = (1U << state->distbits) - 1;
+
+    /* decode literals and length/distances until end-of-block or not enough
+       input data or output space */
+    do {
+        LOAD64(in, next);
+        hold |= next << bits;
+        in += (63 - bits) >> 3;
+        bits |= 56;
+        here = lcode[hold & lmask];
+        if (here.op == 0) {                     /* literal, often two */
+            hold >>= here.bits;
+            bits -= here.bits;
+            Tracevv((stderr, here.val >= 0x20 && here.val < 0x7f ?
+                    "inflate:         literal '%c'\n" :
+                    "inflate:         literal 0x%02x\n", here.val));
+            *out++ = (unsigned char)(here.val);
+            here = lcode[hold & lmask];
+            if (here.op != 0) continue;
+            hold >>= here.bits;
+            bits -= here.bits;
+            Tracevv((stderr, here.val >= 0x20 && here.val < 0x7f ?
+                    "inflate:         literal '%c'\n" :
+                    "inflate:         literal 0x%02x\n", here.val));
+            *out++ = (unsigned char)(here.val);
+            continue;
+        }
+      dolen:
+        op = (unsigned)(here.bits);
+        hold >>= op;
+        bits -= op;
+        op = (unsigned)(here.op);
+        if (op == 0) {                          /* literal */
+            Tracevv((stderr, here.val >= 0x20 && here.val < 0x7f ?
+                    "inflate:         literal '%c'\n" :
+                    "inflate:         literal 0x%02x\n", here.val));
+            *out++ = (unsigned char)(here.val);
+        }
+        else if (op & 16) {                     /* length base */
+            len = (unsigned)(here.val);
+            op &= 15;                           /* number of extra bits */
+            len += (unsigned)hold & ((1U << op) - 1);
+            hold >>= op;
+            bits -= op;
+            Tracevv((stderr, "inflate:         length %u\n", len));
+            here = dcode[hold & dmask];
+          dodist:
+            op = (unsigned)(here.bits);
+            hold >>= op;
+            bits -= op;
+            op = (unsigned)(here.op);
+            if (op & 16) {                      /* distance base */
+                dist = (unsigned)(here.val);
+                op &= 15;                       /* number of extra bits */
+                dist += (unsigned)hold & ((1U << op) - 1);
+#ifdef INFLATE_STRICT
+                if (dist > dmax) {
+                    strm->msg = (char *)"invalid distance too far back";
+                    state->mode = BAD;
+                    break;
+                }
+#endif
+                hold >>= op;
+                bits -= op;
+                Tracevv((stderr, "inflate:         distance %u\n", dist));
+                op = (unsigned)(out - beg);     /* max distance in output */
+                if (dist > op) {                /* see if copy from window */
+                    op = dist - op;             /* distance back in window */
+                    if (op > whave) {
+                        if (state->sane) {
+                            strm->msg =
+                                (char *)"invalid distance too far back";
+                            state->mode = BAD;
+                            break;
+                        }
+                    }
+                    from = window;
+                    if (wnext == 0) {           /* very common case */
+                        from += wsize - op;
+                    }
+                    else if (wnext < op) {      /* wrap around window */
+                        from += wsize + wnext - op;
+                        op -= wnext;
+                        if (op < len) {         /* some from end of window */
+                            len -= op;
+                            memcpy(out, from, op);
+                            out += op;
+                            from = window;
+                            op = wnext;
+                        }
+                    }
+                    else {                      /* contiguous in window */
+                        from += wnext - op;
+                    }
+                    if (op >= len) {            /* all from window */
+                        memcpy(out, from, len);
+                        out += len;
+                        continue;
+                    }
+                    len -= op;                  /* some from window */
+                    memcpy(out, from, op);
+                    out += op;
+                }
+                from = out - dist;              /* copy from output */
+                stop = out + len;
+                if (dist == 1) {
+                    memset(out, *from, len);
+                }
+                else {
+                    if (dist < 8) {
+                        /* copy the first eight bytes one at a time, then copy
+                           from a whole number of distances back, at least
+                           eight */
+                        op = len < 8 ? len : 8;
+                        do {
+                            *out++ = *from++;
+                        } while (--op);
+                        dist *= (7 + dist) / dist;
+                        from = out - dist;
+                    }
+                    while (out < stop) {
+                        memcpy(out, from, 8);
+                        out += 8;
+                        from += 8;
+                    }
+                }
+                out = stop;
+            }
+            else if ((op & 64) == 0) {          /* 2nd level distance code */
+                here = dcode[here.val + (hold & ((1U << op) - 1))];
+                goto dodist;
+            }
+            else {
+                strm->msg = (char *)"invalid distance code";
+                state->mode = BAD;
+                break;
+            }
+        }
+        else if ((op & 64) == 0) {              /* 2nd level length code */
+            here = lcode[here.val + (hold & ((1U << op) - 1))];
+            goto dolen;
+        }
+        else if (op & 32) {                     /* end-of-block */
+            Tracevv((stderr, "inflate:         end of block\n"));
+            state->mode = TYPE;
+            break;
+        }
+        else {
+            strm->msg = (char *)"invalid literal/length code";
+            state->mode = BAD;
+            break;
+        }
+    } while (in < last && out < end);
+
+    /* return unused bytes */
+    len = bits >> 3;
+    in -= len;
+    bits -= len << 3;
+    hold &= (1U << bits) - 1;
+
+    /* update state and return */
+    strm->next_in = in;
+    strm->next_out = out;
+    strm->avail_in = (unsigned)((INFLATE_FAST_MIN_INPUT - 1) + (last - in));
+    strm->avail_out = (unsigned)((INFLATE_FAST_MIN_OUTPUT - 1) + (end - out));
+    state->hold = (unsigned long)hold;
+    state->bits = bits;
+    return;
+}
+
+#endif /* INFLATE_FAST64 */
+
 /*
    inflate_fast() speedups that turned out slower (on a PowerPC G3 750CXe):
    - Using bit fields for code structure
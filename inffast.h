@@ -8,4 +8,22 @@
    subject to change. Applications should only use zlib.h.
  */
 
+/* On 64-bit little-endian machines which allow unaligned loads, inflate_fast()
+   keeps a 64-bit bit buffer and copies matches eight bytes at a time.  It then
+   needs more input and output space to run without checks. */
+#if !defined(NO_INFLATE_FAST64) && \
+    !defined(INFLATE_ALLOW_INVALID_DISTANCE_TOOFAR_ARRR) && \
+    (defined(__x86_64__) || defined(_M_X64) || \
+     (defined(__aarch64__) && !defined(__AARCH64EB__)))
+#  define INFLATE_FAST64
+#endif
+
+#ifdef INFLATE_FAST64
+#  define INFLATE_FAST_MIN_INPUT 8
+#  define INFLATE_FAST_MIN_OUTPUT 266
+#else
+#  define INFLATE_FAST_MIN_INPUT 6
+#  define INFLATE_FAST_MIN_OUTPUT 258
+#endif
+
 void ZLIB_INTERNAL inflate_fast OF((z_streamp strm, unsigned start));
@@ -16,16 +16,44 @@
 // limitations under the License.
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
 
 #include <allheaders.h>
 #include <pix.h>
 
+#include "jbig2arith.h"
 #include "jbig2enc.h"
+#include "jbig2sym.h"
+#include "jbig2tiff.h"
+#include "jbig2trace.h"
+
+// Pages are encoded on worker threads (see -j) unless threads are not
+// available on this platform, as in jbig2enc.cc
+#if !defined(JBIG2_NO_THREADS) && (defined(WIN32) || defined(__MINGW32__))
+#define JBIG2_NO_THREADS
+#endif
+#ifndef JBIG2_NO_THREADS
+#include <pthread.h>
+#endif
+
+// The page workers can be bound to CPUs (see --affinity) where Linux has the
+// calls for it
+#if !defined(JBIG2_NO_AFFINITY) && (defined(JBIG2_NO_THREADS) || \
+                                    !defined(__linux__))
+#define JBIG2_NO_AFFINITY
+#endif
+#ifndef JBIG2_NO_AFFINITY
+#include <sched.h>
+#endif
 
 #if defined(WIN32)
 #define WINBINARY O_BINARY
@@ -33,18 +61,131 @@
 #define WINBINARY 0
 #endif
 
+// The input files are mapped into memory where mmap is available
+#if !defined(JBIG2_NO_MMAP) && (defined(WIN32) || defined(__MINGW32__))
+#define JBIG2_NO_MMAP
+#endif
+#ifndef JBIG2_NO_MMAP
+#include <sys/mman.h>
+#endif
+
+// The pages are written with a gathering write where writev is available
+#if !defined(JBIG2_NO_WRITEV) && (defined(WIN32) || defined(__MINGW32__))
+#define JBIG2_NO_WRITEV
+#endif
+#ifndef JBIG2_NO_WRITEV
+#include <sys/uio.h>
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+#endif
+
 static void
 usage(const char *argv0) {
   fprintf(stderr, "Usage: %s [options] <input filenames...>\n", argv0);
+  fprintf(stderr, "Several inputs (or TIFF subimages) are encoded as the pages of one file.\n");
+  fprintf(stderr, "Inputs may be PNG or PNM, also gzip-compressed (such as .pnm.gz),\n");
+  fprintf(stderr, "or bi-level TIFF (uncompressed, PackBits or G4), with any number of pages.\n");
+  fprintf(stderr, "An input of - is read from the standard input, in any format it sniffs as.\n");
   fprintf(stderr, "Some functions removed for pdfsizeopt.\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -d --duplicate-line-removal: use TPGD in generic region coder\n");
   fprintf(stderr, "  -p --pdf: produce PDF ready data\n");
+  fprintf(stderr, "  -b <basename>: in PDF mode, write page n of several to <basename>.000n,\n"
+                  "                 and the symbols of --symbol-mode to <basename>.sym (def: output)\n");
+  fprintf(stderr, "  --xobject: in PDF mode, write each page as the body of an image XObject,\n"
+                  "             its dictionary and stream, and the symbols as a stream\n");
+  fprintf(stderr, "  --globals-obj <n>: with --xobject and --symbol-mode, the PDF object\n"
+                  "                     number which the pages refer to for the symbols\n");
   fprintf(stderr, "  -t <threshold>: set classification threshold for symbol coder (def: 0.85)\n"); 
+  fprintf(stderr, "  --symbol-mode: code the pages as instances of the symbols of one shared\n"
+                  "                 dictionary (lossy: similar components are drawn the same)\n");
   fprintf(stderr, "  -T <bw threshold>: set 1 bpp threshold (def: 188)\n");
+  fprintf(stderr, "  -T <t,t,...>: encode the input at each of these thresholds, reading it\n"
+                  "                once, to <basename>.T<t> (in PDF mode, page n of several\n"
+                  "                to <basename>.T<t>.000n), with a line of JSON for each\n"
+                  "                page and threshold giving its size\n");
+  fprintf(stderr, "  --count-black: with -T <t,t,...>, also give the black pixels\n");
+  fprintf(stderr, "  -g <template>: generic region template 0..3, 1..3 are faster (def: 0)\n");
+  fprintf(stderr, "  --mmr: use MMR (G4) coding: faster, but larger output\n");
+  fprintf(stderr, "  --at-search <effort>: move the AT pixel of the template to where a sample\n"
+                  "                        of rows of each page codes smallest, coding about\n"
+                  "                        effort times as many rows as the page has (with\n"
+                  "                        --stripes, in parallel) before coding it (for\n"
+                  "                        halftones and dither)\n");
+  fprintf(stderr, "  --try-d: encode each page both with and without -d, keeping the smaller\n");
+  fprintf(stderr, "  --try-T <t,t,...>: encode each page with each of these bw thresholds,\n"
+                  "                     keeping the smallest (read once, coded in parallel\n"
+                  "                     with -j; likewise --try-d and --try-g)\n");
+  fprintf(stderr, "  --try-g <g,g,...>: encode each page with each of these templates\n");
+  fprintf(stderr, "  --try-report: print a line of JSON with the size of each variant tried\n");
+  fprintf(stderr, "  --estimate: instead of encoding, write a line of JSON for each page with\n"
+                  "              the size estimated from coding a sample of its rows\n");
   fprintf(stderr, "  -2: upsample 2x before thresholding\n");
   fprintf(stderr, "  -4: upsample 4x before thresholding\n");
+  fprintf(stderr, "  -s <factor>: downsample by 2 to 8 before thresholding, averaging each\n"
+                  "               square of pixels (for oversampled gray scans)\n");
+  fprintf(stderr, "  -j <n>: encode up to n pages in parallel; with -2 or -4, threads left\n"
+                  "          over scale up each page in parallel (def: 1)\n");
+  fprintf(stderr, "  --pipeline: with -j 1, read and threshold the next pages on another thread\n"
+                  "              while each page is coded\n");
+  fprintf(stderr, "  --affinity: with -j, bind each worker, and the threads it starts for\n"
+                  "              --stripes and -2/-4, to its share of the CPUs, taken a NUMA\n"
+                  "              node at a time, so that its pages stay on one node (Linux)\n");
+  fprintf(stderr, "  --async-output: write the output on another thread, queueing up to 8 MB,\n"
+                  "                  so that a slow reader of a pipe doesn't hold up the\n"
+                  "                  coder (best with --stream)\n");
+  fprintf(stderr, "  --stripes <n>: encode the page as n stripes in parallel (def: 1)\n");
+  fprintf(stderr, "  --deadline-ms <ms>: code each page within ms of the start or fail: the\n"
+                  "                      stripes left of a page running late are coded with\n"
+                  "                      MMR, and a page which still isn't coded in time\n"
+                  "                      fails with exit code 14, which may take until its\n"
+                  "                      stripes being coded end (the page is coded as 8\n"
+                  "                      stripes unless --stripes is given)\n");
+  fprintf(stderr, "  --max-memory <MB>: keep the pages being encoded with -j (or read ahead with\n"
+                  "                     --pipeline) within about MB of memory, by their\n"
+                  "                     headers, and read a page which wouldn't fit a row at\n"
+                  "                     a time where it can be; for each request of --server\n");
+  fprintf(stderr, "  --despeckle: remove isolated pixels, black or white, before coding (lossy:\n"
+                  "               for noisy scans)\n");
+  fprintf(stderr, "  --halftone <cell>: code the halftones and dither of a page as halftone\n"
+                  "                    regions of cells of this many pixels square (3 to 8),\n"
+                  "                    each drawn with a pattern for its number of black\n"
+                  "                    pixels (lossy)\n");
+  fprintf(stderr, "  --crop: only code the bounding box of the black pixels\n");
+  fprintf(stderr, "  --split <rows>: skip white gaps of at least this many rows\n");
+  fprintf(stderr, "  --stream: write the output while encoding (unknown region length)\n");
+  fprintf(stderr, "  --striped-page <rows>: write striped pages, ending a stripe every this many\n"
+                  "                         rows (at most 32767); with --stream the page height\n"
+                  "                         is left unknown until the last stripe ends\n");
+  fprintf(stderr, "  --arena: allocate the images of each page from memory kept for the next\n"
+                  "           (faster for many pages, but may use more memory)\n");
+  fprintf(stderr, "  --stats: print coder counters at the end (needs -DJBIG2_STATS)\n");
+  fprintf(stderr, "  --stats=json: print a line of JSON with the time of each phase for each\n"
+                  "                page, and one with the totals and peak memory at the end\n");
+  fprintf(stderr, "  --band-report <file>: write the bytes coded per band of rows as JSON\n");
+  fprintf(stderr, "  --band-rows <n>: rows in each band of --band-report (def: 64)\n");
+  fprintf(stderr, "  --trusted-input: don't check the CRCs of ancillary PNG chunks\n");
+  fprintf(stderr, "  --cache <dir>: keep the encoded pages in the existing directory dir, by the\n"
+                  "                 hash of the 1 bpp image and the options, and reuse them\n"
+                  "                 (not with --stream, --band-report, --symbol-mode and\n"
+                  "                 several pages in one file)\n");
+  fprintf(stderr, "  --stripe-cache <dir>: keep the coded stripes of the pages (see --stripes\n"
+                  "                        and --striped-page) in the existing directory dir,\n"
+                  "                        by the hash of their rows, and copy those found\n"
+                  "                        there through instead of coding them again, so a\n"
+                  "                        page edited in a few places only codes the stripes\n"
+                  "                        which changed (not with --stream, --symbol-mode or\n"
+                  "                        --band-report)\n");
+  fprintf(stderr, "  --merge: instead of encoding, write the JBIG2 files given (such as those of\n"
+                  "           ranges of the pages of a document, encoded without -p or\n"
+                  "           --stream) as one file of all their pages, without coding\n"
+                  "           them again; the other options are ignored\n");
   fprintf(stderr, "  -v: be verbose\n");
+  fprintf(stderr, "  --server: (on its own) read requests from stdin, one per line, each the\n");
+  fprintf(stderr, "      options and files to encode; reply \"<exit code> <length>\\n<output>\"\n");
+  fprintf(stderr, "Set JBIG2_SIMD to scalar, sse2 (neon) or avx2 to use no SIMD code beyond that\n"
+                  "level, for benchmarking; by default the best the processor has is used.\n");
 }
 
 static bool verbose = false;
@@ -93,184 +234,2772 @@ static int write_all(int fd, const void *buf, ssize_t count) {
   return 0;
 }
 
-int
-main(int argc, char **argv) {
-  bool duplicate_line_removal = false;
-  bool pdfmode = false;
-  float threshold = 0.85;
-  int bw_threshold = 188;
-  bool up2 = false, up4 = false;
-  int i;
+#ifndef JBIG2_NO_THREADS
+// -----------------------------------------------------------------------------
+// The thread writing the output for --async-output, so that a slow reader of
+// a pipe doesn't hold up the coder. The output is copied into blocks which are
+// queued for it, up to limit bytes, beyond which the encoding waits.
+// -----------------------------------------------------------------------------
+struct async_block {
+  struct async_block *next;
+  size_t size, capacity;
+  uint8_t *data;  // just after the block
+};
 
-  for (i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-h") == 0 ||
-        strcmp(argv[i], "--help") == 0) {
-      usage(argv[0]);
-      return 0;
-      continue;
-    }
+struct async_writer {
+  int fd;
+  struct async_block *head, *tail;
+  size_t queued, limit;
+  bool closing;  // no more blocks are coming
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // signalled when a block is queued or written
+  pthread_t thread;
+};
 
-    if (strcmp(argv[i], "-d") == 0 ||
-        strcmp(argv[i], "--duplicate-line-removal") == 0) {
-      duplicate_line_removal = true;
-      continue;
-    }
+// Small writes are put together in blocks of at least this size
+static const size_t kAsyncBlockSize = 64 * 1024;
 
-    if (strcmp(argv[i], "-p") == 0 ||
-        strcmp(argv[i], "--pdf") == 0) {
-      pdfmode = true;
-      continue;
-    }
+// The most output queued for --async-output before the encoding waits
+static const size_t kAsyncQueueLimit = 8 << 20;
 
-    if (strcmp(argv[i], "-2") == 0) {
-      up2 = true;
-      continue;
-    }
-    if (strcmp(argv[i], "-4") == 0) {
-      up4 = true;
-      continue;
-    }
+static void *
+async_worker(void *arg) {
+  struct async_writer *const w = (struct async_writer *) arg;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->head && !w->closing) pthread_cond_wait(&w->cond, &w->lock);
+    struct async_block *const block = w->head;
+    if (!block) break;
+    w->head = block->next;
+    if (!w->head) w->tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+    // as in write_output, the output can't be given up halfway
+    if (0 > write_all(w->fd, block->data, block->size))
+      abort();
+    pthread_mutex_lock(&w->lock);
+    w->queued -= block->size;
+    pthread_cond_broadcast(&w->cond);
+    free(block);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
 
-    if (strcmp(argv[i], "-t") == 0) {
-      char *endptr;
-      threshold = strtod(argv[i+1], &endptr);
-      if (*endptr) {
-        fprintf(stderr, "Cannot parse float value: %s\n", argv[i+1]);
-        usage(argv[0]);
-        return 1;
-      }
+// Start writing to fd on a thread of its own, or return NULL if it can't be
+// created (and the output is written as it comes)
+static struct async_writer *
+async_writer_start(int fd, size_t limit) {
+  struct async_writer *const w =
+      (struct async_writer *) calloc(1, sizeof(struct async_writer));
+  w->fd = fd;
+  w->limit = limit;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->thread, NULL, async_worker, w)) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
 
-      if (threshold > 0.9 || threshold < 0.4) {
-        fprintf(stderr, "Invalid value for threshold\n");
-        fprintf(stderr, "(must be between 0.4 and 0.9)\n");
-        return 10;
-      }
-      i++;
-      continue;
+static void
+async_write(struct async_writer *w, const void *data, size_t size) {
+  pthread_mutex_lock(&w->lock);
+  // a write bigger than the limit waits for the queue to empty
+  while (w->queued && w->queued + size > w->limit) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  struct async_block *block = w->tail;
+  if (!block || block->capacity - block->size < size) {
+    const size_t capacity = size > kAsyncBlockSize ? size : kAsyncBlockSize;
+    block = (struct async_block *) malloc(sizeof(struct async_block) +
+                                          capacity);
+    block->next = NULL;
+    block->size = 0;
+    block->capacity = capacity;
+    block->data = (uint8_t *) (block + 1);
+    if (w->tail) {
+      w->tail->next = block;
+    } else {
+      w->head = block;
     }
+    w->tail = block;
+  }
+  memcpy(block->data + block->size, data, size);
+  block->size += size;
+  w->queued += size;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
 
-    if (strcmp(argv[i], "-T") == 0) {
-      char *endptr;
-      bw_threshold = strtol(argv[i+1], &endptr, 10);
-      if (*endptr) {
-        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
-        usage(argv[0]);
-        return 1;
+// Wait for everything queued to be written, and stop the thread
+static void
+async_writer_finish(struct async_writer *w) {
+  pthread_mutex_lock(&w->lock);
+  w->closing = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w);
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// Where the output goes: a file descriptor or, in server mode, a buffer
+// -----------------------------------------------------------------------------
+struct output {
+  int fd;  // if -1, the output is collected in buf instead
+  uint8_t *buf;
+  size_t size, capacity;
+  uint64_t total;  // the number of bytes written, for --stats=json
+  struct async_writer *async;  // if not NULL, what writes to fd
+  // If not NULL, written (and freed) before anything else: the file header of
+  // several pages, held back so that nothing is written if the first of them
+  // can't be read
+  uint8_t *head;
+  size_t head_size;
+};
+
+static void write_output(struct output *out, const void *data, size_t size);
+
+// Write the head of out, if it still has one to write
+static void
+write_head(struct output *out) {
+  if (!out->head) return;
+  uint8_t *const head = out->head;
+  out->head = NULL;
+  write_output(out, head, out->head_size);
+  free(head);
+}
+
+static void
+write_output(struct output *out, const void *data, size_t size) {
+  write_head(out);
+  out->total += size;
+#ifndef JBIG2_NO_THREADS
+  if (out->async) {
+    async_write(out->async, data, size);
+    return;
+  }
+#endif
+  if (out->fd >= 0) {
+    if (0 > write_all(out->fd, data, size))
+      abort();
+    return;
+  }
+  if (out->size + size > out->capacity) {
+    out->capacity = out->capacity * 2 > out->size + size ? out->capacity * 2
+                                                         : out->size + size;
+    out->buf = (uint8_t *) realloc(out->buf, out->capacity);
+  }
+  memcpy(out->buf + out->size, data, size);
+  out->size += size;
+}
+
+// -----------------------------------------------------------------------------
+// Write a page encoded in pieces (see jbig2_encode_generic_pieces) straight
+// from the buffers of the coders, in as few writes as writev allows
+// -----------------------------------------------------------------------------
+static void
+write_pieces(struct output *out, const struct jbig2_pieces *pieces) {
+  write_head(out);
+#ifndef JBIG2_NO_WRITEV
+  if (out->fd >= 0 && !out->async) {
+    out->total += pieces->length;
+    struct iovec iov[IOV_MAX];
+    for (int i = 0; i < pieces->npieces;) {
+      int n = 0;
+      for (; n < IOV_MAX && i < pieces->npieces; ++n, ++i) {
+        iov[n].iov_base = (void *) pieces->pieces[i].data;
+        iov[n].iov_len = pieces->pieces[i].size;
       }
-      if (bw_threshold < 0 || bw_threshold > 255) {
-        fprintf(stderr, "Invalid bw threshold: (0..255)\n");
-        return 11;
+      // after a short write, carry on from where it stopped
+      struct iovec *v = iov;
+      while (n > 0) {
+        ssize_t got = writev(out->fd, v, n);
+        if (got < 0) abort();
+        for (; n > 0 && (size_t) got >= v->iov_len; ++v, --n) {
+          got -= v->iov_len;
+        }
+        if (n > 0) {
+          v->iov_base = (uint8_t *) v->iov_base + got;
+          v->iov_len -= got;
+        }
       }
-      i++;
-      continue;
     }
+    return;
+  }
+#endif
+  for (int i = 0; i < pieces->npieces; ++i) {
+    write_output(out, pieces->pieces[i].data, pieces->pieces[i].size);
+  }
+}
 
-    if (strcmp(argv[i], "-v") == 0) {
-      verbose = true;
-      continue;
+// -----------------------------------------------------------------------------
+// Write the times of the phases of a page or of all of them for --stats=json,
+// in seconds, as "wall" and "cpu" objects
+// -----------------------------------------------------------------------------
+static void
+write_phase_times(FILE *fp, const struct jbig2_phase_times *times) {
+  static const char *const names[JBIG2_NPHASES] = {
+    "read", "colormap", "gray", "threshold", "encode", "output"
+  };
+  for (int k = 0; k < 2; ++k) {
+    const uint64_t *const ns = k ? times->cpu_ns : times->wall_ns;
+    fprintf(fp, ", \"%s\": {", k ? "cpu" : "wall");
+    for (int i = 0; i < JBIG2_NPHASES; ++i) {
+      fprintf(fp, "%s\"%s\": %.6f", i ? ", " : "", names[i], ns[i] * 1e-9);
     }
-
-    break;
+    fprintf(fp, "}");
   }
+}
 
-  if (i == argc) {
-    fprintf(stderr, "No filename given\n\n");
-    usage(argv[0]);
-    return 4;
+// -----------------------------------------------------------------------------
+// Write a line of JSON for --stats=json about a page which was encoded
+// -----------------------------------------------------------------------------
+static void
+write_page_stats(FILE *fp, int pageno, int width, int height,
+                 uint64_t input_bytes, uint64_t output_bytes,
+                 const struct jbig2_phase_times *times) {
+  uint64_t wall_ns = 0;
+  for (int i = 0; i < JBIG2_NPHASES; ++i) wall_ns += times->wall_ns[i];
+  fprintf(fp, "{\"page\": %d, \"width\": %d, \"height\": %d, "
+          "\"input_bytes\": %llu, \"output_bytes\": %llu, "
+          "\"mpixel_per_s\": %.2f", pageno, width, height,
+          (unsigned long long) input_bytes, (unsigned long long) output_bytes,
+          wall_ns ? 1e3 * width * height / wall_ns : 0.0);
+  write_phase_times(fp, times);
+  fprintf(fp, "}\n");
+}
+
+// The CPU time of the whole process so far, in seconds, if it can be known
+static double
+process_cpu() {
+#ifndef WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
   }
+#endif
+  return 0;
+}
 
-  if (up2 && up4) {
-    fprintf(stderr, "Can't have both -2 and -4!\n");
-    return 6;
+// The peak resident memory of the process so far in kilobytes, or -1
+static long
+peak_rss_kb() {
+#ifndef WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;  // in bytes there
+#else
+    return ru.ru_maxrss;
+#endif
   }
+#endif
+  return -1;
+}
 
-#ifdef WIN32
-  int result = setmode(1, WINBINARY);  // stdout.
-  if (result == -1) {
-    perror("Cannot set mode to binary for stdout.");
-    return 1;
+// -----------------------------------------------------------------------------
+// Output sink for --stream: arg points to the struct output
+// -----------------------------------------------------------------------------
+static void
+write_sink(void *arg, const uint8_t *data, size_t size) {
+  write_output((struct output *) arg, data, size);
+}
+
+// -----------------------------------------------------------------------------
+// Write the bytes coded for each band of rows of a page for --band-report, as
+// a line of JSON
+// -----------------------------------------------------------------------------
+static void
+write_band_report(FILE *fp, int pageno, int width, int height, int band_rows,
+                  const uint32_t *band_bytes) {
+  const int nbands = (height + band_rows - 1) / band_rows;
+  fprintf(fp, "{\"page\": %d, \"width\": %d, \"height\": %d, "
+          "\"band_rows\": %d, \"bytes\": [", pageno, width, height,
+          band_rows);
+  for (int i = 0; i < nbands; ++i) {
+    fprintf(fp, "%s%u", i ? ", " : "", band_bytes[i]);
   }
+  fprintf(fp, "]}\n");
+}
+
+// -----------------------------------------------------------------------------
+// Print the counters of the coders for --stats
+// -----------------------------------------------------------------------------
+static void
+print_coder_stats(const struct jbig2enc_stats *stats) {
+#ifndef JBIG2_STATS
+  fprintf(stderr, "coder stats not collected: build with -DJBIG2_STATS\n");
 #endif
+  const unsigned long long symbols = stats->mps + stats->lps;
+  fprintf(stderr, "coder stats: symbols=%llu mps=%llu lps=%llu (%.2f%%)\n",
+          symbols, (unsigned long long) stats->mps,
+          (unsigned long long) stats->lps,
+          symbols ? 100.0 * stats->lps / symbols : 0.0);
+  fprintf(stderr, "coder stats: renorm_shifts=%llu carries=%llu\n",
+          (unsigned long long) stats->renorm_shifts,
+          (unsigned long long) stats->carries);
+  fprintf(stderr, "coder stats: rows=%llu tpgd_rows=%llu bytes=%llu "
+          "(%.1f per 1k rows)\n",
+          (unsigned long long) stats->rows,
+          (unsigned long long) stats->tpgd_rows,
+          (unsigned long long) stats->bytes,
+          stats->rows ? 1000.0 * stats->bytes / stats->rows : 0.0);
+}
 
-  int pageno = -1;
+// -----------------------------------------------------------------------------
+// Page arena (see --arena): while a thread encodes a page, the image data of
+// the Pix it makes are bump-allocated from blocks which the thread keeps, and
+// all of them are freed at once when the page is done. The blocks are then
+// reused for the next page, so that the large buffers of each page are not
+// mapped and unmapped again, and the threads don't contend in malloc. Freeing
+// the last allocation of a block takes it back; other frees are deferred to the
+// end of the page. Memory from an arena must not outlive the page: the encoded
+// output is not allocated as a Pix, so it isn't.
+// -----------------------------------------------------------------------------
+struct arena_block {
+  struct arena_block *next;
+  size_t size, used;
+  bool touched;  // if anything was allocated from it for this page
+  uint8_t *last;  // the last allocation, if it hasn't been taken back
+  uint8_t *data;
+};
 
-  int numsubimages=0, subimage=0;
-  while (i < argc) {
-    if (subimage==numsubimages) {
-      subimage = numsubimages = 0;
-      FILE *fp;
-      if ((fp=fopen(argv[i], "rb"))==NULL) {
-        fprintf(stderr, "Unable to open \"%s\"", argv[i]);
-        return 1;
-      }
-      l_int32 filetype;
-      if (findFileFormatStream(fp, &filetype)) {
-        fprintf(stderr, "Unable to get file format of \"%s\"", argv[i]);
-        return 1;
-      }
-#if HAVE_LIBTIFF
-      if (filetype==IFF_TIFF && tiffGetCount(fp, &numsubimages)) {
-        fprintf(stderr, "Cannot process TIFF with subimages: \"%s\"", argv[i]);
-        return 1;
-      }
+struct page_arena {
+  struct arena_block *blocks;
+};
+
+static const size_t kArenaBlockSize = 4 << 20;
+static const size_t kArenaAlign = 16;
+
+#ifndef JBIG2_NO_THREADS
+static __thread struct page_arena thread_arena;
+static __thread bool arena_active;
+#else
+static struct page_arena thread_arena;
+static bool arena_active;
 #endif
-      fclose(fp);
+
+// Every allocation is preceded by kArenaAlign bytes which point to the arena it
+// came from, or are NULL if it came from malloc. The data of a Pix may be freed
+// on another thread than the one which made it (a stripe, see --stripes), and
+// is then left for its own thread to free at the end of the page.
+static void *
+arena_malloc(size_t size) {
+  if (!arena_active) {
+    void **const p = (void **) malloc(kArenaAlign + size);
+    if (!p) return NULL;
+    *p = NULL;
+    return (uint8_t *) p + kArenaAlign;
+  }
+  const size_t rounded =
+      kArenaAlign + ((size + kArenaAlign - 1) & ~(kArenaAlign - 1));
+  struct arena_block *block = thread_arena.blocks;
+  for (; block; block = block->next) {
+    if (block->size - block->used >= rounded) break;
+  }
+  if (!block) {
+    const size_t bytes = rounded > kArenaBlockSize ? rounded : kArenaBlockSize;
+    block = (struct arena_block *) malloc(sizeof(struct arena_block) + bytes +
+                                          kArenaAlign);
+    if (!block) return NULL;
+    block->size = bytes;
+    block->used = 0;
+    block->data = (uint8_t *) (((uintptr_t) (block + 1) + kArenaAlign - 1) &
+                               ~(uintptr_t) (kArenaAlign - 1));
+    block->next = thread_arena.blocks;
+    thread_arena.blocks = block;
+  }
+  block->touched = true;
+  block->last = block->data + block->used;
+  block->used += rounded;
+  *(void **) block->last = &thread_arena;
+  return block->last + kArenaAlign;
+}
+
+static void
+arena_free(void *ptr) {
+  if (!ptr) return;
+  uint8_t *const p = (uint8_t *) ptr - kArenaAlign;
+  if (!*(void **) p) {
+    free(p);
+    return;
+  }
+  if (*(void **) p != &thread_arena || !arena_active) return;
+  for (struct arena_block *block = thread_arena.blocks; block;
+       block = block->next) {
+    if (p == block->last) {
+      block->used = block->last - block->data;
+      block->last = NULL;
+      return;
     }
+  }
+}
 
-    PIX *source;
-    if (numsubimages<=1) {
-      source = pixRead(argv[i]);
+// Shrink an allocation to size bytes. Memory from malloc is reallocated; in an
+// arena only the last allocation can give back its end, and any other is left
+// as it is, until the end of the page.
+static void *
+arena_realloc(void *ptr, size_t size) {
+  uint8_t *const p = (uint8_t *) ptr - kArenaAlign;
+  if (!*(void **) p) {
+    void **const q = (void **) realloc(p, kArenaAlign + size);
+    return q ? (uint8_t *) q + kArenaAlign : NULL;
+  }
+  if (*(void **) p != &thread_arena || !arena_active) return ptr;
+  for (struct arena_block *block = thread_arena.blocks; block;
+       block = block->next) {
+    if (p == block->last) {
+      block->used = block->last - block->data + kArenaAlign +
+                    ((size + kArenaAlign - 1) & ~(kArenaAlign - 1));
+      break;
     }
-    else {
-#if HAVE_LIBTIFF
-      source = pixReadTiff(argv[i], subimage++);
-#else
-      source = NULL;
+  }
+  return ptr;
+}
+
+// Start allocating the Pix of a page on this thread from its arena
+static void
+arena_begin() {
+  arena_active = true;
+}
+
+// Free everything allocated for the page. The blocks which were used are kept
+// for the next page, and the others are given back.
+static void
+arena_end() {
+  arena_active = false;
+  struct arena_block **link = &thread_arena.blocks;
+  while (*link) {
+    struct arena_block *const block = *link;
+    if (block->touched) {
+      block->used = 0;
+      block->touched = false;
+      block->last = NULL;
+      link = &block->next;
+    } else {
+      *link = block->next;
+      free(block);
+    }
+  }
+}
+
+// Give back all the blocks of this thread's arena
+static void
+arena_release() {
+  while (thread_arena.blocks) {
+    struct arena_block *const block = thread_arena.blocks;
+    thread_arena.blocks = block->next;
+    free(block);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// A page to encode: an image file, or one of the subimages of a TIFF file
+// -----------------------------------------------------------------------------
+struct page_source {
+  const char *filename;
+  int subimage;  // -1 unless the file has several subimages
+  uint32_t ifd;  // the offset of its directory in a TIFF file, or 0
+  // The contents of the file, which are decoded from memory (see map_file).
+  // The pages of a TIFF file share them, and the last of the refs to be
+  // unmapped frees them.
+  uint8_t *data;
+  size_t size;
+  bool mapped;
+  int *refs;
+};
+
+// -----------------------------------------------------------------------------
+// Get the contents of a file, with a single open: it is mapped into memory if
+// possible, and otherwise (for a pipe, or without mmap) read into a buffer.
+// A filename of "-" is the standard input, which is read from where it is to
+// its end, so that images can be piped in without a temporary file. Returns
+// false if the file cannot be opened.
+// -----------------------------------------------------------------------------
+static bool
+map_file(const char *filename, uint8_t **data, size_t *size, bool *mapped) {
+  const bool is_stdin = strcmp(filename, "-") == 0;
+#ifdef WIN32
+  if (is_stdin && setmode(0, WINBINARY) == -1) return false;
+#endif
+  const int fd = is_stdin ? 0 : open(filename, O_RDONLY | WINBINARY);
+  if (fd < 0) return false;
+  *data = NULL;
+  *size = 0;
+  *mapped = false;
+
+#ifndef JBIG2_NO_MMAP
+  // (the standard input may be a file which has been read from already)
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (!is_stdin || lseek(fd, 0, SEEK_CUR) == 0)) {
+    void *const p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      *data = (uint8_t *) p;
+      *size = st.st_size;
+      *mapped = true;
+      if (!is_stdin) close(fd);
+      return true;
+    }
+  }
 #endif
+
+  size_t capacity = 0;
+  for (;;) {
+    if (*size == capacity) {
+      capacity = capacity ? capacity * 2 : 65536;
+      *data = (uint8_t *) realloc(*data, capacity);
     }
+    const ssize_t r = read(fd, *data + *size, capacity - *size);
+    if (r <= 0) break;
+    *size += r;
+  }
+  if (!is_stdin) close(fd);
+  return true;
+}
 
-    if (!source) return 3;
-    if (verbose)
-      pixInfo(source, "source image:");
+static void
+unmap_page(struct page_source *page) {
+  if (!page->data) return;
+  if (page->refs && __sync_sub_and_fetch(page->refs, 1) > 0) {
+    page->data = NULL;
+    return;
+  }
+  free(page->refs);
+  page->refs = NULL;
+#ifndef JBIG2_NO_MMAP
+  if (page->mapped) {
+    munmap(page->data, page->size);
+  } else
+#endif
+  {
+    free(page->data);
+  }
+  page->data = NULL;
+}
 
-    PIX *pixl, *gray, *pixt;
-    if ((pixl = pixRemoveColormap(source, REMOVE_CMAP_BASED_ON_SRC)) == NULL) {
-      fprintf(stderr, "Failed to remove colormap from %s\n", argv[i]);
-      return 1;
+static void
+free_pages(struct page_source *pages, int npages) {
+  for (int i = 0; i < npages; ++i) unmap_page(&pages[i]);
+  free(pages);
+}
+
+// Set by --server, whose requests come from the standard input
+static bool serving = false;
+
+// -----------------------------------------------------------------------------
+// Append the pages of the given file to *pages. Returns false on error.
+// -----------------------------------------------------------------------------
+static bool
+add_pages(const char *filename, struct page_source **pages, int *npages) {
+  struct page_source file;
+  file.filename = filename;
+  file.subimage = -1;
+  file.ifd = 0;
+  file.refs = NULL;
+  if (serving && strcmp(filename, "-") == 0) {
+    fprintf(stderr, "The standard input holds the requests of --server\n");
+    return false;
+  }
+  if (!map_file(filename, &file.data, &file.size, &file.mapped)) {
+    fprintf(stderr, "Unable to open \"%s\"", filename);
+    return false;
+  }
+  l_int32 filetype;
+  if (file.size < 12 || findFileFormatBuffer(file.data, &filetype)) {
+    fprintf(stderr, "Unable to get file format of \"%s\"", filename);
+    unmap_page(&file);
+    return false;
+  }
+  // only the directories of a TIFF file are found here: each page is decoded
+  // when it is encoded, from the one copy of the file
+  int numsubimages = 0;
+  uint32_t *ifds = NULL;
+  if (filetype == IFF_TIFF) {
+    numsubimages = jbig2_tiff_pages(file.data, file.size, &ifds);
+    if (!numsubimages) {
+      fprintf(stderr, "Cannot read the pages of TIFF file \"%s\"", filename);
+      unmap_page(&file);
+      return false;
+    }
+    if (numsubimages > 1) {
+      file.refs = (int *) malloc(sizeof(int));
+      *file.refs = numsubimages;
     }
-    pixDestroy(&source);
-    pageno++;
+  }
 
-    if (pixl->d > 1) {
-      if (pixl->d > 8) {
-        gray = pixConvertRGBToGrayFast(pixl);
-        if (!gray) return 1;
-      } else {
-        gray = pixClone(pixl);
-      }
-      if (up2) {
-        pixt = pixScaleGray2xLIThresh(gray, bw_threshold);
-      } else if (up4) {
-        pixt = pixScaleGray4xLIThresh(gray, bw_threshold);
-      } else {
-        pixt = pixThresholdToBinary(gray, bw_threshold);
-      }
-      pixDestroy(&gray);
-    } else {
-      pixt = pixClone(pixl);
+  const int n = numsubimages > 1 ? numsubimages : 1;
+  *pages = (struct page_source *) realloc(*pages, (*npages + n) *
+                                          sizeof(struct page_source));
+  for (int i = 0; i < n; ++i) {
+    (*pages)[*npages] = file;
+    (*pages)[*npages].subimage = numsubimages > 1 ? i : -1;
+    if (ifds) (*pages)[*npages].ifd = ifds[i];
+    ++*npages;
+  }
+  free(ifds);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Read page pageno and threshold it to 1 bpp, scaled by upsample (see
+// jbig2_threshold) with up to upsample_threads threads, adding the time of each
+// phase to times if it isn't NULL. With a bw_threshold of -1 the image is
+// returned as it is read, for jbig2_encode_generic_variants to threshold.
+// Returns NULL on error, with *ret set to the exit code.
+// -----------------------------------------------------------------------------
+static PIX *
+read_page(struct page_source *page, int pageno, int bw_threshold,
+          int upsample, int upsample_threads, struct jbig2_phase_times *times, int *ret) {
+  JBIG2_TRACE1(page__start, pageno);
+  struct jbig2_clock mark;
+  jbig2_phase_start(times, &mark);
+  JBIG2_TRACE1(decode__start, pageno);
+  PIX *source;
+  if (page->ifd) {
+    // a bi-level page is decoded straight to 1 bpp
+    source = jbig2_tiff_read(page->data, page->size, page->ifd);
+#if HAVE_LIBTIFF
+    if (!source) {
+      source = pixReadTiff(page->filename,
+                           page->subimage < 0 ? 0 : page->subimage);
+    }
+#endif
+    if (!source) {
+      fprintf(stderr, "Cannot decode page %d of \"%s\": only bi-level TIFF "
+              "pages, uncompressed or with PackBits or G4 compression, can be "
+              "read\n", pageno, page->filename);
     }
-    if (verbose)
-      pixInfo(pixt, "thresholded image:");
+    unmap_page(page);
+  } else if (page->data) {
+    // without scaling, 8 bpp gray PNG is thresholded as it is decoded, so
+    // that the gray image is never held in memory
+    source = upsample != 1 || bw_threshold < 0
+                 ? pixReadMem(page->data, page->size)
+                 : pixReadMemThresh(page->data, page->size, bw_threshold);
+    unmap_page(page);
+  } else {
+    source = NULL;
+  }
+  jbig2_phase_done(times, JBIG2_PHASE_READ, &mark);
+  JBIG2_TRACE4(decode__done, pageno, source ? (int) source->w : 0,
+               source ? (int) source->h : 0, source ? (int) source->d : 0);
 
-    pixDestroy(&pixl);
+  *ret = 3;
+  if (!source) return NULL;
+  if (verbose)
+    pixInfo(source, "source image:");
+  if (bw_threshold < 0) return source;
 
-    int length;
-    uint8_t *ret;
-    ret = jbig2_encode_generic(pixt, !pdfmode, 0, 0, duplicate_line_removal,
-                               &length);
-    if (0 > write_all(1, ret, length))
-      abort();
-    return 0;
+  *ret = 1;
+  PIX *const pixt = jbig2_threshold_in_place(&source, bw_threshold, upsample,
+                                             upsample_threads, times);
+  if (!pixt) {
+    fprintf(stderr, "Failed to threshold %s\n", page->filename);
+    return NULL;
   }
+  if (verbose)
+    pixInfo(pixt, "thresholded image:");
+
+  return pixt;
+}
+
+// -----------------------------------------------------------------------------
+// Make a page encoded into the single buffer data into pieces (see
+// jbig2_encode_generic_pieces), so that it is freed by jbig2_free_pieces
+// -----------------------------------------------------------------------------
+static void
+set_single_piece(struct jbig2_pieces *pieces, uint8_t *data, size_t length) {
+  memset(pieces, 0, sizeof(*pieces));
+  pieces->headers = data;
+  pieces->pieces = (struct jbig2_piece *) malloc(sizeof(struct jbig2_piece));
+  pieces->pieces[0].data = data;
+  pieces->pieces[0].size = length;
+  pieces->npieces = 1;
+  pieces->length = length;
+  pieces->headers_size = length;
 }
 
+// -----------------------------------------------------------------------------
+// Cache of encoded pages (see --cache): a directory with a file for each page,
+// named by a 128-bit hash of the thresholded image and of everything else
+// which goes into the output. The same image, encoded with the same options,
+// is then read back instead of being encoded again. A file is written under
+// another name and renamed, so that several processes can share the cache.
+// -----------------------------------------------------------------------------
+
+// Bumped when the output for the same image and options changes
+static const uint32_t kCacheVersion = 1;
+
+struct cache_key {
+  uint64_t h1, h2;
+};
+
+static inline void
+cache_mix(struct cache_key *key, uint32_t v) {
+  key->h1 = (key->h1 ^ v) * 0x9e3779b97f4a7c15ull;
+  key->h1 ^= key->h1 >> 29;
+  key->h2 = (key->h2 + v) * 0xc2b2ae3d27d4eb4full;
+  key->h2 = (key->h2 << 31) | (key->h2 >> 33);
+}
+
+static struct cache_key
+get_cache_key(PIX *pix, const struct jbig2_generic_options &opts,
+              int at_search) {
+  struct cache_key key = {0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull};
+  const uint32_t header[] = {
+    kCacheVersion, (uint32_t) pix->w, (uint32_t) pix->h,
+    (uint32_t) (opts.xres ? opts.xres : pix->xres),
+    (uint32_t) (opts.yres ? opts.yres : pix->yres), opts.full_headers,
+    opts.duplicate_line_removal, (uint32_t) opts.gbtemplate, opts.mmr,
+    (uint32_t) opts.nstripes, opts.crop, (uint32_t) opts.split_gap,
+    (uint32_t) opts.page, opts.end_of_page, (uint32_t) opts.stripe_rows,
+    opts.unknown_height, (uint32_t) at_search, opts.remove_specks,
+    (uint32_t) opts.halftone
+  };
+  for (size_t i = 0; i < sizeof(header) / sizeof(header[0]); ++i) {
+    cache_mix(&key, header[i]);
+  }
+  // only the pixels count, not the padding at the end of each row
+  const int full = pix->w / 32;
+  const uint32_t pad_mask = pix->w & 31 ? 0xffffffffu << (32 - (pix->w & 31))
+                                        : 0;
+  for (int y = 0; y < (int) pix->h; ++y) {
+    const uint32_t *const line = pix->data + y * pix->wpl;
+    for (int i = 0; i < full; ++i) cache_mix(&key, line[i]);
+    if (pad_mask) cache_mix(&key, line[full] & pad_mask);
+  }
+  return key;
+}
+
+static char *
+cache_path(const char *dir, uint64_t h1, uint64_t h2, const char *suffix) {
+  char *path;
+  asprintf(&path, "%s/%016llx%016llx%s", dir, (unsigned long long) h1,
+           (unsigned long long) h2, suffix);
+  return path;
+}
+
+// Returns true, with the contents of the file at path in *data (which the
+// caller must free) and *length, if it could be read
+static bool
+cache_read(const char *path, uint8_t **data, size_t *length) {
+  const int fd = open(path, O_RDONLY | WINBINARY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 ||
+      (off_t) (size_t) st.st_size != st.st_size) {
+    close(fd);
+    return false;
+  }
+  *length = st.st_size;
+  *data = (uint8_t *) malloc(*length);
+  size_t got = 0;
+  while (*data && got < *length) {
+    const ssize_t r = read(fd, *data + got, *length - got);
+    if (r <= 0) break;
+    got += r;
+  }
+  close(fd);
+  if (got != *length) {
+    free(*data);
+    return false;
+  }
+  return true;
+}
+
+// The files being written to the caches by this process, for their names
+static int cache_writes;
+
+// Write npieces pieces to a file of the cache at path. Failing to is not an
+// error: what would have been in it will just be encoded again next time.
+static void
+cache_write(const char *path, const struct jbig2_piece *pieces, int npieces) {
+  char *tmp;
+  asprintf(&tmp, "%s.%d.%d.tmp", path, (int) getpid(),
+           __sync_fetch_and_add(&cache_writes, 1));
+  const int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | WINBINARY, 0644);
+  if (fd >= 0) {
+    bool ok = true;
+    for (int i = 0; ok && i < npieces; ++i) {
+      ok = write_all(fd, pieces[i].data, pieces[i].size) == 0;
+    }
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+      if (verbose) fprintf(stderr, "Cannot add to the cache: %s\n", path);
+    }
+  } else if (verbose) {
+    fprintf(stderr, "Cannot add to the cache: %s\n", path);
+  }
+  free(tmp);
+}
+
+// Returns true, with the page in *pieces, if it was found in the cache
+static bool
+cache_load(const char *dir, const struct cache_key &key,
+           struct jbig2_pieces *pieces) {
+  char *const path = cache_path(dir, key.h1, key.h2, ".jb2");
+  uint8_t *data;
+  size_t length;
+  const bool found = cache_read(path, &data, &length);
+  free(path);
+  if (found) set_single_piece(pieces, data, length);
+  return found;
+}
+
+// Add a page to the cache
+static void
+cache_store(const char *dir, const struct cache_key &key,
+            const struct jbig2_pieces *pieces) {
+  char *const path = cache_path(dir, key.h1, key.h2, ".jb2");
+  cache_write(path, pieces->pieces, pieces->npieces);
+  free(path);
+}
+
+// The stripes of --stripe-cache, kept in the directory which is the arg of a
+// jbig2_stripe_store, each in a file named by its key
+static bool
+stripe_cache_lookup(void *arg, const uint64_t key[2], uint8_t **data,
+                    size_t *size) {
+  char *const path = cache_path((const char *) arg, key[0], key[1], ".stripe");
+  const bool found = cache_read(path, data, size);
+  free(path);
+  return found;
+}
+
+static void
+stripe_cache_store(void *arg, const uint64_t key[2], const uint8_t *data,
+                   size_t size) {
+  char *const path = cache_path((const char *) arg, key[0], key[1], ".stripe");
+  const struct jbig2_piece piece = {data, size};
+  cache_write(path, &piece, 1);
+  free(path);
+}
+
+// -----------------------------------------------------------------------------
+// The settings for encoding the pages
+// -----------------------------------------------------------------------------
+struct page_settings {
+  int bw_threshold;
+  int upsample;  // 2 or 4 for -2 and -4, minus the factor of -s, or 1
+  int upsample_threads;  // the threads for -2 and -4 on each page
+  bool stream;  // write the output while encoding (see --stream)
+  bool multipage;  // the pages are written as one file
+  bool print_stats;
+  bool stats_json;  // time the phases of each page (see --stats=json)
+  bool band_report;
+  int band_rows;
+  bool arena;  // allocate the Pix of each page from a page arena
+  bool symbol_mode;  // see --symbol-mode
+  const char *cache_dir;  // see --cache, or NULL if the pages aren't cached
+  // the ways to encode each page (see --try-T), if there are several, with
+  // the threads to encode them in parallel
+  const struct jbig2_variant *variants;
+  int nvariants;
+  int variant_threads;
+  bool variant_report;  // see --try-report
+  // for -T with several thresholds, their number (and zero otherwise): the
+  // variants are kept for each, with its black pixels if sweep_black
+  int nsweep;
+  const int *sweep_thresholds;
+  bool sweep_black;  // see --count-black
+  bool estimate;  // only estimate the size of each page (see --estimate)
+  int at_search;  // the effort of --at-search, or 0
+  bool xobject;  // see write_xobject
+  int globals_obj;  // the object of the symbols, for --symbol-mode
+  struct jbig2_generic_options opts;  // the options which are the same for all
+};
+
+// A page encoded at one threshold of a sweep of -T
+struct sweep_page {
+  struct jbig2_pieces pieces;
+  uint64_t black;  // its black pixels, for --count-black
+};
+
+// -----------------------------------------------------------------------------
+// A page to encode, possibly on a worker thread (see -j)
+// -----------------------------------------------------------------------------
+struct page_job {
+  struct page_source *source;
+  int pageno;
+  int ret;  // the exit code, if the page couldn't be encoded
+  struct jbig2_pieces pieces;  // the encoded page, unless streaming
+  struct sweep_page *sweep;  // or, for -T with several thresholds, at each
+  int width, height;
+  uint32_t *band_bytes;  // for --band-report
+  struct jbig2enc_stats stats;  // for --stats
+  struct jbig2_phase_times times;  // for --stats=json
+  uint64_t input_bytes, output_bytes;
+  PIX *pix;  // the thresholded page, if it was read ahead (see --pipeline)
+  bool prepared;
+  bool done;
+  struct jbig2_estimate estimate;  // for --estimate
+  // for --symbol-mode, where the symbols are on the page (see jbig2_classify)
+  struct jbig2_instance *instances;
+  int ninstances;
+  int xres, yres;
+  // for --max-memory, the bytes the page is estimated to take while it is
+  // encoded (see plan_page), and those it keeps until it is written
+  uint64_t memory, held;
+  bool banded;  // read a row at a time to fit in --max-memory
+};
+
+// -----------------------------------------------------------------------------
+// Whether a page can be coded a row at a time with these settings (see
+// jbig2_encode_generic_rows): it must be a PNG or (gzipped) PNM file and coded
+// as a single region, or streamed as a striped page. The cache needs the
+// whole image to hash, the variants the image to threshold each way, and
+// --at-search to sample it. With threads for scaling it up, the whole image is
+// scaled in parallel instead. A page which is banded to fit in --max-memory
+// (see plan_page) is read a row at a time all the same, and isn't cached.
+// -----------------------------------------------------------------------------
+static bool
+rows_possible(const struct page_settings *settings,
+              const struct page_source *page, bool banded) {
+  const struct jbig2_generic_options &opts = settings->opts;
+  if (!page->data || page->ifd || opts.crop || opts.split_gap > 0 || opts.mmr ||
+      opts.nstripes > 1 || (opts.stripe_rows && !settings->stream) ||
+      opts.stripe_store || opts.halftone) {
+    return false;
+  }
+  if (settings->symbol_mode || settings->nvariants > 1 || settings->estimate ||
+      settings->at_search) {
+    return false;
+  }
+  if (!banded && (settings->cache_dir ||
+                  (settings->upsample > 1 && settings->upsample_threads > 1))) {
+    return false;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Start reading a page a row at a time, if it can be coded that way (see
+// rows_possible). Returns NULL otherwise.
+// -----------------------------------------------------------------------------
+static L_ROWREADER *
+start_rows(const struct page_settings *settings, struct page_source *page,
+           bool banded) {
+  if (!rows_possible(settings, page, banded)) return NULL;
+  L_ROWREADER *const rr = rowReaderCreateMem(page->data, page->size);
+  if (rr && verbose) {
+    fprintf(stderr, "source image: %d x %d (%d bits) %ddpi x %ddpi, read a "
+            "row at a time\n", rr->w, rr->h, rr->d, rr->xres, rr->yres);
+  }
+  return rr;
+}
+
+// For --max-memory, the coded page is taken to be at most this share of its
+// 1 bpp image, and a page read a row at a time to keep this many rows of the
+// source at once
+static const int kCodedShare = 4;
+static const int kBandedRows = 16;
+
+// -----------------------------------------------------------------------------
+// Estimate the memory encoding a page will take, from the header of its
+// image, for --max-memory: the decoded image (inflated first, if gzipped),
+// what it is converted through on the way to 1 bpp (see jbig2_threshold), the
+// 1 bpp page in each of the variants and the coded page. The file itself is
+// mapped already, and isn't counted. A page which can be read a row at a time
+// takes only a few rows of the source besides what is coded; one which
+// couldn't otherwise fit in budget is banded to be read that way, if the
+// settings allow it (see rows_possible). A page whose header can't be read is
+// left at 0, and is encoded as if it took nothing.
+// -----------------------------------------------------------------------------
+static void
+plan_page(const struct page_settings *settings, struct page_job *job,
+          uint64_t budget) {
+  struct page_source *const page = job->source;
+  job->memory = job->held = 0;
+  job->banded = false;
+  if (!page->data) return;
+  l_int32 format = IFF_UNKNOWN, w, h, d, iscmap = 0;
+  if (page->ifd) {
+    uint32_t width, height;
+    if (!jbig2_tiff_size(page->data, page->size, page->ifd, &width, &height)) {
+      return;
+    }
+    w = width;
+    h = height;
+    d = 1;
+  } else if (pixReadHeaderMem(page->data, page->size, &format, &w, &h, &d,
+                              &iscmap)) {
+    return;
+  }
+  // a bi-level image isn't scaled
+  const int scale = d == 1 && !iscmap ? 1 : settings->upsample;
+  const uint64_t sw = jbig2_scaled_size(w, scale);
+  const uint64_t sh = jbig2_scaled_size(h, scale);
+  const uint64_t bw = sh * 4 * ((sw + 31) / 32);
+  const uint64_t coded = bw / kCodedShare;
+  const uint64_t row = 4 * (((uint64_t) w * d + 31) / 32);
+  const uint64_t banded = coded + kBandedRows * row;
+
+  uint64_t whole = (uint64_t) h * row;
+  if (format == IFF_GZIP) whole *= 2;
+  if (iscmap) whole += (uint64_t) 4 * w * h;
+  if (iscmap || d >= 16) whole += (uint64_t) w * h;
+  whole += (settings->nvariants > 1 ? settings->nvariants : 1) * bw + coded;
+
+  job->memory = whole;
+  bool rows = rows_possible(settings, page, false);
+  if (!rows && whole > budget && rows_possible(settings, page, true)) {
+    rows = job->banded = true;
+  }
+  if (!rows) return;
+  // not every image can be read a row at a time (see rowReaderCreateMem)
+  L_ROWREADER *rr = rowReaderCreateMem(page->data, page->size);
+  if (!rr) {
+    job->banded = false;
+    return;
+  }
+  rowReaderDestroy(&rr);
+  job->memory = banded;
+  if (job->banded && verbose) {
+    fprintf(stderr, "page %d: %llu bytes read whole, over --max-memory: read "
+            "a row at a time\n", job->pageno, (unsigned long long) whole);
+  }
+}
+
+// One band of rows in this many is coded for --estimate
+static const int kEstimateSampleEvery = 8;
+
+// The threshold to read the pages with (see read_page)
+static int
+page_threshold(const struct page_settings *settings) {
+  return settings->nvariants > 1 ? -1 : settings->bw_threshold;
+}
+
+// -----------------------------------------------------------------------------
+// Encode the page read into source in each of the ways of settings->variants,
+// keeping the smallest in the job or, for a sweep of -T, the smallest at each
+// threshold in job->sweep
+// -----------------------------------------------------------------------------
+static void
+encode_variants(const struct page_settings *settings, struct page_job *job,
+                PIX *source, const struct jbig2_generic_options &opts) {
+  const int n = settings->nvariants;
+  struct jbig2_variant *const variants =
+      (struct jbig2_variant *) malloc(n * sizeof(struct jbig2_variant));
+  memcpy(variants, settings->variants, n * sizeof(struct jbig2_variant));
+  const int best = jbig2_encode_generic_variants(
+      source, settings->upsample, opts, variants, n, settings->variant_threads);
+  // the variants of each threshold of a sweep come together, in its order
+  const int ngroups = settings->nsweep ? settings->nsweep : 1;
+  const int per_group = n / ngroups;
+  if (best < 0) {
+    fprintf(stderr, "Failed to threshold %s\n", job->source->filename);
+    job->ret = 1;
+  } else {
+    job->width = variants[best].width;
+    job->height = variants[best].height;
+    if (settings->nsweep) {
+      job->sweep = (struct sweep_page *) calloc(ngroups,
+                                                sizeof(struct sweep_page));
+    }
+  }
+  for (int g = 0; best >= 0 && g < ngroups; ++g) {
+    int kept = g * per_group;
+    for (int i = kept + 1; i < (g + 1) * per_group; ++i) {
+      if (variants[i].pieces.length < variants[kept].pieces.length) kept = i;
+    }
+    for (int i = g * per_group;
+         settings->variant_report && i < (g + 1) * per_group; ++i) {
+      fprintf(stderr, "{\"page\": %d, \"bw_threshold\": %d, \"tpgd\": %s, "
+              "\"template\": %d, \"bytes\": %llu, \"kept\": %s}\n",
+              job->pageno, variants[i].bw_threshold,
+              variants[i].duplicate_line_removal ? "true" : "false",
+              variants[i].gbtemplate,
+              (unsigned long long) variants[i].pieces.length,
+              i == kept ? "true" : "false");
+    }
+    struct jbig2_pieces *const pieces =
+        settings->nsweep ? &job->sweep[g].pieces : &job->pieces;
+    *pieces = variants[kept].pieces;
+    memset(&variants[kept].pieces, 0, sizeof(variants[kept].pieces));
+    if (settings->nsweep) job->sweep[g].black = variants[kept].black;
+  }
+  for (int i = 0; i < n; ++i) jbig2_free_pieces(&variants[i].pieces);
+  free(variants);
+}
+
+// -----------------------------------------------------------------------------
+// Write the page of job, encoded in pieces, to out: for --xobject, as the body
+// of a PDF image XObject (to be numbered by whoever puts it in a PDF file), the
+// dictionary followed by the stream of the page
+// -----------------------------------------------------------------------------
+static void
+write_page(struct output *out, const struct page_settings *settings,
+           const struct page_job *job, const struct jbig2_pieces *pieces) {
+  if (!settings->xobject) {
+    write_pieces(out, pieces);
+    return;
+  }
+  char *globals = NULL;
+  if (settings->globals_obj) {
+    asprintf(&globals, " /DecodeParms << /JBIG2Globals %d 0 R >>",
+             settings->globals_obj);
+  }
+  char *head;
+  const int length = asprintf(
+      &head, "<< /Type /XObject /Subtype /Image /Width %d /Height %d "
+      "/ColorSpace /DeviceGray /BitsPerComponent 1 /Filter /JBIG2Decode%s "
+      "/Length %llu >>\nstream\n", job->width, job->height,
+      globals ? globals : "", (unsigned long long) pieces->length);
+  write_output(out, head, length);
+  free(head);
+  free(globals);
+  write_pieces(out, pieces);
+  write_output(out, "\nendstream\n", 11);
+}
+
+// -----------------------------------------------------------------------------
+// Write the page of job encoded at each threshold of a sweep of -T to the
+// output for that threshold, outs[t], or in PDF mode with several pages to a
+// file of its own (when page_files), renumbering the segments from segnums[t]
+// when the pages are written as one file. A line of JSON on stderr gives the
+// size of each. Returns the bytes written, or -1 if a file couldn't be opened.
+// -----------------------------------------------------------------------------
+static int64_t
+write_sweep_page(const struct page_settings *settings, struct page_job *job,
+                 const char *basename, bool page_files, struct output *outs,
+                 unsigned *segnums) {
+  int64_t bytes = 0;
+  for (int t = 0; t < settings->nsweep; ++t) {
+    struct sweep_page *const page = &job->sweep[t];
+    struct output file = {-1, NULL, 0, 0, 0, NULL, NULL, 0};
+    struct output *const dest = page_files ? &file : &outs[t];
+    if (page_files) {
+      char *filename;
+      asprintf(&filename, "%s.T%d.%04d", basename,
+               settings->sweep_thresholds[t], job->pageno);
+      file.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0600);
+      if (file.fd < 0) {
+        fprintf(stderr, "Unable to open output file: %s\n", filename);
+        free(filename);
+        return -1;
+      }
+      free(filename);
+    }
+    const uint64_t written = dest->total;
+    if (settings->multipage) {
+      segnums[t] = jbig2_renumber_pieces(&page->pieces, segnums[t]);
+    }
+    write_page(dest, settings, job, &page->pieces);
+    jbig2_free_pieces(&page->pieces);
+    if (file.fd >= 0) close(file.fd);
+    bytes += dest->total - written;
+
+    fprintf(stderr, "{\"page\": %d, \"bw_threshold\": %d, \"bytes\": %llu",
+            job->pageno, settings->sweep_thresholds[t],
+            (unsigned long long) (dest->total - written));
+    if (settings->sweep_black) {
+      fprintf(stderr, ", \"black\": %llu", (unsigned long long) page->black);
+    }
+    fprintf(stderr, "}\n");
+  }
+  free(job->sweep);
+  job->sweep = NULL;
+  return bytes;
+}
+
+// Move the first AT pixel of opts to where it codes the page best, for
+// --at-search
+static void
+search_at(const struct page_settings *settings, const struct page_job *job,
+          PIX *pixt, struct jbig2_generic_options *opts) {
+  if (!settings->at_search || opts->mmr) return;
+  jbig2_search_at(pixt, *opts, settings->at_search, &opts->atx, &opts->aty);
+  if (verbose && (opts->atx || opts->aty)) {
+    fprintf(stderr, "page %d: AT pixel moved to (%d, %d)\n", job->pageno,
+            opts->atx, opts->aty);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Read and encode a page, unless it was read already. When streaming, it is
+// written to out as it is encoded and the segments are numbered with the segnum
+// counter. Otherwise the output is kept in the job, with the segments numbered
+// from zero (see jbig2_renumber_pieces).
+// -----------------------------------------------------------------------------
+static void
+encode_page(const struct page_settings *settings, struct page_job *job,
+            unsigned *segnum, struct output *out) {
+  const int upsample = settings->upsample;
+  if (settings->arena) arena_begin();
+  L_ROWREADER *rr =
+      job->prepared ? NULL : start_rows(settings, job->source, job->banded);
+  const bool cached = settings->cache_dir && !rr;
+  PIX *pixt = NULL;
+  if (job->prepared) {
+    pixt = job->pix;
+    job->pix = NULL;
+    if (!pixt) {
+      if (settings->arena) arena_end();
+      return;
+    }
+    job->width = pixt->w;
+    job->height = pixt->h;
+  } else if (rr) {
+    // a bi-level image isn't scaled (see jbig2_threshold)
+    const int scale = rr->binary ? 1 : upsample;
+    JBIG2_TRACE1(page__start, job->pageno);
+    job->width = jbig2_scaled_size(rr->w, scale);
+    job->height = jbig2_scaled_size(rr->h, scale);
+  } else {
+    pixt = read_page(job->source, job->pageno, page_threshold(settings),
+                     settings->upsample, settings->upsample_threads,
+                     settings->stats_json ? &job->times : NULL, &job->ret);
+    if (!pixt) {
+      if (settings->arena) arena_end();
+      return;
+    }
+    job->width = pixt->w;
+    job->height = pixt->h;
+  }
+  job->ret = 0;
+
+  unsigned first_segnum = 0;
+  if (!settings->stream) segnum = &first_segnum;
+  struct jbig2_generic_options opts = settings->opts;
+  if (settings->print_stats) opts.stats = &job->stats;
+  if (settings->stats_json) opts.times = &job->times;
+  if (settings->multipage) {
+    opts.page = job->pageno + 1;
+    opts.end_of_page = true;
+    opts.segnum = segnum;
+  }
+  if (settings->band_report) {
+    job->band_bytes = (uint32_t *) calloc(
+        (job->height + settings->band_rows - 1) / settings->band_rows,
+        sizeof(uint32_t));
+    opts.band_bytes = job->band_bytes;
+    opts.band_rows = settings->band_rows;
+  }
+
+  if (settings->estimate) {
+    search_at(settings, job, pixt, &opts);
+    jbig2_estimate_generic(pixt, opts, kEstimateSampleEvery, &job->estimate);
+    pixDestroy(&pixt);
+    if (settings->arena) arena_end();
+    return;
+  }
+
+  if (settings->nvariants > 1) {
+    encode_variants(settings, job, pixt, opts);
+    pixDestroy(&pixt);
+    if (settings->arena) arena_end();
+    return;
+  }
+
+  struct cache_key key;
+  if (cached) {
+    key = get_cache_key(pixt, opts, settings->at_search);
+    if (cache_load(settings->cache_dir, key, &job->pieces)) {
+      if (verbose) fprintf(stderr, "page %d found in the cache\n", job->pageno);
+      pixDestroy(&pixt);
+      if (settings->arena) arena_end();
+      return;
+    }
+  }
+
+  search_at(settings, job, pixt, &opts);
+  bool missed_deadline = false;
+  opts.missed_deadline = &missed_deadline;
+  bool ok;
+  if (rr && settings->stream) {
+    ok = jbig2_encode_generic_rows_sink(rr, settings->bw_threshold, upsample,
+                                        opts, write_sink, out);
+  } else if (rr) {
+    ok = jbig2_encode_generic_rows_pieces(rr, settings->bw_threshold,
+                                          upsample, opts, &job->pieces);
+  } else if (settings->stream) {
+    ok = jbig2_encode_generic_sink(pixt, opts, write_sink, out);
+  } else {
+    ok = jbig2_encode_generic_pieces(pixt, opts, &job->pieces);
+  }
+  if (!ok && rr) {
+    // the rows path only fails if the image can't be read
+    job->ret = 3;
+  } else if (!ok && missed_deadline) {
+    fprintf(stderr, "Page %d missed the deadline\n", job->pageno);
+    job->ret = 14;
+  } else if (!ok) {
+    fprintf(stderr, "Failed to encode page %d\n", job->pageno);
+    job->ret = 1;
+  } else if (cached) {
+    cache_store(settings->cache_dir, key, &job->pieces);
+  }
+  if (rr) {
+    rowReaderDestroy(&rr);
+    unmap_page(job->source);
+  }
+  pixDestroy(&pixt);
+  if (settings->arena) arena_end();
+}
+
+// -----------------------------------------------------------------------------
+// Read a page, unless it was read already, and find the symbols on it for
+// --symbol-mode, adding the new ones to classifier. This is done for all the
+// pages before any of them is encoded (see encode_symbol_page), since the
+// dictionary comes first. The time taken is counted as encoding.
+// -----------------------------------------------------------------------------
+static void
+classify_page(const struct page_settings *settings, struct page_job *job,
+              struct jbig2_classifier *classifier) {
+  if (settings->arena) arena_begin();
+  PIX *pixt;
+  if (job->prepared) {
+    pixt = job->pix;
+    job->pix = NULL;
+  } else {
+    pixt = read_page(job->source, job->pageno, settings->bw_threshold,
+                     settings->upsample, settings->upsample_threads,
+                     settings->stats_json ? &job->times : NULL, &job->ret);
+  }
+  if (!pixt) {
+    if (settings->arena) arena_end();
+    return;
+  }
+  job->width = pixt->w;
+  job->height = pixt->h;
+  job->xres = pixt->xres;
+  job->yres = pixt->yres;
+
+  struct jbig2_clock mark;
+  jbig2_phase_start(settings->stats_json ? &job->times : NULL, &mark);
+  job->ret = 0;
+  // so that the specks don't become symbols
+  if (settings->opts.remove_specks) jbig2_remove_specks(pixt);
+  if (!jbig2_classify(classifier, pixt, &job->instances, &job->ninstances)) {
+    fprintf(stderr, "Failed to classify page %d\n", job->pageno);
+    job->ret = 1;
+  }
+  jbig2_phase_done(settings->stats_json ? &job->times : NULL,
+                   JBIG2_PHASE_ENCODE, &mark);
+  pixDestroy(&pixt);
+  if (settings->arena) arena_end();
+}
+
+// -----------------------------------------------------------------------------
+// Encode a page classified by classify_page as a text region of the symbols of
+// the dictionary, which is segment zero. The page is kept in the job as a
+// single piece, numbered from segnum when the pages are written as one file,
+// and otherwise from one (after the dictionary) in a file of its own.
+// -----------------------------------------------------------------------------
+static void
+encode_symbol_page(const struct page_settings *settings, struct page_job *job,
+                   const struct jbig2_classifier *classifier,
+                   unsigned *segnum) {
+  unsigned first_segnum = 1;
+  struct jbig2_generic_options opts = settings->opts;
+  if (settings->stats_json) opts.times = &job->times;
+  opts.segnum = &first_segnum;
+  if (settings->multipage) {
+    opts.page = job->pageno + 1;
+    opts.end_of_page = true;
+    opts.segnum = segnum;
+  }
+  size_t length;
+  uint8_t *const data = jbig2_encode_symbol_page(
+      classifier, job->instances, job->ninstances, job->width, job->height,
+      job->xres, job->yres, 0, opts, &length);
+  free(job->instances);
+  job->instances = NULL;
+  if (!data) {
+    fprintf(stderr, "Failed to encode page %d\n", job->pageno);
+    job->ret = 1;
+    return;
+  }
+
+  set_single_piece(&job->pieces, data, length);
+}
+
+#ifndef JBIG2_NO_THREADS
+// -----------------------------------------------------------------------------
+// The pool of threads encoding pages for -j. The workers take the pages in
+// order, but only up to ahead pages beyond the last one written, so that not
+// too many encoded pages are kept waiting. With --max-memory, a page is only
+// taken while its estimate (see plan_page) fits in what is left of the
+// budget, or when nothing else is held, so that a page bigger than the
+// budget is encoded on its own.
+// -----------------------------------------------------------------------------
+struct page_pool {
+  const struct page_settings *settings;
+  struct page_job *jobs;
+  int njobs;
+  int next;  // the next page to encode
+  int written;  // the number of pages written
+  int ahead;
+  uint64_t budget;  // the bytes of --max-memory, or 0
+  uint64_t in_use;  // those of the pages being encoded, or held to be written
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // signalled when a page is done or written
+};
+
+// Whether the job fits in what is left of the budget of the pool, with its
+// lock held
+static bool
+admit(const struct page_pool *pool, const struct page_job *job) {
+  return !pool->budget || !pool->in_use ||
+         pool->in_use + job->memory <= pool->budget;
+}
+
+static void *
+page_worker(void *arg) {
+  struct page_pool *const pool = (struct page_pool *) arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->next < pool->njobs &&
+           (pool->next >= pool->written + pool->ahead ||
+            !admit(pool, &pool->jobs[pool->next]))) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->next >= pool->njobs) break;
+    struct page_job *const job = &pool->jobs[pool->next++];
+    pool->in_use += job->memory;
+    pthread_mutex_unlock(&pool->lock);
+    encode_page(pool->settings, job, NULL, NULL);
+    uint64_t held = job->pieces.length;
+    for (int t = 0; job->sweep && t < pool->settings->nsweep; ++t) {
+      held += job->sweep[t].pieces.length;
+    }
+    pthread_mutex_lock(&pool->lock);
+    // until it is written, only the coded page is kept
+    pool->in_use += held - job->memory;
+    job->held = held;
+    job->done = true;
+    pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  arena_release();
+  return NULL;
+}
+
+#ifndef JBIG2_NO_AFFINITY
+// The most NUMA nodes looked for in /sys
+static const int kMaxNodes = 64;
+
+// -----------------------------------------------------------------------------
+// Find the CPUs which this process may run on, for --affinity, ordered node
+// by node as /sys/devices/system/node lists them, so that a run of them is
+// on as few nodes as can be (the numbers of the CPUs of a node needn't be
+// consecutive: two sockets often have the even and the odd ones). CPUs which
+// no node lists come last. Sets *cpus (which the caller must free) and
+// returns their number, 0 on error.
+// -----------------------------------------------------------------------------
+static int
+affinity_cpus(int **cpus) {
+  cpu_set_t allowed;
+  *cpus = NULL;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+  *cpus = (int *) malloc(CPU_SETSIZE * sizeof(int));
+  int n = 0;
+  for (int node = 0; node < kMaxNodes; ++node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE *const f = fopen(path, "r");
+    if (!f) continue;
+    // such as 0-7,16-23
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+      hi = lo;
+      if (fscanf(f, "-%d", &hi) < 0) hi = lo;
+      for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++cpu) {
+        if (cpu >= 0 && CPU_ISSET(cpu, &allowed)) {
+          (*cpus)[n++] = cpu;
+          CPU_CLR(cpu, &allowed);
+        }
+      }
+      if (fgetc(f) != ',') break;
+    }
+    fclose(f);
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) (*cpus)[n++] = cpu;
+  }
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Bind the thread which attr creates, worker k of nworkers, to its share of
+// the ncpus cpus of affinity_cpus: a run of them, of one CPU or more, and of
+// a node or more when there are fewer workers than nodes. Memory is put on the
+// node of the CPU which first touches it, so the images and the coders of its
+// pages, which the worker allocates, are local to it, and the threads it
+// starts to code a page (which inherit its CPUs) are on the same node. With
+// more workers than CPUs, they take a CPU each in turn.
+// -----------------------------------------------------------------------------
+static void
+bind_worker(pthread_attr_t *attr, const int *cpus, int ncpus, int k,
+            int nworkers) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (nworkers <= ncpus) {
+    for (int i = k * ncpus / nworkers; i < (k + 1) * ncpus / nworkers; ++i) {
+      CPU_SET(cpus[i], &set);
+    }
+  } else {
+    CPU_SET(cpus[k % ncpus], &set);
+  }
+  pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+#endif
+
+// Read and threshold a page ahead of encoding it (see --pipeline), on another
+// thread than the one which will encode it. The Pix isn't allocated from the
+// page arena of this thread, since it outlives the page here.
+static void
+prepare_page(const struct page_settings *settings, struct page_job *job) {
+  job->pix = read_page(job->source, job->pageno, page_threshold(settings),
+                       settings->upsample, settings->upsample_threads,
+                       settings->stats_json ? &job->times : NULL, &job->ret);
+  job->prepared = true;
+}
+
+// The thread which reads and thresholds the pages for --pipeline, in the same
+// kind of pool: a page is done when it is ready to encode, and the pages are
+// read up to ahead beyond the last one written.
+static void *
+prepare_worker(void *arg) {
+  struct page_pool *const pool = (struct page_pool *) arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->next < pool->njobs &&
+           (pool->next >= pool->written + pool->ahead ||
+            !admit(pool, &pool->jobs[pool->next]))) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->next >= pool->njobs) break;
+    struct page_job *const job = &pool->jobs[pool->next++];
+    // the page is held as read until it is encoded and written
+    pool->in_use += job->memory;
+    job->held = job->memory;
+    pthread_mutex_unlock(&pool->lock);
+    // a banded page is read as it is encoded
+    if (!job->banded) prepare_page(pool->settings, job);
+    pthread_mutex_lock(&pool->lock);
+    job->done = true;
+    pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+#endif
+
+static void
+add_stats(struct jbig2enc_stats *total, const struct jbig2enc_stats *stats) {
+  total->mps += stats->mps;
+  total->lps += stats->lps;
+  total->renorm_shifts += stats->renorm_shifts;
+  total->carries += stats->carries;
+  total->rows += stats->rows;
+  total->tpgd_rows += stats->tpgd_rows;
+  total->bytes += stats->bytes;
+}
+
+// The most values of each of --try-T and --try-g
+static const int kMaxTries = 16;
+
+// The stripes of a page with --deadline-ms and no --stripes
+static const int kDeadlineStripes = 8;
+
+// -----------------------------------------------------------------------------
+// Parse a list of up to kMaxTries numbers between lo and hi separated by commas
+// into list, setting *n to their number. Returns false if it isn't one.
+// -----------------------------------------------------------------------------
+static bool
+parse_int_list(const char *arg, int lo, int hi, int *list, int *n) {
+  *n = 0;
+  for (const char *p = arg;; ++p) {
+    char *endptr;
+    const long v = strtol(p, &endptr, 10);
+    if (endptr == p || v < lo || v > hi || (*endptr && *endptr != ',') ||
+        *n == kMaxTries) {
+      return false;
+    }
+    list[(*n)++] = v;
+    p = endptr;
+    if (!*p) return true;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Write the JBIG2 files given as one file of all their pages to out (see
+// jbig2_merge_files), for --merge. Returns the exit code.
+// -----------------------------------------------------------------------------
+static int
+merge_files(char **filenames, int nfiles, struct output *out) {
+  struct page_source *const files =
+      (struct page_source *) calloc(nfiles, sizeof(struct page_source));
+  const uint8_t **const data =
+      (const uint8_t **) malloc(nfiles * sizeof(uint8_t *));
+  size_t *const lengths = (size_t *) malloc(nfiles * sizeof(size_t));
+  int ret = 0;
+  for (int i = 0; i < nfiles && !ret; ++i) {
+    files[i].filename = filenames[i];
+    if (!map_file(filenames[i], &files[i].data, &files[i].size,
+                  &files[i].mapped)) {
+      fprintf(stderr, "Cannot open %s\n", filenames[i]);
+      ret = 1;
+    }
+    data[i] = files[i].data;
+    lengths[i] = files[i].size;
+  }
+  if (!ret) {
+    struct jbig2_pieces pieces;
+    const int merged = jbig2_merge_files(data, lengths, nfiles, &pieces);
+    if (merged < nfiles) {
+      fprintf(stderr, "Cannot merge %s: it isn't a JBIG2 file written by "
+              "jbig2 without -p or --stream\n", filenames[merged]);
+      ret = 3;
+    } else {
+      if (verbose) {
+        fprintf(stderr, "merged %d files: %d segments\n", nfiles,
+                pieces.nsegments);
+      }
+      write_pieces(out, &pieces);
+      jbig2_free_pieces(&pieces);
+    }
+  }
+  free(lengths);
+  free(data);
+  free_pages(files, nfiles);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Encode the files given by the command line arguments, writing the output to
+// out (except for PDF fragments, which go to files). Returns the exit code.
+// -----------------------------------------------------------------------------
+static int
+run(int argc, char **argv, struct output *out) {
+  bool duplicate_line_removal = false;
+  bool pdfmode = false;
+  float threshold = 0.85;
+  int bw_threshold = 188;
+  bool up2 = false, up4 = false;
+  int downsample = 0;
+  int nstripes = 1;
+  int nthreads = 1;
+  int deadline_ms = 0;
+  long max_memory_mb = 0;
+  bool merge = false;
+  bool stream = false;
+  bool arena = false;
+  bool pipeline = false;
+  bool affinity = false;
+  bool async_output = false;
+  bool symbol_mode = false;
+  const char *cache_dir = NULL;
+  const char *stripe_cache_dir = NULL;
+  bool xobject = false;
+  int globals_obj = 0;
+  bool try_tpgd = false;
+  int try_thresholds[kMaxTries], ntry_thresholds = 0;
+  int try_templates[kMaxTries], ntry_templates = 0;
+  bool try_report = false;
+  int sweep_thresholds[kMaxTries], nsweep = 0;
+  bool count_black = false;
+  bool estimate = false;
+  int at_search = 0;
+  bool trusted_input = false;
+  int gbtemplate = 0;
+  bool mmr = false;
+  bool crop = false;
+  bool despeckle = false;
+  int halftone = 0;
+  int split_gap = 0;
+  int stripe_rows = 0;
+  bool print_stats = false;
+  bool stats_json = false;
+  const char *band_report = NULL;
+  int band_rows = 64;
+  const char *basename = "output";
+  struct jbig2enc_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  int i;
+  verbose = false;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 ||
+        strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-d") == 0 ||
+        strcmp(argv[i], "--duplicate-line-removal") == 0) {
+      duplicate_line_removal = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-p") == 0 ||
+        strcmp(argv[i], "--pdf") == 0) {
+      pdfmode = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-2") == 0) {
+      up2 = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-4") == 0) {
+      up4 = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-s") == 0) {
+      char *endptr;
+      downsample = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (downsample < 2 || downsample > 8) {
+        fprintf(stderr, "Invalid downsample factor: (2..8)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-t") == 0) {
+      char *endptr;
+      threshold = strtod(argv[i+1], &endptr);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse float value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+
+      if (threshold > 0.9 || threshold < 0.4) {
+        fprintf(stderr, "Invalid value for threshold\n");
+        fprintf(stderr, "(must be between 0.4 and 0.9)\n");
+        return 10;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-T") == 0 && strchr(argv[i+1], ',')) {
+      if (!parse_int_list(argv[i+1], 0, 255, sweep_thresholds, &nsweep)) {
+        fprintf(stderr, "Invalid list for -T: (up to %d values, 0..255)\n",
+                kMaxTries);
+        return 11;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-T") == 0) {
+      char *endptr;
+      bw_threshold = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (bw_threshold < 0 || bw_threshold > 255) {
+        fprintf(stderr, "Invalid bw threshold: (0..255)\n");
+        return 11;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-g") == 0) {
+      char *endptr;
+      gbtemplate = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (gbtemplate < 0 || gbtemplate > 3) {
+        fprintf(stderr, "Invalid generic region template: (0..3)\n");
+        return 13;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--mmr") == 0) {
+      mmr = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--at-search") == 0) {
+      char *endptr;
+      at_search = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (at_search < 1) {
+        fprintf(stderr, "Invalid AT search effort: (must be at least 1)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--try-d") == 0) {
+      try_tpgd = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--try-T") == 0 || strcmp(argv[i], "--try-g") == 0) {
+      const bool templates = argv[i][6] == 'g';
+      if (!parse_int_list(argv[i+1], 0, templates ? 3 : 255,
+                          templates ? try_templates : try_thresholds,
+                          templates ? &ntry_templates : &ntry_thresholds)) {
+        fprintf(stderr, "Invalid list for %s: (up to %d values, 0..%d)\n",
+                argv[i], kMaxTries, templates ? 3 : 255);
+        return templates ? 13 : 11;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--try-report") == 0) {
+      try_report = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--count-black") == 0) {
+      count_black = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--estimate") == 0) {
+      estimate = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stripes") == 0) {
+      char *endptr;
+      nstripes = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (nstripes < 1) {
+        fprintf(stderr, "Invalid number of stripes: (must be at least 1)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--crop") == 0) {
+      crop = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--despeckle") == 0) {
+      despeckle = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--halftone") == 0) {
+      char *endptr;
+      halftone = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (halftone < JBIG2_HALFTONE_MIN_CELL ||
+          halftone > JBIG2_HALFTONE_MAX_CELL) {
+        fprintf(stderr, "Invalid halftone cell: (must be %d..%d)\n",
+                JBIG2_HALFTONE_MIN_CELL, JBIG2_HALFTONE_MAX_CELL);
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--split") == 0) {
+      char *endptr;
+      split_gap = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (split_gap < 1) {
+        fprintf(stderr, "Invalid split gap: (must be at least 1)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--striped-page") == 0) {
+      char *endptr;
+      stripe_rows = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (stripe_rows < 1 || stripe_rows > 32767) {
+        fprintf(stderr, "Invalid stripe height: (must be 1..32767)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-j") == 0) {
+      char *endptr;
+      nthreads = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (nthreads < 1) {
+        fprintf(stderr, "Invalid number of threads: (must be at least 1)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--arena") == 0) {
+      arena = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--pipeline") == 0) {
+      pipeline = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--affinity") == 0) {
+      affinity = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--async-output") == 0) {
+      async_output = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--symbol-mode") == 0) {
+      symbol_mode = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--cache") == 0) {
+      cache_dir = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stripe-cache") == 0) {
+      stripe_cache_dir = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--xobject") == 0) {
+      xobject = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--deadline-ms") == 0) {
+      char *endptr;
+      deadline_ms = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (deadline_ms < 1) {
+        fprintf(stderr, "Invalid deadline: (must be at least 1 ms)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--max-memory") == 0) {
+      char *endptr;
+      max_memory_mb = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (max_memory_mb < 1) {
+        fprintf(stderr, "Invalid memory limit: (must be at least 1 MB)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--globals-obj") == 0) {
+      char *endptr;
+      globals_obj = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (globals_obj < 1) {
+        fprintf(stderr, "Invalid object number: (must be at least 1)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--trusted-input") == 0) {
+      trusted_input = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stats") == 0) {
+      print_stats = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stats=json") == 0) {
+      stats_json = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--band-report") == 0) {
+      band_report = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--band-rows") == 0) {
+      char *endptr;
+      band_rows = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (band_rows < 1) {
+        fprintf(stderr, "Invalid number of band rows: (must be at least 1)\n");
+        return 12;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-b") == 0 ||
+        strcmp(argv[i], "--basename") == 0) {
+      basename = argv[i+1];
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--merge") == 0) {
+      merge = true;
+      continue;
+    }
+
+    break;
+  }
+
+  if (i == argc) {
+    fprintf(stderr, "No filename given\n\n");
+    usage(argv[0]);
+    return 4;
+  }
+
+  if (merge) return merge_files(argv + i, argc - i, out);
+
+  if (up2 && up4) {
+    fprintf(stderr, "Can't have both -2 and -4!\n");
+    return 6;
+  }
+
+  if ((up2 || up4) && downsample) {
+    fprintf(stderr, "Can't have both -s and -2 or -4!\n");
+    return 6;
+  }
+
+  if (stream && nstripes > 1) {
+    fprintf(stderr, "Can't have both --stream and --stripes!\n");
+    return 6;
+  }
+
+  if (stream && nthreads > 1) {
+    fprintf(stderr, "Can't have both --stream and -j!\n");
+    return 6;
+  }
+
+  if (symbol_mode && (stream || mmr || nstripes > 1 || crop || split_gap ||
+                      stripe_rows || band_report)) {
+    fprintf(stderr, "--symbol-mode codes text regions, not generic ones: "
+            "can't have --stream, --mmr, --stripes, --crop, --split, "
+            "--striped-page or --band-report!\n");
+    return 6;
+  }
+
+  if (deadline_ms && (stream || symbol_mode || estimate || cache_dir)) {
+    fprintf(stderr, "--deadline-ms works on the stripes of generic regions: "
+            "can't have --stream, --symbol-mode, --estimate or --cache!\n");
+    return 6;
+  }
+
+  if (stripe_cache_dir && (stream || symbol_mode || band_report)) {
+    fprintf(stderr, "--stripe-cache keeps the stripes of generic regions with "
+            "known lengths: can't have --stream, --symbol-mode or "
+            "--band-report!\n");
+    return 6;
+  }
+
+  if (halftone && (stream || symbol_mode || estimate)) {
+    fprintf(stderr, "--halftone codes the halftone regions of a page in "
+            "pieces: can't have --stream, --symbol-mode or --estimate!\n");
+    return 6;
+  }
+
+  if (xobject && (!pdfmode || stream || estimate)) {
+    fprintf(stderr, "--xobject needs -p, and the length of each page: can't "
+            "have --stream or --estimate!\n");
+    return 6;
+  }
+
+  if (xobject && symbol_mode && !globals_obj) {
+    fprintf(stderr, "--xobject with --symbol-mode needs --globals-obj!\n");
+    return 6;
+  }
+
+  // a sweep of -T is a page encoded at each threshold, keeping each
+  if (nsweep > 1 && ntry_thresholds) {
+    fprintf(stderr, "Can't have both -T with several thresholds and "
+            "--try-T!\n");
+    return 6;
+  }
+  if (nsweep == 1) bw_threshold = sweep_thresholds[0];
+  for (int t = 0; nsweep > 1 && t < nsweep; ++t) {
+    try_thresholds[ntry_thresholds++] = sweep_thresholds[t];
+  }
+
+  // the ways of encoding each page: every combination of those tried
+  if (!ntry_thresholds) try_thresholds[ntry_thresholds++] = bw_threshold;
+  if (!ntry_templates) try_templates[ntry_templates++] = gbtemplate;
+  const int nvariants = ntry_thresholds * (try_tpgd ? 2 : 1) * ntry_templates;
+  if (nvariants > 1 && (stream || symbol_mode || band_report || deadline_ms)) {
+    fprintf(stderr, "Can't try several variants with --stream, --symbol-mode, "
+            "--band-report or --deadline-ms!\n");
+    return 6;
+  }
+
+  if (at_search && (symbol_mode || nvariants > 1)) {
+    fprintf(stderr, "--at-search moves the AT pixel of a single generic region "
+            "template: can't have --symbol-mode or variants to try!\n");
+    return 6;
+  }
+
+  if (estimate && (stream || symbol_mode || band_report || nvariants > 1)) {
+    fprintf(stderr, "Can't have --estimate with --stream, --symbol-mode, "
+            "--band-report or variants to try!\n");
+    return 6;
+  }
+
+  // before any threads are started (and reset for each server request)
+  l_pngSetTrustedInput(trusted_input);
+
+  // for the summary of --stats=json: the totals of the pages, and the time
+  // and output from here
+  struct jbig2_phase_times total_times;
+  memset(&total_times, 0, sizeof(total_times));
+  struct jbig2_clock start;
+  jbig2_phase_start(&total_times, &start);
+  const double start_cpu = stats_json ? process_cpu() : 0;
+  const uint64_t start_output = out->total;
+  uint64_t total_pixels = 0, input_bytes = 0, file_bytes = 0;
+
+  struct page_source *pages = NULL;
+  int npages = 0;
+  for (; i < argc; ++i) {
+    if (!add_pages(argv[i], &pages, &npages)) {
+      free_pages(pages, npages);
+      return 1;
+    }
+  }
+  // Several pages are written as one file or, in PDF mode, as a fragment for
+  // each page in a file of its own. So are symbol coded pages, even one, as
+  // their dictionary is apart from them.
+  const bool multipage = npages > 1 || symbol_mode;
+
+  FILE *band_fp = NULL;
+  if (band_report) {
+    band_fp = fopen(band_report, "w");
+    if (!band_fp) {
+      fprintf(stderr, "Cannot write band report: %s\n", band_report);
+      free_pages(pages, npages);
+      return 1;
+    }
+  }
+
+  struct page_settings settings;
+  settings.bw_threshold = bw_threshold;
+  settings.upsample = up2 ? 2 : up4 ? 4 : downsample ? -downsample : 1;
+  // threads which are not needed for the pages scale them up
+  settings.upsample_threads = nthreads > npages ? nthreads / npages : 1;
+  settings.stream = stream;
+  settings.multipage = multipage && !pdfmode;
+  settings.print_stats = print_stats;
+  settings.stats_json = stats_json;
+  settings.band_report = band_fp != NULL;
+  settings.band_rows = band_rows;
+  settings.arena = arena;
+  settings.symbol_mode = symbol_mode;
+  // a page is only cached when its output doesn't depend on the others, all
+  // of it is kept in the job, and it is encoded just one way
+  settings.cache_dir = stream || band_fp || symbol_mode || estimate ||
+                       settings.multipage || nvariants > 1 ? NULL : cache_dir;
+  struct jbig2_variant *variants = NULL;
+  settings.nvariants = nvariants;
+  if (nvariants > 1) {
+    variants = (struct jbig2_variant *) calloc(nvariants,
+                                               sizeof(struct jbig2_variant));
+    int n = 0;
+    for (int t = 0; t < ntry_thresholds; ++t) {
+      for (int d = 0; d < (try_tpgd ? 2 : 1); ++d) {
+        for (int g = 0; g < ntry_templates; ++g, ++n) {
+          variants[n].bw_threshold = try_thresholds[t];
+          variants[n].duplicate_line_removal =
+              try_tpgd ? d == 1 : duplicate_line_removal;
+          variants[n].gbtemplate = try_templates[g];
+          variants[n].count_black = nsweep > 1 && count_black;
+        }
+      }
+    }
+  }
+  settings.variants = variants;
+  // threads which are not needed for the pages encode the variants
+  settings.variant_threads = settings.upsample_threads;
+  settings.variant_report = try_report;
+  settings.nsweep = nsweep > 1 ? nsweep : 0;
+  settings.sweep_thresholds = sweep_thresholds;
+  settings.sweep_black = count_black;
+  settings.estimate = estimate;
+  settings.at_search = at_search;
+  settings.xobject = xobject;
+  settings.globals_obj = symbol_mode ? globals_obj : 0;
+  settings.opts.full_headers = !pdfmode && !multipage;
+  settings.opts.duplicate_line_removal = duplicate_line_removal;
+  settings.opts.gbtemplate = gbtemplate;
+  settings.opts.mmr = mmr;
+  settings.opts.nstripes = settings.opts.nthreads = nstripes;
+  if (deadline_ms) {
+    // the deadline is looked at as the stripes start and end
+    if (nstripes == 1) settings.opts.nstripes = kDeadlineStripes;
+    settings.opts.deadline_ns =
+        start.wall_ns + (uint64_t) deadline_ms * 1000000;
+  }
+  settings.opts.crop = crop;
+  settings.opts.remove_specks = despeckle;
+  settings.opts.halftone = halftone;
+  struct jbig2_stripe_store stripe_store;
+  stripe_store.lookup = stripe_cache_lookup;
+  stripe_store.store = stripe_cache_store;
+  stripe_store.arg = (void *) stripe_cache_dir;
+  if (stripe_cache_dir) settings.opts.stripe_store = &stripe_store;
+  settings.opts.split_gap = split_gap;
+  settings.opts.stripe_rows = stripe_rows;
+  // a page being streamed is ended by its last stripe
+  settings.opts.unknown_height = stream && stripe_rows;
+
+  struct page_job *const jobs =
+      (struct page_job *) calloc(npages, sizeof(struct page_job));
+  for (int pageno = 0; pageno < npages; ++pageno) {
+    jobs[pageno].source = &pages[pageno];
+    jobs[pageno].pageno = pageno;
+    // all of a TIFF file is counted as its first page
+    jobs[pageno].input_bytes =
+        pages[pageno].subimage > 0 ? 0 : pages[pageno].size;
+  }
+  const uint64_t max_memory = (uint64_t) max_memory_mb << 20;
+  for (int pageno = 0; max_memory && pageno < npages; ++pageno) {
+    plan_page(&settings, &jobs[pageno], max_memory);
+  }
+
+#ifndef JBIG2_NO_THREADS
+  struct page_pool pool;
+  pthread_t *threads = NULL;
+  int nworkers = 0;
+  bool preparing = false;  // the workers only read the pages (--pipeline)
+  if (nthreads > npages) nthreads = npages;
+  if (nthreads > 1 || (pipeline && npages > 1)) {
+    // the symbols are found on this thread, in order, so the workers only
+    // read the pages for that too
+    preparing = nthreads == 1 || symbol_mode;
+    pool.settings = &settings;
+    pool.jobs = jobs;
+    pool.njobs = npages;
+    pool.next = 0;
+    pool.written = 0;
+    // two pages read ahead keep the coder busy when one is slow to read
+    pool.ahead = nthreads == 1 ? 2 : 2 * nthreads;
+    pool.budget = max_memory;
+    pool.in_use = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+#ifndef JBIG2_NO_AFFINITY
+    int *cpus = NULL;
+    const int ncpus = affinity ? affinity_cpus(&cpus) : 0;
+#else
+    (void) affinity;  // there is no way to bind the threads here
+#endif
+    // if a thread can't be created the pages are encoded by the others, or
+    // read here as they are encoded
+    for (; nworkers < nthreads; ++nworkers) {
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+#ifndef JBIG2_NO_AFFINITY
+      if (ncpus) bind_worker(&attr, cpus, ncpus, nworkers, nthreads);
+#endif
+      const int err = pthread_create(&threads[nworkers], &attr,
+                                     preparing ? prepare_worker : page_worker,
+                                     &pool);
+      pthread_attr_destroy(&attr);
+      if (err) break;
+    }
+#ifndef JBIG2_NO_AFFINITY
+    free(cpus);
+#endif
+    if (!nworkers) free(threads);
+  }
+  // the output of the run (but not the files of PDF mode) is written on a
+  // thread of its own
+  if (async_output && out->fd >= 0) {
+    out->async = async_writer_start(out->fd, kAsyncQueueLimit);
+  }
+#else
+  (void) pipeline;  // there is no thread to read the pages on
+  (void) async_output;  // or to write them
+  (void) affinity;  // or to bind
+#endif
+
+  // For --symbol-mode, all the pages are classified first
+  int ret = 0;
+  struct jbig2_classifier classifier;
+  jbig2_classifier_init(&classifier, threshold);
+  for (int pageno = 0; symbol_mode && pageno < npages; ++pageno) {
+    struct page_job *const job = &jobs[pageno];
+#ifndef JBIG2_NO_THREADS
+    if (nworkers) {
+      pthread_mutex_lock(&pool.lock);
+      while (!job->done) pthread_cond_wait(&pool.cond, &pool.lock);
+      pthread_mutex_unlock(&pool.lock);
+    }
+#endif
+    classify_page(&settings, job, &classifier);
+    if (job->ret) {
+      ret = job->ret;
+      break;
+    }
+#ifndef JBIG2_NO_THREADS
+    if (nworkers) {
+      pthread_mutex_lock(&pool.lock);
+      pool.written++;
+      pool.in_use -= job->held;
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+    }
+#endif
+  }
+  if (verbose && symbol_mode && !ret) {
+    fprintf(stderr, "%d symbols on %d pages\n", classifier.nsymbols, npages);
+  }
+
+  // with --estimate, only the lines of JSON are written, and for a sweep of
+  // -T the output at each threshold goes to files of its own
+  const bool page_files = multipage && pdfmode && !estimate;
+  const bool sweep = settings.nsweep > 0;
+  unsigned segnum = 0;
+  if (!ret && multipage && !pdfmode && !estimate && !sweep) {
+    out->head = jbig2_encode_file_header(npages, &out->head_size);
+  }
+  struct output *sweep_outs = NULL;
+  unsigned *sweep_segnums = NULL;
+  if (sweep) {
+    sweep_outs = (struct output *) calloc(nsweep, sizeof(struct output));
+    sweep_segnums = (unsigned *) calloc(nsweep, sizeof(unsigned));
+    for (int t = 0; t < nsweep; ++t) sweep_outs[t].fd = -1;
+  }
+  for (int t = 0; !ret && sweep && !page_files && t < nsweep; ++t) {
+    char *filename;
+    asprintf(&filename, "%s.T%d", basename, sweep_thresholds[t]);
+    sweep_outs[t].fd =
+        open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0600);
+    if (sweep_outs[t].fd < 0) {
+      fprintf(stderr, "Unable to open output file: %s\n", filename);
+      ret = 1;
+    } else if (multipage && !pdfmode) {
+      sweep_outs[t].head =
+          jbig2_encode_file_header(npages, &sweep_outs[t].head_size);
+    }
+    free(filename);
+  }
+
+  // The dictionary is segment zero: the first of the file or, in PDF mode, the
+  // only one of the JBIG2Globals stream
+  if (!ret && symbol_mode) {
+    size_t length;
+    uint8_t *const dict = jbig2_encode_symbol_dict(&classifier, segnum++,
+                                                   &length);
+    if (!dict) {
+      fprintf(stderr, "Failed to encode the symbol dictionary\n");
+      ret = 1;
+    } else if (pdfmode) {
+      char *filename;
+      asprintf(&filename, "%s.sym", basename);
+      struct output file = {-1, NULL, 0, 0, 0, NULL, NULL, 0};
+      file.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0600);
+      if (file.fd < 0) {
+        fprintf(stderr, "Unable to open output file: %s\n", filename);
+        ret = 1;
+      } else {
+        if (xobject) {
+          char *head;
+          const int head_length = asprintf(&head, "<< /Length %lu >>\nstream\n",
+                                           (unsigned long) length);
+          write_output(&file, head, head_length);
+          free(head);
+        }
+        write_output(&file, dict, length);
+        if (xobject) write_output(&file, "\nendstream\n", 11);
+        close(file.fd);
+        file_bytes += file.total;
+      }
+      free(filename);
+    } else {
+      write_output(out, dict, length);
+    }
+    free(dict);
+  }
+
+  // The pages are written in order, whichever order they are encoded in
+  for (int pageno = 0; !ret && pageno < npages; ++pageno) {
+    struct page_job *const job = &jobs[pageno];
+
+    struct output file = {-1, NULL, 0, 0, 0, NULL, NULL, 0};
+    struct output *const dest = page_files ? &file : out;
+    const uint64_t written = dest->total;
+    if (page_files && !sweep) {
+      char *filename;
+      asprintf(&filename, "%s.%04d", basename, pageno);
+      file.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0600);
+      if (file.fd < 0) {
+        fprintf(stderr, "Unable to open output file: %s\n", filename);
+        free(filename);
+        ret = 1;
+        break;
+      }
+      free(filename);
+    }
+
+    if (symbol_mode) {
+      encode_symbol_page(&settings, job, &classifier, &segnum);
+    } else
+#ifndef JBIG2_NO_THREADS
+    if (nworkers) {
+      pthread_mutex_lock(&pool.lock);
+      while (!job->done) pthread_cond_wait(&pool.cond, &pool.lock);
+      pthread_mutex_unlock(&pool.lock);
+      if (preparing) encode_page(&settings, job, &segnum, dest);
+    } else
+#endif
+    {
+      encode_page(&settings, job, &segnum, dest);
+    }
+    if (job->ret) {
+      if (file.fd >= 0) close(file.fd);
+      ret = job->ret;
+      break;
+    }
+
+    struct jbig2_clock mark;
+    jbig2_phase_start(stats_json ? &job->times : NULL, &mark);
+    JBIG2_TRACE1(output__start, pageno);
+    if (estimate) {
+      const struct jbig2_estimate &est = job->estimate;
+      char *line;
+      const int length = asprintf(
+          &line, "{\"page\": %d, \"width\": %d, \"height\": %d, "
+          "\"bytes\": %llu, \"low\": %llu, \"high\": %llu, "
+          "\"bands\": %d, \"sampled\": %d}\n", pageno, job->width,
+          job->height, (unsigned long long) est.bytes,
+          (unsigned long long) est.low, (unsigned long long) est.high,
+          est.bands, est.sampled);
+      write_output(dest, line, length);
+      free(line);
+    }
+    if (job->pieces.npieces) {
+      if (settings.multipage) {
+        segnum = jbig2_renumber_pieces(&job->pieces, segnum);
+      }
+      write_page(dest, &settings, job, &job->pieces);
+      jbig2_free_pieces(&job->pieces);
+    }
+    int64_t sweep_bytes = 0;
+    if (job->sweep) {
+      sweep_bytes = write_sweep_page(&settings, job, basename, page_files,
+                                     sweep_outs, sweep_segnums);
+      if (sweep_bytes < 0) {
+        ret = 1;
+        break;
+      }
+      // the files of the sweep which stay open are counted when closed
+      if (page_files) file_bytes += sweep_bytes;
+    }
+    if (file.fd >= 0) close(file.fd);
+    jbig2_phase_done(stats_json ? &job->times : NULL, JBIG2_PHASE_OUTPUT,
+                     &mark);
+    job->output_bytes = dest->total - written + sweep_bytes;
+    JBIG2_TRACE2(output__done, pageno, job->output_bytes);
+    JBIG2_TRACE4(page__done, pageno, job->width, job->height,
+                 job->output_bytes);
+    if (dest == &file) file_bytes += file.total;
+
+    if (job->band_bytes) {
+      write_band_report(band_fp, pageno, job->width, job->height, band_rows,
+                        job->band_bytes);
+      free(job->band_bytes);
+      job->band_bytes = NULL;
+    }
+    add_stats(&stats, &job->stats);
+    if (stats_json) {
+      write_page_stats(stderr, pageno, job->width, job->height,
+                       job->input_bytes, job->output_bytes, &job->times);
+      for (int k = 0; k < JBIG2_NPHASES; ++k) {
+        total_times.wall_ns[k] += job->times.wall_ns[k];
+        total_times.cpu_ns[k] += job->times.cpu_ns[k];
+      }
+      total_pixels += (uint64_t) job->width * job->height;
+      input_bytes += job->input_bytes;
+    }
+
+#ifndef JBIG2_NO_THREADS
+    if (nworkers && !symbol_mode) {
+      pthread_mutex_lock(&pool.lock);
+      pool.written++;
+      pool.in_use -= job->held;
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+    }
+#endif
+  }
+
+#ifndef JBIG2_NO_THREADS
+  if (nworkers) {
+    // after an error, the pages not started yet are dropped
+    pthread_mutex_lock(&pool.lock);
+    pool.next = pool.njobs;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (int t = 0; t < nworkers; ++t) pthread_join(threads[t], NULL);
+    free(threads);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+  }
+#endif
+  for (int pageno = 0; pageno < npages; ++pageno) {
+    jbig2_free_pieces(&jobs[pageno].pieces);
+    for (int t = 0; jobs[pageno].sweep && t < nsweep; ++t) {
+      jbig2_free_pieces(&jobs[pageno].sweep[t].pieces);
+    }
+    free(jobs[pageno].sweep);
+    free(jobs[pageno].band_bytes);
+    pixDestroy(&jobs[pageno].pix);
+    free(jobs[pageno].instances);
+  }
+  jbig2_classifier_free(&classifier);
+  free(variants);
+  free(jobs);
+  free_pages(pages, npages);
+
+  if (!ret && multipage && !pdfmode && !estimate && !sweep) {
+    size_t length;
+    uint8_t *const eof = jbig2_encode_end_of_file(segnum, &length);
+    write_output(out, eof, length);
+    free(eof);
+  }
+  // still held back if the first page failed
+  free(out->head);
+  out->head = NULL;
+  for (int t = 0; sweep && t < nsweep; ++t) {
+    if (sweep_outs[t].fd < 0) continue;
+    if (!ret && multipage && !pdfmode) {
+      size_t length;
+      uint8_t *const eof = jbig2_encode_end_of_file(sweep_segnums[t], &length);
+      write_output(&sweep_outs[t], eof, length);
+      free(eof);
+    }
+    free(sweep_outs[t].head);
+    close(sweep_outs[t].fd);
+    file_bytes += sweep_outs[t].total;
+  }
+  free(sweep_outs);
+  free(sweep_segnums);
+#ifndef JBIG2_NO_THREADS
+  if (out->async) {
+    async_writer_finish(out->async);
+    out->async = NULL;
+  }
+#endif
+
+  if (!ret && print_stats) print_coder_stats(&stats);
+  if (!ret && stats_json) {
+    struct jbig2_clock end;
+    jbig2_phase_start(&total_times, &end);
+    const double elapsed = (end.wall_ns - start.wall_ns) * 1e-9;
+    const uint64_t output_bytes = out->total - start_output + file_bytes;
+    fprintf(stderr, "{\"pages\": %d, \"input_bytes\": %llu, "
+            "\"output_bytes\": %llu, \"elapsed\": %.6f, "
+            "\"process_cpu\": %.6f, \"peak_rss_kb\": %ld, "
+            "\"mpixel_per_s\": %.2f", npages,
+            (unsigned long long) input_bytes,
+            (unsigned long long) output_bytes, elapsed,
+            process_cpu() - start_cpu, peak_rss_kb(),
+            elapsed > 0 ? total_pixels * 1e-6 / elapsed : 0.0);
+    write_phase_times(stderr, &total_times);
+    fprintf(stderr, "}\n");
+  }
+  if (band_fp && fclose(band_fp) != 0 && !ret) {
+    fprintf(stderr, "Cannot write band report: %s\n", band_report);
+    ret = 1;
+  }
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Read a line from fp into *line (growing it as needed), without the newline.
+// Returns false at the end of the input.
+// -----------------------------------------------------------------------------
+static bool
+read_line(FILE *fp, char **line, size_t *capacity) {
+  size_t size = 0;
+  for (;;) {
+    if (size + 2 > *capacity) {
+      *capacity = *capacity ? *capacity * 2 : 256;
+      *line = (char *) realloc(*line, *capacity);
+    }
+    if (!fgets(*line + size, *capacity - size, fp)) break;
+    size += strlen(*line + size);
+    if (size && (*line)[size - 1] == '\n') {
+      (*line)[size - 1] = 0;
+      return true;
+    }
+  }
+  return size > 0;
+}
+
+// -----------------------------------------------------------------------------
+// Server mode (--server) for callers which encode many images: the requests
+// are read from stdin, one per line. A request is the arguments for one run
+// (options and input files) separated by spaces, with \ quoting a space or a
+// \. The reply on stdout is a line with the exit code and the length of the
+// output, followed by the output itself.
+// -----------------------------------------------------------------------------
+static int
+serve() {
+  struct output out = {-1, NULL, 0, 0, 0, NULL, NULL, 0};
+  char *line = NULL;
+  size_t capacity = 0;
+  char **args = NULL;
+
+  serving = true;
+  while (read_line(stdin, &line, &capacity)) {
+    // split the line into arguments in place
+    args = (char **) realloc(args, (strlen(line) / 2 + 3) * sizeof(char *));
+    int nargs = 0;
+    args[nargs++] = (char *) "jbig2";
+    char *in = line, *arg = NULL, *end = line;
+    for (; *in; ++in) {
+      if (*in == ' ' || *in == '\t') {
+        if (arg) {
+          *end++ = 0;
+          args[nargs++] = arg;
+          arg = NULL;
+        }
+        continue;
+      }
+      if (!arg) arg = end;
+      if (*in == '\\' && in[1]) ++in;
+      *end++ = *in;
+    }
+    if (arg) {
+      *end = 0;
+      args[nargs++] = arg;
+    }
+    args[nargs] = NULL;
+
+    out.size = 0;
+    const int ret = run(nargs, args, &out);
+    printf("%d %lu\n", ret, (unsigned long) out.size);
+    fwrite(out.buf, 1, out.size, stdout);
+    fflush(stdout);
+  }
+
+  free(args);
+  free(line);
+  free(out.buf);
+  arena_release();
+  return 0;
+}
+
+int
+main(int argc, char **argv) {
+#ifdef WIN32
+  int result = setmode(1, WINBINARY);  // stdout.
+  if (result == -1) {
+    perror("Cannot set mode to binary for stdout.");
+    return 1;
+  }
+#endif
+
+  // the Pix are allocated from a page arena with --arena, and from malloc
+  // otherwise
+  setPixMemoryManager(arena_malloc, arena_free);
+  setPixMemoryReallocator(arena_realloc);
+  // cache-line aligned rows, and huge pages for multi-megabyte images
+  setPixDataAlignment(64, 1, 2 << 20);
+
+  if (argc == 2 && strcmp(argv[1], "--server") == 0) return serve();
+
+  struct output out = {1, NULL, 0, 0, 0, NULL, NULL, 0};
+  const int ret = run(argc, argv, &out);
+  arena_release();
+  return ret;
+}
@@ -21,6 +21,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "jbig2simd.h"
+
 #define u64 uint64_t
 #define u32 uint32_t
 #define u16 uint16_t
@@ -48,67 +56,121 @@ struct context ctbl[] = {
   // This is the standard state table from
   // Table E.1 of the standard. The switch has been omitted and
   // those states are included below
-#define STATETABLE \
-  {0x5601, F( 1), SWITCH(F( 1))},\
-  {0x3401, F( 2), F( 6)},\
-  {0x1801, F( 3), F( 9)},\
-  {0x0ac1, F( 4), F(12)},\
-  {0x0521, F( 5), F(29)},\
-  {0x0221, F(38), F(33)},\
-  {0x5601, F( 7), SWITCH(F( 6))},\
-  {0x5401, F( 8), F(14)},\
-  {0x4801, F( 9), F(14)},\
-  {0x3801, F(10), F(14)},\
-  {0x3001, F(11), F(17)},\
-  {0x2401, F(12), F(18)},\
-  {0x1c01, F(13), F(20)},\
-  {0x1601, F(29), F(21)},\
-  {0x5601, F(15), SWITCH(F(14))},\
-  {0x5401, F(16), F(14)},\
-  {0x5101, F(17), F(15)},\
-  {0x4801, F(18), F(16)},\
-  {0x3801, F(19), F(17)},\
-  {0x3401, F(20), F(18)},\
-  {0x3001, F(21), F(19)},\
-  {0x2801, F(22), F(19)},\
-  {0x2401, F(23), F(20)},\
-  {0x2201, F(24), F(21)},\
-  {0x1c01, F(25), F(22)},\
-  {0x1801, F(26), F(23)},\
-  {0x1601, F(27), F(24)},\
-  {0x1401, F(28), F(25)},\
-  {0x1201, F(29), F(26)},\
-  {0x1101, F(30), F(27)},\
-  {0x0ac1, F(31), F(28)},\
-  {0x09c1, F(32), F(29)},\
-  {0x08a1, F(33), F(30)},\
-  {0x0521, F(34), F(31)},\
-  {0x0441, F(35), F(32)},\
-  {0x02a1, F(36), F(33)},\
-  {0x0221, F(37), F(34)},\
-  {0x0141, F(38), F(35)},\
-  {0x0111, F(39), F(36)},\
-  {0x0085, F(40), F(37)},\
-  {0x0049, F(41), F(38)},\
-  {0x0025, F(42), F(39)},\
-  {0x0015, F(43), F(40)},\
-  {0x0009, F(44), F(41)},\
-  {0x0005, F(45), F(42)},\
-  {0x0001, F(45), F(43)},
+#define STATETABLE(S) \
+  S(0x5601, F( 1), SWITCH(F( 1)))\
+  S(0x3401, F( 2), F( 6))\
+  S(0x1801, F( 3), F( 9))\
+  S(0x0ac1, F( 4), F(12))\
+  S(0x0521, F( 5), F(29))\
+  S(0x0221, F(38), F(33))\
+  S(0x5601, F( 7), SWITCH(F( 6)))\
+  S(0x5401, F( 8), F(14))\
+  S(0x4801, F( 9), F(14))\
+  S(0x3801, F(10), F(14))\
+  S(0x3001, F(11), F(17))\
+  S(0x2401, F(12), F(18))\
+  S(0x1c01, F(13), F(20))\
+  S(0x1601, F(29), F(21))\
+  S(0x5601, F(15), SWITCH(F(14)))\
+  S(0x5401, F(16), F(14))\
+  S(0x5101, F(17), F(15))\
+  S(0x4801, F(18), F(16))\
+  S(0x3801, F(19), F(17))\
+  S(0x3401, F(20), F(18))\
+  S(0x3001, F(21), F(19))\
+  S(0x2801, F(22), F(19))\
+  S(0x2401, F(23), F(20))\
+  S(0x2201, F(24), F(21))\
+  S(0x1c01, F(25), F(22))\
+  S(0x1801, F(26), F(23))\
+  S(0x1601, F(27), F(24))\
+  S(0x1401, F(28), F(25))\
+  S(0x1201, F(29), F(26))\
+  S(0x1101, F(30), F(27))\
+  S(0x0ac1, F(31), F(28))\
+  S(0x09c1, F(32), F(29))\
+  S(0x08a1, F(33), F(30))\
+  S(0x0521, F(34), F(31))\
+  S(0x0441, F(35), F(32))\
+  S(0x02a1, F(36), F(33))\
+  S(0x0221, F(37), F(34))\
+  S(0x0141, F(38), F(35))\
+  S(0x0111, F(39), F(36))\
+  S(0x0085, F(40), F(37))\
+  S(0x0049, F(41), F(38))\
+  S(0x0025, F(42), F(39))\
+  S(0x0015, F(43), F(40))\
+  S(0x0009, F(44), F(41))\
+  S(0x0005, F(45), F(42))\
+  S(0x0001, F(45), F(43))
+#define S(qe, mps, lps) {qe, mps, lps},
+#define F(x) x
+#define SWITCH(x) (x + 46)
+  STATETABLE(S)
+#undef SWITCH
 #undef F
+
+#define F(x) (x + 46)
+#define SWITCH(x) ((x) - 46)
+  STATETABLE(S)
+#undef SWITCH
+#undef F
+#undef S
+};
+
+// -----------------------------------------------------------------------------
+// The same table with each state packed into a single word so that the coder
+// gets everything it needs with one load:
+//   bits 16..31: Qe
+//   bit 15: the MPS of this state
+//   bits 8..14: the next state after coding an MPS
+//   bits 0..6: the next state after coding an LPS
+// -----------------------------------------------------------------------------
+static const u32 ctbl_packed[] = {
+#define PACK(qe, mps, nmps, nlps) \
+  (((u32) (qe) << 16) | ((u32) (mps) << 15) | ((nmps) << 8) | (nlps)),
 #define F(x) x
 #define SWITCH(x) (x + 46)
-  STATETABLE
+#define S(qe, nmps, nlps) PACK(qe, 0, nmps, nlps)
+  STATETABLE(S)
+#undef S
 #undef SWITCH
 #undef F
 
 #define F(x) (x + 46)
 #define SWITCH(x) ((x) - 46)
-  STATETABLE
+#define S(qe, nmps, nlps) PACK(qe, 1, nmps, nlps)
+  STATETABLE(S)
+#undef S
 #undef SWITCH
 #undef F
+#undef PACK
 };
 
+// -----------------------------------------------------------------------------
+// For each state, ceil(2**32 / Qe). An MPS which leaves A at or above 0x8000
+// only moves A down and C up by Qe, so a run of them can be done in one step
+// once we know how many fit: (A - 0x8000) / Qe, which is worked out with a
+// multiply by this. For numerators below 0x8000 the result is exact.
+// -----------------------------------------------------------------------------
+static const u64 ctbl_mps_recip[] = {
+#define F(x) x
+#define SWITCH(x) x
+#define S(qe, nmps, nlps) ((1ull << 32) / (qe) + 1),
+  STATETABLE(S)
+  STATETABLE(S)
+#undef S
+#undef SWITCH
+#undef F
+};
+
+// Counting for struct jbig2enc_stats
+#ifdef JBIG2_STATS
+#define STAT(field, n) ctx->stats.field += (n)
+#else
+#define STAT(field, n)
+#endif
+
 #if __GNUC__ >= 4
 #define BRANCH_OPT
 #endif
@@ -133,10 +195,32 @@ jbig2enc_init(struct jbig2enc_ctx *ctx) {
   ctx->bp = -1;
   ctx->b = 0;
   ctx->outbuf_used = 0;
+  ctx->outbuf_capacity = JBIG2_OUTPUTBUFFER_SIZE;
+  ctx->outbuf_reserved = 0;
+  ctx->flat = false;
+  ctx->sink = NULL;
+  ctx->sink_arg = NULL;
+  ctx->sink_written = 0;
   ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
   ctx->output_chunks = NULL;
   ctx->output_chunks_size = ctx->output_chunks_capacity = 0;
   ctx->iaidctx = NULL;
+  memset(ctx->context_dirty, 0, sizeof(ctx->context_dirty));
+  ctx->intctx_dirty = false;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->band_bytes = NULL;
+}
+
+// see comments in .h file
+void
+jbig2enc_init_flat(struct jbig2enc_ctx *ctx, int reserved) {
+  jbig2enc_init(ctx);
+  ctx->flat = true;
+  ctx->outbuf_reserved = ctx->outbuf_used = reserved;
+  if (ctx->outbuf_capacity < (size_t) reserved * 2) {
+    ctx->outbuf_capacity = (size_t) reserved * 2;
+    ctx->outbuf = (u8 *) realloc(ctx->outbuf, ctx->outbuf_capacity);
+  }
 }
 
 // see comments in .h file
@@ -150,30 +234,187 @@ jbig2enc_dealloc(struct jbig2enc_ctx *ctx) {
   free(ctx->iaidctx);
 }
 
+// see comments in .h file
+void
+jbig2enc_init_sink(struct jbig2enc_ctx *ctx,
+                   void (*sink)(void *sink_arg, const u8 *data, size_t size),
+                   void *sink_arg) {
+  jbig2enc_init(ctx);
+  ctx->sink = sink;
+  ctx->sink_arg = sink_arg;
+}
+
+// see comments in .h file
+void
+jbig2enc_reset(struct jbig2enc_ctx *ctx) {
+  for (unsigned i = 0; i < sizeof(ctx->context_dirty); ++i) {
+    if (ctx->context_dirty[i]) {
+      memset(ctx->context + i * JBIG2_CTX_BLOCK, 0, JBIG2_CTX_BLOCK);
+    }
+  }
+  memset(ctx->context_dirty, 0, sizeof(ctx->context_dirty));
+  if (ctx->intctx_dirty) memset(ctx->intctx, 0, 13 * 512);
+  ctx->intctx_dirty = false;
+  free(ctx->iaidctx);
+  ctx->iaidctx = NULL;
+
+  ctx->a = 0x8000;
+  ctx->c = 0;
+  ctx->ct = 12;
+  ctx->bp = -1;
+  ctx->b = 0;
+
+  // keep the first chunk (or the flat buffer) only
+  if (ctx->output_chunks_size) {
+    free(ctx->outbuf);
+    ctx->outbuf = ctx->output_chunks[0];
+    for (size_t i = 1; i < ctx->output_chunks_size; ++i) {
+      free(ctx->output_chunks[i]);
+    }
+    ctx->output_chunks_size = 0;
+  }
+  if (!ctx->outbuf) {
+    ctx->outbuf_capacity = JBIG2_OUTPUTBUFFER_SIZE;
+    if (ctx->outbuf_capacity < ctx->outbuf_reserved * 2) {
+      ctx->outbuf_capacity = ctx->outbuf_reserved * 2;
+    }
+    ctx->outbuf = (u8 *) malloc(ctx->outbuf_capacity);
+  }
+  ctx->outbuf_used = ctx->outbuf_reserved;
+  ctx->sink_written = 0;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->band_bytes = NULL;
+}
+
+// see comments in .h file
+void
+jbig2enc_reset_flat(struct jbig2enc_ctx *ctx, int reserved) {
+  if (!ctx->flat) abort();
+  ctx->outbuf_reserved = reserved;
+  jbig2enc_reset(ctx);
+  if (ctx->outbuf_capacity < (size_t) reserved * 2) {
+    ctx->outbuf_capacity = (size_t) reserved * 2;
+    ctx->outbuf = (u8 *) realloc(ctx->outbuf, ctx->outbuf_capacity);
+  }
+}
+
+// see comments in .h file
+void
+jbig2enc_addstats(const struct jbig2enc_ctx *ctx,
+                  struct jbig2enc_stats *stats) {
+  stats->mps += ctx->stats.mps;
+  stats->lps += ctx->stats.lps;
+  stats->renorm_shifts += ctx->stats.renorm_shifts;
+  stats->carries += ctx->stats.carries;
+  stats->rows += ctx->stats.rows;
+  stats->tpgd_rows += ctx->stats.tpgd_rows;
+  stats->bytes += jbig2enc_datasize(ctx);
+}
+
+// see comments in .h file
+void
+jbig2enc_bands(struct jbig2enc_ctx *ctx, uint32_t *band_bytes, int band_rows,
+               int y0) {
+  ctx->band_bytes = band_bytes;
+  ctx->band_rows = band_rows;
+  ctx->band_y0 = y0;
+  ctx->band_mark = jbig2enc_datasize(ctx);
+}
+
+// see comments in .h file
+void
+jbig2enc_endrow(struct jbig2enc_ctx *ctx, int y, int my) {
+  const int pagey = ctx->band_y0 + y;
+  if ((pagey + 1) % ctx->band_rows != 0 && y + 1 != my) return;
+  const size_t size = jbig2enc_datasize(ctx);
+  // the bands at the ends of a stripe are shared with the stripes next to it,
+  // which may be coded at the same time
+  __sync_fetch_and_add(&ctx->band_bytes[pagey / ctx->band_rows],
+                       size - ctx->band_mark);
+  ctx->band_mark = size;
+}
+
+// -----------------------------------------------------------------------------
+// Pass the current output chunk to the sink and start it again
+// -----------------------------------------------------------------------------
+static void
+flush_sink(struct jbig2enc_ctx *restrict ctx) {
+  if (ctx->outbuf_used) ctx->sink(ctx->sink_arg, ctx->outbuf, ctx->outbuf_used);
+  ctx->sink_written += ctx->outbuf_used;
+  ctx->outbuf_used = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Make room in the output for at least one more byte: either double the size
+// of the flat output buffer, pass the chunk to the sink or start a new chunk.
+// -----------------------------------------------------------------------------
+static void
+grow_output(struct jbig2enc_ctx *restrict ctx) {
+  if (ctx->sink) {
+    flush_sink(ctx);
+    return;
+  }
+
+  if (ctx->flat) {
+    ctx->outbuf_capacity *= 2;
+    ctx->outbuf = (u8 *) realloc(ctx->outbuf, ctx->outbuf_capacity);
+    return;
+  }
+
+  if (ctx->output_chunks_size == ctx->output_chunks_capacity) {
+    if (ctx->output_chunks_capacity < 16) ctx->output_chunks_capacity = 16;
+    while (ctx->output_chunks_size >= ctx->output_chunks_capacity) {
+      ctx->output_chunks_capacity <<= 1;
+    }
+    ctx->output_chunks = (u8 **) realloc(
+        ctx->output_chunks,
+        ctx->output_chunks_capacity * sizeof *ctx->output_chunks);
+  }
+  ctx->output_chunks[ctx->output_chunks_size++] = ctx->outbuf;
+  ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
+  ctx->outbuf_used = 0;
+}
+
 // -----------------------------------------------------------------------------
 // Emit a byte from the compressor by appending to the current output buffer.
-// If the buffer is full, allocate a new one
+// If the buffer is full, make room first
 // -----------------------------------------------------------------------------
 static void inline
 emit(struct jbig2enc_ctx *restrict ctx) {
-  if (unlikely(ctx->outbuf_used == JBIG2_OUTPUTBUFFER_SIZE)) {
-    if (ctx->output_chunks_size == ctx->output_chunks_capacity) {
-      if (ctx->output_chunks_capacity < 16) ctx->output_chunks_capacity = 16;
-      while (ctx->output_chunks_size >= ctx->output_chunks_capacity) {
-        ctx->output_chunks_capacity <<= 1;
-      }
-      ctx->output_chunks = (u8 **) realloc(
-          ctx->output_chunks,
-          ctx->output_chunks_capacity * sizeof *ctx->output_chunks);
-    }
-    ctx->output_chunks[ctx->output_chunks_size++] = ctx->outbuf;
-    ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
-    ctx->outbuf_used = 0;
-  }
+  if (unlikely(ctx->outbuf_used == ctx->outbuf_capacity)) grow_output(ctx);
 
   ctx->outbuf[ctx->outbuf_used++] = ctx->b;
 }
 
+// see comments in .h file
+void
+jbig2enc_putbyte(struct jbig2enc_ctx *ctx, u8 byte) {
+  if (unlikely(ctx->outbuf_used == ctx->outbuf_capacity)) grow_output(ctx);
+
+  ctx->outbuf[ctx->outbuf_used++] = byte;
+}
+
+// see comments in .h file
+void
+jbig2enc_putbytes(struct jbig2enc_ctx *restrict ctx, const u8 *restrict data,
+                  size_t size) {
+  while (size) {
+    if (ctx->outbuf_used == ctx->outbuf_capacity) grow_output(ctx);
+    size_t n = ctx->outbuf_capacity - ctx->outbuf_used;
+    if (n > size) n = size;
+    memcpy(ctx->outbuf + ctx->outbuf_used, data, n);
+    ctx->outbuf_used += n;
+    data += n;
+    size -= n;
+  }
+}
+
+// see comments in .h file
+void
+jbig2enc_flush(struct jbig2enc_ctx *ctx) {
+  if (ctx->sink) flush_sink(ctx);
+}
+
 // -----------------------------------------------------------------------------
 // The BYTEOUT procedure from the standard
 // -----------------------------------------------------------------------------
@@ -182,6 +423,7 @@ byteout(struct jbig2enc_ctx *restrict ctx) {
   if (ctx->b == 0xff) goto rblock;
 
   if (ctx->c < 0x8000000) goto lblock;
+  STAT(carries, 1);
   ctx->b += 1;
   if (ctx->b != 0xff) goto lblock;
   ctx->c &= 0x7ffffff;
@@ -213,8 +455,88 @@ lblock:
   return;
 }
 
+// -----------------------------------------------------------------------------
+// Record that an entry of context (either the image contexts or intctx) might
+// not be zero anymore, for jbig2enc_reset. This is only done when a state
+// changes, which is much rarer than coding a bit.
+// -----------------------------------------------------------------------------
+static inline void
+mark_dirty(struct jbig2enc_ctx *restrict ctx, const u8 *context, u32 ctxnum) {
+  if (context == ctx->context) {
+    ctx->context_dirty[ctxnum / JBIG2_CTX_BLOCK] = 1;
+  } else {
+    ctx->intctx_dirty = true;
+  }
+}
+
+#ifndef JBIG2_REFERENCE_CODER
+// -----------------------------------------------------------------------------
+// A merging of the ENCODE, CODELPS and CODEMPS procedures from the standard.
+//
+// This works from the packed state table. The common case, an MPS which
+// doesn't need renormalisation, is tested for first. Everything else shares
+// a single path where the conditional exchange is done without branches: the
+// coded symbol gets the upper subinterval (and C moves up by Qe) when it is
+// an MPS which doesn't need an exchange or an LPS which does.
+// -----------------------------------------------------------------------------
+static void
+encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum, u8 d) {
+  const u8 i = context[ctxnum];
+  const u32 state = ctbl_packed[i];
+  const u16 qe = state >> 16;
+  const u8 mps = (state >> 15) & 1;
+
+#ifdef CODER_DEBUGGING
+    fprintf(stderr, "B: %d %d %d %d\n", ctxnum, qe, ctx->a, d);
+#endif
+
+#ifdef TRACE
+  static int ec = 0;
+  printf("%d\t%d %d %x %x %x %d %x %d\n", ec++, i, mps, qe, ctx->a, ctx->c, ctx->ct, ctx->b, ctx->bp);
+#endif
+
+  ctx->a -= qe;
+  if (likely(d == mps && (ctx->a & 0x8000))) {
+    STAT(mps, 1);
+    ctx->c += qe;
+    return;
+  }
+  STAT(mps, d == mps);
+  STAT(lps, d != mps);
+
+  const u32 upper = (d == mps) != (ctx->a < qe);
+  ctx->c += qe & -upper;
+  ctx->a = upper ? ctx->a : qe;
+  context[ctxnum] = (state >> (d == mps ? 8 : 0)) & 0x7f;
+  mark_dirty(ctx, context, ctxnum);
+
+  // Renormalise. Most often A needs to be doubled just once; otherwise it is
+  // shifted all at once, by the count of its leading zeros, instead of a bit
+  // at a time. C is shifted up to each byte boundary on the way, so that
+  // BYTEOUT sees it just as it would in the loop of the standard.
+  if (likely(ctx->a & 0x4000)) {
+    STAT(renorm_shifts, 1);
+    ctx->a <<= 1;
+    ctx->c <<= 1;
+    if (unlikely(!--ctx->ct)) byteout(ctx);
+    return;
+  }
+  int shift = __builtin_clz(ctx->a) - 16;
+  STAT(renorm_shifts, shift);
+  ctx->a <<= shift;
+  while (shift >= ctx->ct) {
+    shift -= ctx->ct;
+    ctx->c <<= ctx->ct;
+    byteout(ctx);
+  }
+  ctx->c <<= shift;
+  ctx->ct -= shift;
+}
+#else
 // -----------------------------------------------------------------------------
 // A merging of the ENCODE, CODELPS and CODEMPS procedures from the standard
+//
+// This is the textbook version which works from ctbl.
 // -----------------------------------------------------------------------------
 static void
 encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum, u8 d) {
@@ -232,13 +554,7 @@ encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum,
 #endif
 
   if (unlikely(d != mps)) goto codelps;
-#ifdef SURPRISE_MAP
-  {
-  u8 b = static_cast<unsigned char>
-    (((static_cast<float>(qe) / 0xac02) * 255));
-  write(3, &b, 1);
-  }
-#endif
+  STAT(mps, 1);
   ctx->a -= qe;
   if (unlikely((ctx->a & 0x8000) == 0)) {
     if (unlikely(ctx->a < qe)) {
@@ -247,6 +563,7 @@ encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum,
       ctx->c += qe;
     }
     context[ctxnum] = ctbl[i].mps;
+    mark_dirty(ctx, context, ctxnum);
     goto renorme;
   } else {
     ctx->c += qe;
@@ -255,13 +572,7 @@ encode_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum,
   return;
 
 codelps:
-#ifdef SURPRISE_MAP
-  {
-  u8 b = static_cast<unsigned char>
-    ((1.0f - (static_cast<float>(qe) / 0xac02)) * 255);
-  write(3, &b, 1);
-  }
-#endif
+  STAT(lps, 1);
   ctx->a -= qe;
   if (ctx->a < qe) {
     ctx->c += qe;
@@ -269,9 +580,11 @@ codelps:
     ctx->a = qe;
   }
   context[ctxnum] = ctbl[i].lps;
+  mark_dirty(ctx, context, ctxnum);
 
 renorme:
   do {
+    STAT(renorm_shifts, 1);
     ctx->a <<= 1;
     ctx->c <<= 1;
     ctx->ct -= 1;
@@ -280,6 +593,111 @@ renorme:
     }
   } while ((ctx->a & 0x8000) == 0);
 }
+#endif  // JBIG2_REFERENCE_CODER
+
+// -----------------------------------------------------------------------------
+// Encode n copies of the bit d, all in the same context. This gives exactly
+// the same output as n calls to encode_bit, but the MPS steps which don't
+// renormalise are done in bulk.
+// -----------------------------------------------------------------------------
+static void
+encode_run(struct jbig2enc_ctx *restrict ctx, u8 *restrict context, u32 ctxnum,
+           u8 d, unsigned n) {
+  while (n) {
+    const u8 i = context[ctxnum];
+    const u32 state = ctbl_packed[i];
+    if (d == ((state >> 15) & 1)) {
+      const u16 qe = state >> 16;
+      unsigned k = ((u64) (ctx->a - 0x8000) * ctbl_mps_recip[i]) >> 32;
+      if (k > n) k = n;
+      ctx->a -= k * qe;
+      ctx->c += k * qe;
+      STAT(mps, k);
+      n -= k;
+      if (!n) break;
+    }
+    // this one needs renormalisation (or is an LPS)
+    encode_bit(ctx, context, ctxnum, d);
+    n--;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Integer coding (Annex A.2). A value is coded as its sign, a prefix which
+// picks one of these ranges for its magnitude, and then the offset into the
+// range in the given number of bits. Every bit is coded in a context made
+// from the bits before it (PREV in the standard).
+// -----------------------------------------------------------------------------
+struct int_range {
+  u32 bot;  // the first magnitude of the range
+  u8 prefix, prefix_bits;
+  u8 bits;  // the bits of offset
+};
+
+static const struct int_range int_ranges[] = {
+  {0, 0x0, 1, 2},
+  {4, 0x2, 2, 4},
+  {20, 0x6, 3, 6},
+  {84, 0xe, 4, 8},
+  {340, 0x1e, 5, 12},
+  {4436, 0x1f, 5, 32},
+};
+
+static inline void
+encode_int_bit(struct jbig2enc_ctx *restrict ctx, u8 *restrict context,
+               u32 *prev, u8 d) {
+  encode_bit(ctx, context, *prev, d);
+  // a context keeps the last eight bits once there are that many
+  *prev = *prev < 256 ? (*prev << 1) | d : (((*prev << 1) | d) & 511) | 256;
+}
+
+// Code the sign and then the magnitude, where a negative zero is the
+// out-of-band value
+static void
+encode_int(struct jbig2enc_ctx *restrict ctx, int proc, bool negative,
+           u32 magnitude) {
+  u8 *const context = ctx->intctx[proc];
+  int i = 0;
+  while (i < 5 && magnitude >= int_ranges[i + 1].bot) i++;
+  const struct int_range *const range = &int_ranges[i];
+
+  u32 prev = 1;
+  encode_int_bit(ctx, context, &prev, negative);
+  for (int j = range->prefix_bits - 1; j >= 0; --j) {
+    encode_int_bit(ctx, context, &prev, (range->prefix >> j) & 1);
+  }
+  const u32 offset = magnitude - range->bot;
+  for (int j = range->bits - 1; j >= 0; --j) {
+    encode_int_bit(ctx, context, &prev, (offset >> j) & 1);
+  }
+}
+
+// see comments in .h file
+void
+jbig2enc_int(struct jbig2enc_ctx *restrict ctx, int proc, int value) {
+  if (value > 2000000000 || value < -2000000000) abort();
+  encode_int(ctx, proc, value < 0, value < 0 ? -value : value);
+}
+
+// see comments in .h file
+void
+jbig2enc_oob(struct jbig2enc_ctx *restrict ctx, int proc) {
+  encode_int(ctx, proc, true, 0);
+}
+
+// see comments in .h file
+void
+jbig2enc_iaid(struct jbig2enc_ctx *restrict ctx, int symcodelen, int value) {
+  if (!ctx->iaidctx) {
+    ctx->iaidctx = (u8 *) calloc(1 << symcodelen, 1);
+  }
+  u32 prev = 1;
+  for (int j = symcodelen - 1; j >= 0; --j) {
+    const u8 d = (value >> j) & 1;
+    encode_bit(ctx, ctx->iaidctx, prev, d);
+    prev = (prev << 1) | d;
+  }
+}
 
 // -----------------------------------------------------------------------------
 // The FINALISE procudure from the standard
@@ -316,28 +734,461 @@ encode_final(struct jbig2enc_ctx *restrict ctx) {
 void
 jbig2enc_final(struct jbig2enc_ctx *restrict ctx) {
   encode_final(ctx);
+  jbig2enc_flush(ctx);
 }
 
 // see comments in .h file
-unsigned
+size_t
 jbig2enc_datasize(const struct jbig2enc_ctx *ctx) {
-  return JBIG2_OUTPUTBUFFER_SIZE * ctx->output_chunks_size + ctx->outbuf_used;
+  return JBIG2_OUTPUTBUFFER_SIZE * ctx->output_chunks_size + ctx->sink_written +
+         ctx->outbuf_used - ctx->outbuf_reserved;
 }
 
 // see comments in .h file
 void
 jbig2enc_tobuffer(const struct jbig2enc_ctx *restrict ctx, u8 *restrict buffer) {
-  int j = 0;
+  size_t j = 0;
   for (size_t i = 0; i < ctx->output_chunks_size; ++i) {
     memcpy(&buffer[j], ctx->output_chunks[i], JBIG2_OUTPUTBUFFER_SIZE);
     j += JBIG2_OUTPUTBUFFER_SIZE;
   }
 
-  memcpy(&buffer[j], ctx->outbuf, ctx->outbuf_used);
+  memcpy(&buffer[j], ctx->outbuf + ctx->outbuf_reserved,
+         ctx->outbuf_used - ctx->outbuf_reserved);
+}
+
+// see comments in .h file
+int
+jbig2enc_chunks(const struct jbig2enc_ctx *ctx, const u8 **chunks,
+                size_t *sizes) {
+  const int n = ctx->output_chunks_size;
+  if (chunks) {
+    for (int i = 0; i < n; ++i) {
+      chunks[i] = ctx->output_chunks[i];
+      sizes[i] = JBIG2_OUTPUTBUFFER_SIZE;
+    }
+    chunks[n] = ctx->outbuf + ctx->outbuf_reserved;
+    sizes[n] = ctx->outbuf_used - ctx->outbuf_reserved;
+  }
+  return n + 1;
+}
+
+// see comments in .h file
+u8 *
+jbig2enc_takebuffer(struct jbig2enc_ctx *ctx, size_t extra) {
+  if (!ctx->flat) abort();
+  u8 *ret = ctx->outbuf;
+  if (ctx->outbuf_capacity - ctx->outbuf_used < extra) {
+    ret = (u8 *) realloc(ret, ctx->outbuf_used + extra);
+  }
+  ctx->outbuf = NULL;
+  ctx->outbuf_used = ctx->outbuf_capacity = 0;
+  return ret;
 }
 
-// This is the context used for the TPGD bits
-#define TPGDCTX 0x9b25
+// see comments in .h file
+u8 *
+jbig2enc_flatbuffer(struct jbig2enc_ctx *ctx, size_t extra) {
+  if (!ctx->flat) abort();
+  if (ctx->outbuf_capacity - ctx->outbuf_used < extra) {
+    ctx->outbuf_capacity = ctx->outbuf_used + extra;
+    ctx->outbuf = (u8 *) realloc(ctx->outbuf, ctx->outbuf_capacity);
+  }
+  return ctx->outbuf;
+}
+
+// These are the contexts used for the TPGD bits of each template
+static const u16 tpgd_ctx[4] = {0x9b25, 0x0795, 0x00e5, 0x0195};
+
+// -----------------------------------------------------------------------------
+// Context precomputation
+//
+// The context of a pixel only depends on pixels which have already been coded,
+// so the contexts for a whole row can be built before any of them are fed to
+// the (strictly serial) arithmetic coder. The contexts are made in groups of
+// eight pixels: each source row contributes a 16-bit window whose top bit is
+// the leftmost pixel needed by the first pixel of the group. Pixel j of the
+// group then finds its bits at the top of (window << j), which is a per-lane
+// multiply (or shift) by a constant vector on SIMD hardware.
+//
+// With the AT pixels in their default locations every template takes a run of
+// pixels from each row, with the leftmost pixel in the highest bit, so a
+// template is described by where each run starts and where it goes.
+// -----------------------------------------------------------------------------
+#define CTX_GROUP 8
+
+struct template_shape {
+  int dx2, dx1, dx0;  // offset of the leftmost pixel used from each row
+  // the bits of the context from each row are ((window << j) >> shift) & mask
+  int shift2, shift1, shift0;
+  u16 mask2, mask1, mask0;
+};
+
+static const struct template_shape template_shapes[4] = {
+  // template 0: 5 pixels of row y - 2, 7 of row y - 1, 4 of row y
+  {-2, -3, -4, 0, 5, 12, 0xf800, 0x07f0, 0x000f},
+  // template 1: 4 pixels of row y - 2, 6 of row y - 1, 3 of row y
+  {-1, -2, -3, 3, 7, 13, 0x1e00, 0x01f8, 0x0007},
+  // template 2: 3 pixels of row y - 2, 5 of row y - 1, 2 of row y
+  {-1, -2, -2, 6, 9, 14, 0x0380, 0x007c, 0x0003},
+  // template 3: 6 pixels of row y - 1, 4 of row y
+  {0, -3, -4, 0, 6, 12, 0x0000, 0x03f0, 0x000f},
+};
+
+// -----------------------------------------------------------------------------
+// The first AT pixel, moved from its default location. Its bit of the context
+// is that of the default location, which is the last pixel of the run of the
+// row above (the lowest bit of mask1), so the contexts are built as for the
+// default template and then that bit of each is replaced.
+// -----------------------------------------------------------------------------
+struct at_pixel {
+  int dx, dy;  // where it is from the pixel being coded
+  u16 bit;  // its bit of the context
+};
+
+// see comments in .h file
+void
+jbig2enc_default_at(int gbtemplate, int *atx, int *aty) {
+  *atx = gbtemplate < 2 ? 3 : 2;
+  *aty = -1;
+}
+
+// see comments in .h file
+bool
+jbig2enc_at_ok(int gbtemplate, int atx, int aty) {
+  if (gbtemplate < 0 || gbtemplate > 3) return false;
+  int dx, dy;
+  jbig2enc_default_at(gbtemplate, &dx, &dy);
+  if (atx == dx && aty == dy) return true;
+  if (atx < -JBIG2_AT_MAX_DX || atx > JBIG2_AT_MAX_DX) return false;
+  // the pixels of each row which the template takes already
+  const struct template_shape *const shape = &template_shapes[gbtemplate];
+  int first, n;
+  if (aty == -2) {
+    first = shape->dx2;
+    n = __builtin_popcount(shape->mask2);
+  } else if (aty == -1) {
+    first = shape->dx1;
+    n = __builtin_popcount(shape->mask1);
+  } else if (aty == 0) {
+    first = shape->dx0;
+    n = -shape->dx0;
+    if (atx >= 0) return false;
+  } else {
+    return false;
+  }
+  return atx < first || atx >= first + n;
+}
+
+// Returns word i of a row, or zero if it's outside of the image
+static inline u32
+row_word(const u32 *restrict row, int i, int words_per_row) {
+  if (!row || i < 0 || i >= words_per_row) return 0;
+  return row[i];
+}
+
+// Returns the 16 pixels of a row starting at pixel x, which may be negative.
+// Pixels outside of the image are zero.
+static inline u32
+row_window(const u32 *restrict row, int x, int words_per_row) {
+  const int i = x >> 5;  // arithmetic shift: floor for negative x
+  const u64 w = ((u64) row_word(row, i, words_per_row) << 32) |
+                row_word(row, i + 1, words_per_row);
+  return (u32) ((w << (x & 31)) >> 48);
+}
+
+// -----------------------------------------------------------------------------
+// Build the contexts of CTX_GROUP pixels from the windows of the row two up,
+// the row above and the current row, each starting at the offset given by the
+// template shape from x, the first pixel of the group. Returns true iff all of
+// the contexts are zero.
+// -----------------------------------------------------------------------------
+static inline bool
+contexts_for_group(u16 *restrict out, const struct template_shape *shape,
+                   u32 win2, u32 win1, u32 win0) {
+#if defined(__SSE2__)
+  if (simd_level() >= SIMD_SSE2) {
+    const __m128i pow = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i t2 = _mm_and_si128(
+        _mm_srl_epi16(_mm_mullo_epi16(_mm_set1_epi16((short) win2), pow),
+                      _mm_cvtsi32_si128(shape->shift2)),
+        _mm_set1_epi16((short) shape->mask2));
+    const __m128i t1 = _mm_and_si128(
+        _mm_srl_epi16(_mm_mullo_epi16(_mm_set1_epi16((short) win1), pow),
+                      _mm_cvtsi32_si128(shape->shift1)),
+        _mm_set1_epi16((short) shape->mask1));
+    const __m128i t0 = _mm_and_si128(
+        _mm_srl_epi16(_mm_mullo_epi16(_mm_set1_epi16((short) win0), pow),
+                      _mm_cvtsi32_si128(shape->shift0)),
+        _mm_set1_epi16((short) shape->mask0));
+    const __m128i t = _mm_or_si128(_mm_or_si128(t2, t1), t0);
+    _mm_storeu_si128((__m128i *) out, t);
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(t, _mm_setzero_si128())) ==
+           0xffff;
+  }
+#elif defined(__ARM_NEON)
+  if (simd_level() >= SIMD_NEON) {
+    const int16x8_t shifts = {0, 1, 2, 3, 4, 5, 6, 7};
+    const uint16x8_t t2 = vandq_u16(
+        vshlq_u16(vshlq_u16(vdupq_n_u16(win2), shifts),
+                  vdupq_n_s16(-shape->shift2)),
+        vdupq_n_u16(shape->mask2));
+    const uint16x8_t t1 = vandq_u16(
+        vshlq_u16(vshlq_u16(vdupq_n_u16(win1), shifts),
+                  vdupq_n_s16(-shape->shift1)),
+        vdupq_n_u16(shape->mask1));
+    const uint16x8_t t0 = vandq_u16(
+        vshlq_u16(vshlq_u16(vdupq_n_u16(win0), shifts),
+                  vdupq_n_s16(-shape->shift0)),
+        vdupq_n_u16(shape->mask0));
+    const uint16x8_t t = vorrq_u16(vorrq_u16(t2, t1), t0);
+    vst1q_u16(out, t);
+    const uint64x2_t t64 = vreinterpretq_u64_u16(t);
+    return (vgetq_lane_u64(t64, 0) | vgetq_lane_u64(t64, 1)) == 0;
+  }
+#endif
+  u16 any = 0;
+  for (int j = 0; j < CTX_GROUP; ++j) {
+    out[j] = ((((win2 << j) & 0xffff) >> shape->shift2) & shape->mask2) |
+             ((((win1 << j) & 0xffff) >> shape->shift1) & shape->mask1) |
+             ((((win0 << j) & 0xffff) >> shape->shift0) & shape->mask0);
+    any |= out[j];
+  }
+  return any == 0;
+}
+
+// Build the contexts of the pixels covered by word i of row0, fetching each
+// window with the bounds checks of row_window
+static inline bool
+word_contexts_checked(u16 *restrict ctxrow, const struct template_shape *shape,
+                      const u32 *restrict row2, const u32 *restrict row1,
+                      const u32 *restrict row0, int i, int words_per_row) {
+  bool zero = row0[i] == 0;
+  for (int x = i * 32; x < i * 32 + 32; x += CTX_GROUP) {
+    zero &= contexts_for_group(
+        ctxrow + x, shape,
+        row_window(row2, x + shape->dx2, words_per_row),
+        row_window(row1, x + shape->dx1, words_per_row),
+        row_window(row0, x + shape->dx0, words_per_row));
+  }
+  return zero;
+}
+
+// -----------------------------------------------------------------------------
+// The same for a word which isn't the first or last of its row, of rows which
+// are all inside the image. Every window of the word then comes from words
+// i - 1, i and i + 1 of its row: the first group of the word starts at most
+// four pixels into word i - 1 and the last ends at most seven pixels into word
+// i + 1, so the windows are shifted out of two 64-bit pairs without any checks.
+// -----------------------------------------------------------------------------
+static inline bool
+word_contexts_interior(u16 *restrict ctxrow, const struct template_shape *shape,
+                       const u32 *restrict row2, const u32 *restrict row1,
+                       const u32 *restrict row0, int i) {
+  const u64 a2 = ((u64) row2[i - 1] << 32) | row2[i];
+  const u64 a1 = ((u64) row1[i - 1] << 32) | row1[i];
+  const u64 a0 = ((u64) row0[i - 1] << 32) | row0[i];
+  const u64 b2 = ((u64) row2[i] << 32) | row2[i + 1];
+  const u64 b1 = ((u64) row1[i] << 32) | row1[i + 1];
+  const u64 b0 = ((u64) row0[i] << 32) | row0[i + 1];
+  u16 *const out = ctxrow + i * 32;
+
+  // dx is never positive, so the first group starts in a, and the others in b
+  bool zero = row0[i] == 0;
+  zero &= contexts_for_group(out, shape,
+                             (u32) ((a2 << (32 + shape->dx2)) >> 48),
+                             (u32) ((a1 << (32 + shape->dx1)) >> 48),
+                             (u32) ((a0 << (32 + shape->dx0)) >> 48));
+  for (int g = CTX_GROUP; g < 32; g += CTX_GROUP) {
+    zero &= contexts_for_group(out + g, shape,
+                               (u32) ((b2 << (g + shape->dx2)) >> 48),
+                               (u32) ((b1 << (g + shape->dx1)) >> 48),
+                               (u32) ((b0 << (g + shape->dx0)) >> 48));
+  }
+  return zero;
+}
+
+// -----------------------------------------------------------------------------
+// Fill ctxrow with the context of every pixel in a row. Any of the row
+// pointers may be NULL if that row is above the top of the image. ctxrow must
+// have room for words_per_row * 32 entries.
+//
+// quiet[i] is set iff every pixel covered by word i of row0 is white and has
+// context 0, which is the case for most of a scanned page.
+//
+// Only the first two rows of the image and the first and last word of each
+// row need the checked window fetch; everything else takes the interior path.
+// -----------------------------------------------------------------------------
+static void
+build_row_contexts(u16 *restrict ctxrow, u8 *restrict quiet,
+                   const struct template_shape *shape,
+                   const u32 *restrict row2, const u32 *restrict row1,
+                   const u32 *restrict row0, int words_per_row) {
+  if (!row2 || !row1 || words_per_row < 3) {
+    for (int i = 0; i < words_per_row; ++i) {
+      quiet[i] = word_contexts_checked(ctxrow, shape, row2, row1, row0, i,
+                                       words_per_row);
+    }
+    return;
+  }
+
+  const int last = words_per_row - 1;
+  quiet[0] = word_contexts_checked(ctxrow, shape, row2, row1, row0, 0,
+                                   words_per_row);
+  for (int i = 1; i < last; ++i) {
+    quiet[i] = word_contexts_interior(ctxrow, shape, row2, row1, row0, i);
+  }
+  quiet[last] = word_contexts_checked(ctxrow, shape, row2, row1, row0, last,
+                                      words_per_row);
+}
+
+// -----------------------------------------------------------------------------
+// Move the first AT pixel of the contexts of a row built by build_row_contexts
+// to at, in atrow, and set quiet again to match
+// -----------------------------------------------------------------------------
+static void
+move_at_pixel(u16 *restrict ctxrow, u8 *restrict quiet,
+              const struct at_pixel *at, const u32 *restrict atrow,
+              const u32 *restrict row0, int words_per_row) {
+  const u16 keep = (u16) ~at->bit;
+  const int shift = __builtin_ctz(at->bit);
+  for (int i = 0; i < words_per_row; ++i) {
+    u16 any = row0[i] != 0;
+    for (int x = i * 32; x < i * 32 + 32; x += CTX_GROUP) {
+      const u32 win = row_window(atrow, x + at->dx, words_per_row);
+      u16 *const cx = ctxrow + x;
+      for (int j = 0; j < CTX_GROUP; ++j) {
+        cx[j] = (cx[j] & keep) | (((win >> (15 - j)) & 1) << shift);
+        any |= cx[j];
+      }
+    }
+    quiet[i] = any == 0;
+  }
+}
+
+static inline bool
+row_is_white(const u32 *row, int words_per_row) {
+  for (int i = 0; i < words_per_row; ++i) {
+    if (row[i]) return false;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Start coding row y (of my rows of mx pixels) of an image, given the two rows
+// above it (NULL above the top of the image), with the first AT pixel at at,
+// or in its default location if that is NULL. ltp and sltp are the TPGD state,
+// and white_rows the number of white rows up to this one (at most three), which
+// are carried from row to row.
+//
+// Returns false if that was the whole row: a duplicate skipped by TPGD, or a
+// white row coded as one run. Otherwise the contexts of the row are in ctxrow
+// and quiet (see build_row_contexts) and the pixels are still to be coded.
+// -----------------------------------------------------------------------------
+static inline bool
+start_row(struct jbig2enc_ctx *restrict ctx, const struct template_shape *shape,
+          const struct at_pixel *at, u16 tpgdctx, u16 *restrict ctxrow, u8 *restrict quiet,
+          const u32 *restrict row2, const u32 *restrict row1,
+          const u32 *restrict row, int words_per_row, int mx, int y, int my,
+          bool duplicate_line_removal, u8 *ltp, u8 *sltp, int *white_rows) {
+  u8 *const context = ctx->context;
+  STAT(rows, 1);
+
+  if (y >= 1 && duplicate_line_removal) {
+    // it's possible that the last row was the same as this row
+    if (memcmp(row, row1, words_per_row * 4) == 0) {
+      *sltp = *ltp ^ 1;
+      *ltp = 1;
+    } else {
+      *sltp = *ltp;
+      *ltp = 0;
+    }
+  }
+  // a row which is the same as the last one is white iff that one was
+  if (duplicate_line_removal && *ltp ? !*white_rows
+                                     : !row_is_white(row, words_per_row)) {
+    *white_rows = 0;
+  } else if (*white_rows < 3) {
+    ++*white_rows;
+  }
+  if (duplicate_line_removal) {
+    encode_bit(ctx, context, tpgdctx, *sltp);
+    if (*ltp) {
+      STAT(tpgd_rows, 1);
+      if (unlikely(ctx->band_bytes != NULL)) jbig2enc_endrow(ctx, y, my);
+      return false;
+    }
+  }
+
+  if (*white_rows > y || *white_rows == 3) {
+    // this row and the two above it are white (as on a blank page, or between
+    // the lines of text), so every pixel is in context 0 (wherever the AT
+    // pixel is in them) and the whole row is one run, as the loop in code_row
+    // would find without working out the contexts
+    encode_run(ctx, context, 0, 0, mx);
+    if (unlikely(ctx->band_bytes != NULL)) jbig2enc_endrow(ctx, y, my);
+    return false;
+  }
+
+  build_row_contexts(ctxrow, quiet, shape, row2, row1, row, words_per_row);
+  if (at) {
+    move_at_pixel(ctxrow, quiet, at,
+                  at->dy == 0 ? row : at->dy == -1 ? row1 : row2, row,
+                  words_per_row);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Code row y of an image: see start_row for the arguments
+// -----------------------------------------------------------------------------
+static inline void
+code_row(struct jbig2enc_ctx *restrict ctx, const struct template_shape *shape,
+         const struct at_pixel *at, u16 tpgdctx, u16 *restrict ctxrow, u8 *restrict quiet,
+         const u32 *restrict row2, const u32 *restrict row1,
+         const u32 *restrict row, int words_per_row, int mx, int y, int my,
+         bool duplicate_line_removal, u8 *ltp, u8 *sltp, int *white_rows) {
+  if (!start_row(ctx, shape, at, tpgdctx, ctxrow, quiet, row2, row1, row,
+                 words_per_row, mx, y, my, duplicate_line_removal, ltp, sltp,
+                 white_rows)) {
+    return;
+  }
+  u8 *const context = ctx->context;
+
+  for (int x = 0; x < mx;) {
+    if (quiet[x / 32]) {
+      // a stretch of white with nothing above it: these are all coded in
+      // context 0, so they go through the run coder together.
+      int n = 32;
+      while (x + n < mx && quiet[(x + n) / 32]) n += 32;
+      if (x + n > mx) n = mx - x;
+      encode_run(ctx, context, 0, 0, n);
+      x += n;
+      continue;
+    }
+
+    // the next pixel to code is kept at the top of w
+    u32 w = row[x / 32];
+    const u16 *restrict const cx = ctxrow + x;
+    if (likely(mx - x >= 32)) {
+      // a whole word: the trip count is constant
+      for (int j = 0; j < 32; ++j) {
+        encode_bit(ctx, context, cx[j], w >> 31);
+        w <<= 1;
+      }
+      x += 32;
+      continue;
+    }
+    // the partial word at the end of the row
+    const int n = mx - x;
+    for (int j = 0; j < n; ++j) {
+      encode_bit(ctx, context, cx[j], w >> 31);
+      w <<= 1;
+    }
+    x += n;
+  }
+  if (unlikely(ctx->band_bytes != NULL)) jbig2enc_endrow(ctx, y, my);
+}
 
 // -----------------------------------------------------------------------------
 // This is designed for Leptonica's 1bpp packed format images. Each row is some
@@ -346,106 +1197,281 @@ jbig2enc_tobuffer(const struct jbig2enc_ctx *restrict ctx, u8 *restrict buffer)
 void
 jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
                   int mx, int my, bool duplicate_line_removal) {
+  jbig2enc_bitimage_template(ctx, idata, mx, my, 0, duplicate_line_removal);
+}
+
+// -----------------------------------------------------------------------------
+// Find the first AT pixel at (atx, aty) of gbtemplate for start_row: returns
+// NULL if it's in the default location, and otherwise fills in *at
+// -----------------------------------------------------------------------------
+static const struct at_pixel *
+find_at_pixel(int gbtemplate, int atx, int aty, struct at_pixel *at) {
+  int dx, dy;
+  jbig2enc_default_at(gbtemplate, &dx, &dy);
+  if (atx == dx && aty == dy) return NULL;
+  if (!jbig2enc_at_ok(gbtemplate, atx, aty)) abort();
+  const u16 mask1 = template_shapes[gbtemplate].mask1;
+  at->dx = atx;
+  at->dy = aty;
+  at->bit = mask1 & -mask1;
+  return at;
+}
+
+// see comments in .h file
+void
+jbig2enc_bitimage_template(struct jbig2enc_ctx *restrict ctx,
+                           const u8 *restrict idata, int mx, int my,
+                           int gbtemplate, bool duplicate_line_removal) {
+  int atx, aty;
+  jbig2enc_default_at(gbtemplate, &atx, &aty);
+  jbig2enc_bitimage_at(ctx, idata, mx, my, gbtemplate, atx, aty,
+                       duplicate_line_removal);
+}
+
+// see comments in .h file
+void
+jbig2enc_bitimage_at(struct jbig2enc_ctx *restrict ctx,
+                     const u8 *restrict idata, int mx, int my, int gbtemplate,
+                     int atx, int aty, bool duplicate_line_removal) {
   const u32 *restrict data = (u32 *) idata;
-  u8 *const context = ctx->context;
+  const struct template_shape *const shape = &template_shapes[gbtemplate];
+  struct at_pixel moved;
+  const struct at_pixel *const at =
+      find_at_pixel(gbtemplate, atx, aty, &moved);
+  const u16 tpgdctx = tpgd_ctx[gbtemplate];
   const unsigned words_per_row = (mx + 31) / 32;
-  const unsigned bytes_per_row = words_per_row * 4;
+  u16 *const ctxrow = (u16 *) malloc(words_per_row * 32 * sizeof(u16));
+  u8 *const quiet = (u8 *) malloc(words_per_row);
 
   u8 ltp = 0, sltp = 0;
+  int white_rows = 0;
 
   for (int y = 0; y < my; ++y) {
-    int x = 0;
-
-    // the c* values store the context bits for each row. The template is fixed
-    // as template 0 with the floating bits in the default locations.
-    u16 c1, c2, c3;
-    // the w* values contain words from each of the rows: w1 is from two rows
-    // up etc. The next bit to roll onto the context values are kept at the top
-    // of these words.
-    u32 w1, w2, w3;
-    w1 = w2 = w3 = 0;
-
-    if (y >= 2) w1 = data[(y - 2) * words_per_row];
-    if (y >= 1) {
-      w2 = data[(y - 1) * words_per_row];
-
-      if (duplicate_line_removal) {
-        // it's possible that the last row was the same as this row
-        if (memcmp(&data[y * words_per_row], &data[(y - 1) * words_per_row],
-                   bytes_per_row) == 0) {
-          sltp = ltp ^ 1;
-          ltp = 1;
-        } else {
-          sltp = ltp;
-          ltp = 0;
-        }
-      }
-    }
-    if (duplicate_line_removal) {
-      encode_bit(ctx, context, TPGDCTX, sltp);
-      if (ltp) continue;
+    code_row(ctx, shape, at, tpgdctx, ctxrow, quiet,
+             y >= 2 ? &data[(y - 2) * words_per_row] : NULL,
+             y >= 1 ? &data[(y - 1) * words_per_row] : NULL,
+             &data[y * words_per_row], words_per_row, mx, y, my,
+             duplicate_line_removal, &ltp, &sltp, &white_rows);
+  }
+
+  free(quiet);
+  free(ctxrow);
+}
+
+// -----------------------------------------------------------------------------
+// One of the images being coded by jbig2enc_bitimage_interleaved
+// -----------------------------------------------------------------------------
+struct interleaved_image {
+  struct jbig2enc_ctx *ctx;
+  const u32 *data;
+  int mx, my, words_per_row;
+  u16 *ctxrow;
+  u8 *quiet;
+  u8 ltp, sltp;
+  int white_rows;
+  bool busy;  // the pixels of the current row are still to be coded
+};
+
+// see comments in .h file
+void
+jbig2enc_bitimage_interleaved(struct jbig2enc_ctx *const *ctxs,
+                              const u8 *const *idata, const int *mx,
+                              const int *my, int n, int gbtemplate,
+                              bool duplicate_line_removal) {
+  if (n < 1 || n > JBIG2_MAX_INTERLEAVE) abort();
+  const struct template_shape *const shape = &template_shapes[gbtemplate];
+  const u16 tpgdctx = tpgd_ctx[gbtemplate];
+  struct interleaved_image images[JBIG2_MAX_INTERLEAVE];
+  int rows = 0, words = 0;
+  for (int k = 0; k < n; ++k) {
+    struct interleaved_image *const im = &images[k];
+    im->ctx = ctxs[k];
+    im->data = (const u32 *) idata[k];
+    im->mx = mx[k];
+    im->my = my[k];
+    im->words_per_row = (mx[k] + 31) / 32;
+    im->ctxrow = (u16 *) malloc(im->words_per_row * 32 * sizeof(u16));
+    im->quiet = (u8 *) malloc(im->words_per_row);
+    im->ltp = im->sltp = 0;
+    im->white_rows = 0;
+    if (my[k] > rows) rows = my[k];
+    if (im->words_per_row > words) words = im->words_per_row;
+  }
+
+  for (int y = 0; y < rows; ++y) {
+    for (int k = 0; k < n; ++k) {
+      struct interleaved_image *const im = &images[k];
+      const int wpr = im->words_per_row;
+      im->busy = y < im->my &&
+                 start_row(im->ctx, shape, NULL, tpgdctx, im->ctxrow, im->quiet,
+                           y >= 2 ? &im->data[(y - 2) * wpr] : NULL,
+                           y >= 1 ? &im->data[(y - 1) * wpr] : NULL,
+                           &im->data[y * wpr], wpr, im->mx, y, im->my,
+                           duplicate_line_removal, &im->ltp, &im->sltp,
+                           &im->white_rows);
     }
-    w3 = data[y * words_per_row];
-
-    // the top three bits are the start of the context c1
-    c1 = w1 >> 29;
-    c2 = w2 >> 28;
-    // and we need to remove the used bits from the w* vars
-    w1 <<= 3;
-    w2 <<= 4;
-    c3 = 0;
-    for (x = 0; x < mx; ++x) {
-      const u16 tval = (c1 << 11) | (c2 << 4) | c3;
-      const u8 v = (w3 & 0x80000000) >> 31;
-
-      //fprintf(stderr, "%d %d %d %d\n", x, y, tval, v);
-      encode_bit(ctx, context, tval, v);
-      c1 <<= 1;
-      c2 <<= 1;
-      c3 <<= 1;
-      c1 |= (w1 & 0x80000000) >> 31;
-      c2 |= (w2 & 0x80000000) >> 31;
-      c3 |= v;
-      const int m = x % 32;
-      if (m == 28 && y >= 2) {
-        // need to roll in another word from two lines up
-        const unsigned wordno = (x / 32) + 1;
-        if (wordno >= words_per_row) {
-          w1 = 0;
+
+    // Code word i of every row which still has pixels to code. A run of white
+    // the coder takes in bulk, and the partial word at the end of a row, are
+    // coded as code_row would; the whole words of the other rows are coded a
+    // bit of each in turn. (Splitting a white stretch into a run per word
+    // gives the same output, see encode_run.)
+    for (int i = 0; i < words; ++i) {
+      struct jbig2enc_ctx *c[JBIG2_MAX_INTERLEAVE];
+      const u16 *cx[JBIG2_MAX_INTERLEAVE];
+      u32 w[JBIG2_MAX_INTERLEAVE];
+      int m = 0;
+      for (int k = 0; k < n; ++k) {
+        struct interleaved_image *const im = &images[k];
+        if (!im->busy || i >= im->words_per_row) continue;
+        const int x = i * 32;
+        const u32 word = im->data[y * im->words_per_row + i];
+        const int left = im->mx - x < 32 ? im->mx - x : 32;
+        if (im->quiet[i]) {
+          encode_run(im->ctx, im->ctx->context, 0, 0, left);
+        } else if (left < 32) {
+          u32 v = word;
+          for (int j = 0; j < left; ++j) {
+            encode_bit(im->ctx, im->ctx->context, im->ctxrow[x + j], v >> 31);
+            v <<= 1;
+          }
         } else {
-          w1 = data[(y - 2) * words_per_row + wordno];
+          c[m] = im->ctx;
+          cx[m] = im->ctxrow + x;
+          w[m] = word;
+          m++;
         }
-      } else {
-        w1 <<= 1;
       }
-
-      if (m == 27 && y >= 1) {
-        // need to roll in another word from the last line
-        const unsigned wordno = (x / 32) + 1;
-        if (wordno >= words_per_row) {
-          w2 = 0;
-        } else {
-          w2 = data[(y - 1) * words_per_row + wordno];
+      if (m == 1) {
+        for (int j = 0; j < 32; ++j) {
+          encode_bit(c[0], c[0]->context, cx[0][j], w[0] >> 31);
+          w[0] <<= 1;
+        }
+      } else if (m == 2) {
+        for (int j = 0; j < 32; ++j) {
+          encode_bit(c[0], c[0]->context, cx[0][j], w[0] >> 31);
+          encode_bit(c[1], c[1]->context, cx[1][j], w[1] >> 31);
+          w[0] <<= 1;
+          w[1] <<= 1;
+        }
+      } else if (m) {
+        for (int j = 0; j < 32; ++j) {
+          for (int t = 0; t < m; ++t) {
+            encode_bit(c[t], c[t]->context, cx[t][j], w[t] >> 31);
+            w[t] <<= 1;
+          }
         }
-      } else {
-        w2 <<= 1;
       }
+    }
 
-      if (m == 31) {
-        // need to roll in another word from this line
-        const unsigned wordno = (x / 32) + 1;
-        if (wordno >= words_per_row) {
-          w3 = 0;
-        } else {
-          w3 = data[y * words_per_row + wordno];
-        }
-      } else {
-        w3 <<= 1;
+    for (int k = 0; k < n; ++k) {
+      struct jbig2enc_ctx *const ctx = images[k].ctx;
+      if (images[k].busy && unlikely(ctx->band_bytes != NULL)) {
+        jbig2enc_endrow(ctx, y, images[k].my);
       }
+    }
+  }
+
+  for (int k = 0; k < n; ++k) {
+    free(images[k].quiet);
+    free(images[k].ctxrow);
+  }
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_init(struct jbig2enc_rows *rows, int mx, int my, int gbtemplate,
+                   bool duplicate_line_removal) {
+  int atx, aty;
+  jbig2enc_default_at(gbtemplate, &atx, &aty);
+  jbig2enc_rows_init_at(rows, mx, my, gbtemplate, atx, aty,
+                        duplicate_line_removal);
+}
 
-      c1 &= 31;
-      c2 &= 127;
-      c3 &= 15;
+// see comments in .h file
+void
+jbig2enc_rows_init_at(struct jbig2enc_rows *rows, int mx, int my,
+                      int gbtemplate, int atx, int aty,
+                      bool duplicate_line_removal) {
+  const int words_per_row = (mx + 31) / 32;
+  rows->mx = mx;
+  rows->my = my;
+  rows->y = 0;
+  rows->gbtemplate = gbtemplate;
+  rows->atx = atx;
+  rows->aty = aty;
+  rows->duplicate_line_removal = duplicate_line_removal;
+  rows->ltp = rows->sltp = 0;
+  rows->white_rows = 0;
+  rows->ring = (u32 *) malloc(3 * words_per_row * sizeof(u32));
+  rows->ctxrow = (u16 *) malloc(words_per_row * 32 * sizeof(u16));
+  rows->quiet = (u8 *) malloc(words_per_row);
+}
+
+// Code row rows->y of the image, which is in the ring already
+static void
+rows_code_next(struct jbig2enc_ctx *restrict ctx,
+               struct jbig2enc_rows *restrict rows) {
+  const int words_per_row = (rows->mx + 31) / 32;
+  const int y = rows->y++;
+  struct at_pixel moved;
+  code_row(ctx, &template_shapes[rows->gbtemplate],
+           find_at_pixel(rows->gbtemplate, rows->atx, rows->aty, &moved),
+           tpgd_ctx[rows->gbtemplate], rows->ctxrow, rows->quiet,
+           y >= 2 ? rows->ring + ((y - 2) % 3) * words_per_row : NULL,
+           y >= 1 ? rows->ring + ((y - 1) % 3) * words_per_row : NULL,
+           rows->ring + (y % 3) * words_per_row, words_per_row, rows->mx, y,
+           rows->my, rows->duplicate_line_removal, &rows->ltp, &rows->sltp,
+           &rows->white_rows);
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_code(struct jbig2enc_ctx *restrict ctx,
+                   struct jbig2enc_rows *restrict rows,
+                   const u8 *restrict irow) {
+  const int words_per_row = (rows->mx + 31) / 32;
+  memcpy(rows->ring + (rows->y % 3) * words_per_row, irow, words_per_row * 4);
+  rows_code_next(ctx, rows);
+}
+
+// see comments in .h file
+void
+jbig2enc_load_msb(u32 *restrict words, const u8 *restrict bytes, int mx) {
+  const int words_per_row = (mx + 31) / 32;
+  const int nbytes = (mx + 7) / 8;
+  // the whole words, which the compiler makes a load and a byte swap
+  const int full = nbytes / 4;
+  for (int i = 0; i < full; ++i) {
+    const u8 *const p = bytes + i * 4;
+    words[i] = ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+  if (full < words_per_row) {
+    u32 word = 0;
+    for (int j = full * 4; j < full * 4 + 4; ++j) {
+      word = (word << 8) | (j < nbytes ? bytes[j] : 0);
     }
+    words[full] = word;
   }
+  // the bits past the end of the row are the caller's, and may be anything
+  if (mx & 31) words[words_per_row - 1] &= 0xffffffffu << (32 - (mx & 31));
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_code_msb(struct jbig2enc_ctx *restrict ctx,
+                       struct jbig2enc_rows *restrict rows,
+                       const u8 *restrict irow) {
+  const int words_per_row = (rows->mx + 31) / 32;
+  jbig2enc_load_msb(rows->ring + (rows->y % 3) * words_per_row, irow,
+                    rows->mx);
+  rows_code_next(ctx, rows);
+}
+
+// see comments in .h file
+void
+jbig2enc_rows_free(struct jbig2enc_rows *rows) {
+  free(rows->quiet);
+  free(rows->ctxrow);
+  free(rows->ring);
 }
@@ -26,6 +26,8 @@
 #include <sys/types.h>
 
 #define JBIG2_MAX_CTX 65536
+// The image contexts are cleared by _reset in blocks of this many
+#define JBIG2_CTX_BLOCK 1024
 #define JBIG2_OUTPUTBUFFER_SIZE 20 * 1024
 
 #ifdef _MSC_VER
@@ -36,6 +38,26 @@
 //#define CODER_DEBUGGING
 //#define SYM_DEBUGGING
 //#define SYMBOL_COMPRESSION_DEBUGGING
+// Use the table driven coder straight from the standard instead of the
+// packed one. The output is the same, so this is only useful for testing.
+//#define JBIG2_REFERENCE_CODER
+// Count what the coders do (see struct jbig2enc_stats). Without this the
+// counters are always zero and cost nothing.
+//#define JBIG2_STATS
+
+// -----------------------------------------------------------------------------
+// Counters of the work done by the coders, collected if JBIG2_STATS is
+// defined. Use jbig2enc_addstats to get them.
+// -----------------------------------------------------------------------------
+struct jbig2enc_stats {
+  uint64_t mps;  // number of MPS symbols coded by the arithmetic coder
+  uint64_t lps;  // number of LPS symbols coded by the arithmetic coder
+  uint64_t renorm_shifts;  // number of bits shifted out by renormalisation
+  uint64_t carries;  // number of carries into the byte already buffered
+  uint64_t rows;  // number of image rows coded (including TPGD rows)
+  uint64_t tpgd_rows;  // number of rows skipped as duplicates by TPGD
+  uint64_t bytes;  // number of bytes output
+};
 
 // -----------------------------------------------------------------------------
 // This is the context for the arithmetic encoder used in JBIG2. The coder is a
@@ -44,6 +66,14 @@
 //
 // When outputting data, the bytes are collected into chunks of size
 // JBIG2_OUTPUTBUFFER_SIZE. These are chained in a linked list.
+//
+// A context set up with jbig2enc_init_flat instead collects the bytes in a
+// single buffer which grows geometrically and which starts with some reserved
+// space, so that headers can be written in front of the data without copying
+// it (see jbig2enc_takebuffer).
+//
+// A context set up with jbig2enc_init_sink passes each chunk to a callback as
+// soon as it is full, so that the output never has to be held in memory.
 // -----------------------------------------------------------------------------
 struct jbig2enc_ctx {
   // these are the current state of the arithmetic coder
@@ -57,7 +87,31 @@ struct jbig2enc_ctx {
   size_t output_chunks_size;
   size_t output_chunks_capacity;
   uint8_t *outbuf;  // this is the current output chunk
-  int outbuf_used;  // number of bytes used in outbuf
+  size_t outbuf_used;  // number of bytes used in outbuf
+  size_t outbuf_capacity;  // size of outbuf
+  size_t outbuf_reserved;  // bytes at the start of outbuf which aren't output
+  bool flat;  // true iff outbuf is grown instead of starting a new chunk
+  // if not NULL, full chunks are passed to this instead of being kept
+  void (*sink)(void *sink_arg, const uint8_t *data, size_t size);
+  void *sink_arg;
+  size_t sink_written;  // number of bytes passed to sink so far
+  // the blocks of context (and whether intctx) written since the last _reset
+  uint8_t context_dirty[JBIG2_MAX_CTX / JBIG2_CTX_BLOCK];
+  bool intctx_dirty;
+  struct jbig2enc_stats stats;  // all zero unless JBIG2_STATS is defined
+  // if not NULL, the number of bytes output while coding each band of
+  // band_rows rows is added to band_bytes (see jbig2enc_bands)
+  uint32_t *band_bytes;
+  int band_rows;
+  int band_y0;  // the row of the page of row 0 of the image being coded
+  size_t band_mark;  // jbig2enc_datasize at the end of the last band
+
+  // The tables come last, so that everything above (which is touched for
+  // every pixel) shares a few cache lines, and coding an image never brings
+  // in the lines of intctx. The image contexts are indexed by the raw template
+  // value: on scanned text that already keeps more of the busy contexts
+  // together than any other order of the rows in it, or choice of the six
+  // bits which pick the entry within a cache line.
   uint8_t context[JBIG2_MAX_CTX];  // state machine context for encoding images
   uint8_t intctx[13][512];  // 512 bytes of context indexes for each of 13 different int decodings
                             // this data is also used for refinement coding
@@ -86,7 +140,7 @@ enum {
 //
 // Before doing this you should make sure that the coder is _flush()'ed
 // -----------------------------------------------------------------------------
-unsigned jbig2enc_datasize(const struct jbig2enc_ctx *ctx);
+size_t jbig2enc_datasize(const struct jbig2enc_ctx *ctx);
 
 // -----------------------------------------------------------------------------
 // Writes the output of the given context to a buffer. The buffer must be at
@@ -95,6 +149,52 @@ unsigned jbig2enc_datasize(const struct jbig2enc_ctx *ctx);
 void jbig2enc_tobuffer(const struct jbig2enc_ctx *__restrict__ ctx,
                        uint8_t *__restrict__ buffer);
 
+// -----------------------------------------------------------------------------
+// Returns the number of chunks the output of the given context is held in and,
+// if chunks isn't NULL, sets chunks[i] and sizes[i] to each of them in order,
+// so that they can be written out without _tobuffer. The last one may be
+// empty. They belong to the context, and are valid until it is _dealloc'ed or
+// _reset. Not for a context with a sink.
+//
+// Before doing this you should make sure that the coder is _flush()'ed
+// -----------------------------------------------------------------------------
+int jbig2enc_chunks(const struct jbig2enc_ctx *ctx, const uint8_t **chunks,
+                    size_t *sizes);
+
+// -----------------------------------------------------------------------------
+// Append a byte to the output of the given context as it is, bypassing the
+// arithmetic coder. This is for the other coders (see jbig2mmr.h) which share
+// the output handling.
+// -----------------------------------------------------------------------------
+void jbig2enc_putbyte(struct jbig2enc_ctx *ctx, uint8_t byte);
+
+// As _putbyte, for size bytes of data, such as output coded before
+void jbig2enc_putbytes(struct jbig2enc_ctx *__restrict__ ctx,
+                       const uint8_t *__restrict__ data, size_t size);
+
+// -----------------------------------------------------------------------------
+// Count the bytes output while coding each band of band_rows rows of a page,
+// for finding the parts of it which are expensive to code. The image coded
+// next starts at row y0 of the page, and the bytes for band i are added to
+// band_bytes[i], which must have room for all the bands of the page. Several
+// contexts may add to the same band_bytes at the same time. _reset turns this
+// off again.
+// -----------------------------------------------------------------------------
+void jbig2enc_bands(struct jbig2enc_ctx *ctx, uint32_t *band_bytes,
+                    int band_rows, int y0);
+
+// -----------------------------------------------------------------------------
+// Called by the image coders at the end of each row y (of my) when
+// ctx->band_bytes is set.
+// -----------------------------------------------------------------------------
+void jbig2enc_endrow(struct jbig2enc_ctx *ctx, int y, int my);
+
+// -----------------------------------------------------------------------------
+// For a context with a sink, pass any output which is held back to the sink.
+// Does nothing for other contexts. _final does this itself.
+// -----------------------------------------------------------------------------
+void jbig2enc_flush(struct jbig2enc_ctx *ctx);
+
 // -----------------------------------------------------------------------------
 // This function takes almost the same arguments as _image, above. But in this
 // case the data pointer points to packed data.
@@ -108,12 +208,205 @@ void jbig2enc_bitimage(struct jbig2enc_ctx *__restrict__ ctx,
                        const uint8_t *__restrict__ data, int mx, int my,
                        bool duplicate_line_removal);
 
+// -----------------------------------------------------------------------------
+// As _bitimage, but code the image with generic region template gbtemplate
+// (0..3), with the AT pixels in their default locations. Templates 1..3 use
+// fewer pixels for each context, which is faster but compresses less well.
+// -----------------------------------------------------------------------------
+void jbig2enc_bitimage_template(struct jbig2enc_ctx *__restrict__ ctx,
+                                const uint8_t *__restrict__ data, int mx,
+                                int my, int gbtemplate,
+                                bool duplicate_line_removal);
+
+// -----------------------------------------------------------------------------
+// The first AT pixel of each template (A1, see 6.2.5.4) is in its default
+// location at (3, -1) for templates 0 and 1 and (2, -1) for 2 and 3: that is,
+// at x + 3 of the row above the pixel at x being coded. The coder can also
+// move it to (atx, aty) in either of the two rows above (aty of -1 or -2), or
+// to the left on the same row (aty of 0, atx negative), up to
+// JBIG2_AT_MAX_DX pixels to either side, so long as it isn't a pixel which
+// the template takes already. The other AT pixels of template 0 stay where
+// they are.
+// -----------------------------------------------------------------------------
+#define JBIG2_AT_MAX_DX 16
+
+void jbig2enc_default_at(int gbtemplate, int *atx, int *aty);
+
+// Returns true iff (atx, aty) is the default location of the first AT pixel
+// of gbtemplate or one which the coder can move it to
+bool jbig2enc_at_ok(int gbtemplate, int atx, int aty);
+
+// -----------------------------------------------------------------------------
+// As _bitimage_template, but with the first AT pixel at (atx, aty), which
+// must be allowed by _at_ok.
+// -----------------------------------------------------------------------------
+void jbig2enc_bitimage_at(struct jbig2enc_ctx *__restrict__ ctx,
+                          const uint8_t *__restrict__ data, int mx, int my,
+                          int gbtemplate, int atx, int aty,
+                          bool duplicate_line_removal);
+
+// The most images which _bitimage_interleaved codes at once
+#define JBIG2_MAX_INTERLEAVE 4
+
+// -----------------------------------------------------------------------------
+// Code n (1..JBIG2_MAX_INTERLEAVE) images, image k of my[k] rows of mx[k]
+// pixels at idata[k] into ctxs[k], each exactly as _bitimage_template would
+// code it on its own. The images are coded a row of each in turn, and where
+// several of them have pixels to code in the same word of a row, a bit of each
+// is coded in turn. The coder is one long serial chain of dependencies, and
+// this gives an out-of-order core two or more of them to overlap on a single
+// thread. Whether that is faster depends on the core: where the coder is
+// bound by mispredicted branches (as on noisy images) it is not, so the
+// encoder doesn't use it; jbig2bench measures both. The contexts must be
+// distinct.
+// -----------------------------------------------------------------------------
+void jbig2enc_bitimage_interleaved(struct jbig2enc_ctx *const *ctxs,
+                                   const uint8_t *const *idata, const int *mx,
+                                   const int *my, int n, int gbtemplate,
+                                   bool duplicate_line_removal);
+
+// -----------------------------------------------------------------------------
+// Code an integer with the given procedure (one of the JBIG2_IA* values above,
+// see Annex A.2). |value| must be at most 2000000000.
+// -----------------------------------------------------------------------------
+void jbig2enc_int(struct jbig2enc_ctx *__restrict__ ctx, int proc, int value);
+
+// -----------------------------------------------------------------------------
+// Code the out-of-band value with the given integer procedure, which ends a
+// height class of a symbol dictionary (JBIG2_IADW) or a strip of a text region
+// (JBIG2_IADS).
+// -----------------------------------------------------------------------------
+void jbig2enc_oob(struct jbig2enc_ctx *__restrict__ ctx, int proc);
+
+// -----------------------------------------------------------------------------
+// Code a symbol ID of symcodelen bits (Annex A.3). symcodelen must be the same
+// for every ID coded until the next _reset.
+// -----------------------------------------------------------------------------
+void jbig2enc_iaid(struct jbig2enc_ctx *__restrict__ ctx, int symcodelen,
+                   int value);
+
+// -----------------------------------------------------------------------------
+// The state for coding an image a row at a time, as _bitimage_template does,
+// for images which are never all held in memory. Only the last three rows
+// are kept.
+// -----------------------------------------------------------------------------
+struct jbig2enc_rows {
+  int mx, my;  // the size of the image
+  int y;  // the next row to code
+  int gbtemplate;
+  int atx, aty;  // the first AT pixel (see jbig2enc_at_ok)
+  bool duplicate_line_removal;
+  uint8_t ltp, sltp;  // the TPGD state
+  int white_rows;  // the number of white rows just coded, up to three
+  uint32_t *ring;  // the last three rows coded, row y at (y % 3)
+  uint16_t *ctxrow;
+  uint8_t *quiet;
+};
+
+// -----------------------------------------------------------------------------
+// Set up rows to code an image of my rows of mx pixels with the given template
+// (see _bitimage_template).
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_init(struct jbig2enc_rows *rows, int mx, int my,
+                        int gbtemplate, bool duplicate_line_removal);
+
+// As _rows_init, with the first AT pixel at (atx, aty) (see _bitimage_at)
+void jbig2enc_rows_init_at(struct jbig2enc_rows *rows, int mx, int my,
+                           int gbtemplate, int atx, int aty,
+                           bool duplicate_line_removal);
+
+// -----------------------------------------------------------------------------
+// Code the next row of the image, which is in the format of a row of
+// _bitimage (with zero pad bits). After the last row, call _final as usual.
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_code(struct jbig2enc_ctx *__restrict__ ctx,
+                        struct jbig2enc_rows *__restrict__ rows,
+                        const uint8_t *__restrict__ row);
+
+// -----------------------------------------------------------------------------
+// As _rows_code, but the row is (mx + 7) / 8 bytes, the leftmost pixel in the
+// most significant bit of the first, as libpng, PBM and TIFF have them, and
+// the bits of the last byte past the end of the row may be anything. The row
+// is put straight into the words the coder looks at, without any other copy.
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_code_msb(struct jbig2enc_ctx *__restrict__ ctx,
+                            struct jbig2enc_rows *__restrict__ rows,
+                            const uint8_t *__restrict__ row);
+
+// -----------------------------------------------------------------------------
+// Put a row of mx pixels of (mx + 7) / 8 bytes, as _rows_code_msb takes it,
+// into the (mx + 31) / 32 words of a row of _bitimage, with zero pad bits
+// -----------------------------------------------------------------------------
+void jbig2enc_load_msb(uint32_t *__restrict__ words,
+                       const uint8_t *__restrict__ bytes, int mx);
+
+// -----------------------------------------------------------------------------
+// Free the buffers of rows
+// -----------------------------------------------------------------------------
+void jbig2enc_rows_free(struct jbig2enc_rows *rows);
 
 // -----------------------------------------------------------------------------
 // Init a new context
 // -----------------------------------------------------------------------------
 void jbig2enc_init(struct jbig2enc_ctx *ctx);
 
+// -----------------------------------------------------------------------------
+// Init a new context which collects its output in a single buffer, leaving
+// the first reserved bytes of it free for the caller.
+// -----------------------------------------------------------------------------
+void jbig2enc_init_flat(struct jbig2enc_ctx *ctx, int reserved);
+
+// -----------------------------------------------------------------------------
+// Init a new context which passes its output to sink in chunks of
+// JBIG2_OUTPUTBUFFER_SIZE bytes as it is produced. The last chunk, which may be
+// shorter, is passed by _final. sink_arg is passed as the first argument.
+// -----------------------------------------------------------------------------
+void jbig2enc_init_sink(struct jbig2enc_ctx *ctx,
+                        void (*sink)(void *sink_arg, const uint8_t *data,
+                                     size_t size),
+                        void *sink_arg);
+
+// -----------------------------------------------------------------------------
+// Take the output buffer from a context created with jbig2enc_init_flat. The
+// buffer starts with the reserved bytes, followed by the jbig2enc_datasize
+// bytes of output, followed by at least extra bytes of space. The caller owns
+// the buffer and must free it. The context must still be _dealloc'ed, but
+// can't be used for any further output.
+//
+// Before doing this you should make sure that the coder is _flush()'ed
+// -----------------------------------------------------------------------------
+uint8_t *jbig2enc_takebuffer(struct jbig2enc_ctx *ctx, size_t extra);
+
+// -----------------------------------------------------------------------------
+// As jbig2enc_takebuffer, but the buffer stays with the context, which can go
+// on to code more after a _reset (or _reset_flat). The buffer is only valid
+// until then.
+// -----------------------------------------------------------------------------
+uint8_t *jbig2enc_flatbuffer(struct jbig2enc_ctx *ctx, size_t extra);
+
+// -----------------------------------------------------------------------------
+// Make a context ready to encode again, as if it had just been set up with the
+// same _init function. The output buffers are kept (a taken flat buffer is
+// replaced) and only the parts of the context which were used are cleared, so
+// this is much cheaper than _dealloc and _init for small images. Any output
+// not taken yet is thrown away.
+// -----------------------------------------------------------------------------
+void jbig2enc_reset(struct jbig2enc_ctx *ctx);
+
+// -----------------------------------------------------------------------------
+// As jbig2enc_reset for a context set up with jbig2enc_init_flat, but leaving
+// the first reserved bytes of the buffer free from now on
+// -----------------------------------------------------------------------------
+void jbig2enc_reset_flat(struct jbig2enc_ctx *ctx, int reserved);
+
+// -----------------------------------------------------------------------------
+// Add the counters of the given context since it was set up (or last _reset)
+// to *stats. The byte count is that of _datasize, so the coder should be
+// _flush()'ed first.
+// -----------------------------------------------------------------------------
+void jbig2enc_addstats(const struct jbig2enc_ctx *ctx,
+                       struct jbig2enc_stats *stats);
+
 // -----------------------------------------------------------------------------
 // Destroy a context
 // -----------------------------------------------------------------------------
@@ -0,0 +1,462 @@
+// Microbenchmarks for the hot kernels of the encoder and the image readers.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -----------------------------------------------------------------------------
+// Usage: jbig2bench [-n <repeats>] [<image or PNG files...>]
+//
+// Each kernel is run on synthetic images (a text-like page, noise, and the
+// matching gray and colour images) and on the given files, and the best of
+// the repeats is reported in Mpixel/s and (on x86) cycles/pixel. PNG reading
+// and inflate are only timed on the given PNG files. Build with c-bench.sh.
+// -----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <allheaders.h>
+#include <pix.h>
+#include <zlib.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "jbig2arith.h"
+#include "jbig2comps.h"
+
+#define u64 uint64_t
+#define u32 uint32_t
+#define u8  uint8_t
+
+static int repeats = 5;
+
+// -----------------------------------------------------------------------------
+// Timing. A kernel is a function run once over the whole input; the best run
+// out of repeats is reported for pixels pixels.
+// -----------------------------------------------------------------------------
+struct timing {
+  double seconds;
+  u64 cycles;
+};
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static u64
+cycles() {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+typedef void (*kernel_fn)(void *arg);
+
+static void
+run(const char *kernel, const char *input, double pixels, kernel_fn fn,
+    void *arg) {
+  struct timing best;
+  best.seconds = 1e30;
+  best.cycles = 0;
+  for (int i = 0; i < repeats; ++i) {
+    const double t0 = now();
+    const u64 c0 = cycles();
+    fn(arg);
+    const u64 c1 = cycles();
+    const double t1 = now();
+    if (t1 - t0 < best.seconds) {
+      best.seconds = t1 - t0;
+      best.cycles = c1 - c0;
+    }
+  }
+  if (best.cycles) {
+    printf("%-32s %-24s %10.1f Mpix/s %8.2f cycles/pix\n", kernel, input,
+           pixels / best.seconds * 1e-6, best.cycles / pixels);
+  } else {
+    printf("%-32s %-24s %10.1f Mpix/s\n", kernel, input,
+           pixels / best.seconds * 1e-6);
+  }
+  fflush(stdout);
+}
+
+// -----------------------------------------------------------------------------
+// Synthetic images: a page of text-like blobs on white, and uniform noise
+// -----------------------------------------------------------------------------
+static u32 rng_state = 12345;
+
+static u32
+rng() {
+  rng_state = rng_state * 1103515245 + 12345;
+  return rng_state >> 8;
+}
+
+static PIX *
+make_text_page(int w, int h) {
+  PIX *const pix = pixCreate(w, h, 1);
+  const int wpl = pix->wpl;
+  u32 *const data = pix->data;
+  // lines of "words": short runs of black boxes with some holes in them
+  for (int y0 = h / 20; y0 + 40 < h - h / 20; y0 += 60) {
+    for (int x0 = w / 20; x0 + 30 < w - w / 20;) {
+      const int cw = 12 + rng() % 16;
+      for (int y = y0; y < y0 + 40; ++y) {
+        for (int x = x0; x < x0 + cw; ++x) {
+          if (rng() % 8 == 0) continue;
+          data[y * wpl + x / 32] |= 0x80000000u >> (x % 32);
+        }
+      }
+      x0 += cw + 4 + (rng() % 6 == 0 ? 30 : 0);
+    }
+  }
+  return pix;
+}
+
+static PIX *
+make_noise(int w, int h, int depth) {
+  PIX *const pix = pixCreate(w, h, depth);
+  const int wpl = pix->wpl;
+  u32 *const data = pix->data;
+  for (int i = 0; i < wpl * h; ++i) data[i] = rng() ^ (rng() << 16);
+  pixSetPadBits(pix, 0);
+  return pix;
+}
+
+// Returns a copy of the 1 bpp image pix at depth 8 (white is 255) or 32 (RGB)
+static PIX *
+make_deeper(PIX *pix, int depth) {
+  PIX *const ret = pixCreate(pix->w, pix->h, depth);
+  for (unsigned y = 0; y < pix->h; ++y) {
+    const u32 *const lines = pix->data + y * pix->wpl;
+    u32 *const lined = ret->data + y * ret->wpl;
+    for (unsigned x = 0; x < pix->w; ++x) {
+      const u32 v = (lines[x / 32] >> (31 - x % 32)) & 1 ? 0 : 255;
+      if (depth == 8) {
+        lined[x / 4] |= v << (24 - 8 * (x % 4));
+      } else {
+        lined[x] = v << 24 | v << 16 | v << 8;
+      }
+    }
+  }
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// The kernels
+// -----------------------------------------------------------------------------
+struct bitimage_arg {
+  PIX *pix;
+  bool tpgd;
+  int gbtemplate;
+};
+
+static void
+bitimage_kernel(void *arg) {
+  const struct bitimage_arg *const a = (struct bitimage_arg *) arg;
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  jbig2enc_bitimage_template(&ctx, (u8 *) a->pix->data, a->pix->w, a->pix->h,
+                             a->gbtemplate, a->tpgd);
+  jbig2enc_final(&ctx);
+  jbig2enc_dealloc(&ctx);
+}
+
+// The image coded as n stripes, interleaved on one thread
+struct interleaved_arg {
+  PIX *pix;
+  int n;
+};
+
+static void
+interleaved_kernel(void *arg) {
+  const struct interleaved_arg *const a = (struct interleaved_arg *) arg;
+  struct jbig2enc_ctx ctx[JBIG2_MAX_INTERLEAVE];
+  struct jbig2enc_ctx *ctxs[JBIG2_MAX_INTERLEAVE];
+  const u8 *data[JBIG2_MAX_INTERLEAVE];
+  int w[JBIG2_MAX_INTERLEAVE], h[JBIG2_MAX_INTERLEAVE];
+  const int rows = (a->pix->h + a->n - 1) / a->n;
+  for (int i = 0; i < a->n; ++i) {
+    const int y0 = i * rows;
+    jbig2enc_init(&ctx[i]);
+    ctxs[i] = &ctx[i];
+    data[i] = (u8 *) (a->pix->data + y0 * a->pix->wpl);
+    w[i] = a->pix->w;
+    h[i] = (int) a->pix->h - y0 < rows ? (int) a->pix->h - y0 : rows;
+  }
+  jbig2enc_bitimage_interleaved(ctxs, data, w, h, a->n, 0, false);
+  for (int i = 0; i < a->n; ++i) {
+    jbig2enc_final(&ctx[i]);
+    jbig2enc_dealloc(&ctx[i]);
+  }
+}
+
+struct components_arg {
+  PIX *pix;
+  int connectivity;
+};
+
+static void
+components_kernel(void *arg) {
+  const struct components_arg *const a = (struct components_arg *) arg;
+  struct jbig2_components comps;
+  if (!jbig2_find_components(a->pix, a->connectivity, &comps)) abort();
+  jbig2_free_components(&comps);
+}
+
+struct threshold_arg {
+  PIX *gray;  // 8 bpp
+  PIX *bw;
+};
+
+static void
+threshold_kernel(void *arg) {
+  const struct threshold_arg *const a = (struct threshold_arg *) arg;
+  const int h = a->gray->h;
+  const int w = a->gray->w;
+  for (int y = 0; y < h; ++y) {
+    thresholdToBinaryLineLow(a->bw->data + y * a->bw->wpl, w,
+                             a->gray->data + y * a->gray->wpl, 8, 188);
+  }
+}
+
+struct scale_arg {
+  PIX *gray;  // 8 bpp source
+  u32 *lines;  // factor rows of the scaled image
+  int wpld;
+  int factor;
+};
+
+static void
+scale_kernel(void *arg) {
+  const struct scale_arg *const a = (struct scale_arg *) arg;
+  const int h = a->gray->h;
+  const int w = a->gray->w;
+  const int wpls = a->gray->wpl;
+  for (int y = 0; y < h; ++y) {
+    u32 *const lines = a->gray->data + y * wpls;
+    if (a->factor == 2) {
+      scaleGray2xLILineLow(a->lines, a->wpld, lines, w, wpls, y == h - 1);
+    } else {
+      scaleGray4xLILineLow(a->lines, a->wpld, lines, w, wpls, y == h - 1);
+    }
+  }
+}
+
+static void
+rgb_to_gray_kernel(void *arg) {
+  PIX *gray = pixConvertRGBToGrayFast((PIX *) arg);
+  pixDestroy(&gray);
+}
+
+static void
+read_png_kernel(void *arg) {
+  FILE *const fp = fopen((const char *) arg, "rb");
+  if (!fp) abort();
+  PIX *pix = pixReadStreamPng(fp);
+  fclose(fp);
+  pixDestroy(&pix);
+}
+
+struct inflate_arg {
+  u8 *in;  // the concatenated IDAT data of a PNG file
+  size_t in_size;
+  u8 *out;
+  size_t out_size;
+};
+
+static void
+inflate_kernel(void *arg) {
+  const struct inflate_arg *const a = (struct inflate_arg *) arg;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) abort();
+  zs.next_in = a->in;
+  zs.avail_in = a->in_size;
+  zs.next_out = a->out;
+  zs.avail_out = a->out_size;
+  if (inflate(&zs, Z_FINISH) != Z_STREAM_END) abort();
+  inflateEnd(&zs);
+}
+
+// -----------------------------------------------------------------------------
+// Read the IDAT chunks of a PNG file into a->in and size a->out to fit the
+// inflated data. Returns false if it's not a PNG file.
+// -----------------------------------------------------------------------------
+static bool
+load_idat(const char *filename, struct inflate_arg *a) {
+  FILE *const fp = fopen(filename, "rb");
+  if (!fp) return false;
+  u8 sig[8];
+  if (fread(sig, 1, 8, fp) != 8 || memcmp(sig, "\x89PNG\r\n\x1a\n", 8)) {
+    fclose(fp);
+    return false;
+  }
+  a->in = NULL;
+  a->in_size = 0;
+  a->out_size = 0;
+  u8 head[8];
+  while (fread(head, 1, 8, fp) == 8) {
+    const u32 len = (u32) head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+    if (memcmp(head + 4, "IHDR", 4) == 0 && len >= 13) {
+      u8 ihdr[13];
+      if (fread(ihdr, 1, 13, fp) != 13) break;
+      const u32 w = (u32) ihdr[0] << 24 | ihdr[1] << 16 | ihdr[2] << 8 | ihdr[3];
+      const u32 h = (u32) ihdr[4] << 24 | ihdr[5] << 16 | ihdr[6] << 8 | ihdr[7];
+      // the largest row is 8 bytes per pixel (16-bit RGBA) plus the filter byte
+      a->out_size = (size_t) h * (w * 8 + 1);
+      fseek(fp, len - 13 + 4, SEEK_CUR);
+    } else if (memcmp(head + 4, "IDAT", 4) == 0) {
+      a->in = (u8 *) realloc(a->in, a->in_size + len);
+      if (fread(a->in + a->in_size, 1, len, fp) != len) break;
+      a->in_size += len;
+      fseek(fp, 4, SEEK_CUR);
+    } else {
+      fseek(fp, len + 4, SEEK_CUR);
+    }
+  }
+  fclose(fp);
+  a->out = (u8 *) malloc(a->out_size);
+  return a->in_size > 0;
+}
+
+// -----------------------------------------------------------------------------
+// Run all the kernels which take an image of this depth
+// -----------------------------------------------------------------------------
+static void
+bench_image(PIX *pix, const char *name) {
+  const double pixels = (double) pix->w * pix->h;
+  PIX *bw = NULL, *gray = NULL;
+
+  if (pix->d == 32) {
+    run("pixConvertRGBToGrayFast", name, pixels, rgb_to_gray_kernel, pix);
+    gray = pixConvertRGBToGrayFast(pix);
+  } else if (pix->d == 8 && !pix->colormap) {
+    gray = pixClone(pix);
+  } else if (pix->d == 1) {
+    bw = pixClone(pix);
+  }
+
+  if (gray) {
+    struct threshold_arg t;
+    t.gray = gray;
+    t.bw = pixCreate(gray->w, gray->h, 1);
+    run("thresholdToBinaryLineLow", name, pixels, threshold_kernel, &t);
+    pixDestroy(&t.bw);
+
+    for (int factor = 2; factor <= 4; factor += 2) {
+      struct scale_arg s;
+      s.gray = gray;
+      s.factor = factor;
+      s.wpld = (gray->w * factor + 3) / 4;
+      s.lines = (u32 *) malloc(s.wpld * factor * sizeof(u32));
+      run(factor == 2 ? "scaleGray2xLILineLow" : "scaleGray4xLILineLow", name,
+          pixels * factor * factor, scale_kernel, &s);
+      free(s.lines);
+    }
+
+    if (!bw) bw = pixThresholdToBinary(gray, 188);
+    pixDestroy(&gray);
+  }
+
+  if (bw) {
+    pixSetPadBits(bw, 0);
+    for (int gbtemplate = 0; gbtemplate < 4; ++gbtemplate) {
+      for (int tpgd = 0; tpgd < 2; ++tpgd) {
+        struct bitimage_arg b;
+        b.pix = bw;
+        b.tpgd = tpgd;
+        b.gbtemplate = gbtemplate;
+        char kernel[64];
+        snprintf(kernel, sizeof(kernel), "jbig2enc_bitimage T%d%s", gbtemplate,
+                 tpgd ? " TPGD" : "");
+        run(kernel, name, pixels, bitimage_kernel, &b);
+      }
+    }
+    for (int n = 2; n <= JBIG2_MAX_INTERLEAVE; n *= 2) {
+      struct interleaved_arg l;
+      l.pix = bw;
+      l.n = n;
+      run(n == 2 ? "jbig2enc_bitimage_interleaved T0 x2" :
+          "jbig2enc_bitimage_interleaved T0 x4", name, pixels,
+          interleaved_kernel, &l);
+    }
+    for (int connectivity = 4; connectivity <= 8; connectivity += 4) {
+      struct components_arg c;
+      c.pix = bw;
+      c.connectivity = connectivity;
+      run(connectivity == 4 ? "jbig2_find_components 4" :
+          "jbig2_find_components 8", name, pixels, components_kernel, &c);
+    }
+    pixDestroy(&bw);
+  }
+}
+
+int
+main(int argc, char **argv) {
+  int i = 1;
+  if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+    repeats = atoi(argv[i + 1]);
+    if (repeats < 1) repeats = 1;
+    i += 2;
+  }
+
+  // synthetic inputs of a 300 dpi A4 page
+  const int w = 2480, h = 3508;
+  PIX *text = make_text_page(w, h);
+  PIX *noise1 = make_noise(w, h, 1);
+  PIX *noise8 = make_noise(w, h, 8);
+  PIX *text8 = make_deeper(text, 8);
+  PIX *text32 = make_deeper(text, 32);
+  bench_image(text, "synthetic text 1bpp");
+  bench_image(noise1, "synthetic noise 1bpp");
+  bench_image(text8, "synthetic text 8bpp");
+  bench_image(noise8, "synthetic noise 8bpp");
+  bench_image(text32, "synthetic text 32bpp");
+  pixDestroy(&text);
+  pixDestroy(&noise1);
+  pixDestroy(&noise8);
+  pixDestroy(&text8);
+  pixDestroy(&text32);
+
+  for (; i < argc; ++i) {
+    const char *const name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1
+                                                   : argv[i];
+    PIX *pix = pixRead(argv[i]);
+    if (!pix) {
+      fprintf(stderr, "Cannot read %s\n", argv[i]);
+      continue;
+    }
+    const double pixels = (double) pix->w * pix->h;
+    struct inflate_arg z;
+    if (load_idat(argv[i], &z)) {
+      run("pixReadStreamPng", name, pixels, read_png_kernel, argv[i]);
+      run("inflate", name, pixels, inflate_kernel, &z);
+      free(z.in);
+      free(z.out);
+    }
+    PIX *pixl = pixRemoveColormap(pix, REMOVE_CMAP_BASED_ON_SRC);
+    pixDestroy(&pix);
+    if (pixl) bench_image(pixl, name);
+    pixDestroy(&pixl);
+  }
+
+  return 0;
+}
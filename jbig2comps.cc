@@ -0,0 +1,257 @@
+// Connected components of 1 bpp images, for symbol coding.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2comps.h"
+
+#define u32 uint32_t
+
+// -----------------------------------------------------------------------------
+// A growable array of runs
+// -----------------------------------------------------------------------------
+struct run_list {
+  struct jbig2_run *runs;
+  int n, size;
+};
+
+static bool
+add_run(struct run_list *list, int y, int x0, int x1) {
+  if (list->n == list->size) {
+    if (list->size > INT_MAX / 2) return false;
+    const int size = list->size ? list->size * 2 : 1024;
+    struct jbig2_run *const runs =
+        (struct jbig2_run *) realloc(list->runs, size * sizeof(*runs));
+    if (!runs) return false;
+    list->runs = runs;
+    list->size = size;
+  }
+  struct jbig2_run *const run = &list->runs[list->n++];
+  run->y = y;
+  run->x0 = x0;
+  run->x1 = x1;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Add the runs of black pixels in a row of w pixels. Words which are all
+// white outside a run, or all black inside one, are skipped whole; otherwise
+// each edge is found with a count of leading zeros. (Leptonica keeps the
+// leftmost pixel in the top bit of each word.)
+// -----------------------------------------------------------------------------
+static bool
+find_runs(struct run_list *list, const u32 *line, int w, int y) {
+  const int words = (w + 31) / 32;
+  bool in_run = false;
+  int start = 0;
+  for (int i = 0; i < words; ++i) {
+    u32 word = line[i];
+    if (i == words - 1 && (w & 31)) word &= 0xffffffffu << (32 - (w & 31));
+    if (word == (in_run ? 0xffffffffu : 0)) continue;
+    // the bits still to look at are the ones in mask
+    u32 mask = 0xffffffffu;
+    for (;;) {
+      const u32 edges = (in_run ? ~word : word) & mask;
+      if (!edges) break;
+      const int bit = __builtin_clz(edges);
+      const int x = i * 32 + bit;
+      if (in_run) {
+        if (!add_run(list, y, start, x)) return false;
+      } else {
+        start = x;
+      }
+      in_run = !in_run;
+      mask = (0xffffffffu >> bit) >> 1;
+    }
+  }
+  if (in_run && !add_run(list, y, start, w)) return false;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Union-find over the runs. A root is always the first run of its set, so
+// every parent comes before its child: that keeps the components in raster
+// order and lets them be numbered in one pass afterwards.
+// -----------------------------------------------------------------------------
+static int
+find_root(int *parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static void
+join(int *parent, int a, int b) {
+  a = find_root(parent, a);
+  b = find_root(parent, b);
+  if (a < b) {
+    parent[b] = a;
+  } else if (b < a) {
+    parent[a] = b;
+  }
+}
+
+bool
+jbig2_find_components(PIX *pix, int connectivity,
+                      struct jbig2_components *comps) {
+  memset(comps, 0, sizeof(*comps));
+  if (!pix || pix->d != 1 || (connectivity != 4 && connectivity != 8)) {
+    return false;
+  }
+  const int w = pix->w, h = pix->h, wpl = pix->wpl;
+  // with 8-connectivity, runs which only touch at the corners are joined
+  const int slack = connectivity == 8;
+
+  struct run_list list;
+  memset(&list, 0, sizeof(list));
+  int *parent = NULL;
+  int parent_size = 0;
+  int prev_start = 0, prev_end = 0;  // the runs of the last row
+  for (int y = 0; y < h; ++y) {
+    const int cur_start = list.n;
+    if (!find_runs(&list, pix->data + y * wpl, w, y)) goto fail;
+    const int cur_end = list.n;
+    if (cur_end > parent_size) {
+      int *const p = (int *) realloc(parent, list.size * sizeof(int));
+      if (!p) goto fail;
+      parent = p;
+      parent_size = list.size;
+    }
+
+    const struct jbig2_run *const runs = list.runs;
+    int first = prev_start;  // the first run of the last row which could touch
+    for (int j = cur_start; j < cur_end; ++j) {
+      parent[j] = j;
+      while (first < prev_end && runs[first].x1 + slack <= runs[j].x0) ++first;
+      for (int k = first; k < prev_end && runs[k].x0 < runs[j].x1 + slack;
+           ++k) {
+        join(parent, k, j);
+      }
+    }
+    prev_start = cur_start;
+    prev_end = cur_end;
+  }
+
+  {
+    // number the components, overwriting each parent with its component
+    // number: as parents come first, the parent's number is already there
+    int ncomps = 0;
+    for (int i = 0; i < list.n; ++i) {
+      parent[i] = parent[i] == i ? ncomps++ : parent[parent[i]];
+    }
+
+    struct jbig2_component *const c = (struct jbig2_component *)
+        malloc((ncomps ? ncomps : 1) * sizeof(*c));
+    struct jbig2_run *const sorted = (struct jbig2_run *)
+        malloc((list.n ? list.n : 1) * sizeof(*sorted));
+    if (!c || !sorted) {
+      free(c);
+      free(sorted);
+      goto fail;
+    }
+    for (int i = 0; i < ncomps; ++i) {
+      c[i].x = INT_MAX;
+      c[i].y = -1;
+      c[i].w = 0;
+      c[i].npixels = 0;
+      c[i].nruns = 0;
+    }
+    int *const right = (int *) malloc((ncomps ? ncomps : 1) * sizeof(int));
+    if (!right) {
+      free(c);
+      free(sorted);
+      goto fail;
+    }
+    for (int i = 0; i < list.n; ++i) {
+      const struct jbig2_run *const run = &list.runs[i];
+      struct jbig2_component *const comp = &c[parent[i]];
+      if (comp->y < 0) {
+        comp->y = run->y;
+        right[parent[i]] = run->x1;
+      }
+      if (run->x0 < comp->x) comp->x = run->x0;
+      if (run->x1 > right[parent[i]]) right[parent[i]] = run->x1;
+      comp->h = run->y - comp->y + 1;
+      comp->npixels += run->x1 - run->x0;
+      comp->nruns++;
+    }
+    int next = 0;
+    for (int i = 0; i < ncomps; ++i) {
+      c[i].w = right[i] - c[i].x;
+      c[i].first_run = next;
+      next += c[i].nruns;
+      right[i] = c[i].first_run;
+    }
+    // the runs are in raster order, so they stay in it within each component
+    for (int i = 0; i < list.n; ++i) sorted[right[parent[i]]++] = list.runs[i];
+    free(right);
+
+    comps->comps = c;
+    comps->ncomps = ncomps;
+    comps->runs = sorted;
+    comps->nruns = list.n;
+  }
+  free(list.runs);
+  free(parent);
+  return true;
+
+fail:
+  free(list.runs);
+  free(parent);
+  return false;
+}
+
+void
+jbig2_free_components(struct jbig2_components *comps) {
+  free(comps->comps);
+  free(comps->runs);
+  memset(comps, 0, sizeof(*comps));
+}
+
+void
+jbig2_draw_component(const struct jbig2_components *comps, int i, u32 *data,
+                     int wpl) {
+  const struct jbig2_component *const comp = &comps->comps[i];
+  for (int r = comp->first_run; r < comp->first_run + comp->nruns; ++r) {
+    const struct jbig2_run *const run = &comps->runs[r];
+    u32 *const line = data + (run->y - comp->y) * wpl;
+    const int x0 = run->x0 - comp->x, x1 = run->x1 - comp->x;
+    // set the bits x0 <= x < x1 of the row a word at a time
+    const int first = x0 / 32, last = (x1 - 1) / 32;
+    const u32 head = 0xffffffffu >> (x0 & 31);
+    const u32 tail = 0xffffffffu << (31 - ((x1 - 1) & 31));
+    if (first == last) {
+      line[first] |= head & tail;
+    } else {
+      line[first] |= head;
+      for (int k = first + 1; k < last; ++k) line[k] = 0xffffffffu;
+      line[last] |= tail;
+    }
+  }
+}
+
+PIX *
+jbig2_component_pix(const struct jbig2_components *comps, int i) {
+  PIX *const pix = pixCreate(comps->comps[i].w, comps->comps[i].h, 1);
+  if (!pix) return NULL;
+  jbig2_draw_component(comps, i, pix->data, pix->wpl);
+  return pix;
+}
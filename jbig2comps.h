@@ -0,0 +1,73 @@
+// Connected components of 1 bpp images, for symbol coding.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2COMPS_H__
+#define JBIG2ENC_JBIG2COMPS_H__
+
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct Pix;
+
+// A horizontal run of black pixels: x0 <= x < x1 of row y
+struct jbig2_run {
+  int y, x0, x1;
+};
+
+struct jbig2_component {
+  int x, y, w, h;  // the bounding box
+  int npixels;
+  int first_run, nruns;  // the runs of the component, in raster order
+};
+
+// -----------------------------------------------------------------------------
+// The connected components of an image, in the order of their first pixel in
+// raster order (as Leptonica's pixConnComp finds them). The runs of each
+// component are together in runs, so a component can be drawn (or hashed)
+// without touching the image again.
+// -----------------------------------------------------------------------------
+struct jbig2_components {
+  struct jbig2_component *comps;
+  int ncomps;
+  struct jbig2_run *runs;
+  int nruns;
+};
+
+// -----------------------------------------------------------------------------
+// Find the connected components of the black pixels of the 1 bpp image pix,
+// with connectivity 4 or 8. The rows are scanned a word at a time for runs,
+// and runs which touch on neighbouring rows are joined with union-find, so
+// the time taken depends on the number of runs rather than of pixels.
+//
+// Returns false if pix isn't 1 bpp or we ran out of memory. Otherwise call
+// jbig2_free_components on *comps when done.
+// -----------------------------------------------------------------------------
+bool jbig2_find_components(struct Pix *pix, int connectivity,
+                           struct jbig2_components *comps);
+
+void jbig2_free_components(struct jbig2_components *comps);
+
+// Draw component i into the zeroed 1 bpp rows at data, of wpl words each, the
+// size of its bounding box
+void jbig2_draw_component(const struct jbig2_components *comps, int i,
+                          uint32_t *data, int wpl);
+
+// Returns a new 1 bpp image of component i, the size of its bounding box, or
+// NULL if we ran out of memory
+struct Pix *jbig2_component_pix(const struct jbig2_components *comps, int i);
+
+#endif  // JBIG2ENC_JBIG2COMPS_H__
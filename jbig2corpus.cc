@@ -0,0 +1,258 @@
+// End-to-end corpus benchmark and bit-exact regression check for jbig2.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -----------------------------------------------------------------------------
+// Usage: jbig2corpus [-b <jbig2 binary>] -r <refdir> [-u]
+//                    <dir or image files...> [-- <jbig2 options...>]
+//
+// Runs the jbig2 binary (./jbig2 by default) once per PNG/PNM page, with the
+// given options, and prints the wall time, user time, peak RSS and output
+// size of each run. The output is compared byte-for-byte against
+// <refdir>/<page>.jb2, and the exit code is 1 if any page differs or fails.
+// With -u the references are (re)written instead. The intended use is to
+// record the references with a build of the reference coder
+// (-DJBIG2_REFERENCE_CODER) and then check each optimized build against them.
+// Build with c-bench.sh.
+// -----------------------------------------------------------------------------
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *binary = "./jbig2";
+static const char *refdir = NULL;
+static bool update = false;
+
+static char **pages = NULL;
+static int npages = 0;
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool
+is_page(const char *name) {
+  static const char *const exts[] = {
+    ".png", ".pnm", ".pbm", ".pgm", ".ppm", NULL
+  };
+  const char *const dot = strrchr(name, '.');
+  if (!dot) return false;
+  for (int i = 0; exts[i]; ++i) {
+    if (strcasecmp(dot, exts[i]) == 0) return true;
+  }
+  return false;
+}
+
+static void
+add_page(const char *path) {
+  pages = (char **) realloc(pages, (npages + 1) * sizeof(char *));
+  pages[npages++] = strdup(path);
+}
+
+static int
+compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void
+add_dir(const char *dir) {
+  DIR *const d = opendir(dir);
+  if (!d) return;
+  const int first = npages;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    if (!is_page(e->d_name)) continue;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    add_page(path);
+  }
+  closedir(d);
+  qsort(pages + first, npages - first, sizeof(char *), compare_paths);
+}
+
+// Read a whole file. Returns NULL if it cannot be read.
+static unsigned char *
+read_file(const char *path, size_t *len) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  unsigned char *const buf = (unsigned char *) malloc(st.st_size + 1);
+  size_t done = 0;
+  while (done < (size_t) st.st_size) {
+    const ssize_t r = read(fd, buf + done, st.st_size - done);
+    if (r <= 0) break;
+    done += r;
+  }
+  close(fd);
+  *len = done;
+  return buf;
+}
+
+// Run the binary on one page with stdout going to outpath and return its exit
+// status, or -1 if it could not be run.
+static int
+run_page(const char *page, char **opts, int nopts, const char *outpath,
+         double *wall, double *user, long *maxrss_kb) {
+  const int fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -1;
+  char **argv = (char **) malloc((nopts + 3) * sizeof(char *));
+  argv[0] = (char *) binary;
+  for (int i = 0; i < nopts; ++i) argv[i + 1] = opts[i];
+  argv[nopts + 1] = (char *) page;
+  argv[nopts + 2] = NULL;
+
+  const double t0 = now();
+  const pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fd, 1);
+    close(fd);
+    execv(binary, argv);
+    _exit(127);
+  }
+  close(fd);
+  free(argv);
+  if (pid < 0) return -1;
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) != pid) return -1;
+  *wall = now() - t0;
+  *user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+  *maxrss_kb = ru.ru_maxrss;
+  if (!WIFEXITED(status)) return -1;
+  return WEXITSTATUS(status);
+}
+
+static void
+usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [-b <jbig2 binary>] -r <refdir> [-u] "
+          "<dir or image files...> [-- <jbig2 options...>]\n", argv0);
+}
+
+int
+main(int argc, char **argv) {
+  char **opts = NULL;
+  int nopts = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--") == 0) {
+      opts = argv + i + 1;
+      nopts = argc - i - 1;
+      break;
+    }
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      binary = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      refdir = argv[++i];
+    } else if (strcmp(argv[i], "-u") == 0) {
+      update = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      struct stat st;
+      if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+        add_dir(argv[i]);
+      } else {
+        add_page(argv[i]);
+      }
+    }
+  }
+  if (!refdir || !npages) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (update) mkdir(refdir, 0755);
+
+  char tmppath[64];
+  snprintf(tmppath, sizeof(tmppath), "/tmp/jbig2corpus.%d", (int) getpid());
+
+  int failures = 0;
+  double total_wall = 0, total_user = 0;
+  long peak_rss = 0;
+  size_t total_bytes = 0;
+
+  printf("%-32s %9s %9s %9s %10s  %s\n", "page", "wall/s", "user/s",
+         "rss/KiB", "bytes", "result");
+  for (int i = 0; i < npages; ++i) {
+    const char *const name = strrchr(pages[i], '/') ? strrchr(pages[i], '/') + 1
+                                                    : pages[i];
+    char refpath[4096];
+    snprintf(refpath, sizeof(refpath), "%s/%s.jb2", refdir, name);
+
+    double wall = 0, user = 0;
+    long rss = 0;
+    const int ret = run_page(pages[i], opts, nopts,
+                             update ? refpath : tmppath, &wall, &user, &rss);
+    size_t outlen = 0;
+    unsigned char *const out = read_file(update ? refpath : tmppath, &outlen);
+
+    char result[64];
+    if (ret != 0 || !out) {
+      snprintf(result, sizeof(result), "FAILED (exit %d)", ret);
+      failures++;
+    } else if (update) {
+      snprintf(result, sizeof(result), "written");
+    } else {
+      size_t reflen;
+      unsigned char *const ref = read_file(refpath, &reflen);
+      if (!ref) {
+        snprintf(result, sizeof(result), "NO REFERENCE");
+        failures++;
+      } else {
+        size_t j = 0;
+        while (j < outlen && j < reflen && out[j] == ref[j]) j++;
+        if (j == outlen && j == reflen) {
+          snprintf(result, sizeof(result), "identical");
+        } else {
+          snprintf(result, sizeof(result), "DIFFERS at byte %lu (ref %lu)",
+                   (unsigned long) j, (unsigned long) reflen);
+          failures++;
+        }
+        free(ref);
+      }
+    }
+    free(out);
+
+    printf("%-32s %9.4f %9.4f %9ld %10lu  %s\n", name, wall, user, rss,
+           (unsigned long) outlen, result);
+    fflush(stdout);
+    total_wall += wall;
+    total_user += user;
+    if (rss > peak_rss) peak_rss = rss;
+    total_bytes += outlen;
+  }
+  unlink(tmppath);
+
+  printf("%-32s %9.4f %9.4f %9ld %10lu  %d of %d failed\n", "total",
+         total_wall, total_user, peak_rss, (unsigned long) total_bytes,
+         failures, npages);
+  return failures ? 1 : 0;
+}
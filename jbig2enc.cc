@@ -16,12 +16,14 @@
 // limitations under the License.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <allheaders.h>
 #include <pix.h>
 
 #include <math.h>
+#include <time.h>
 #if defined(sun)
 #include <sys/types.h>
 #else
@@ -34,8 +36,22 @@
 #define u8  uint8_t
 
 #include "jbig2arith.h"
+#include "jbig2mmr.h"
 #include "jbig2structs.h"
 #include "jbig2segments.h"
+#include "jbig2sym.h"
+#include "jbig2enc.h"
+#include "jbig2trace.h"
+
+// Stripes are encoded on worker threads unless threads are not available on
+// this platform (or were turned off with -DJBIG2_NO_THREADS), in which case
+// they are encoded one after the other.
+#if !defined(JBIG2_NO_THREADS) && (defined(WIN32) || defined(__MINGW32__))
+#define JBIG2_NO_THREADS
+#endif
+#ifndef JBIG2_NO_THREADS
+#include <pthread.h>
+#endif
 
 #ifdef __MINGW32__
 unsigned short my_htons(unsigned short x) {
@@ -48,83 +64,867 @@ unsigned long my_htonl(unsigned long x) {
 #endif
 
 #define SEGMENT(x) x.write(ret + offset); offset += x.size();
+#define GENREG(x) memcpy(ret + offset, &x, generic_region_size(&x)) ; \
+    offset += generic_region_size(&x)
+
+// -----------------------------------------------------------------------------
+// A part of a page which is coded as one generic region. With opts.crop it is
+// only the bounding box of the black pixels of its rows and, unless the box is
+// as wide as the page, pix holds a copy of it.
+// -----------------------------------------------------------------------------
+struct jbig2_region {
+  const u32 *data;  // first row of the region
+  int wpl;  // words per row of data
+  int x, y, w, h;  // the region on the page
+  struct Pix *pix;  // if not NULL, owns data
+};
+
+static bool
+row_is_white(const u32 *row, int wpl) {
+  u32 bits = 0;
+  for (int i = 0; i < wpl; ++i) bits |= row[i];
+  return !bits;
+}
+
+// -----------------------------------------------------------------------------
+// Find the bands of rows of bw to code: band i is the rows from bands[2*i] up
+// to bands[2*i + 1]. Without crop or split_gap this is the whole page. With
+// either, the white rows at the top and the bottom are left out, and with
+// split_gap the page is also split at each run of at least that many white
+// rows. A page which is all white gets a single white row. bw must have zero
+// pad bits. Returns the number of bands; the caller must free *bands.
+// -----------------------------------------------------------------------------
+static int
+find_bands(const struct Pix *bw, bool crop, int split_gap, int **bands) {
+  const int h = bw->h, wpl = bw->wpl;
+  int *const b = (int *) malloc((h / 2 + 1) * 2 * sizeof(int));
+  *bands = b;
+  if (!crop && split_gap <= 0) {
+    b[0] = 0;
+    b[1] = h;
+    return 1;
+  }
+
+  int n = 0;
+  for (int y = 0; y < h;) {
+    const int gap_start = y;
+    while (y < h && row_is_white(bw->data + y * wpl, wpl)) y++;
+    if (y == h) break;
+    // a short gap is coded as part of the band above it
+    if (!n || (split_gap > 0 && y - gap_start >= split_gap)) b[2 * n++] = y;
+    while (y < h && !row_is_white(bw->data + y * wpl, wpl)) y++;
+    b[2 * n - 1] = y;
+  }
+  if (!n) {
+    b[0] = 0;
+    b[1] = 1;
+    n = 1;
+  }
+  return n;
+}
+
+// The first row of the first band of find_bands on a striped page, or 0
+static int
+first_band_row(const struct Pix *bw, const struct jbig2_generic_options &opts) {
+  if (!opts.stripe_rows || (!opts.crop && opts.split_gap <= 0)) return 0;
+  for (int y = 0; y < (int) bw->h; ++y) {
+    if (!row_is_white(bw->data + y * bw->wpl, bw->wpl)) return y;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Set up region to code rows y0 up to y1 of bw. With crop, the columns are
+// found by ORing the rows together, a word at a time.
+// -----------------------------------------------------------------------------
+static void
+init_region(struct jbig2_region *region, const struct Pix *bw, int y0, int y1,
+            bool crop) {
+  const int wpl = bw->wpl;
+  const u32 *const data = bw->data;
+  region->data = data + y0 * wpl;
+  region->wpl = wpl;
+  region->x = 0;
+  region->y = y0;
+  region->w = bw->w;
+  region->h = y1 - y0;
+  region->pix = NULL;
+  if (!crop) return;
+
+  u32 *const columns = (u32 *) calloc(wpl, sizeof(u32));
+  for (int y = y0; y < y1; ++y) {
+    const u32 *const row = data + y * wpl;
+    for (int i = 0; i < wpl; ++i) columns[i] |= row[i];
+  }
+  int first = 0, last = wpl - 1;
+  while (first < wpl && !columns[first]) first++;
+  if (first == wpl) {
+    // all white: a single white pixel is the smallest valid region
+    free(columns);
+    region->w = 1;
+    return;
+  }
+  while (!columns[last]) last--;
+  // the leftmost pixel of a word is its top bit
+  const int x0 = first * 32 + __builtin_clz(columns[first]);
+  const int x1 = last * 32 + 32 - __builtin_ctz(columns[last]);
+  free(columns);
+
+  region->x = x0;
+  region->w = x1 - x0;
+  if (x0 == 0 && x1 == (int) bw->w) return;
+  region->pix = pixCreate(region->w, region->h, 1);
+  const int dwpl = region->pix->wpl;
+  const int shift = x0 % 32;
+  for (int y = 0; y < region->h; ++y) {
+    const u32 *const src = data + (y0 + y) * wpl + first;
+    u32 *const dst = region->pix->data + y * dwpl;
+    for (int i = 0; i < dwpl; ++i) {
+      dst[i] = src[i] << shift;
+      if (shift && first + i + 1 < wpl) dst[i] |= src[i + 1] >> (32 - shift);
+    }
+  }
+  pixSetPadBits(region->pix, 0);
+  region->data = region->pix->data;
+  region->wpl = dwpl;
+}
+
+// -----------------------------------------------------------------------------
+// Fill in the headers shared by all the ways of encoding a single page as
+// generic regions.
+// -----------------------------------------------------------------------------
+static void
+init_file_header(struct jbig2_file_header *header, int npages) {
+  memset(header, 0, sizeof(*header));
+  header->n_pages = htonl(npages);
+  header->organisation_type = 1;
+  memcpy(&header->id, JBIG2_FILE_MAGIC, 8);
+}
+
+// w, h, bw_xres and bw_yres are those of the bi-level page
+static void
+init_page_info(Segment *seg, struct jbig2_page_info *pageinfo,
+               const int w, const int h, const int bw_xres,
+               const int bw_yres, const int xres, const int yres,
+               const int page) {
+  seg->type = segment_page_information;
+  seg->page = page;
+  seg->len = sizeof(struct jbig2_page_info);
+  memset(pageinfo, 0, sizeof(*pageinfo));
+  pageinfo->width = htonl(w);
+  pageinfo->height = htonl(h);
+  pageinfo->xres = htonl(xres ? xres : bw_xres);
+  pageinfo->yres = htonl(yres ? yres : bw_yres);
+  pageinfo->is_lossless = 1;
+}
+
+// -----------------------------------------------------------------------------
+// Returns true iff the striping of opts can be written: the maximum stripe size
+// in the page information is 15 bits, and only a striped page can leave its
+// height unknown (7.4.8.5)
+// -----------------------------------------------------------------------------
+static bool
+striping_ok(const struct jbig2_generic_options &opts) {
+  return opts.stripe_rows >= 0 && opts.stripe_rows <= 0x7fff &&
+         (opts.stripe_rows || !opts.unknown_height);
+}
+
+// Mark pageinfo as that of a striped page, if opts asks for one
+static void
+init_page_striping(struct jbig2_page_info *pageinfo,
+                   const struct jbig2_generic_options &opts) {
+  if (!opts.stripe_rows) return;
+  pageinfo->segment_flags = htons(0x8000 | opts.stripe_rows);
+  if (opts.unknown_height) pageinfo->height = 0xffffffff;
+}
+
+// The number of stripes of a page h rows high, or zero if it isn't striped
+static int
+page_stripes(const struct jbig2_generic_options &opts, int h) {
+  return opts.stripe_rows ? (h + opts.stripe_rows - 1) / opts.stripe_rows : 0;
+}
+
+// The stripe of the page which row y is in
+static int
+stripe_of(const struct jbig2_generic_options &opts, int y) {
+  return opts.stripe_rows ? y / opts.stripe_rows : 0;
+}
+
+// The size of an end of stripe segment for the page of opts
+static unsigned
+end_of_stripe_size(const struct jbig2_generic_options &opts) {
+  Segment seg;
+  seg.page = opts.page;
+  return seg.size() + sizeof(u32);
+}
+
+// The first AT pixel of opts, in its default location for (0, 0)
+static void
+generic_at(const struct jbig2_generic_options &opts, int *atx, int *aty) {
+  if (opts.atx || opts.aty) {
+    *atx = opts.atx;
+    *aty = opts.aty;
+  } else {
+    jbig2enc_default_at(opts.gbtemplate, atx, aty);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Write the end of stripe segment (7.4.10) of stripe k of a page h rows high,
+// numbered number, to out. Its data is the last row of the stripe. Returns its
+// size.
+// -----------------------------------------------------------------------------
+static unsigned
+write_end_of_stripe(u8 *out, unsigned number,
+                    const struct jbig2_generic_options &opts, int k, int h) {
+  Segment seg;
+  seg.number = number;
+  seg.type = segment_end_of_stripe;
+  seg.page = opts.page;
+  seg.len = sizeof(u32);
+  seg.write(out);
+  const int end = (k + 1) * opts.stripe_rows < h ? (k + 1) * opts.stripe_rows
+                                                 : h;
+  const u32 last = htonl(end - 1);
+  memcpy(out + seg.size(), &last, sizeof(last));
+  return seg.size() + sizeof(last);
+}
+
+static void
+init_generic_region(struct jbig2_generic_region *genreg,
+                    const struct jbig2_region *region,
+                    const struct jbig2_generic_options &opts) {
+  memset(genreg, 0, sizeof(*genreg));
+  genreg->width = htonl(region->w);
+  genreg->height = htonl(region->h);
+  genreg->x = htonl(region->x);
+  genreg->y = htonl(region->y);
+  if (opts.mmr) {
+    // there's no TPGD or template with MMR
+    genreg->mmr = 1;
+    return;
+  }
+  if (opts.duplicate_line_removal) {
+    genreg->tpgdon = true;
+  }
+  genreg->gbtemplate = opts.gbtemplate;
+  // the AT pixels other than the first are in the default locations for the
+  // template
+  int atx, aty;
+  generic_at(opts, &atx, &aty);
+  genreg->a1x = atx;
+  genreg->a1y = aty;
+  if (opts.gbtemplate == 0) {
+    genreg->a2x = -3;
+    genreg->a2y = -1;
+    genreg->a3x = 2;
+    genreg->a3y = -2;
+    genreg->a4x = -2;
+    genreg->a4y = -2;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Return the number of bytes of a generic region header as written: templates
+// other than 0 only have one AT pixel and MMR doesn't have any.
+// -----------------------------------------------------------------------------
+static int
+generic_region_size(const struct jbig2_generic_region *genreg) {
+  if (genreg->mmr) return sizeof(*genreg) - 8;
+  return genreg->gbtemplate ? sizeof(*genreg) - 6 : sizeof(*genreg);
+}
+
+// -----------------------------------------------------------------------------
+// Timing the phases of a page (see jbig2_phase_times). The threads started by
+// run_jobs add their CPU time to helper_cpu_ns of the thread which started
+// them when they are joined, so that it counts on the clock of that thread.
+// -----------------------------------------------------------------------------
+#ifndef JBIG2_NO_THREADS
+static __thread u64 helper_cpu_ns;
+#else
+static u64 helper_cpu_ns;
+#endif
+
+static u64
+thread_cpu_ns() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  return (u64) clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
 
 // see comments in .h file
-u8 *
-jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xres,
-                     const int yres, const bool duplicate_line_removal,
-                     int *const length) {
-  int segnum = 0;
+uint64_t
+jbig2_wall_ns() {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  return (u64) clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
 
-  if (!bw) return NULL;
-  pixSetPadBits(bw, 0);
+// see comments in .h file
+void
+jbig2_phase_start(const struct jbig2_phase_times *times,
+                  struct jbig2_clock *mark) {
+  if (!times) return;
+  mark->wall_ns = jbig2_wall_ns();
+  mark->cpu_ns = thread_cpu_ns() + helper_cpu_ns;
+}
 
-  struct jbig2_file_header header;
-  if (full_headers) {
-    memset(&header, 0, sizeof(header));
-    header.n_pages = htonl(1);
-    header.organisation_type = 1;
-    memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+// see comments in .h file
+void
+jbig2_phase_done(struct jbig2_phase_times *times, int phase,
+                 struct jbig2_clock *mark) {
+  if (!times) return;
+  const struct jbig2_clock start = *mark;
+  jbig2_phase_start(times, mark);
+  times->wall_ns[phase] += mark->wall_ns - start.wall_ns;
+  times->cpu_ns[phase] += mark->cpu_ns - start.cpu_ns;
+}
+
+// -----------------------------------------------------------------------------
+// Run fn on each of the n items of size itemsize starting at items using up to
+// nthreads threads (including the calling one). Returns once all are done.
+// -----------------------------------------------------------------------------
+struct jbig2_jobs {
+  void (*fn)(void *item);
+  u8 *items;
+  size_t itemsize;
+  int n;
+  int next;  // index of the next item to be taken, updated atomically
+  u64 helper_cpu_ns;  // the CPU time of the threads started, added atomically
+};
+
+static void *
+run_jobs_worker(void *arg) {
+  struct jbig2_jobs *const jobs = (struct jbig2_jobs *) arg;
+  for (;;) {
+    const int i = __sync_fetch_and_add(&jobs->next, 1);
+    if (i >= jobs->n) break;
+    jobs->fn(jobs->items + i * jobs->itemsize);
   }
+  return NULL;
+}
 
-  // setup compression
+#ifndef JBIG2_NO_THREADS
+// A thread started by run_jobs, which counts its CPU time when it is done
+static void *
+run_jobs_thread(void *arg) {
+  struct jbig2_jobs *const jobs = (struct jbig2_jobs *) arg;
+  run_jobs_worker(jobs);
+  __sync_fetch_and_add(&jobs->helper_cpu_ns, thread_cpu_ns());
+  return NULL;
+}
+#endif
+
+static void
+run_jobs(void (*fn)(void *item), void *items, size_t itemsize, int n,
+         int nthreads) {
+  struct jbig2_jobs jobs;
+  jobs.fn = fn;
+  jobs.items = (u8 *) items;
+  jobs.itemsize = itemsize;
+  jobs.n = n;
+  jobs.next = 0;
+  jobs.helper_cpu_ns = 0;
+
+#ifndef JBIG2_NO_THREADS
+  if (nthreads > n) nthreads = n;
+  pthread_t *const threads =
+      nthreads > 1 ? (pthread_t *) malloc((nthreads - 1) * sizeof(pthread_t))
+                   : NULL;
+  int started = 0;
+  for (; started < nthreads - 1; ++started) {
+    // if a thread can't be created the remaining work is done by the others
+    if (pthread_create(&threads[started], NULL, run_jobs_thread, &jobs)) break;
+  }
+  run_jobs_worker(&jobs);
+  for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+  helper_cpu_ns += jobs.helper_cpu_ns;
+#else
+  (void) nthreads;
+  run_jobs_worker(&jobs);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// How the stripes of a page are doing against opts.deadline_ns. The counters
+// are updated atomically, as the stripes may be coded on several threads.
+// -----------------------------------------------------------------------------
+struct jbig2_deadline {
+  u64 deadline_ns;
+  // the first stripe of the page always keeps its coder, as the room for its
+  // headers is reserved before it's coded
+  const struct jbig2_stripe *first;
+  int threads;  // the threads coding the stripes
+  u64 rows_left;  // the rows of the stripes not started yet
+  // the rows coded so far with the arithmetic coder [0] and with MMR [1], and
+  // the time that took
+  u64 rows[2], ns[2];
+  int mmr;  // set once the stripes left are to be coded with MMR
+  // set once a stripe isn't coded because time is running out, or ends after
+  // the deadline
+  int missed;
+};
+
+// What a stripe is coded as: a generic region or, with opts.halftone, the
+// pattern dictionary of the page or a halftone region (see find_halftones)
+enum stripe_kind {
+  stripe_generic = 0,
+  stripe_patterns,
+  stripe_halftone
+};
+
+struct jbig2_halftone;
+
+// -----------------------------------------------------------------------------
+// A horizontal stripe of a page, coded as its own generic region
+// -----------------------------------------------------------------------------
+struct jbig2_stripe {
+  struct jbig2_region region;
+  int kind;
+  const struct jbig2_halftone *halftone;  // for the other kinds
+  int gbtemplate;
+  int atx, aty;  // the first AT pixel (see generic_at)
+  bool mmr;
+  bool duplicate_line_removal;
+  int reserved;  // bytes to leave in front of the output for the headers
+  bool chunked;  // keep the output in chunks (see jbig2_encode_generic_pieces)
+  u32 *band_bytes;  // see jbig2_generic_options
+  int band_rows;
   struct jbig2enc_ctx ctx;
-  jbig2enc_init(&ctx);
+  // If not NULL, a flat context kept by a Jbig2Encoder, which the stripe is
+  // coded into (after a _reset) instead of ctx
+  struct jbig2enc_ctx *cache;
+  struct jbig2_deadline *deadline;  // NULL if there's none
+  const struct jbig2_stripe_store *store;  // see jbig2_generic_options
+  size_t datasize;
+};
+
+// The context which the output of a stripe is in
+static struct jbig2enc_ctx *
+stripe_ctx(struct jbig2_stripe *stripe) {
+  return stripe->cache ? stripe->cache : &stripe->ctx;
+}
+
+// Free the context of a stripe, unless it's kept by a Jbig2Encoder
+static void
+stripe_dealloc(struct jbig2_stripe *stripe) {
+  if (!stripe->cache) jbig2enc_dealloc(&stripe->ctx);
+}
+
+// As init_generic_region for a stripe, which may have been coded with MMR
+// although opts.mmr is false (see opts.deadline_ns)
+static void
+init_stripe_region(struct jbig2_generic_region *genreg,
+                   const struct jbig2_stripe *stripe,
+                   const struct jbig2_generic_options &opts) {
+  struct jbig2_generic_options stripe_opts = opts;
+  stripe_opts.mmr = stripe->mmr;
+  init_generic_region(genreg, &stripe->region, stripe_opts);
+}
+
+// -----------------------------------------------------------------------------
+// Split the nbands bands of *bands (see find_bands) at every multiple of rows,
+// so that none of them crosses the end of a stripe of a striped page. Returns
+// the new number of bands.
+// -----------------------------------------------------------------------------
+static int
+split_bands(int rows, int **bands, int nbands) {
+  const int *const b = *bands;
+  int n = 0;
+  for (int i = 0; i < nbands; ++i) {
+    n += (b[2 * i + 1] - 1) / rows - b[2 * i] / rows + 1;
+  }
+  int *const split = (int *) malloc(n * 2 * sizeof(int));
+  int j = 0;
+  for (int i = 0; i < nbands; ++i) {
+    for (int y0 = b[2 * i]; y0 < b[2 * i + 1]; ++j) {
+      const int end = (y0 / rows + 1) * rows;
+      split[2 * j] = y0;
+      split[2 * j + 1] = end < b[2 * i + 1] ? end : b[2 * i + 1];
+      y0 = split[2 * j + 1];
+    }
+  }
+  free(*bands);
+  *bands = split;
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Split the page into the stripes to code: each band of rows (see find_bands)
+// is split into a share of the nstripes stripes in proportion to its height.
+// Every stripe starts on a whole row; the last one of a band may be shorter
+// than the others. On a striped page, the bands are first split at the end of
+// each stripe of the page, so the stripe of the page of each region is that of
+// its first row. Returns the number of stripes; the caller must free *stripes.
+// -----------------------------------------------------------------------------
+static int
+init_stripes(const struct Pix *bw, const struct jbig2_generic_options &opts,
+             int nstripes, struct jbig2_stripe **stripes) {
+  int *bands;
+  int nbands = find_bands(bw, opts.crop, opts.split_gap, &bands);
+  if (opts.stripe_rows > 0) {
+    nbands = split_bands(opts.stripe_rows, &bands, nbands);
+  }
+  int rows = 0;
+  for (int i = 0; i < nbands; ++i) rows += bands[2 * i + 1] - bands[2 * i];
+  if (nstripes < 1) nstripes = 1;
+
+  // the number of stripes of each band and their height, a pair per band
+  int *const split = (int *) malloc(nbands * 2 * sizeof(int));
+  int n = 0;
+  for (int i = 0; i < nbands; ++i) {
+    const int height = bands[2 * i + 1] - bands[2 * i];
+    int pieces = ((long long) nstripes * height + rows - 1) / rows;
+    if (pieces > height) pieces = height;
+    split[2 * i + 1] = (height + pieces - 1) / pieces;
+    split[2 * i] = (height + split[2 * i + 1] - 1) / split[2 * i + 1];
+    n += split[2 * i];
+  }
+
+  struct jbig2_stripe *const s =
+      (struct jbig2_stripe *) malloc(n * sizeof(struct jbig2_stripe));
+  int j = 0;
+  for (int i = 0; i < nbands; ++i) {
+    for (int k = 0; k < split[2 * i]; ++k, ++j) {
+      const int y0 = bands[2 * i] + k * split[2 * i + 1];
+      const int y1 = y0 + split[2 * i + 1] < bands[2 * i + 1]
+                     ? y0 + split[2 * i + 1] : bands[2 * i + 1];
+      init_region(&s[j].region, bw, y0, y1, opts.crop);
+      s[j].kind = stripe_generic;
+      s[j].halftone = NULL;
+      s[j].gbtemplate = opts.gbtemplate;
+      generic_at(opts, &s[j].atx, &s[j].aty);
+      s[j].mmr = opts.mmr;
+      s[j].duplicate_line_removal = opts.duplicate_line_removal;
+      s[j].reserved = 0;
+      s[j].chunked = false;
+      s[j].band_bytes = opts.band_bytes;
+      s[j].band_rows = opts.band_rows;
+      s[j].cache = NULL;
+      s[j].deadline = NULL;
+      s[j].store = opts.stripe_store;
+    }
+  }
+  free(split);
+  free(bands);
+  *stripes = s;
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Code the region of a stripe with the given (fresh) context and free the copy
+// of it, if any
+// -----------------------------------------------------------------------------
+static void
+code_stripe(struct jbig2enc_ctx *ctx, struct jbig2_stripe *stripe) {
+  const struct jbig2_region *const region = &stripe->region;
+  if (stripe->band_bytes) {
+    jbig2enc_bands(ctx, stripe->band_bytes, stripe->band_rows, region->y);
+  }
+  JBIG2_TRACE2(bitimage__start, region->w, region->h);
+  if (stripe->mmr) {
+    jbig2enc_mmrimage(ctx, (u8 *) region->data, region->w, region->h);
+    JBIG2_TRACE3(bitimage__done, region->w, region->h, jbig2enc_datasize(ctx));
+  } else {
+    jbig2enc_bitimage_at(ctx, (u8 *) region->data, region->w, region->h,
+                         stripe->gbtemplate, stripe->atx, stripe->aty,
+                         stripe->duplicate_line_removal);
+    JBIG2_TRACE3(bitimage__done, region->w, region->h, jbig2enc_datasize(ctx));
+    jbig2enc_final(ctx);
+  }
+  JBIG2_TRACE1(final__done, jbig2enc_datasize(ctx));
+  pixDestroy(&stripe->region.pix);
+}
+
+// Bumped when the data coded for the same stripe changes (see
+// jbig2_stripe_store)
+static const u32 kStripeKeyVersion = 1;
+
+static inline void
+stripe_key_mix(u64 key[2], u32 v) {
+  key[0] = (key[0] ^ v) * 0x9e3779b97f4a7c15ull;
+  key[0] ^= key[0] >> 29;
+  key[1] = (key[1] + v) * 0xc2b2ae3d27d4eb4full;
+  key[1] = (key[1] << 31) | (key[1] >> 33);
+}
+
+// The key of a stripe in a jbig2_stripe_store: the hash of everything its data
+// depends on
+static void
+stripe_key(const struct jbig2_stripe *stripe, u64 key[2]) {
+  const struct jbig2_region *const region = &stripe->region;
+  key[0] = 0x510e527fade682d1ull;
+  key[1] = 0x9b05688c2b3e6c1full;
+  const u32 header[] = {
+    kStripeKeyVersion, (u32) region->w, (u32) region->h,
+    (u32) stripe->gbtemplate, (u32) stripe->atx, (u32) stripe->aty,
+    stripe->mmr, stripe->duplicate_line_removal
+  };
+  for (size_t i = 0; i < sizeof(header) / sizeof(header[0]); ++i) {
+    stripe_key_mix(key, header[i]);
+  }
+  // only the pixels count, not the rest of the words of a cropped row
+  const int words = (region->w + 31) / 32;
+  const u32 last_mask = region->w & 31 ? 0xffffffffu << (32 - (region->w & 31))
+                                       : 0xffffffffu;
+  for (int y = 0; y < region->h; ++y) {
+    const u32 *const row = region->data + y * region->wpl;
+    for (int i = 0; i < words - 1; ++i) stripe_key_mix(key, row[i]);
+    stripe_key_mix(key, row[words - 1] & last_mask);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// As code_stripe, but with stripe->store: the data of the stripe is copied
+// from the store if it has it, and given to it if not
+// -----------------------------------------------------------------------------
+static void
+code_stored_stripe(struct jbig2enc_ctx *ctx, struct jbig2_stripe *stripe) {
+  const struct jbig2_stripe_store *const store = stripe->store;
+  u64 key[2];
+  stripe_key(stripe, key);
+  u8 *data;
+  size_t size;
+  if (store->lookup(store->arg, key, &data, &size)) {
+    jbig2enc_putbytes(ctx, data, size);
+    free(data);
+    pixDestroy(&stripe->region.pix);
+    return;
+  }
+  code_stripe(ctx, stripe);
+  size = jbig2enc_datasize(ctx);
+  data = (u8 *) malloc(size ? size : 1);
+  if (!data) return;
+  jbig2enc_tobuffer(ctx, data);
+  store->store(store->arg, key, data, size);
+  free(data);
+}
+
+// Returns true iff coding rows more rows of the page, at the rate of the ones
+// coded so far with MMR or not (none being known yet if none were), would end
+// after the deadline
+static bool
+projected_late(struct jbig2_deadline *d, int mmr, u64 rows, u64 now) {
+  const u64 done = __sync_fetch_and_add(&d->rows[mmr], 0);
+  const u64 ns = __sync_fetch_and_add(&d->ns[mmr], 0);
+  return done && (double) ns / done * rows / d->threads > d->deadline_ns - now;
+}
+
+// -----------------------------------------------------------------------------
+// Decide how to code a stripe with a deadline, as it starts. Once the rest of
+// the page is projected to end too late with the arithmetic coder, at the
+// rate of the stripes of the page done so far, it's all coded with MMR. (So
+// the first stripes always use the arithmetic coder.) Returns false if the
+// time has run out, or is projected to with MMR, so it isn't worth coding.
+// -----------------------------------------------------------------------------
+static bool
+stripe_in_time(struct jbig2_stripe *stripe, u64 now) {
+  struct jbig2_deadline *const d = stripe->deadline;
+  const u64 rows = __sync_fetch_and_sub(&d->rows_left, stripe->region.h);
+  if (now >= d->deadline_ns || __sync_fetch_and_add(&d->missed, 0) ||
+      projected_late(d, 1, rows, now)) {
+    __sync_fetch_and_or(&d->missed, 1);
+    return false;
+  }
+  if (stripe != d->first && !stripe->mmr &&
+      (__sync_fetch_and_add(&d->mmr, 0) || projected_late(d, 0, rows, now))) {
+    __sync_fetch_and_or(&d->mmr, 1);
+    stripe->mmr = true;
+  }
+  return true;
+}
+
+static void
+encode_stripe(void *arg) {
+  struct jbig2_stripe *const stripe = (struct jbig2_stripe *) arg;
+  const u64 start = stripe->deadline ? jbig2_wall_ns() : 0;
+  if (stripe->deadline && !stripe_in_time(stripe, start)) {
+    // the page fails, so there's nothing to code: only a context to free
+    pixDestroy(&stripe->region.pix);
+    if (!stripe->cache) jbig2enc_init(&stripe->ctx);
+    stripe->datasize = 0;
+    return;
+  }
+  if (stripe->cache) {
+    jbig2enc_reset_flat(stripe->cache, stripe->reserved);
+  } else if (stripe->chunked) {
+    jbig2enc_init(&stripe->ctx);
+  } else {
+    jbig2enc_init_flat(&stripe->ctx, stripe->reserved);
+  }
+  if (stripe->store) {
+    code_stored_stripe(stripe_ctx(stripe), stripe);
+  } else {
+    code_stripe(stripe_ctx(stripe), stripe);
+  }
+  stripe->datasize = jbig2enc_datasize(stripe_ctx(stripe));
+  if (stripe->deadline) {
+    struct jbig2_deadline *const d = stripe->deadline;
+    const u64 end = jbig2_wall_ns();
+    __sync_fetch_and_add(&d->rows[stripe->mmr], (u64) stripe->region.h);
+    __sync_fetch_and_add(&d->ns[stripe->mmr], end - start);
+    // the stripes started before any of them ended weren't projected at all
+    if (end > d->deadline_ns) __sync_fetch_and_or(&d->missed, 1);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Returns true iff size bytes of data fit in a segment. The length of the data
+// is 32 bits, and 0xffffffff means that it isn't known (7.2.7).
+// -----------------------------------------------------------------------------
+static bool
+segment_fits(size_t size) {
+  return size < 0xffffffffu;
+}
+
+// -----------------------------------------------------------------------------
+// Split bw into stripes (see init_stripes) and code them, leaving reserved
+// bytes in front of the output of the first (which is coded into cache, if
+// that isn't NULL). If the data of a stripe is too long for its segment, which
+// takes billions of noisy pixels, it's all done again with twice as many
+// stripes. Returns the number of stripes; the caller must free *stripes. If
+// opts.deadline_ns passes before all the stripes are coded, it returns 0
+// instead, with nothing to free, and sets *opts.missed_deadline.
+// -----------------------------------------------------------------------------
+static int
+code_stripes(const struct Pix *bw, const struct jbig2_generic_options &opts,
+             int reserved, bool chunked, struct jbig2enc_ctx *cache,
+             struct jbig2_stripe **stripes) {
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  struct jbig2_deadline deadline;
+  memset(&deadline, 0, sizeof(deadline));
+  deadline.deadline_ns = opts.deadline_ns;
+  for (int want = opts.nstripes;;) {
+    struct jbig2_stripe *s;
+    const int n = init_stripes(bw, opts, want, &s);
+    deadline.first = s;
+    deadline.threads = opts.nthreads > 1 ? opts.nthreads : 1;
+    if (deadline.threads > n) deadline.threads = n;
+    deadline.rows_left = 0;
+    for (int i = 0; i < n; ++i) deadline.rows_left += s[i].region.h;
+    s[0].reserved = reserved;
+    s[0].cache = cache;
+    for (int i = 0; i < n; ++i) {
+      s[i].chunked = chunked;
+      if (opts.deadline_ns) s[i].deadline = &deadline;
+    }
+    run_jobs(encode_stripe, s, sizeof(struct jbig2_stripe), n, opts.nthreads);
+
+    if (deadline.missed) {
+      for (int j = 0; j < n; ++j) stripe_dealloc(&s[j]);
+      free(s);
+      if (opts.missed_deadline) *opts.missed_deadline = true;
+      jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+      *stripes = NULL;
+      return 0;
+    }
+
+    jbig2_generic_region genreg;
+    init_generic_region(&genreg, &s[0].region, opts);
+    int i = 0;
+    while (i < n &&
+           segment_fits(generic_region_size(&genreg) + s[i].datasize)) {
+      ++i;
+    }
+    if (i == n) {
+      jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+      *stripes = s;
+      return n;
+    }
+    // a single row is never too long, so this ends
+    if (n >= (int) bw->h) abort();
+    for (int j = 0; j < n; ++j) stripe_dealloc(&s[j]);
+    free(s);
+    if (opts.band_bytes) {
+      memset(opts.band_bytes, 0,
+             (bw->h + opts.band_rows - 1) / opts.band_rows * sizeof(u32));
+    }
+    want = n * 2;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_opts, but if cache isn't NULL the first stripe is
+// coded into it (see code_stripes), and the result is left in its buffer
+// -----------------------------------------------------------------------------
+static u8 *
+encode_generic(struct Pix *const bw, const struct jbig2_generic_options &opts,
+               struct jbig2enc_ctx *cache, size_t *const length) {
+  unsigned segnum = opts.segnum ? *opts.segnum : 0;
+  const bool full_headers = opts.full_headers;
+  const bool end_of_page = full_headers || opts.end_of_page;
+
+  if (!bw || !striping_ok(opts)) return NULL;
+  if (opts.remove_specks) jbig2_remove_specks(bw);
+  pixSetPadBits(bw, 0);
+
+  struct jbig2_file_header header;
+  if (full_headers) init_file_header(&header, 1);
 
   Segment seg, seg2, endseg;
   jbig2_page_info pageinfo;
-  memset(&pageinfo, 0, sizeof(pageinfo));
   jbig2_generic_region genreg;
-  memset(&genreg, 0, sizeof(genreg));
 
   seg.number = segnum;
   segnum++;
-  seg.type = segment_page_information;
-  seg.page = 1;
-  seg.len = sizeof(struct jbig2_page_info);
-  pageinfo.width = htonl(bw->w);
-  pageinfo.height = htonl(bw->h);
-  pageinfo.xres = htonl(xres ? xres : bw->xres);
-  pageinfo.yres = htonl(yres ? yres : bw->yres);
-  pageinfo.is_lossless = 1;
-
-#ifdef SURPRISE_MAP
-  dprintf(3, "P5\n%d %d 255\n", bw->w, bw->h);
-#endif
-
-  jbig2enc_bitimage(&ctx, (u8 *) bw->data, bw->w, bw->h, duplicate_line_removal);
-  jbig2enc_final(&ctx);
-  const int datasize = jbig2enc_datasize(&ctx);
+  init_page_info(&seg, &pageinfo, bw->w, bw->h, bw->xres, bw->yres, opts.xres,
+                 opts.yres, opts.page);
+  init_page_striping(&pageinfo, opts);
 
-  seg2.number = segnum;
-  segnum++;
   seg2.type = segment_imm_generic_region;
-  seg2.page = 1;
-  seg2.len = sizeof(genreg) + datasize;
+  seg2.page = opts.page;
 
-  endseg.number = segnum;
-  segnum++;
-  endseg.page = 1;
-
-  genreg.width = htonl(bw->w);
-  genreg.height = htonl(bw->h);
-  if (duplicate_line_removal) {
-    genreg.tpgdon = true;
-  }
-  genreg.a1x = 3;
-  genreg.a1y = -1;
-  genreg.a2x = -3;
-  genreg.a2y = -1;
-  genreg.a3x = 2;
-  genreg.a3y = -2;
-  genreg.a4x = -2;
-  genreg.a4y = -2;
-
-  const int totalsize = seg.size() + sizeof(pageinfo) + seg2.size() +
-                        sizeof(genreg) + datasize +
-                        (full_headers ? (sizeof(header) + 2*endseg.size()) : 0);
-  u8 *const ret = (u8 *) malloc(totalsize);
-  int offset = 0;
+  // The output of the first stripe is written after all the headers in front
+  // of it, and the rest of the file is appended to it, so that the bulk of the
+  // data is never copied. (The headers are the same size for every stripe.)
+  struct jbig2_region region;
+  memset(&region, 0, sizeof(region));
+  init_generic_region(&genreg, &region, opts);
+  // On a striped page, the stripes above the first region end in front of it.
+  const int reserved = seg.size() + sizeof(pageinfo) + seg2.size() +
+                       generic_region_size(&genreg) +
+                       (full_headers ? sizeof(header) : 0) +
+                       stripe_of(opts, first_band_row(bw, opts)) *
+                           end_of_stripe_size(opts);
+
+  // setup compression
+  struct jbig2_stripe *stripes;
+  const int nstripes =
+      code_stripes(bw, opts, reserved, false, cache, &stripes);
+  if (!nstripes) return NULL;
+  const int npage_stripes = page_stripes(opts, bw->h);
+
+  endseg.number = segnum + nstripes + npage_stripes;
+  endseg.page = opts.page;
+
+  size_t totalsize = stripes[0].reserved + stripes[0].datasize +
+                     npage_stripes * end_of_stripe_size(opts) +
+                     (full_headers ? 2*endseg.size() :
+                      end_of_page ? endseg.size() : 0);
+  for (int i = 1; i < nstripes; ++i) {
+    init_stripe_region(&genreg, &stripes[i], opts);
+    totalsize += seg2.size() + generic_region_size(&genreg) +
+                 stripes[i].datasize;
+  }
+  if (opts.stats) {
+    for (int i = 0; i < nstripes; ++i) {
+      jbig2enc_addstats(stripe_ctx(&stripes[i]), opts.stats);
+    }
+  }
+  const size_t extra = totalsize - stripes[0].reserved - stripes[0].datasize;
+  u8 *const ret = cache ? jbig2enc_flatbuffer(cache, extra)
+                        : jbig2enc_takebuffer(&stripes[0].ctx, extra);
+  size_t offset = 0;
 
 #define F(x) memcpy(ret + offset, &x, sizeof(x)) ; offset += sizeof(x)
   if (full_headers) {
@@ -132,24 +932,2881 @@ jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xr
   }
   SEGMENT(seg);
   F(pageinfo);
-  SEGMENT(seg2);
-  F(genreg);
-  jbig2enc_tobuffer(&ctx, ret + offset);
-  offset += datasize;
+  int k = 0;  // the next stripe of the page to end
+  for (int i = 0; i < nstripes; ++i) {
+    while (k < stripe_of(opts, stripes[i].region.y)) {
+      offset += write_end_of_stripe(ret + offset, segnum++, opts, k++, bw->h);
+    }
+    seg2.number = segnum;
+    segnum++;
+    init_stripe_region(&genreg, &stripes[i], opts);
+    seg2.len = generic_region_size(&genreg) + stripes[i].datasize;
+    SEGMENT(seg2);
+    GENREG(genreg);
+    if (i > 0) jbig2enc_tobuffer(&stripes[i].ctx, ret + offset);
+    offset += stripes[i].datasize;
+    stripe_dealloc(&stripes[i]);
+  }
+  while (k < npage_stripes) {
+    offset += write_end_of_stripe(ret + offset, segnum++, opts, k++, bw->h);
+  }
 
-  if (full_headers) {
+  if (end_of_page) {
     endseg.type = segment_end_of_page;
     SEGMENT(endseg);
+    segnum++;
+  }
+  if (full_headers) {
     endseg.number += 1;
     endseg.type = segment_end_of_file;
     SEGMENT(endseg);
   }
+  if (opts.segnum) *opts.segnum = segnum;
 
   if (totalsize != offset) abort();
 
-  jbig2enc_dealloc(&ctx);
+  free(stripes);
 
   *length = offset;
 
   return ret;
 }
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_opts(struct Pix *const bw,
+                          const struct jbig2_generic_options &opts,
+                          size_t *const length) {
+  return encode_generic(bw, opts, NULL, length);
+}
+
+// see comments in .h file
+Jbig2Encoder::Jbig2Encoder() : ctx_(NULL), data_(NULL), size_(0) {}
+
+Jbig2Encoder::~Jbig2Encoder() {
+  reset();
+}
+
+// see comments in .h file
+bool
+Jbig2Encoder::encode(struct Pix *const bw,
+                     const struct jbig2_generic_options &opts) {
+  data_ = NULL;
+  size_ = 0;
+  if (!bw || !striping_ok(opts)) return false;
+  if (!ctx_) {
+    ctx_ = (struct jbig2enc_ctx *) malloc(sizeof(struct jbig2enc_ctx));
+    jbig2enc_init_flat(ctx_, 0);
+  }
+  data_ = encode_generic(bw, opts, ctx_, &size_);
+  return data_ != NULL;
+}
+
+// see comments in .h file
+void
+Jbig2Encoder::take(Jbig2Buffer *const out) {
+  uint8_t *const data = data_ ? jbig2enc_takebuffer(ctx_, 0) : NULL;
+  Jbig2Buffer taken(data, size_);
+  out->swap(taken);
+  data_ = NULL;
+  size_ = 0;
+}
+
+// see comments in .h file
+void
+Jbig2Encoder::reset() {
+  if (ctx_) {
+    jbig2enc_dealloc(ctx_);
+    free(ctx_);
+  }
+  ctx_ = NULL;
+  data_ = NULL;
+  size_ = 0;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xres,
+                     const int yres, const bool duplicate_line_removal,
+                     size_t *const length) {
+  struct jbig2_generic_options opts;
+  opts.full_headers = full_headers;
+  opts.xres = xres;
+  opts.yres = yres;
+  opts.duplicate_line_removal = duplicate_line_removal;
+  return jbig2_encode_generic_opts(bw, opts, length);
+}
+
+// -----------------------------------------------------------------------------
+// Whether jbig2_threshold scales a gray image by upsample: up by 2 or 4, or
+// down by -2 to -8
+// -----------------------------------------------------------------------------
+static bool
+scales_gray(int upsample) {
+  return upsample == 2 || upsample == 4 || (upsample <= -2 && upsample >= -8);
+}
+
+// see comments in .h file
+int
+jbig2_scaled_size(int size, int upsample) {
+  if (!scales_gray(upsample)) return size;
+  return upsample < 0 ? (size - upsample - 1) / -upsample : size * upsample;
+}
+
+// -----------------------------------------------------------------------------
+// A range of source rows of a page being scaled up and thresholded
+// -----------------------------------------------------------------------------
+struct jbig2_upsample_band {
+  PIX *gray;
+  PIX *bw;
+  int upsample;
+  int bw_threshold;
+  int first, last;
+};
+
+static void
+upsample_band(void *item) {
+  struct jbig2_upsample_band *const band = (struct jbig2_upsample_band *) item;
+  PIX *const gray = band->gray;
+  if (band->upsample == 2) {
+    scaleGray2xLIThreshLow(band->bw->data, band->bw->wpl, gray->data, gray->w,
+                           gray->h, gray->wpl, band->bw_threshold, band->first,
+                           band->last);
+  } else {
+    scaleGray4xLIThreshLow(band->bw->data, band->bw->wpl, gray->data, gray->w,
+                           gray->h, gray->wpl, band->bw_threshold, band->first,
+                           band->last);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// As pixScaleGray2xLIThresh or pixScaleGray4xLIThresh, but with the source rows
+// split into nthreads bands which are done in parallel. Each source row only
+// makes its own destination rows, so the output is the same.
+// -----------------------------------------------------------------------------
+static PIX *
+upsample_threshold(PIX *const gray, int bw_threshold, int upsample,
+                   int nthreads) {
+  if (nthreads > (int) gray->h) nthreads = gray->h;
+  if (nthreads <= 1 || gray->d != 8 || bw_threshold < 0 ||
+      bw_threshold > 256) {
+    // the leptonica functions do (and report) the checks
+    return upsample == 2 ? pixScaleGray2xLIThresh(gray, bw_threshold)
+                         : pixScaleGray4xLIThresh(gray, bw_threshold);
+  }
+
+  PIX *const bw = pixCreate(upsample * gray->w, upsample * gray->h, 1);
+  if (!bw) return NULL;
+  pixCopyResolution(bw, gray);
+  pixScaleResolution(bw, upsample, upsample);
+
+  struct jbig2_upsample_band *const bands = (struct jbig2_upsample_band *)
+      malloc(nthreads * sizeof(struct jbig2_upsample_band));
+  for (int i = 0; i < nthreads; ++i) {
+    bands[i].gray = gray;
+    bands[i].bw = bw;
+    bands[i].upsample = upsample;
+    bands[i].bw_threshold = bw_threshold;
+    bands[i].first = (long long) gray->h * i / nthreads;
+    bands[i].last = (long long) gray->h * (i + 1) / nthreads;
+  }
+  run_jobs(upsample_band, bands, sizeof(struct jbig2_upsample_band), nthreads,
+           nthreads);
+  free(bands);
+  return bw;
+}
+
+// see comments in .h file
+struct Pix *
+jbig2_threshold(struct Pix *const source, int bw_threshold, int upsample,
+                int nthreads) {
+  return jbig2_threshold_timed(source, bw_threshold, upsample, nthreads, NULL);
+}
+
+// -----------------------------------------------------------------------------
+// jbig2_threshold_timed, and jbig2_threshold_in_place if *psource is to be
+// destroyed: it is, as soon as everything made from it holds its own reference,
+// so that a gray image that nothing else refers to can be thresholded in place
+// -----------------------------------------------------------------------------
+static PIX *
+threshold(PIX **const psource, bool destroy, int bw_threshold, int upsample,
+          int nthreads, struct jbig2_phase_times *times) {
+  PIX *const source = *psource;
+  if (!source) return NULL;
+  struct jbig2_clock mark;
+  jbig2_phase_start(times, &mark);
+  JBIG2_TRACE3(colormap__start, source->w, source->h, source->d);
+  if (source->colormap && !scales_gray(upsample)) {
+    // without scaling, map the palette straight to binary
+    PIX *const bw = pixConvertCmapToBinary(source, bw_threshold);
+    if (destroy) pixDestroy(psource);
+    jbig2_phase_done(times, JBIG2_PHASE_COLORMAP, &mark);
+    if (bw) JBIG2_TRACE3(colormap__done, bw->w, bw->h, bw->d);
+    return bw;
+  }
+  PIX *pixl = pixRemoveColormap(source, REMOVE_CMAP_BASED_ON_SRC);
+  if (destroy) pixDestroy(psource);
+  jbig2_phase_done(times, JBIG2_PHASE_COLORMAP, &mark);
+  if (!pixl) return NULL;
+  JBIG2_TRACE3(colormap__done, pixl->w, pixl->h, pixl->d);
+  if (pixl->d == 1) return pixl;
+
+  PIX *gray, *bw;
+  if (pixl->d > 8 && !scales_gray(upsample)) {
+    // without scaling, go straight from RGB to binary
+    bw = pixConvertRGBToBinaryFast(pixl, bw_threshold);
+    pixDestroy(&pixl);
+    jbig2_phase_done(times, JBIG2_PHASE_GRAY, &mark);
+    return bw;
+  }
+  if (pixl->d > 8) {
+    gray = pixConvertRGBToGrayFast(pixl);
+  } else {
+    gray = pixClone(pixl);
+  }
+  pixDestroy(&pixl);
+  jbig2_phase_done(times, JBIG2_PHASE_GRAY, &mark);
+  if (!gray) return NULL;
+  JBIG2_TRACE2(threshold__start, gray->w, gray->h);
+  if (upsample == 2 || upsample == 4) {
+    bw = upsample_threshold(gray, bw_threshold, upsample, nthreads);
+  } else if (scales_gray(upsample)) {
+    bw = pixScaleGrayAreaThresh(gray, -upsample, bw_threshold);
+  } else if (gray->refcount == 1 && !gray->colormap &&
+             pixThresholdToBinaryInPlace(gray, bw_threshold) == 0) {
+    // the page is made bi-level in its own buffer
+    jbig2_phase_done(times, JBIG2_PHASE_THRESHOLD, &mark);
+    JBIG2_TRACE2(threshold__done, gray->w, gray->h);
+    return gray;
+  } else {
+    bw = pixThresholdToBinary(gray, bw_threshold);
+  }
+  pixDestroy(&gray);
+  jbig2_phase_done(times, JBIG2_PHASE_THRESHOLD, &mark);
+  if (bw) JBIG2_TRACE2(threshold__done, bw->w, bw->h);
+  return bw;
+}
+
+// see comments in .h file
+PIX *
+jbig2_threshold_timed(struct Pix *const source, int bw_threshold,
+                      int upsample, int nthreads,
+                      struct jbig2_phase_times *times) {
+  PIX *pix = source;
+  return threshold(&pix, false, bw_threshold, upsample, nthreads, times);
+}
+
+// see comments in .h file
+PIX *
+jbig2_threshold_in_place(struct Pix **const source, int bw_threshold,
+                         int upsample, int nthreads,
+                         struct jbig2_phase_times *times) {
+  return threshold(source, true, bw_threshold, upsample, nthreads, times);
+}
+
+// -----------------------------------------------------------------------------
+// One row of jbig2_remove_specks: out is row with its isolated pixels removed,
+// above and below being the rows around it (NULL outside the page). The pad
+// bits of the rows must be zero, and are left zero in out. Bit 31 of a word is
+// its leftmost pixel, so the neighbours to the left of the pixels of a word
+// are the word shifted right a bit, with the last pixel of the word before
+// shifted in, and those to the right the word shifted left.
+// -----------------------------------------------------------------------------
+static void
+remove_specks_row(u32 *out, const u32 *above, const u32 *row,
+                  const u32 *below, int wpl) {
+  u32 a = above ? above[0] : 0, b = below ? below[0] : 0, c = row[0];
+  u32 pa = 0, pb = 0, pc = 0;
+  for (int i = 0; i < wpl; ++i) {
+    const bool last = i == wpl - 1;
+    const u32 na = above && !last ? above[i + 1] : 0;
+    const u32 nb = below && !last ? below[i + 1] : 0;
+    const u32 nc = !last ? row[i + 1] : 0;
+    const u32 al = a >> 1 | pa << 31, ar = a << 1 | na >> 31;
+    const u32 bl = b >> 1 | pb << 31, br = b << 1 | nb >> 31;
+    const u32 cl = c >> 1 | pc << 31, cr = c << 1 | nc >> 31;
+    const u32 any = a | al | ar | b | bl | br | cl | cr;
+    const u32 all = a & al & ar & b & bl & br & cl & cr;
+    // a pad pixel has a white one above it (or none), so stays white
+    out[i] = (c & any) | (~c & all);
+    pa = a, pb = b, pc = c;
+    a = na, b = nb, c = nc;
+  }
+}
+
+// see comments in .h file
+void
+jbig2_remove_specks(struct Pix *const bw) {
+  if (!bw || bw->d != 1 || !bw->h) return;
+  pixSetPadBits(bw, 0);
+  const int wpl = bw->wpl;
+  // the row above as it was, since it has been changed by now
+  u32 *const prev = (u32 *) malloc(2 * wpl * sizeof(u32));
+  u32 *const out = prev + wpl;
+  for (int y = 0; y < (int) bw->h; ++y) {
+    u32 *const row = bw->data + y * wpl;
+    remove_specks_row(out, y ? prev : NULL, row,
+                      y + 1 < (int) bw->h ? row + wpl : NULL, wpl);
+    memcpy(prev, row, wpl * sizeof(u32));
+    memcpy(row, out, wpl * sizeof(u32));
+  }
+  free(prev);
+}
+
+// -----------------------------------------------------------------------------
+// A range of source rows of a page being scaled up and thresholded at several
+// thresholds
+// -----------------------------------------------------------------------------
+struct jbig2_upsample_several_band {
+  PIX *gray;
+  PIX **bws;
+  const int *thresholds;
+  int n;
+  int upsample;
+  int first, last;
+  bool failed;  // if memory ran out
+};
+
+static void
+upsample_several_band(void *item) {
+  struct jbig2_upsample_several_band *const band =
+      (struct jbig2_upsample_several_band *) item;
+  PIX *const gray = band->gray;
+  const int upsample = band->upsample;
+  // the destination rows made from each source row, in each image
+  l_uint32 **const lineds =
+      (l_uint32 **) malloc(band->n * sizeof(l_uint32 *));
+  if (!lineds) {
+    band->failed = true;
+    return;
+  }
+  for (int i = band->first; i < band->last; ++i) {
+    for (int k = 0; k < band->n; ++k) {
+      PIX *const bw = band->bws[k];
+      lineds[k] = bw->data + upsample * i * bw->wpl;
+    }
+    l_uint32 *const lines = gray->data + i * gray->wpl;
+    if (upsample == 2) {
+      scaleGray2xLIMultiThreshLineLow(lineds, band->bws[0]->wpl, lines,
+                                      gray->w, gray->wpl,
+                                      i == (int) gray->h - 1,
+                                      band->thresholds, band->n);
+    } else {
+      scaleGray4xLIMultiThreshLineLow(lineds, band->bws[0]->wpl, lines,
+                                      gray->w, gray->wpl,
+                                      i == (int) gray->h - 1,
+                                      band->thresholds, band->n);
+    }
+  }
+  free(lineds);
+}
+
+// -----------------------------------------------------------------------------
+// As upsample_threshold at each of the n thresholds, into bws, but
+// interpolating each row of gray just once. Returns false on failure.
+// -----------------------------------------------------------------------------
+static bool
+upsample_threshold_several(PIX *const gray, const int *thresholds, int n,
+                           int upsample, int nthreads, PIX **bws) {
+  bool checked = gray->d == 8;
+  for (int k = 0; checked && k < n; ++k) {
+    checked = thresholds[k] >= 0 && thresholds[k] <= 256;
+  }
+  if (!checked) {
+    // the leptonica functions do (and report) the checks
+    for (int k = 0; k < n; ++k) {
+      bws[k] = upsample_threshold(gray, thresholds[k], upsample, nthreads);
+      if (!bws[k]) return false;
+    }
+    return true;
+  }
+
+  for (int k = 0; k < n; ++k) {
+    bws[k] = pixCreate(upsample * gray->w, upsample * gray->h, 1);
+    if (!bws[k]) return false;
+    pixCopyResolution(bws[k], gray);
+    pixScaleResolution(bws[k], upsample, upsample);
+  }
+  if (nthreads > (int) gray->h) nthreads = gray->h;
+  if (nthreads < 1) nthreads = 1;
+  struct jbig2_upsample_several_band *const bands =
+      (struct jbig2_upsample_several_band *) malloc(
+          nthreads * sizeof(struct jbig2_upsample_several_band));
+  for (int i = 0; i < nthreads; ++i) {
+    bands[i].gray = gray;
+    bands[i].bws = bws;
+    bands[i].thresholds = thresholds;
+    bands[i].n = n;
+    bands[i].upsample = upsample;
+    bands[i].first = (long long) gray->h * i / nthreads;
+    bands[i].last = (long long) gray->h * (i + 1) / nthreads;
+    bands[i].failed = false;
+  }
+  run_jobs(upsample_several_band, bands,
+           sizeof(struct jbig2_upsample_several_band), nthreads, nthreads);
+  bool ok = true;
+  for (int i = 0; i < nthreads; ++i) ok = ok && !bands[i].failed;
+  free(bands);
+  return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Threshold source as jbig2_threshold does at each of the n thresholds, into
+// bws, but converting it to gray just once (see upsample_threshold_several
+// for scaling it up). Returns false on failure, leaving the images made so
+// far in bws for the caller to destroy.
+// -----------------------------------------------------------------------------
+static bool
+threshold_several(PIX *const source, const int *thresholds, int n,
+                  int upsample, int nthreads, struct jbig2_phase_times *times,
+                  PIX **bws) {
+  // a palette is mapped straight to binary at each threshold, and a depth
+  // that can't be made gray is left to report its error
+  if (n == 1 || (source->colormap && !scales_gray(upsample)) ||
+      (source->d > 8 && source->d != 32)) {
+    for (int k = 0; k < n; ++k) {
+      bws[k] = jbig2_threshold_timed(source, thresholds[k], upsample,
+                                     nthreads, times);
+      if (!bws[k]) return false;
+    }
+    return true;
+  }
+
+  struct jbig2_clock mark;
+  jbig2_phase_start(times, &mark);
+  PIX *pixl = pixRemoveColormap(source, REMOVE_CMAP_BASED_ON_SRC);
+  jbig2_phase_done(times, JBIG2_PHASE_COLORMAP, &mark);
+  if (!pixl) return false;
+  if (pixl->d == 1) {
+    for (int k = 0; k < n; ++k) bws[k] = pixClone(pixl);
+    pixDestroy(&pixl);
+    return true;
+  }
+  // RGB is thresholded by its green, which is also its fast gray
+  PIX *gray = pixl->d > 8 ? pixConvertRGBToGrayFast(pixl) : pixClone(pixl);
+  pixDestroy(&pixl);
+  jbig2_phase_done(times, JBIG2_PHASE_GRAY, &mark);
+  if (!gray) return false;
+  bool ok = true;
+  if (upsample == 2 || upsample == 4) {
+    ok = upsample_threshold_several(gray, thresholds, n, upsample, nthreads,
+                                    bws);
+  } else {
+    for (int k = 0; ok && k < n; ++k) {
+      bws[k] = scales_gray(upsample)
+                   ? pixScaleGrayAreaThresh(gray, -upsample, thresholds[k])
+                   : pixThresholdToBinary(gray, thresholds[k]);
+      ok = bws[k] != NULL;
+    }
+  }
+  pixDestroy(&gray);
+  jbig2_phase_done(times, JBIG2_PHASE_THRESHOLD, &mark);
+  return ok;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_mem(const u8 *data, size_t size, int bw_threshold,
+                         int upsample,
+                         const struct jbig2_generic_options &opts,
+                         size_t *const length) {
+  // a page which is coded as a single region is read a row at a time, unless
+  // there are threads to scale it up in parallel. If that fails, the whole
+  // image is read again below, to report the error.
+  if (!opts.crop && opts.split_gap <= 0 && !opts.mmr && opts.nstripes <= 1 &&
+      ((upsample != 2 && upsample != 4) || opts.nthreads <= 1)) {
+    L_ROWREADER *rr = rowReaderCreateMem(data, size);
+    if (rr) {
+      u8 *const ret = jbig2_encode_generic_rows(rr, bw_threshold, upsample,
+                                                opts, length);
+      rowReaderDestroy(&rr);
+      if (ret) return ret;
+    }
+  }
+
+  // without scaling, 8 bpp gray PNG is thresholded as it is decoded
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  PIX *source = scales_gray(upsample)
+                    ? pixReadMem(data, size)
+                    : pixReadMemThresh(data, size, bw_threshold);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_READ, &mark);
+  if (!source) return NULL;
+  PIX *bw = jbig2_threshold_in_place(&source, bw_threshold, upsample,
+                                     opts.nthreads, opts.times);
+  if (!bw) return NULL;
+  u8 *const ret = jbig2_encode_generic_opts(bw, opts, length);
+  pixDestroy(&bw);
+  return ret;
+}
+
+// see comments in .h file
+bool
+jbig2_encode_generic_sink(struct Pix *const bw,
+                          const struct jbig2_generic_options &opts,
+                          void (*sink)(void *sink_arg, const u8 *data,
+                                       size_t size),
+                          void *sink_arg) {
+  unsigned segnum = opts.segnum ? *opts.segnum : 0;
+  const bool full_headers = opts.full_headers;
+  const bool end_of_page = full_headers || opts.end_of_page;
+  if (!bw || !striping_ok(opts)) return false;
+  if (opts.remove_specks) jbig2_remove_specks(bw);
+  pixSetPadBits(bw, 0);
+
+  struct jbig2_stripe *stripes;
+  const int nregions = init_stripes(bw, opts, 1, &stripes);
+  const int npage_stripes = page_stripes(opts, bw->h);
+
+  struct jbig2_file_header header;
+  Segment seg, seg2, endseg;
+  jbig2_page_info pageinfo;
+  jbig2_generic_region genreg;
+
+  if (full_headers) init_file_header(&header, 1);
+  seg.number = segnum++;
+  init_page_info(&seg, &pageinfo, bw->w, bw->h, bw->xres, bw->yres, opts.xres,
+                 opts.yres, opts.page);
+  init_page_striping(&pageinfo, opts);
+  // the length isn't known until the region is encoded, so use the unknown
+  // length form (7.2.7): the decoder finds the end of the data by the 0xffac
+  // marker which ends the arithmetic coded data (or the 0x0000 after the MMR
+  // data) and the row count after it.
+  seg2.type = segment_imm_generic_region;
+  seg2.page = opts.page;
+  seg2.len = 0xffffffff;
+  endseg.number = segnum + nregions + npage_stripes;
+  endseg.page = opts.page;
+
+  // (each end of stripe segment is passed to sink before the next is written)
+  u8 ret[sizeof(header) + 2 * (sizeof(struct jbig2_segment) + 4 + 4) +
+         sizeof(pageinfo) + sizeof(genreg) + 2];
+  int offset = 0;
+  if (full_headers) {
+    F(header);
+  }
+  SEGMENT(seg);
+  F(pageinfo);
+
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init_sink(&ctx, sink, sink_arg);
+  int k = 0;  // the next stripe of the page to end
+  for (int i = 0; i < nregions; ++i) {
+    while (k < stripe_of(opts, stripes[i].region.y)) {
+      sink(sink_arg, ret, offset);
+      offset = write_end_of_stripe(ret, segnum++, opts, k++, bw->h);
+    }
+    seg2.number = segnum++;
+    init_generic_region(&genreg, &stripes[i].region, opts);
+    SEGMENT(seg2);
+    GENREG(genreg);
+    sink(sink_arg, ret, offset);
+
+    if (i > 0) jbig2enc_reset(&ctx);
+    struct jbig2_clock mark;
+    jbig2_phase_start(opts.times, &mark);
+    code_stripe(&ctx, &stripes[i]);
+    jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+    if (opts.stats) jbig2enc_addstats(&ctx, opts.stats);
+
+    offset = 0;
+    if (opts.mmr) {
+      const u16 end_marker = 0;
+      F(end_marker);
+    }
+    const u32 rows = htonl(stripes[i].region.h);
+    F(rows);
+  }
+  jbig2enc_dealloc(&ctx);
+  free(stripes);
+  while (k < npage_stripes) {
+    sink(sink_arg, ret, offset);
+    offset = write_end_of_stripe(ret, segnum++, opts, k++, bw->h);
+  }
+
+  if (end_of_page) {
+    endseg.type = segment_end_of_page;
+    SEGMENT(endseg);
+    segnum++;
+  }
+  if (full_headers) {
+    endseg.number += 1;
+    endseg.type = segment_end_of_file;
+    SEGMENT(endseg);
+  }
+  if (opts.segnum) *opts.segnum = segnum;
+  sink(sink_arg, ret, offset);
+
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// The factor by which the image of rr is scaled by jbig2_threshold (see
+// scales_gray), or 1: a bi-level image never is.
+// -----------------------------------------------------------------------------
+static int
+rows_scale(const L_ROWREADER *rr, int upsample) {
+  return !rr->binary && scales_gray(upsample) ? upsample : 1;
+}
+
+// The resolution of an image scaled by a factor of jbig2_threshold, rounded as
+// pixScaleResolution does
+static int
+scaled_res(int res, int upsample) {
+  return upsample < 0 ? (2 * res - upsample) / (-2 * upsample)
+                      : res * upsample;
+}
+
+// -----------------------------------------------------------------------------
+// The coder of the rows of a page for code_rows. On a striped page, each
+// stripe is coded as a region of its own: after its last row the coder is
+// flushed and end_stripe is called with the row after the stripe, and the
+// coder is then reset for the next stripe.
+// -----------------------------------------------------------------------------
+struct jbig2_rows_coder {
+  struct jbig2enc_ctx *ctx;
+  struct jbig2enc_rows rows;
+  const struct jbig2_generic_options *opts;
+  int w, h;
+  int y;  // the rows coded so far
+  void (*end_stripe)(void *arg, struct jbig2enc_ctx *ctx, int y);
+  void *arg;
+};
+
+// Start the region from row coder->y: the rest of the page, or of its stripe
+static void
+rows_coder_start(struct jbig2_rows_coder *coder) {
+  const struct jbig2_generic_options &opts = *coder->opts;
+  const int left = coder->h - coder->y;
+  int atx, aty;
+  generic_at(opts, &atx, &aty);
+  jbig2enc_rows_init_at(&coder->rows, coder->w,
+                        opts.stripe_rows && left > opts.stripe_rows
+                            ? opts.stripe_rows : left,
+                        opts.gbtemplate, atx, aty,
+                        opts.duplicate_line_removal);
+  if (opts.band_bytes) {
+    jbig2enc_bands(coder->ctx, opts.band_bytes, opts.band_rows, coder->y);
+  }
+}
+
+static void
+rows_coder_code(struct jbig2_rows_coder *coder, const u32 *row) {
+  jbig2enc_rows_code(coder->ctx, &coder->rows, (const u8 *) row);
+  const int stripe_rows = coder->opts->stripe_rows;
+  if (++coder->y % (stripe_rows ? stripe_rows : coder->h) ||
+      coder->y == coder->h) {
+    return;
+  }
+  jbig2enc_final(coder->ctx);
+  jbig2enc_rows_free(&coder->rows);
+  coder->end_stripe(coder->arg, coder->ctx, coder->y);
+  jbig2enc_reset(coder->ctx);
+  rows_coder_start(coder);
+}
+
+// -----------------------------------------------------------------------------
+// The rows of a page on their way from code_rows to the coder which, with
+// opts.remove_specks, go through jbig2_remove_specks a row at a time: a row is
+// coded once the row below it has come, and the last when the filter is
+// finished.
+// -----------------------------------------------------------------------------
+struct jbig2_speck_filter {
+  struct jbig2_rows_coder *coder;
+  int wpl;
+  u32 pad_mask;  // of the last word of a row
+  int n;  // the rows come so far
+  u32 *ring;  // NULL to pass the rows straight on, or the last three of them
+  u32 *out;
+};
+
+static void
+speck_filter_init(struct jbig2_speck_filter *f,
+                  struct jbig2_rows_coder *coder) {
+  f->coder = coder;
+  f->wpl = (coder->w + 31) / 32;
+  f->pad_mask = coder->w & 31 ? 0xffffffffu << (32 - (coder->w & 31))
+                              : 0xffffffffu;
+  f->n = 0;
+  f->ring = coder->opts->remove_specks
+                ? (u32 *) malloc(4 * f->wpl * sizeof(u32)) : NULL;
+  f->out = f->ring ? f->ring + 3 * f->wpl : NULL;
+}
+
+// Code row y - 1 of the rows come so far, below being the row under it
+static void
+speck_filter_emit(struct jbig2_speck_filter *f, const u32 *below) {
+  const int y = f->n - 1;
+  remove_specks_row(f->out, y ? f->ring + ((y - 1) % 3) * f->wpl : NULL,
+                    f->ring + (y % 3) * f->wpl, below, f->wpl);
+  rows_coder_code(f->coder, f->out);
+}
+
+static void
+speck_filter_code(struct jbig2_speck_filter *f, const u32 *row) {
+  if (!f->ring) {
+    rows_coder_code(f->coder, row);
+    return;
+  }
+  u32 *const slot = f->ring + (f->n % 3) * f->wpl;
+  memcpy(slot, row, f->wpl * sizeof(u32));
+  slot[f->wpl - 1] &= f->pad_mask;
+  if (f->n) speck_filter_emit(f, slot);
+  ++f->n;
+}
+
+// Code the last row, unless the page is given up (flush false)
+static void
+speck_filter_finish(struct jbig2_speck_filter *f, bool flush) {
+  if (flush && f->ring && f->n) speck_filter_emit(f, NULL);
+  free(f->ring);
+}
+
+// -----------------------------------------------------------------------------
+// Read the image of rr a row at a time, make it bi-level as jbig2_threshold
+// does, and code it with ctx as a single generic region of the whole page, or
+// with opts.stripe_rows as one for each stripe, calling end_stripe with arg
+// between them (see jbig2_rows_coder). Only the rows being scaled up or down
+// and the three rows which the coder looks at (and with opts.remove_specks,
+// three more) are held in memory. Returns false on a read error.
+// -----------------------------------------------------------------------------
+static bool
+code_rows(struct jbig2enc_ctx *ctx, L_ROWREADER *rr, int bw_threshold,
+          int upsample, const struct jbig2_generic_options &opts,
+          void (*end_stripe)(void *arg, struct jbig2enc_ctx *ctx, int y),
+          void *arg) {
+  const int scale = rows_scale(rr, upsample);
+  const int w = jbig2_scaled_size(rr->w, scale);
+  const int h = jbig2_scaled_size(rr->h, scale);
+  const int wpl = (w + 31) / 32;
+  u32 *const bw = (u32 *) malloc((scale > 1 ? scale : 1) * wpl * sizeof(u32));
+  bool ok = true;
+
+  struct jbig2_rows_coder coder;
+  coder.ctx = ctx;
+  coder.opts = &opts;
+  coder.w = w;
+  coder.h = h;
+  coder.y = 0;
+  coder.end_stripe = end_stripe;
+  coder.arg = arg;
+  rows_coder_start(&coder);
+  struct jbig2_speck_filter specks;
+  speck_filter_init(&specks, &coder);
+  // the phases take turns on each row
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  if (scale == 1) {
+    for (int y = 0; ok && y < h; ++y) {
+      ok = !rowReaderReadBinary(rr, bw, bw_threshold);
+      jbig2_phase_done(opts.times, JBIG2_PHASE_READ, &mark);
+      if (ok) speck_filter_code(&specks, bw);
+      jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+    }
+  } else if (scale < 0) {
+    // the source rows of each destination row are read one after the other,
+    // as they would be in the gray image
+    const int factor = -scale;
+    const int wpls = (rr->w + 3) / 4;
+    u32 *const gray = (u32 *) malloc(factor * wpls * sizeof(u32));
+    for (int y = 0; ok && y < h; ++y) {
+      const int nrows = rr->h - y * factor < factor ? rr->h - y * factor
+                                                    : factor;
+      for (int k = 0; ok && k < nrows; ++k) {
+        ok = !rowReaderReadGray(rr, gray + k * wpls);
+      }
+      jbig2_phase_done(opts.times, JBIG2_PHASE_READ, &mark);
+      if (!ok) break;
+      scaleGrayAreaThreshLineLow(bw, w, gray, rr->w, wpls, nrows, factor,
+                                 bw_threshold);
+      jbig2_phase_done(opts.times, JBIG2_PHASE_THRESHOLD, &mark);
+      speck_filter_code(&specks, bw);
+      jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+    }
+    free(gray);
+  } else {
+    // each source row is scaled up together with the one below it, so the
+    // two are kept one after the other, as they would be in the gray image
+    const int wpls = (rr->w + 3) / 4;
+    u32 *const gray = (u32 *) malloc(2 * wpls * sizeof(u32));
+    ok = !rowReaderReadGray(rr, gray);
+    for (int i = 0; ok && i < rr->h; ++i) {
+      const int last = i == rr->h - 1;
+      if (!last && rowReaderReadGray(rr, gray + wpls)) {
+        ok = false;
+        break;
+      }
+      jbig2_phase_done(opts.times, JBIG2_PHASE_READ, &mark);
+      if (scale == 2) {
+        scaleGray2xLIThreshLineLow(bw, wpl, gray, rr->w, wpls, last,
+                                   bw_threshold);
+      } else {
+        scaleGray4xLIThreshLineLow(bw, wpl, gray, rr->w, wpls, last,
+                                   bw_threshold);
+      }
+      jbig2_phase_done(opts.times, JBIG2_PHASE_THRESHOLD, &mark);
+      for (int k = 0; k < scale; ++k) {
+        speck_filter_code(&specks, bw + k * wpl);
+      }
+      memcpy(gray, gray + wpls, wpls * sizeof(u32));
+      jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+    }
+    free(gray);
+  }
+  speck_filter_finish(&specks, ok);
+  jbig2enc_final(ctx);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+  jbig2enc_rows_free(&coder.rows);
+  free(bw);
+  return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Where the rows of a page coded a row at a time come from: a row reader,
+// made bi-level as jbig2_threshold does, or the caller's bi-level rows (see
+// jbig2_encode_generic_bits), either at pointers of their own or stride bytes
+// apart from data
+// -----------------------------------------------------------------------------
+struct jbig2_row_source {
+  L_ROWREADER *rr;
+  int bw_threshold, upsample;
+  const u8 *const *rows;
+  const u8 *data;
+  ptrdiff_t stride;
+  int w, h, xres, yres;
+};
+
+// The size and resolution of the page of src, as it is coded
+static void
+source_size(const struct jbig2_row_source &src, int *w, int *h, int *xres,
+            int *yres) {
+  if (!src.rr) {
+    *w = src.w;
+    *h = src.h;
+    *xres = src.xres;
+    *yres = src.yres;
+    return;
+  }
+  const int scale = rows_scale(src.rr, src.upsample);
+  *w = jbig2_scaled_size(src.rr->w, scale);
+  *h = jbig2_scaled_size(src.rr->h, scale);
+  *xres = scaled_res(src.rr->xres, scale);
+  *yres = scaled_res(src.rr->yres, scale);
+}
+
+// -----------------------------------------------------------------------------
+// Code the caller's bi-level rows of src with ctx, as code_rows codes those of
+// a row reader (but never as a striped page). Each row goes straight from
+// where it is into the rows which the coder looks at, unless the specks are
+// removed on the way.
+// -----------------------------------------------------------------------------
+static void
+code_bits(struct jbig2enc_ctx *ctx, const struct jbig2_row_source &src,
+          const struct jbig2_generic_options &opts) {
+  struct jbig2_rows_coder coder;
+  coder.ctx = ctx;
+  coder.opts = &opts;
+  coder.w = src.w;
+  coder.h = src.h;
+  coder.y = 0;
+  coder.end_stripe = NULL;
+  coder.arg = NULL;
+  rows_coder_start(&coder);
+  struct jbig2_speck_filter specks;
+  speck_filter_init(&specks, &coder);
+  u32 *const row = specks.ring
+                       ? (u32 *) malloc(specks.wpl * sizeof(u32)) : NULL;
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  for (int y = 0; y < src.h; ++y) {
+    const u8 *const bytes = src.rows ? src.rows[y] : src.data + y * src.stride;
+    if (row) {
+      jbig2enc_load_msb(row, bytes, src.w);
+      speck_filter_code(&specks, row);
+    } else {
+      jbig2enc_rows_code_msb(ctx, &coder.rows, bytes);
+    }
+  }
+  speck_filter_finish(&specks, true);
+  free(row);
+  jbig2enc_final(ctx);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+  jbig2enc_rows_free(&coder.rows);
+}
+
+// Code the page of src with ctx. Returns false on a read error.
+static bool
+code_source(struct jbig2enc_ctx *ctx, const struct jbig2_row_source &src,
+            const struct jbig2_generic_options &opts) {
+  if (!src.rr) {
+    code_bits(ctx, src, opts);
+    return true;
+  }
+  return code_rows(ctx, src.rr, src.bw_threshold, src.upsample, opts, NULL,
+                   NULL);
+}
+
+// -----------------------------------------------------------------------------
+// Code the page of src as a single generic region, as jbig2_encode_generic_rows
+// (and jbig2_encode_generic_bits) do
+// -----------------------------------------------------------------------------
+static u8 *
+encode_rows(const struct jbig2_row_source &src,
+            const struct jbig2_generic_options &opts, size_t *const length) {
+  unsigned segnum = opts.segnum ? *opts.segnum : 0;
+  const bool full_headers = opts.full_headers;
+  const bool end_of_page = full_headers || opts.end_of_page;
+  if (opts.crop || opts.split_gap > 0 || opts.mmr || opts.stripe_rows) {
+    return NULL;
+  }
+
+  struct jbig2_region region;
+  memset(&region, 0, sizeof(region));
+  int xres, yres;
+  source_size(src, &region.w, &region.h, &xres, &yres);
+
+  struct jbig2_file_header header;
+  Segment seg, seg2, endseg;
+  jbig2_page_info pageinfo;
+  jbig2_generic_region genreg;
+
+  if (full_headers) init_file_header(&header, 1);
+  seg.number = segnum++;
+  init_page_info(&seg, &pageinfo, region.w, region.h, xres, yres, opts.xres,
+                 opts.yres, opts.page);
+  seg2.type = segment_imm_generic_region;
+  seg2.page = opts.page;
+  seg2.number = segnum++;
+  endseg.number = segnum;
+  endseg.page = opts.page;
+  init_generic_region(&genreg, &region, opts);
+
+  // as in jbig2_encode_generic_opts, the headers go in front of the data
+  const int reserved = seg.size() + sizeof(pageinfo) + seg2.size() +
+                       generic_region_size(&genreg) +
+                       (full_headers ? sizeof(header) : 0);
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init_flat(&ctx, reserved);
+  if (!code_source(&ctx, src, opts)) {
+    jbig2enc_dealloc(&ctx);
+    return NULL;
+  }
+  if (opts.stats) jbig2enc_addstats(&ctx, opts.stats);
+
+  const size_t datasize = jbig2enc_datasize(&ctx);
+  if (!segment_fits(generic_region_size(&genreg) + datasize)) {
+    // which the caller can code again in stripes
+    jbig2enc_dealloc(&ctx);
+    return NULL;
+  }
+  const size_t totalsize = reserved + datasize +
+                           (full_headers ? 2*endseg.size() :
+                            end_of_page ? endseg.size() : 0);
+  u8 *const ret = jbig2enc_takebuffer(&ctx, totalsize - reserved - datasize);
+  jbig2enc_dealloc(&ctx);
+  size_t offset = 0;
+  if (full_headers) {
+    F(header);
+  }
+  SEGMENT(seg);
+  F(pageinfo);
+  seg2.len = generic_region_size(&genreg) + datasize;
+  SEGMENT(seg2);
+  GENREG(genreg);
+  offset += datasize;
+
+  if (end_of_page) {
+    endseg.type = segment_end_of_page;
+    SEGMENT(endseg);
+    segnum++;
+  }
+  if (full_headers) {
+    endseg.number += 1;
+    endseg.type = segment_end_of_file;
+    SEGMENT(endseg);
+  }
+  if (opts.segnum) *opts.segnum = segnum;
+
+  if (totalsize != offset) abort();
+
+  *length = offset;
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_rows(L_ROWREADER *rr, int bw_threshold, int upsample,
+                          const struct jbig2_generic_options &opts,
+                          size_t *const length) {
+  if (!rr || bw_threshold < 0 || bw_threshold > 256) return NULL;
+  struct jbig2_row_source src;
+  memset(&src, 0, sizeof(src));
+  src.rr = rr;
+  src.bw_threshold = bw_threshold;
+  src.upsample = upsample;
+  return encode_rows(src, opts, length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_bits(const u8 *const *rows, int w, int h, int xres,
+                          int yres, const struct jbig2_generic_options &opts,
+                          size_t *const length) {
+  if (!rows || w <= 0 || h <= 0) return NULL;
+  struct jbig2_row_source src;
+  memset(&src, 0, sizeof(src));
+  src.rows = rows;
+  src.w = w;
+  src.h = h;
+  src.xres = xres;
+  src.yres = yres;
+  return encode_rows(src, opts, length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_bytes(const u8 *data, ptrdiff_t stride, int w, int h,
+                           int xres, int yres,
+                           const struct jbig2_generic_options &opts,
+                           size_t *const length) {
+  if (!data || w <= 0 || h <= 0) return NULL;
+  struct jbig2_row_source src;
+  memset(&src, 0, sizeof(src));
+  src.data = data;
+  src.stride = stride;
+  src.w = w;
+  src.h = h;
+  src.xres = xres;
+  src.yres = yres;
+  return encode_rows(src, opts, length);
+}
+
+// -----------------------------------------------------------------------------
+// The state of jbig2_encode_generic_rows_sink between the stripes of a striped
+// page
+// -----------------------------------------------------------------------------
+struct jbig2_rows_sink_page {
+  const struct jbig2_generic_options *opts;
+  void (*sink)(void *sink_arg, const u8 *data, size_t size);
+  void *sink_arg;
+  unsigned segnum;  // of the next segment
+  Segment seg2;
+  struct jbig2_region region;  // that of the stripe being coded
+  int h;  // of the page
+};
+
+// -----------------------------------------------------------------------------
+// Called by code_rows at the end of each stripe but the last: end its region
+// and its stripe, and start the region of the next stripe from row y
+// -----------------------------------------------------------------------------
+static void
+rows_sink_stripe(void *arg, struct jbig2enc_ctx *ctx, int y) {
+  struct jbig2_rows_sink_page *const page = (struct jbig2_rows_sink_page *) arg;
+  const struct jbig2_generic_options &opts = *page->opts;
+  if (opts.stats) jbig2enc_addstats(ctx, opts.stats);
+
+  jbig2_generic_region genreg;
+  u8 ret[sizeof(u32) + 2 * (sizeof(struct jbig2_segment) + 4 + 4) +
+         sizeof(u32) + sizeof(genreg)];
+  int offset = 0;
+  const u32 rows = htonl(page->region.h);
+  F(rows);
+  offset += write_end_of_stripe(ret + offset, page->segnum++, opts,
+                                stripe_of(opts, y - 1), page->h);
+  page->region.y = y;
+  page->region.h = page->h - y < opts.stripe_rows ? page->h - y
+                                                  : opts.stripe_rows;
+  page->seg2.number = page->segnum++;
+  init_generic_region(&genreg, &page->region, opts);
+  SEGMENT(page->seg2);
+  GENREG(genreg);
+  page->sink(page->sink_arg, ret, offset);
+}
+
+// see comments in .h file
+bool
+jbig2_encode_generic_rows_sink(L_ROWREADER *rr, int bw_threshold,
+                               int upsample,
+                               const struct jbig2_generic_options &opts,
+                               void (*sink)(void *sink_arg, const u8 *data,
+                                            size_t size),
+                               void *sink_arg) {
+  const bool full_headers = opts.full_headers;
+  const bool end_of_page = full_headers || opts.end_of_page;
+  if (!rr || opts.crop || opts.split_gap > 0 || opts.mmr) return false;
+  if (bw_threshold < 0 || bw_threshold > 256) return false;
+  if (!striping_ok(opts)) return false;
+
+  const int scale = rows_scale(rr, upsample);
+  struct jbig2_rows_sink_page page;
+  page.opts = &opts;
+  page.sink = sink;
+  page.sink_arg = sink_arg;
+  page.segnum = opts.segnum ? *opts.segnum : 0;
+  page.h = jbig2_scaled_size(rr->h, scale);
+  // a striped page starts with the region of its first stripe
+  struct jbig2_region &region = page.region;
+  memset(&region, 0, sizeof(region));
+  region.w = jbig2_scaled_size(rr->w, scale);
+  region.h = opts.stripe_rows && page.h > opts.stripe_rows ? opts.stripe_rows
+                                                           : page.h;
+
+  struct jbig2_file_header header;
+  Segment seg, endseg;
+  Segment &seg2 = page.seg2;
+  jbig2_page_info pageinfo;
+  jbig2_generic_region genreg;
+
+  if (full_headers) init_file_header(&header, 1);
+  seg.number = page.segnum++;
+  init_page_info(&seg, &pageinfo, region.w, page.h, scaled_res(rr->xres, scale),
+                 scaled_res(rr->yres, scale), opts.xres, opts.yres, opts.page);
+  init_page_striping(&pageinfo, opts);
+  // with the unknown length form, as in jbig2_encode_generic_sink
+  seg2.type = segment_imm_generic_region;
+  seg2.page = opts.page;
+  seg2.len = 0xffffffff;
+  seg2.number = page.segnum++;
+  endseg.page = opts.page;
+  init_generic_region(&genreg, &region, opts);
+
+  u8 ret[sizeof(header) + 2 * (sizeof(struct jbig2_segment) + 4 + 4) +
+         sizeof(pageinfo) + sizeof(genreg) + 4];
+  int offset = 0;
+  if (full_headers) {
+    F(header);
+  }
+  SEGMENT(seg);
+  F(pageinfo);
+  SEGMENT(seg2);
+  GENREG(genreg);
+  sink(sink_arg, ret, offset);
+
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init_sink(&ctx, sink, sink_arg);
+  const bool ok = code_rows(&ctx, rr, bw_threshold, upsample, opts,
+                            rows_sink_stripe, &page);
+  if (opts.stats) jbig2enc_addstats(&ctx, opts.stats);
+  jbig2enc_dealloc(&ctx);
+  if (!ok) return false;
+
+  unsigned segnum = page.segnum;
+  offset = 0;
+  const u32 rows = htonl(region.h);
+  F(rows);
+  if (opts.stripe_rows) {
+    offset += write_end_of_stripe(ret + offset, segnum++, opts,
+                                  page_stripes(opts, page.h) - 1, page.h);
+  }
+  endseg.number = segnum;
+  if (end_of_page) {
+    endseg.type = segment_end_of_page;
+    SEGMENT(endseg);
+    segnum++;
+  }
+  if (full_headers) {
+    endseg.number += 1;
+    endseg.type = segment_end_of_file;
+    SEGMENT(endseg);
+  }
+  if (opts.segnum) *opts.segnum = segnum;
+  sink(sink_arg, ret, offset);
+
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Halftone regions (see jbig2_generic_options.halftone). They are only looked
+// for in the bands of rows which are costly in the cost map of the page: the
+// bytes of each band of opts.band_rows rows when it is coded as generic
+// regions (as --band-report gives them), estimated from kHalftoneCostRows rows
+// of it, of which a band which takes at least a bit for every
+// kHalftoneBandPixels pixels is costly. A band is the width of the page, so it
+// can't tell where a halftone is along it, and there the page is looked at in
+// square blocks of kHalftoneBlockCells cells: a block is a halftone if at
+// least kHalftoneTransitions tenths of the pairs of pixels side by side or one
+// above the other in it differ. On text it's less than one in ten, and on
+// dither or the dots of a halftone screen about half, but less in the lightest
+// and darkest parts, so gaps of up to kHalftoneGapBlocks blocks between
+// halftone blocks count as halftone too. A halftone region needs at least
+// kHalftoneMinBlocks such blocks side by side.
+// -----------------------------------------------------------------------------
+static const int kHalftoneBandPixels = 16;
+static const int kHalftoneCostRows = 4;
+static const int kHalftoneBlockCells = 8;
+static const int kHalftoneTransitions = 2;
+static const int kHalftoneGapBlocks = 2;
+static const int kHalftoneMinBlocks = 2;
+// The most cells which are looked at to choose the patterns: of more, every
+// so many are taken
+static const size_t kHalftoneSampleCells = 1 << 12;
+
+// The pattern dictionary of a page: the pattern of each number of black
+// pixels in a cell, as cell_bits gives it
+struct jbig2_halftone {
+  const struct Pix *bw;  // the page
+  int cell;
+  int npatterns;  // cell * cell + 1
+  u64 patterns[JBIG2_HALFTONE_MAX_CELL * JBIG2_HALFTONE_MAX_CELL + 1];
+};
+
+// The number of pixels x0 up to x1 of row which are set
+static int
+count_bits(const u32 *row, int x0, int x1) {
+  int n = 0;
+  for (int i = x0 / 32; i * 32 < x1; ++i) {
+    u32 v = row[i];
+    if (i == x0 / 32) v &= 0xffffffffu >> (x0 % 32);
+    if ((i + 1) * 32 > x1) v &= ~(0xffffffffu >> (x1 % 32));
+    n += __builtin_popcount(v);
+  }
+  return n;
+}
+
+// Pixels x up to x + n (n at most 32) of a row of wpl words, in the top n bits
+static inline u32
+row_bits(const u32 *row, int wpl, int x, int n) {
+  const int i = x / 32, shift = x % 32;
+  u32 v = i < wpl ? row[i] << shift : 0;
+  if (shift && i + 1 < wpl) v |= row[i + 1] >> (32 - shift);
+  return n < 32 ? v & ~(0xffffffffu >> n) : v;
+}
+
+// -----------------------------------------------------------------------------
+// The cell of bw whose top left pixel is (x, y): its rows one after the other
+// from the top, the leftmost pixel of each in its highest bit. The pixels from
+// x1 to the right or from y1 down count as white.
+// -----------------------------------------------------------------------------
+static u64
+cell_bits(const struct Pix *bw, int cell, int x, int y, int x1, int y1) {
+  const int n = x1 - x < cell ? x1 - x : cell;
+  u64 bits = 0;
+  for (int r = 0; r < cell; ++r) {
+    const u32 v =
+        y + r < y1 ? row_bits(bw->data + (y + r) * bw->wpl, bw->wpl, x, n) : 0;
+    bits = bits << cell | v >> (32 - cell);
+  }
+  return bits;
+}
+
+// The value of pixel (r, c) of an 8 x 8 Bayer matrix (0..63)
+static int
+bayer(int r, int c) {
+  int v = 0;
+  for (int k = 0; k < 3; ++k) {
+    v = v << 2 | ((r ^ c) >> k & 1) << 1 | (r >> k & 1);
+  }
+  return v;
+}
+
+// -----------------------------------------------------------------------------
+// The pattern of count black pixels for a cell which no cell of the page gives:
+// the pixels are taken in the order of a Bayer matrix, so that they are spread
+// out as by ordered dither
+// -----------------------------------------------------------------------------
+static u64
+dither_pattern(int cell, int count) {
+  u64 bits = 0;
+  for (int v = 0; v < 64 && count; ++v) {
+    for (int r = 0; r < cell; ++r) {
+      for (int c = 0; c < cell; ++c) {
+        if (count && bayer(r, c) == v) {
+          bits |= 1ull << ((cell - 1 - r) * cell + cell - 1 - c);
+          count--;
+        }
+      }
+    }
+  }
+  return bits;
+}
+
+// A cell of the page, and the number of times it's been seen
+struct cell_count {
+  u64 bits;
+  size_t n;  // 0 if the slot of the hash table (see find_halftones) is free
+};
+
+// -----------------------------------------------------------------------------
+// Estimate the cost map of bw into costs: kHalftoneCostRows rows from the
+// middle of each band are coded, after the two rows above them (which only
+// give them their neighbours), and their bytes are taken for those of all of
+// the rows of the band. As in code_sample_bands, the contexts are carried on
+// from one band to the next.
+// -----------------------------------------------------------------------------
+static void
+estimate_costs(const struct Pix *bw, const struct jbig2_generic_options &opts,
+               u32 *costs) {
+  const int h = bw->h, rows = opts.band_rows;
+  int atx, aty;
+  generic_at(opts, &atx, &aty);
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  for (int band = 0; band * rows < h; ++band) {
+    const int first = band * rows;
+    const int end = first + rows < h ? first + rows : h;
+    const int mid = (first + end - kHalftoneCostRows) / 2;
+    const int y0 = mid > first ? mid : first;
+    const int y1 = y0 + kHalftoneCostRows < end ? y0 + kHalftoneCostRows : end;
+    const int top = y0 > 2 ? y0 - 2 : 0;
+    struct jbig2enc_rows r;
+    jbig2enc_rows_init_at(&r, bw->w, y1 - top, opts.gbtemplate, atx, aty,
+                          opts.duplicate_line_removal);
+    unsigned start = 0;
+    for (int y = top; y < y1; ++y) {
+      if (y == y0) start = jbig2enc_datasize(&ctx);
+      jbig2enc_rows_code(&ctx, &r, (u8 *) (bw->data + y * bw->wpl));
+    }
+    jbig2enc_rows_free(&r);
+    costs[band] = (u64) (jbig2enc_datasize(&ctx) - start) * (end - first) /
+                  (y1 - y0);
+  }
+  jbig2enc_dealloc(&ctx);
+}
+
+// Returns true iff any band of rows y0 to y1 of bw is costly in costs (see
+// kHalftoneBandPixels), with bands of rows rows
+static bool
+rows_costly(const struct Pix *bw, const u32 *costs, int rows, int y0, int y1) {
+  for (int band = y0 / rows; band * rows < y1; ++band) {
+    const int end = (band + 1) * rows < (int) bw->h ? (band + 1) * rows
+                                                    : bw->h;
+    const u64 pixels = (u64) bw->w * (end - band * rows);
+    if ((u64) costs[band] * 8 * kHalftoneBandPixels >= pixels) return true;
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+// Find the halftone regions of bw, of which costs is the cost map: the runs of
+// halftone blocks side by side in each row of blocks in costly bands, from the
+// top left of the page, each added to the region of the same columns in the
+// row of blocks above, if there is one. On a striped page they are then split
+// at the end of each stripe. Each is cut down to a whole number of cells, the
+// rows and columns past them being left to the generic regions. Returns the
+// number of them, in order of their first rows, in *regions (which the caller
+// must free). bw must have zero pad bits.
+// -----------------------------------------------------------------------------
+static int
+find_halftone_regions(const struct Pix *bw,
+                      const struct jbig2_generic_options &opts,
+                      const u32 *costs, struct jbig2_region **regions) {
+  const int w = bw->w, h = bw->h, wpl = bw->wpl;
+  const int block = opts.halftone * kHalftoneBlockCells;
+  const int nbx = (w + block - 1) / block;
+  u32 *const transitions = (u32 *) malloc(nbx * sizeof(u32));
+  bool *const halftone = (bool *) malloc(nbx * sizeof(bool));
+  u32 *const diff = (u32 *) malloc(wpl * sizeof(u32));
+  struct jbig2_region *r = NULL;
+  int n = 0, capacity = 0;
+  // (if memory runs out, there are no halftones)
+  bool ok = transitions && halftone && diff;
+  for (int y0 = 0; ok && y0 < h; y0 += block) {
+    const int y1 = y0 + block < h ? y0 + block : h;
+    if (!rows_costly(bw, costs, opts.band_rows, y0, y1)) continue;
+    memset(transitions, 0, nbx * sizeof(u32));
+    for (int y = y0; y < y1; ++y) {
+      const u32 *const row = bw->data + y * wpl;
+      // each pixel which differs from the one on its right, of which the last
+      // pixel of the row has none, and then from the one below
+      for (int i = 0; i < wpl; ++i) {
+        diff[i] = row[i] ^ (row[i] << 1 | (i + 1 < wpl ? row[i + 1] >> 31 : 0));
+      }
+      diff[(w - 1) / 32] &= ~(0x80000000u >> ((w - 1) % 32));
+      for (int bx = 0; bx < nbx; ++bx) {
+        const int x1 = (bx + 1) * block < w ? (bx + 1) * block : w;
+        transitions[bx] += count_bits(diff, bx * block, x1);
+      }
+      if (y + 1 == h) continue;
+      for (int i = 0; i < wpl; ++i) diff[i] = row[i] ^ row[i + wpl];
+      for (int bx = 0; bx < nbx; ++bx) {
+        const int x1 = (bx + 1) * block < w ? (bx + 1) * block : w;
+        transitions[bx] += count_bits(diff, bx * block, x1);
+      }
+    }
+    for (int bx = 0; bx < nbx; ++bx) {
+      const int x1 = (bx + 1) * block < w ? (bx + 1) * block : w;
+      const u32 pairs = 2 * (x1 - bx * block) * (y1 - y0);
+      halftone[bx] = transitions[bx] * 10 >= kHalftoneTransitions * pairs;
+    }
+    for (int bx = 1; bx < nbx; ++bx) {
+      if (halftone[bx] || !halftone[bx - 1]) continue;
+      int end = bx;
+      while (end < nbx && !halftone[end]) ++end;
+      if (end < nbx && end - bx <= kHalftoneGapBlocks) {
+        for (; bx < end; ++bx) halftone[bx] = true;
+      }
+    }
+
+    for (int bx = 0; bx < nbx;) {
+      if (!halftone[bx]) {
+        ++bx;
+        continue;
+      }
+      int end = bx;
+      while (end < nbx && halftone[end]) ++end;
+      const int x0 = bx * block, x1 = end * block < w ? end * block : w;
+      bx = end;
+      if (end - x0 / block < kHalftoneMinBlocks) continue;
+      int j = n - 1;
+      while (j >= 0 && (r[j].y + r[j].h != y0 || r[j].x != x0 ||
+                        r[j].w != x1 - x0)) {
+        --j;
+      }
+      if (j >= 0) {
+        r[j].h += y1 - y0;
+        continue;
+      }
+      if (n == capacity) {
+        capacity = capacity ? 2 * capacity : 16;
+        struct jbig2_region *const grown = (struct jbig2_region *) realloc(
+            r, capacity * sizeof(struct jbig2_region));
+        if (!grown) {
+          ok = false;
+          break;
+        }
+        r = grown;
+      }
+      r[n].data = bw->data + y0 * wpl;
+      r[n].wpl = wpl;
+      r[n].x = x0;
+      r[n].y = y0;
+      r[n].w = x1 - x0;
+      r[n].h = y1 - y0;
+      r[n].pix = NULL;
+      n++;
+    }
+  }
+  free(diff);
+  free(halftone);
+  free(transitions);
+  if (!ok) n = 0;
+  const int cell = opts.halftone;
+  int kept = 0;
+  for (int i = 0; i < n; ++i) {
+    r[i].w -= r[i].w % cell;
+    r[i].h -= r[i].h % cell;
+    if (r[i].h) r[kept++] = r[i];
+  }
+  n = kept;
+
+  if (n && opts.stripe_rows > 0) {
+    const int rows = opts.stripe_rows;
+    int split = 0;
+    for (int i = 0; i < n; ++i) {
+      split += (r[i].y + r[i].h - 1) / rows - r[i].y / rows + 1;
+    }
+    struct jbig2_region *const s =
+        (struct jbig2_region *) malloc(split * sizeof(struct jbig2_region));
+    if (!s) {
+      free(r);
+      *regions = NULL;
+      return 0;
+    }
+    int j = 0;
+    for (int i = 0; i < n; ++i) {
+      const int bottom = r[i].y + r[i].h;
+      for (int y = r[i].y; y < bottom;) {
+        const int end = (y / rows + 1) * rows < bottom ? (y / rows + 1) * rows
+                                                       : bottom;
+        s[j] = r[i];
+        s[j].data = bw->data + y * wpl;
+        s[j].y = y;
+        s[j].h = (end - y) - (end - y) % cell;
+        y = end;
+        if (s[j].h) ++j;
+      }
+    }
+    split = j;
+    // in order of the first rows, which the pieces of a region taller than a
+    // stripe aren't
+    for (int i = 1; i < split; ++i) {
+      for (int k = i; k > 0 && s[k - 1].y > s[k].y; --k) {
+        const struct jbig2_region t = s[k];
+        s[k] = s[k - 1];
+        s[k - 1] = t;
+      }
+    }
+    free(r);
+    r = s;
+    n = split;
+  }
+  *regions = r;
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Plan the halftone regions of bw (see find_halftone_regions) and their
+// pattern dictionary: the pattern of each number of black pixels is the
+// commonest of the whole cells of the regions (or of those sampled, see
+// kHalftoneSampleCells) with that many, or if there's none, that of
+// dither_pattern. Returns the number of stripes to code for
+// them, the dictionary first, in *stripes, with the dictionary in *ht (both of
+// which the caller must free), or 0 if there are no halftones.
+// -----------------------------------------------------------------------------
+static int
+find_halftones(const struct Pix *bw, const struct jbig2_generic_options &opts,
+               const u32 *costs, struct jbig2_halftone **ht,
+               struct jbig2_stripe **stripes) {
+  struct jbig2_region *regions;
+  const int nregions = find_halftone_regions(bw, opts, costs, &regions);
+  if (!nregions) {
+    free(regions);
+    return 0;
+  }
+
+  const int cell = opts.halftone;
+  size_t ncells = 0;
+  for (int i = 0; i < nregions; ++i) {
+    ncells += (size_t) (regions[i].w / cell) * (regions[i].h / cell);
+  }
+  const size_t every = ncells / kHalftoneSampleCells + 1;
+  // the cells sampled are counted in a hash table of at least twice as many
+  // slots
+  int shift = 64;
+  while (((size_t) 1 << (64 - shift)) < 2 * (ncells / every + 1)) --shift;
+  const size_t mask = ((size_t) 1 << (64 - shift)) - 1;
+  struct cell_count *const counts =
+      (struct cell_count *) calloc(mask + 1, sizeof(struct cell_count));
+  if (!counts) {
+    free(regions);
+    return 0;
+  }
+  size_t k = 0;
+  for (int i = 0; i < nregions; ++i) {
+    const struct jbig2_region *const region = &regions[i];
+    for (int y = region->y; y + cell <= region->y + region->h; y += cell) {
+      for (int x = region->x; x + cell <= region->x + region->w; x += cell) {
+        if (k++ % every) continue;
+        const u64 bits = cell_bits(bw, cell, x, y, x + cell, y + cell);
+        size_t slot = (size_t) (bits * 0x9e3779b97f4a7c15ull >> shift);
+        while (counts[slot].n && counts[slot].bits != bits) {
+          slot = (slot + 1) & mask;
+        }
+        counts[slot].bits = bits;
+        counts[slot].n++;
+      }
+    }
+  }
+
+  struct jbig2_halftone *const d =
+      (struct jbig2_halftone *) malloc(sizeof(struct jbig2_halftone));
+  d->bw = bw;
+  d->cell = cell;
+  d->npatterns = cell * cell + 1;
+  size_t most[JBIG2_HALFTONE_MAX_CELL * JBIG2_HALFTONE_MAX_CELL + 1];
+  for (int c = 0; c < d->npatterns; ++c) {
+    d->patterns[c] = dither_pattern(cell, c);
+    most[c] = 0;
+  }
+  // of as common cells, the least bits
+  for (size_t i = 0; i <= mask; ++i) {
+    const struct cell_count *const count = &counts[i];
+    if (!count->n) continue;
+    const int c = __builtin_popcountll(count->bits);
+    if (count->n > most[c] ||
+        (count->n == most[c] && count->bits < d->patterns[c])) {
+      most[c] = count->n;
+      d->patterns[c] = count->bits;
+    }
+  }
+  free(counts);
+
+  const int n = nregions + 1;
+  struct jbig2_stripe *const s =
+      (struct jbig2_stripe *) malloc(n * sizeof(struct jbig2_stripe));
+  for (int i = 0; i < n; ++i) {
+    if (i == 0) {
+      // the collective bitmap of the patterns (6.7.5), just before the
+      // first region which uses it
+      memset(&s[i].region, 0, sizeof(s[i].region));
+      s[i].region.y = regions[0].y;
+      s[i].region.w = d->npatterns * cell;
+      s[i].region.h = cell;
+      s[i].kind = stripe_patterns;
+    } else {
+      s[i].region = regions[i - 1];
+      s[i].kind = stripe_halftone;
+    }
+    s[i].halftone = d;
+    s[i].gbtemplate = 0;
+    jbig2enc_default_at(0, &s[i].atx, &s[i].aty);
+    s[i].mmr = false;
+    s[i].duplicate_line_removal = false;
+    s[i].reserved = 0;
+    s[i].chunked = true;
+    s[i].band_bytes = NULL;
+    s[i].band_rows = opts.band_rows;
+    s[i].cache = NULL;
+    s[i].deadline = NULL;
+    s[i].store = NULL;
+    s[i].datasize = 0;
+  }
+  free(regions);
+  *ht = d;
+  *stripes = s;
+  return n;
+}
+
+// Make the pixels of region of pix white
+static void
+clear_region(struct Pix *pix, const struct jbig2_region *region) {
+  const int x0 = region->x, x1 = region->x + region->w;
+  for (int y = region->y; y < region->y + region->h; ++y) {
+    u32 *const row = pix->data + y * pix->wpl;
+    for (int i = x0 / 32; i * 32 < x1; ++i) {
+      u32 mask = 0xffffffffu;
+      if (i == x0 / 32) mask &= 0xffffffffu >> (x0 % 32);
+      if ((i + 1) * 32 > x1) mask &= ~(0xffffffffu >> (x1 % 32));
+      row[i] &= ~mask;
+    }
+  }
+}
+
+// The generic template of the collective bitmap of the patterns of cells of
+// cell pixels, whose first AT pixel is a cell to the left (6.7.5): one which
+// doesn't take that pixel already (see jbig2enc_at_ok)
+static int
+pattern_template(int cell) {
+  return cell > 4 ? 0 : 2;
+}
+
+// The bits of each value of the gray-scale image of the grid of a halftone
+// region with npatterns patterns (HBPP, 6.6.5)
+static int
+gray_bits(int npatterns) {
+  int bits = 0;
+  while (1 << bits < npatterns) bits++;
+  return bits;
+}
+
+// Code the collective bitmap of the patterns of ht
+static void
+code_patterns(struct jbig2enc_ctx *ctx, const struct jbig2_halftone *ht) {
+  const int cell = ht->cell;
+  PIX *pix = pixCreate(ht->npatterns * cell, cell, 1);
+  for (int k = 0; k < ht->npatterns; ++k) {
+    for (int r = 0; r < cell; ++r) {
+      u32 *const row = pix->data + r * pix->wpl;
+      for (int c = 0; c < cell; ++c) {
+        if (ht->patterns[k] >> ((cell - 1 - r) * cell + cell - 1 - c) & 1) {
+          SET_DATA_BIT(row, k * cell + c);
+        }
+      }
+    }
+  }
+  JBIG2_TRACE2(bitimage__start, pix->w, pix->h);
+  jbig2enc_bitimage_at(ctx, (u8 *) pix->data, pix->w, pix->h,
+                       pattern_template(cell), -cell, 0, false);
+  JBIG2_TRACE3(bitimage__done, pix->w, pix->h, jbig2enc_datasize(ctx));
+  jbig2enc_final(ctx);
+  JBIG2_TRACE1(final__done, jbig2enc_datasize(ctx));
+  pixDestroy(&pix);
+}
+
+// -----------------------------------------------------------------------------
+// Code a halftone region of the page of ht: the number of black pixels of
+// each cell of its grid, which is the pattern to draw there, as the gray-scale
+// image of Annex C.5. Its bit planes, of the Gray code of each value, are
+// coded from the top one down, one after the other with the same contexts.
+// -----------------------------------------------------------------------------
+static void
+code_halftone(struct jbig2enc_ctx *ctx, const struct jbig2_halftone *ht,
+              const struct jbig2_region *region) {
+  const int cell = ht->cell;
+  const int gw = (region->w + cell - 1) / cell;
+  const int gh = (region->h + cell - 1) / cell;
+  u8 *const gray = (u8 *) malloc((size_t) gw * gh);
+  for (int m = 0; m < gh; ++m) {
+    for (int n = 0; n < gw; ++n) {
+      const int v = __builtin_popcountll(
+          cell_bits(ht->bw, cell, region->x + n * cell, region->y + m * cell,
+                    region->x + region->w, region->y + region->h));
+      gray[(size_t) m * gw + n] = v ^ (v >> 1);
+    }
+  }
+  JBIG2_TRACE2(bitimage__start, region->w, region->h);
+  PIX *plane = pixCreate(gw, gh, 1);
+  for (int j = gray_bits(ht->npatterns) - 1; j >= 0; --j) {
+    for (int m = 0; m < gh; ++m) {
+      u32 *const row = plane->data + m * plane->wpl;
+      memset(row, 0, plane->wpl * sizeof(u32));
+      const u8 *const values = gray + (size_t) m * gw;
+      for (int n = 0; n < gw; ++n) {
+        if (values[n] >> j & 1) SET_DATA_BIT(row, n);
+      }
+    }
+    // the AT pixels are in their default locations (C.5)
+    jbig2enc_bitimage_template(ctx, (u8 *) plane->data, gw, gh, 0, false);
+  }
+  JBIG2_TRACE3(bitimage__done, region->w, region->h, jbig2enc_datasize(ctx));
+  jbig2enc_final(ctx);
+  JBIG2_TRACE1(final__done, jbig2enc_datasize(ctx));
+  pixDestroy(&plane);
+  free(gray);
+}
+
+static void
+encode_halftone_stripe(void *arg) {
+  struct jbig2_stripe *const stripe = (struct jbig2_stripe *) arg;
+  jbig2enc_init(&stripe->ctx);
+  if (stripe->kind == stripe_patterns) {
+    code_patterns(&stripe->ctx, stripe->halftone);
+  } else {
+    code_halftone(&stripe->ctx, stripe->halftone, &stripe->region);
+  }
+  stripe->datasize = jbig2enc_datasize(&stripe->ctx);
+}
+
+// -----------------------------------------------------------------------------
+// Code the stripes of find_halftones, adding their bytes to opts.band_bytes
+// (each region's shared out between its rows, and the dictionary's counted in
+// the band of the first), and put them in with the ngeneric stripes of the
+// rest of the page in order of their first rows. Returns the stripes of the
+// page, which replace both (whose arrays are freed).
+// -----------------------------------------------------------------------------
+static struct jbig2_stripe *
+code_halftones(const struct jbig2_generic_options &opts,
+               struct jbig2_stripe *generic, int ngeneric,
+               struct jbig2_stripe *halftones, int nhalftones) {
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  run_jobs(encode_halftone_stripe, halftones, sizeof(struct jbig2_stripe),
+           nhalftones, opts.nthreads);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+
+  for (int i = 0; opts.band_bytes && i < nhalftones; ++i) {
+    const struct jbig2_region *const region = &halftones[i].region;
+    const int h = halftones[i].kind == stripe_patterns ? 1 : region->h;
+    const int rows = opts.band_rows;
+    for (int y = region->y; y < region->y + h;) {
+      const int end = (y / rows + 1) * rows < region->y + h
+                      ? (y / rows + 1) * rows : region->y + h;
+      opts.band_bytes[y / rows] += (u64) halftones[i].datasize * (end - y) / h;
+      y = end;
+    }
+  }
+
+  struct jbig2_stripe *const s = (struct jbig2_stripe *) malloc(
+      (ngeneric + nhalftones) * sizeof(struct jbig2_stripe));
+  int i = 0, j = 0;
+  while (i < ngeneric || j < nhalftones) {
+    if (j < nhalftones &&
+        (i == ngeneric || halftones[j].region.y < generic[i].region.y)) {
+      s[i + j] = halftones[j];
+      j++;
+    } else {
+      s[i + j] = generic[i];
+      i++;
+    }
+  }
+  free(generic);
+  free(halftones);
+  return s;
+}
+
+// The size of the region segment data header of a stripe, as
+// write_stripe_header writes it
+static int
+stripe_header_size(const struct jbig2_stripe *stripe,
+                   const struct jbig2_generic_options &opts) {
+  if (stripe->kind == stripe_patterns) return sizeof(struct jbig2_pattern_dict);
+  if (stripe->kind == stripe_halftone) {
+    return sizeof(struct jbig2_halftone_region);
+  }
+  jbig2_generic_region genreg;
+  init_stripe_region(&genreg, stripe, opts);
+  return generic_region_size(&genreg);
+}
+
+// -----------------------------------------------------------------------------
+// Write the region segment data header of a stripe to out: that of a generic
+// region, of the pattern dictionary of the halftones of a page (7.4.4), or of
+// a halftone region drawn with it (7.4.5). Returns its size.
+// -----------------------------------------------------------------------------
+static int
+write_stripe_header(u8 *out, const struct jbig2_stripe *stripe,
+                    const struct jbig2_generic_options &opts) {
+  const struct jbig2_halftone *const ht = stripe->halftone;
+  if (stripe->kind == stripe_patterns) {
+    struct jbig2_pattern_dict dict;
+    memset(&dict, 0, sizeof(dict));
+    dict.hdtemplate = pattern_template(ht->cell);
+    dict.hdpw = ht->cell;
+    dict.hdph = ht->cell;
+    dict.graymax = htonl(ht->npatterns - 1);
+    memcpy(out, &dict, sizeof(dict));
+    return sizeof(dict);
+  }
+  if (stripe->kind == stripe_halftone) {
+    const struct jbig2_region *const region = &stripe->region;
+    struct jbig2_halftone_region halftone;
+    // the patterns are drawn on white with OR, a cell apart (6.6.5.2)
+    memset(&halftone, 0, sizeof(halftone));
+    halftone.width = htonl(region->w);
+    halftone.height = htonl(region->h);
+    halftone.x = htonl(region->x);
+    halftone.y = htonl(region->y);
+    halftone.hgw = htonl((region->w + ht->cell - 1) / ht->cell);
+    halftone.hgh = htonl((region->h + ht->cell - 1) / ht->cell);
+    halftone.hrx = htons(ht->cell * 256);
+    memcpy(out, &halftone, sizeof(halftone));
+    return sizeof(halftone);
+  }
+  jbig2_generic_region genreg;
+  init_stripe_region(&genreg, stripe, opts);
+  memcpy(out, &genreg, generic_region_size(&genreg));
+  return generic_region_size(&genreg);
+}
+
+// -----------------------------------------------------------------------------
+// Make the pieces of a page (w x h at bw_xres x bw_yres) from its coded
+// stripes, which the pieces then own, as jbig2_encode_generic_opts would write
+// it: the headers go in a buffer of their own, and the pieces take turns
+// between that and the chunks of each stripe.
+//
+// The data of a stripe which is too long for the length of its segment (only
+// the single stripe of jbig2_encode_generic_rows_pieces can be) is written with
+// the unknown length instead, as jbig2_encode_generic_sink does. The stripes
+// of find_halftones are written as the pattern dictionary and halftone regions
+// which they are.
+// -----------------------------------------------------------------------------
+static void
+make_pieces(const struct jbig2_generic_options &opts, int w, int h,
+            int bw_xres, int bw_yres, struct jbig2_stripe *stripes,
+            int nstripes, struct jbig2_pieces *pieces) {
+  unsigned segnum = opts.segnum ? *opts.segnum : 0;
+  const bool full_headers = opts.full_headers;
+  const bool end_of_page = full_headers || opts.end_of_page;
+
+  struct jbig2_file_header header;
+  Segment seg, seg2, endseg;
+  jbig2_page_info pageinfo;
+
+  if (full_headers) init_file_header(&header, 1);
+  seg.number = segnum++;
+  init_page_info(&seg, &pageinfo, w, h, bw_xres, bw_yres, opts.xres,
+                 opts.yres, opts.page);
+  init_page_striping(&pageinfo, opts);
+  int last_halftone = -1;
+  for (int i = 0; i < nstripes; ++i) {
+    if (stripes[i].kind == stripe_halftone) last_halftone = i;
+  }
+  if (last_halftone >= 0) pageinfo.is_lossless = 0;
+  const int npage_stripes = page_stripes(opts, h);
+  seg2.page = opts.page;
+  endseg.number = segnum + nstripes + npage_stripes;
+  endseg.page = opts.page;
+
+  const int nsegments =
+      1 + nstripes + npage_stripes + (full_headers ? 2 : end_of_page);
+  int size = (full_headers ? sizeof(header) : 0) + seg.size() +
+             sizeof(pageinfo) + npage_stripes * end_of_stripe_size(opts) +
+             (nsegments - 1 - nstripes - npage_stripes) * endseg.size();
+  for (int i = 0; i < nstripes; ++i) {
+    const int header_size = stripe_header_size(&stripes[i], opts);
+    // at most, for the dictionary a halftone region refers to
+    size += seg2.size() + header_size +
+            (stripes[i].kind == stripe_halftone ? sizeof(u32) : 0);
+    // the row count after data of unknown length
+    if (!segment_fits(header_size + stripes[i].datasize)) {
+      size += sizeof(u32);
+    }
+  }
+  int nchunks = 0;
+  for (int i = 0; i < nstripes; ++i) {
+    nchunks += jbig2enc_chunks(&stripes[i].ctx, NULL, NULL);
+  }
+  u8 *const ret = (u8 *) malloc(size);
+  pieces->headers = ret;
+  pieces->segments = (int *) malloc(nsegments * sizeof(int));
+  pieces->nsegments = 0;
+  pieces->pieces = (struct jbig2_piece *) malloc(
+      (nstripes + 1 + nchunks) * sizeof(struct jbig2_piece));
+  pieces->npieces = 0;
+  pieces->stripes = stripes;
+  pieces->nstripes = nstripes;
+  int offset = 0;
+  int start = 0;  // where the headers not in a piece yet start
+  const u8 **const chunks = (const u8 **) malloc(nchunks * sizeof(u8 *));
+  size_t *const sizes = (size_t *) malloc(nchunks * sizeof(size_t));
+
+#define SEGMENT_AT(x) pieces->segments[pieces->nsegments++] = offset; SEGMENT(x)
+  if (full_headers) {
+    F(header);
+  }
+  SEGMENT_AT(seg);
+  F(pageinfo);
+  size_t length = 0;
+  int k = 0;  // the next stripe of the page to end
+  unsigned dict = 0;  // the segment number of the pattern dictionary
+  for (int i = 0; i < nstripes; ++i) {
+    while (k < stripe_of(opts, stripes[i].region.y)) {
+      pieces->segments[pieces->nsegments++] = offset;
+      offset += write_end_of_stripe(ret + offset, segnum++, opts, k++, h);
+    }
+    seg2.number = segnum;
+    segnum++;
+    seg2.type = segment_imm_generic_region;
+    seg2.nreferred = 0;
+    seg2.retain_bits = 0;
+    if (stripes[i].kind == stripe_patterns) {
+      seg2.type = segment_pattern_dict;
+      dict = seg2.number;
+    } else if (stripes[i].kind == stripe_halftone) {
+      // the dictionary is kept until the last region is drawn
+      seg2.type = segment_imm_halftone_region;
+      seg2.nreferred = 1;
+      seg2.referred[0] = dict;
+      seg2.retain_bits = i < last_halftone ? 2 : 0;
+    }
+    const int header_size = stripe_header_size(&stripes[i], opts);
+    const bool fits = segment_fits(header_size + stripes[i].datasize);
+    seg2.len = fits ? header_size + stripes[i].datasize : 0xffffffff;
+    SEGMENT_AT(seg2);
+    offset += write_stripe_header(ret + offset, &stripes[i], opts);
+    struct jbig2_piece *piece = &pieces->pieces[pieces->npieces++];
+    piece->data = ret + start;
+    piece->size = offset - start;
+    length += offset - start;
+    start = offset;
+    const int n = jbig2enc_chunks(&stripes[i].ctx, chunks, sizes);
+    for (int j = 0; j < n; ++j) {
+      if (!sizes[j]) continue;
+      piece = &pieces->pieces[pieces->npieces++];
+      piece->data = chunks[j];
+      piece->size = sizes[j];
+      length += sizes[j];
+    }
+    if (!fits) {
+      // this goes in the next piece of the headers
+      const u32 rows = htonl(stripes[i].region.h);
+      F(rows);
+    }
+  }
+  while (k < npage_stripes) {
+    pieces->segments[pieces->nsegments++] = offset;
+    offset += write_end_of_stripe(ret + offset, segnum++, opts, k++, h);
+  }
+
+  if (end_of_page) {
+    endseg.type = segment_end_of_page;
+    SEGMENT_AT(endseg);
+    segnum++;
+  }
+  if (full_headers) {
+    endseg.number += 1;
+    endseg.type = segment_end_of_file;
+    SEGMENT_AT(endseg);
+  }
+#undef SEGMENT_AT
+  if (offset > start) {
+    struct jbig2_piece *const piece = &pieces->pieces[pieces->npieces++];
+    piece->data = ret + start;
+    piece->size = offset - start;
+    length += offset - start;
+  }
+  if (opts.segnum) *opts.segnum = segnum;
+
+  if (offset > size) abort();
+
+  free(chunks);
+  free(sizes);
+  pieces->headers_size = offset;
+  pieces->length = length;
+}
+
+// As jbig2_encode_generic_pieces, for an image whose pad bits are zero already,
+// which is then only read. Returns false iff the deadline was missed.
+static bool
+encode_generic_pieces(struct Pix *const bw,
+                      const struct jbig2_generic_options &opts,
+                      struct jbig2_pieces *pieces) {
+  struct jbig2_halftone *ht = NULL;
+  struct jbig2_stripe *halftones = NULL;
+  int nhalftones = 0;
+  if (opts.halftone) {
+    const int nbands = (bw->h + opts.band_rows - 1) / opts.band_rows;
+    u32 *const costs = (u32 *) malloc(nbands * sizeof(u32));
+    if (costs) {
+      struct jbig2_clock mark;
+      jbig2_phase_start(opts.times, &mark);
+      estimate_costs(bw, opts, costs);
+      nhalftones = find_halftones(bw, opts, costs, &ht, &halftones);
+      jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+      free(costs);
+    }
+  }
+  struct jbig2_stripe *stripes;
+  int nstripes;
+  if (!nhalftones) {
+    nstripes = code_stripes(bw, opts, 0, true, NULL, &stripes);
+    if (!nstripes) return false;
+  } else {
+    // the rest of the page is coded with the halftones left white
+    struct Pix *rest = pixCopy(NULL, bw);
+    for (int i = 1; i < nhalftones; ++i) {
+      clear_region(rest, &halftones[i].region);
+    }
+    nstripes = code_stripes(rest, opts, 0, true, NULL, &stripes);
+    pixDestroy(&rest);
+    if (!nstripes) {
+      free(halftones);
+      free(ht);
+      return false;
+    }
+    stripes = code_halftones(opts, stripes, nstripes, halftones, nhalftones);
+    nstripes += nhalftones;
+    // (code_stripes only keeps to the deadline for the generic regions)
+    if (opts.deadline_ns && jbig2_wall_ns() > opts.deadline_ns) {
+      for (int i = 0; i < nstripes; ++i) stripe_dealloc(&stripes[i]);
+      free(stripes);
+      free(ht);
+      if (opts.missed_deadline) *opts.missed_deadline = true;
+      return false;
+    }
+  }
+  if (opts.stats) {
+    for (int i = 0; i < nstripes; ++i) {
+      jbig2enc_addstats(&stripes[i].ctx, opts.stats);
+    }
+  }
+  make_pieces(opts, bw->w, bw->h, bw->xres, bw->yres, stripes, nstripes,
+              pieces);
+  for (int i = 0; i < nstripes; ++i) stripes[i].halftone = NULL;
+  free(ht);
+  return true;
+}
+
+// see comments in .h file
+bool
+jbig2_encode_generic_pieces(struct Pix *const bw,
+                            const struct jbig2_generic_options &opts,
+                            struct jbig2_pieces *pieces) {
+  if (!bw || !striping_ok(opts)) return false;
+  if (opts.remove_specks) jbig2_remove_specks(bw);
+  pixSetPadBits(bw, 0);
+  return encode_generic_pieces(bw, opts, pieces);
+}
+
+// see comments in .h file
+bool
+jbig2_encode_generic_rows_pieces(L_ROWREADER *rr, int bw_threshold,
+                                 int upsample,
+                                 const struct jbig2_generic_options &opts,
+                                 struct jbig2_pieces *pieces) {
+  if (!rr || opts.crop || opts.split_gap > 0 || opts.mmr || opts.stripe_rows) {
+    return false;
+  }
+  if (bw_threshold < 0 || bw_threshold > 256) return false;
+
+  // the page is the one stripe
+  const int scale = rows_scale(rr, upsample);
+  struct jbig2_stripe *const stripe =
+      (struct jbig2_stripe *) calloc(1, sizeof(struct jbig2_stripe));
+  stripe->region.w = jbig2_scaled_size(rr->w, scale);
+  stripe->region.h = jbig2_scaled_size(rr->h, scale);
+  jbig2enc_init(&stripe->ctx);
+  if (!code_rows(&stripe->ctx, rr, bw_threshold, upsample, opts, NULL,
+                 NULL)) {
+    jbig2enc_dealloc(&stripe->ctx);
+    free(stripe);
+    return false;
+  }
+  if (opts.stats) jbig2enc_addstats(&stripe->ctx, opts.stats);
+  stripe->datasize = jbig2enc_datasize(&stripe->ctx);
+  make_pieces(opts, stripe->region.w, stripe->region.h, scaled_res(rr->xres, scale),
+              scaled_res(rr->yres, scale), stripe, 1, pieces);
+  return true;
+}
+
+// see comments in .h file
+void
+jbig2_free_pieces(struct jbig2_pieces *pieces) {
+  for (int i = 0; i < pieces->nstripes; ++i) {
+    jbig2enc_dealloc(&pieces->stripes[i].ctx);
+  }
+  free(pieces->stripes);
+  free(pieces->pieces);
+  free(pieces->segments);
+  free(pieces->headers);
+  memset(pieces, 0, sizeof(*pieces));
+}
+
+// The bands of jbig2_estimate_generic, the rows coded above each, and the
+// fewest bands it samples rather than coding the page
+static const int kEstimateBandRows = 64;
+static const int kEstimateWarmRows = 16;
+static const int kEstimateMinSamples = 8;
+
+// -----------------------------------------------------------------------------
+// Code one band in every sample_every of the whole bands of bw, starting with
+// band first, with the rows above each, and add the bytes of each band to *sum
+// and their squares to *sum2. Returns the number of bands coded.
+//
+// The contexts are carried on from one band to the next, as they would be
+// through the page, and the rows above each only give it its neighbours. The
+// coder holds back a few bytes, but as many before a band as after it, so the
+// difference in its output is the size of the band.
+// -----------------------------------------------------------------------------
+static int
+code_sample_bands(PIX *const bw, const struct jbig2_generic_options &opts,
+                  int first, int sample_every, double *sum, double *sum2) {
+  const int full_bands = bw->h / kEstimateBandRows;
+  int atx, aty;
+  generic_at(opts, &atx, &aty);
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  int n = 0;
+  for (int band = first; band < full_bands; band += sample_every) {
+    const int y0 = band * kEstimateBandRows;
+    const int top = y0 > kEstimateWarmRows ? y0 - kEstimateWarmRows : 0;
+    const int y1 = y0 + kEstimateBandRows;
+    struct jbig2enc_rows rows;
+    jbig2enc_rows_init_at(&rows, bw->w, y1 - top, opts.gbtemplate, atx, aty,
+                          opts.duplicate_line_removal);
+    unsigned start = 0;
+    for (int y = top; y < y1; ++y) {
+      if (y == y0) start = jbig2enc_datasize(&ctx);
+      jbig2enc_rows_code(&ctx, &rows, (u8 *) (bw->data + y * bw->wpl));
+    }
+    jbig2enc_rows_free(&rows);
+    const double bytes = jbig2enc_datasize(&ctx) - start;
+    *sum += bytes;
+    *sum2 += bytes * bytes;
+    n++;
+  }
+  jbig2enc_dealloc(&ctx);
+  return n;
+}
+
+// The size of all of bw coded as a single region, without the headers
+static uint64_t
+code_whole_page(PIX *const bw, const struct jbig2_generic_options &opts) {
+  int atx, aty;
+  generic_at(opts, &atx, &aty);
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  jbig2enc_bitimage_at(&ctx, (u8 *) bw->data, bw->w, bw->h, opts.gbtemplate,
+                       atx, aty, opts.duplicate_line_removal);
+  jbig2enc_final(&ctx);
+  const uint64_t bytes = jbig2enc_datasize(&ctx);
+  jbig2enc_dealloc(&ctx);
+  return bytes;
+}
+
+// see comments in .h file
+bool
+jbig2_estimate_generic(struct Pix *const bw,
+                       const struct jbig2_generic_options &opts,
+                       int sample_every, struct jbig2_estimate *est) {
+  if (!bw) return false;
+  if (opts.remove_specks) jbig2_remove_specks(bw);
+  pixSetPadBits(bw, 0);
+  const int w = bw->w, h = bw->h;
+
+  // the headers, as jbig2_encode_generic_opts writes them for one region
+  struct jbig2_file_header header;
+  Segment seg, seg2, endseg;
+  jbig2_page_info pageinfo;
+  jbig2_generic_region genreg;
+  struct jbig2_region region;
+  memset(&region, 0, sizeof(region));
+  region.w = w;
+  region.h = h;
+  seg.number = opts.segnum ? *opts.segnum : 0;
+  seg2.number = seg.number + 1;
+  endseg.number = seg.number + 2;
+  init_page_info(&seg, &pageinfo, w, h, bw->xres, bw->yres, opts.xres,
+                 opts.yres, opts.page);
+  struct jbig2_generic_options region_opts = opts;
+  region_opts.mmr = false;
+  init_generic_region(&genreg, &region, region_opts);
+  const uint64_t overhead =
+      (opts.full_headers ? sizeof(header) + 2 * endseg.size()
+       : opts.end_of_page ? endseg.size() : 0) +
+      seg.size() + sizeof(pageinfo) + seg2.size() +
+      generic_region_size(&genreg);
+
+  const int nbands = (h + kEstimateBandRows - 1) / kEstimateBandRows;
+  const int full_bands = h / kEstimateBandRows;
+  est->bands = nbands;
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  if (sample_every < 2 || full_bands / sample_every < kEstimateMinSamples) {
+    est->bytes = est->low = est->high = overhead + code_whole_page(bw, opts);
+    est->sampled = 0;
+    jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+    return true;
+  }
+
+  // Only whole bands are sampled, starting in the middle of the first stride.
+  double sum = 0, sum2 = 0;
+  const int n = code_sample_bands(bw, opts, sample_every / 2, sample_every,
+                                  &sum, &sum2);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+
+  // the mean of the bands scaled up to the whole page, with the error of the
+  // mean of a sample of n of the full_bands (and two bytes for the flush)
+  const double mean = sum / n;
+  const double var = n > 1 ? (sum2 - sum * mean) / (n - 1) : 0;
+  const double scale = (double) h / kEstimateBandRows;
+  const double error = 1.96 * scale *
+                       sqrt((var > 0 ? var : 0) / n *
+                            (1 - (double) n / full_bands));
+  const double total = mean * scale;
+  est->bytes = overhead + 2 + (uint64_t) (total + 0.5);
+  est->low = overhead + 2 + (uint64_t) (total > error ? total - error : 0);
+  est->high = overhead + 2 + (uint64_t) (total + error + 0.5);
+  est->sampled = n;
+  return true;
+}
+
+// How far to either side jbig2_search_at looks for the first AT pixel: far
+// enough for the period of the usual halftone screens and dithers at 300 to
+// 600 dpi
+static const int kAtSearchDx = 8;
+
+// -----------------------------------------------------------------------------
+// A location of the first AT pixel tried by jbig2_search_at
+// -----------------------------------------------------------------------------
+struct at_candidate {
+  PIX *bw;
+  struct jbig2_generic_options opts;  // with the location in atx and aty
+  int first, sample_every;  // the bands to code (see code_sample_bands)
+  double bytes;
+};
+
+static void
+try_at_candidate(void *item) {
+  struct at_candidate *const c = (struct at_candidate *) item;
+  if (c->bw->h < kEstimateBandRows) {
+    c->bytes = code_whole_page(c->bw, c->opts);
+    return;
+  }
+  double sum2 = 0;
+  c->bytes = 0;
+  code_sample_bands(c->bw, c->opts, c->first, c->sample_every, &c->bytes,
+                    &sum2);
+}
+
+// see comments in .h file
+bool
+jbig2_search_at(struct Pix *const bw, const struct jbig2_generic_options &opts,
+                int effort, int *atx, int *aty) {
+  if (!bw) return false;
+  if (opts.remove_specks) jbig2_remove_specks(bw);
+  pixSetPadBits(bw, 0);
+  *atx = *aty = 0;
+
+  // the default location first, so that it wins a tie
+  struct at_candidate *const c = (struct at_candidate *) malloc(
+      (3 * (2 * kAtSearchDx + 1) + 1) * sizeof(struct at_candidate));
+  int n = 0;
+  c[n].opts = opts;
+  c[n].opts.atx = c[n].opts.aty = 0;
+  n++;
+  int dx, dy;
+  jbig2enc_default_at(opts.gbtemplate, &dx, &dy);
+  for (int y = -2; y <= 0; ++y) {
+    for (int x = -kAtSearchDx; x <= kAtSearchDx; ++x) {
+      if ((x == dx && y == dy) || !jbig2enc_at_ok(opts.gbtemplate, x, y)) {
+        continue;
+      }
+      c[n].opts = opts;
+      c[n].opts.atx = x;
+      c[n].opts.aty = y;
+      n++;
+    }
+  }
+
+  // Each band sampled costs its rows and those above it, for each location.
+  // The bands are the same for all of them, as in jbig2_estimate_generic, but
+  // a page with fewer bands than the stride has just the middle one.
+  if (effort < 1) effort = 1;
+  const int full_bands = bw->h / kEstimateBandRows;
+  const int every =
+      (n * (kEstimateBandRows + kEstimateWarmRows) +
+       effort * kEstimateBandRows - 1) / (effort * kEstimateBandRows);
+  const int first = (every < full_bands ? every : full_bands) / 2;
+  for (int i = 0; i < n; ++i) {
+    c[i].bw = bw;
+    c[i].opts.stats = NULL;
+    c[i].opts.times = NULL;
+    c[i].first = first;
+    c[i].sample_every = every;
+  }
+
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  run_jobs(try_at_candidate, c, sizeof(struct at_candidate), n, opts.nthreads);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+
+  int best = 0;
+  for (int i = 1; i < n; ++i) {
+    if (c[i].bytes < c[best].bytes) best = i;
+  }
+  *atx = c[best].opts.atx;
+  *aty = c[best].opts.aty;
+  free(c);
+  return true;
+}
+
+// The number of black pixels of the 1 bpp image bw, whose pad bits are zero
+static uint64_t
+count_black(PIX *const bw) {
+  uint64_t black = 0;
+  const size_t nwords = (size_t) bw->wpl * bw->h;
+  for (size_t i = 0; i < nwords; ++i) black += __builtin_popcount(bw->data[i]);
+  return black;
+}
+
+// -----------------------------------------------------------------------------
+// A variant being encoded by jbig2_encode_generic_variants
+// -----------------------------------------------------------------------------
+struct variant_job {
+  struct jbig2_variant *variant;
+  PIX *bw;
+  struct jbig2_generic_options opts;
+  struct jbig2enc_stats stats;
+  unsigned segnum;
+};
+
+static void
+encode_variant(void *item) {
+  struct variant_job *const job = (struct variant_job *) item;
+  encode_generic_pieces(job->bw, job->opts, &job->variant->pieces);
+}
+
+// see comments in .h file
+int
+jbig2_encode_generic_variants(struct Pix *const source, int upsample,
+                              const struct jbig2_generic_options &opts,
+                              struct jbig2_variant *variants, int nvariants,
+                              int nthreads) {
+  for (int i = 0; i < nvariants; ++i) {
+    memset(&variants[i].pieces, 0, sizeof(variants[i].pieces));
+  }
+  if (!striping_ok(opts)) return -1;
+  // the distinct thresholds of the variants, and the image for each
+  int *const thresholds = (int *) malloc(nvariants * sizeof(int));
+  int *const image = (int *) malloc(nvariants * sizeof(int));
+  int nthresholds = 0;
+  for (int i = 0; i < nvariants; ++i) {
+    int j = 0;
+    while (j < nthresholds && thresholds[j] != variants[i].bw_threshold) ++j;
+    if (j == nthresholds) thresholds[nthresholds++] = variants[i].bw_threshold;
+    image[i] = j;
+  }
+  PIX **const bws = (PIX **) calloc(nthresholds, sizeof(PIX *));
+  struct variant_job *const jobs =
+      (struct variant_job *) calloc(nvariants, sizeof(struct variant_job));
+  const bool ok = threshold_several(source, thresholds, nthresholds, upsample,
+                                    nthreads, opts.times, bws);
+  // before the images are shared between the threads, which only read them
+  for (int j = 0; ok && j < nthresholds; ++j) {
+    if (opts.remove_specks) jbig2_remove_specks(bws[j]);
+    pixSetPadBits(bws[j], 0);
+  }
+  for (int i = 0; ok && i < nvariants; ++i) {
+    struct variant_job *const job = &jobs[i];
+    job->variant = &variants[i];
+    job->bw = bws[image[i]];
+    job->variant->width = job->bw->w;
+    job->variant->height = job->bw->h;
+    job->variant->black = 0;
+    if (variants[i].count_black) {
+      int j = 0;
+      while (j < i && (image[j] != image[i] || !variants[j].count_black)) ++j;
+      job->variant->black = j < i ? variants[j].black : count_black(job->bw);
+    }
+    job->opts = opts;
+    job->opts.duplicate_line_removal = variants[i].duplicate_line_removal;
+    job->opts.gbtemplate = variants[i].gbtemplate;
+    job->opts.nthreads = 1;
+    job->opts.stats = opts.stats ? &job->stats : NULL;
+    job->opts.times = NULL;
+    job->opts.deadline_ns = 0;  // every variant is coded to the end
+    // each numbers its segments from the same place
+    job->segnum = opts.segnum ? *opts.segnum : 0;
+    job->opts.segnum = &job->segnum;
+  }
+
+  int best = -1;
+  if (ok) {
+    struct jbig2_clock mark;
+    jbig2_phase_start(opts.times, &mark);
+    run_jobs(encode_variant, jobs, sizeof(struct variant_job), nvariants,
+             nthreads);
+    jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+    for (int i = 0; i < nvariants; ++i) {
+      if (opts.stats) {
+        const struct jbig2enc_stats &stats = jobs[i].stats;
+        opts.stats->mps += stats.mps;
+        opts.stats->lps += stats.lps;
+        opts.stats->renorm_shifts += stats.renorm_shifts;
+        opts.stats->carries += stats.carries;
+        opts.stats->rows += stats.rows;
+        opts.stats->tpgd_rows += stats.tpgd_rows;
+        opts.stats->bytes += stats.bytes;
+      }
+      if (best < 0 ||
+          variants[i].pieces.length < variants[best].pieces.length) {
+        best = i;
+      }
+    }
+    if (opts.segnum) *opts.segnum = jobs[best].segnum;
+  }
+  for (int j = 0; j < nthresholds; ++j) pixDestroy(&bws[j]);
+  free(bws);
+  free(jobs);
+  free(image);
+  free(thresholds);
+  return best;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_file_header(int npages, size_t *const length) {
+  struct jbig2_file_header header;
+  init_file_header(&header, npages);
+  u8 *const ret = (u8 *) malloc(sizeof(header));
+  memcpy(ret, &header, sizeof(header));
+  *length = sizeof(header);
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_end_of_file(unsigned segnum, size_t *const length) {
+  Segment endseg;
+  endseg.number = segnum;
+  endseg.type = segment_end_of_file;
+  u8 *const ret = (u8 *) malloc(endseg.size());
+  size_t offset = 0;
+  SEGMENT(endseg);
+  *length = offset;
+  return ret;
+}
+
+// see comments in .h file
+unsigned
+jbig2_renumber_segments(u8 *data, size_t length, unsigned segnum) {
+  for (size_t offset = 0; offset < length;) {
+    // the segments written flat never refer to others (only the halftones of
+    // jbig2_encode_generic_pieces do), so the header is the fixed part, the
+    // page and the length (see Segment::write)
+    struct jbig2_segment seg;
+    memcpy(&seg, data + offset, sizeof(seg));
+    seg.number = htonl(segnum);
+    segnum++;
+    memcpy(data + offset, &seg, sizeof(seg));
+    offset += sizeof(seg) + (seg.page_assoc_size ? 4 : 1);
+    u32 len;
+    memcpy(&len, data + offset, sizeof(len));
+    offset += sizeof(len) + htonl(len);
+  }
+  return segnum;
+}
+
+// -----------------------------------------------------------------------------
+// Read the header of the segment at offset of data, of size bytes, into *seg,
+// and set *header_size. Returns false if it isn't one which Segment can write,
+// with more than four segments referred to (the long form of 7.2.4), or it
+// doesn't fit.
+// -----------------------------------------------------------------------------
+static bool
+read_segment_header(const u8 *data, size_t size, size_t offset, Segment *seg,
+                    size_t *header_size) {
+  struct jbig2_segment s;
+  if (size - offset < sizeof(s)) return false;
+  memcpy(&s, data + offset, sizeof(s));
+  size_t j = offset + sizeof(s);
+  seg->number = ntohl(s.number);
+  seg->type = s.type;
+  seg->deferred_non_retain = s.deferred_non_retain;
+  seg->retain_bits = s.retain_bits;
+  seg->nreferred = s.segment_count;
+  if (seg->nreferred > 4) return false;
+  const unsigned referred_size = seg->referred_size();
+  const unsigned page_size = s.page_assoc_size ? 4 : 1;
+  if (size - j < seg->nreferred * referred_size + page_size + sizeof(u32)) {
+    return false;
+  }
+  for (int i = 0; i < seg->nreferred; ++i, j += referred_size) {
+    if (referred_size == 1) {
+      seg->referred[i] = data[j];
+    } else if (referred_size == 2) {
+      seg->referred[i] = data[j] << 8 | data[j + 1];
+    } else {
+      u32 v;
+      memcpy(&v, data + j, sizeof(v));
+      seg->referred[i] = ntohl(v);
+    }
+  }
+  if (page_size == 4) {
+    u32 v;
+    memcpy(&v, data + j, sizeof(v));
+    seg->page = ntohl(v);
+  } else {
+    seg->page = data[j];
+  }
+  j += page_size;
+  u32 len;
+  memcpy(&len, data + j, sizeof(len));
+  j += sizeof(len);
+  seg->len = ntohl(len);
+  *header_size = j - offset;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// As read_segment_header, for a segment which must be followed by its data:
+// returns false too if that is of unknown length (7.2.7) or doesn't fit.
+// -----------------------------------------------------------------------------
+static bool
+read_segment(const u8 *data, size_t size, size_t offset, Segment *seg,
+             size_t *header_size) {
+  if (!read_segment_header(data, size, offset, seg, header_size)) return false;
+  return seg->len != 0xffffffff && size - offset - *header_size >= seg->len;
+}
+
+// The longest header Segment writes: four 32-bit segments referred to, and a
+// 32-bit page
+static const int kMaxSegmentHeader = sizeof(struct jbig2_segment) + 4 * 4 + 4 +
+                                     4;
+
+// -----------------------------------------------------------------------------
+// Check that a file can be merged by jbig2_merge_files, and set *npages to the
+// last page which any of its segments is associated with, and add the number
+// of its segments to keep (all but the end of file) to *nsegments. The number
+// of pages in its header isn't used, as it may not be known.
+// -----------------------------------------------------------------------------
+static bool
+check_merge_file(const u8 *data, size_t size, u32 *npages, int *nsegments) {
+  struct jbig2_file_header h;
+  if (size < sizeof(h)) return false;
+  memcpy(&h, data, sizeof(h));
+  // (without the number of pages, the header would be shorter)
+  if (memcmp(h.id, JBIG2_FILE_MAGIC, 8) || !h.organisation_type ||
+      h.unknown_n_pages) {
+    return false;
+  }
+  *npages = 0;
+  // the segments must be numbered one after the other, and each may only
+  // refer to earlier ones of the same file
+  unsigned first = 0, next = 0;
+  for (size_t offset = sizeof(h); offset < size;) {
+    Segment seg;
+    size_t header_size;
+    if (!read_segment(data, size, offset, &seg, &header_size)) return false;
+    if (offset == sizeof(h)) first = next = seg.number;
+    if (seg.number != next++) return false;
+    for (int i = 0; i < seg.nreferred; ++i) {
+      if (seg.referred[i] < first || seg.referred[i] >= seg.number) {
+        return false;
+      }
+    }
+    if (seg.page > *npages) *npages = seg.page;
+    offset += header_size + seg.len;
+    if (seg.type == segment_end_of_file) return offset == size;
+    ++*nsegments;
+  }
+  return true;
+}
+
+// see comments in .h file
+int
+jbig2_merge_files(const uint8_t *const *files, const size_t *lengths,
+                  int nfiles, struct jbig2_pieces *pieces) {
+  memset(pieces, 0, sizeof(*pieces));
+  u32 *const file_pages = (u32 *) malloc(nfiles * sizeof(u32));
+  u32 npages = 0;
+  int nsegments = 0;
+  for (int f = 0; f < nfiles; ++f) {
+    if (!check_merge_file(files[f], lengths[f], &file_pages[f], &nsegments)) {
+      free(file_pages);
+      return f;
+    }
+    npages += file_pages[f];
+  }
+
+  struct jbig2_file_header header;
+  init_file_header(&header, npages);
+  // only the headers are written here: the data of the segments is left where
+  // it is in the files, a piece each
+  const int size = sizeof(header) + (nsegments + 1) * kMaxSegmentHeader;
+  u8 *const ret = (u8 *) malloc(size);
+  pieces->headers = ret;
+  pieces->segments = (int *) malloc((nsegments + 1) * sizeof(int));
+  pieces->pieces = (struct jbig2_piece *) malloc(
+      (2 * nsegments + 2) * sizeof(struct jbig2_piece));
+  int offset = 0;
+  int start = 0;  // where the headers not in a piece yet start
+#define HEADERS_PIECE                                                    \
+  if (offset > start) {                                                  \
+    struct jbig2_piece *const piece = &pieces->pieces[pieces->npieces++]; \
+    piece->data = ret + start;                                           \
+    piece->size = offset - start;                                        \
+    pieces->length += offset - start;                                    \
+    start = offset;                                                      \
+  }
+
+  F(header);
+  unsigned segnum = 0;
+  u32 page_base = 0;
+  for (int f = 0; f < nfiles; ++f) {
+    const unsigned file_base = segnum;
+    unsigned first = 0;
+    for (size_t at = sizeof(header); at < lengths[f];) {
+      Segment seg;
+      size_t header_size;
+      read_segment(files[f], lengths[f], at, &seg, &header_size);
+      if (at == sizeof(header)) first = seg.number;
+      at += header_size;
+      if (seg.type == segment_end_of_file) break;
+      seg.number = seg.number - first + file_base;
+      for (int i = 0; i < seg.nreferred; ++i) {
+        seg.referred[i] = seg.referred[i] - first + file_base;
+      }
+      // page 0 is that of the segments which aren't associated with any
+      if (seg.page) seg.page += page_base;
+      pieces->segments[pieces->nsegments++] = offset;
+      SEGMENT(seg);
+      if (seg.len) {
+        HEADERS_PIECE
+        struct jbig2_piece *const piece = &pieces->pieces[pieces->npieces++];
+        piece->data = files[f] + at;
+        piece->size = seg.len;
+        pieces->length += seg.len;
+      }
+      at += seg.len;
+      segnum++;
+    }
+    page_base += file_pages[f];
+  }
+  Segment endseg;
+  endseg.number = segnum;
+  endseg.type = segment_end_of_file;
+  pieces->segments[pieces->nsegments++] = offset;
+  SEGMENT(endseg);
+  HEADERS_PIECE
+#undef HEADERS_PIECE
+  if (offset > size) abort();
+  pieces->headers_size = offset;
+
+  free(file_pages);
+  return nfiles;
+}
+
+// the rows of each strip of the text regions of symbol coding
+static const int kLogStrips = 2;
+
+// see comments in .h file
+u8 *
+jbig2_encode_symbol_dict(struct jbig2_classifier *classifier, unsigned segnum,
+                         size_t *const length) {
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  jbig2enc_symbol_table(&ctx, classifier);
+  jbig2enc_final(&ctx);
+
+  struct jbig2_symbol_dict symtab;
+  memset(&symtab, 0, sizeof(symtab));
+  // generic template 0 with the AT pixels in the default locations, as for
+  // jbig2enc_bitimage
+  symtab.a1x = 3;
+  symtab.a1y = -1;
+  symtab.a2x = -3;
+  symtab.a2y = -1;
+  symtab.a3x = 2;
+  symtab.a3y = -2;
+  symtab.a4x = -2;
+  symtab.a4y = -2;
+  symtab.exsyms = symtab.newsyms = htonl(classifier->nsymbols);
+
+  Segment seg;
+  seg.number = segnum;
+  seg.type = segment_symbol_table;
+  seg.page = 0;
+  if (!segment_fits(sizeof(symtab) + jbig2enc_datasize(&ctx))) {
+    jbig2enc_dealloc(&ctx);
+    return NULL;
+  }
+  seg.len = sizeof(symtab) + jbig2enc_datasize(&ctx);
+
+  const size_t totalsize = seg.size() + seg.len;
+  u8 *const ret = (u8 *) malloc(totalsize);
+  size_t offset = 0;
+  SEGMENT(seg);
+  F(symtab);
+  jbig2enc_tobuffer(&ctx, ret + offset);
+  offset += jbig2enc_datasize(&ctx);
+  jbig2enc_dealloc(&ctx);
+  if (totalsize != offset) abort();
+
+  *length = offset;
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_symbol_page(const struct jbig2_classifier *classifier,
+                         const struct jbig2_instance *instances,
+                         int ninstances, int width, int height, int bw_xres,
+                         int bw_yres, unsigned dict_segnum,
+                         const struct jbig2_generic_options &opts,
+                         size_t *const length) {
+  unsigned segnum = opts.segnum ? *opts.segnum : 0;
+
+  struct jbig2_clock mark;
+  jbig2_phase_start(opts.times, &mark);
+  struct jbig2enc_ctx ctx;
+  jbig2enc_init(&ctx);
+  jbig2enc_text_region(&ctx, classifier, instances, ninstances, kLogStrips);
+  jbig2enc_final(&ctx);
+  jbig2_phase_done(opts.times, JBIG2_PHASE_ENCODE, &mark);
+
+  Segment seg, seg2, endseg;
+  jbig2_page_info pageinfo;
+  seg.number = segnum++;
+  init_page_info(&seg, &pageinfo, width, height, bw_xres, bw_yres, opts.xres,
+                 opts.yres, opts.page);
+  // the symbols stand for components which are only about the same
+  pageinfo.is_lossless = 0;
+
+  struct jbig2_text_region textreg;
+  memset(&textreg, 0, sizeof(textreg));
+  textreg.width = htonl(width);
+  textreg.height = htonl(height);
+  textreg.logsbstrips = kLogStrips;
+  textreg.refcorner = 0;  // bottom left
+  struct jbig2_text_region_syminsts syminsts;
+  syminsts.sbnuminstances = htonl(ninstances);
+
+  if (!segment_fits(sizeof(textreg) + sizeof(syminsts) +
+                    jbig2enc_datasize(&ctx))) {
+    jbig2enc_dealloc(&ctx);
+    return NULL;
+  }
+  // a page without any symbols is just the page info
+  if (ninstances) {
+    seg2.number = segnum++;
+    seg2.type = segment_imm_text_region;
+    seg2.page = opts.page;
+    seg2.nreferred = 1;
+    seg2.referred[0] = dict_segnum;
+    // the dictionary is kept for the pages after this one
+    seg2.retain_bits = 2;
+    seg2.len = sizeof(textreg) + sizeof(syminsts) + jbig2enc_datasize(&ctx);
+  }
+  endseg.number = segnum;
+  endseg.type = segment_end_of_page;
+  endseg.page = opts.page;
+  if (opts.end_of_page) segnum++;
+
+  const size_t totalsize = seg.size() + sizeof(pageinfo) +
+                           (ninstances ? seg2.size() + seg2.len : 0) +
+                           (opts.end_of_page ? endseg.size() : 0);
+  u8 *const ret = (u8 *) malloc(totalsize);
+  size_t offset = 0;
+  SEGMENT(seg);
+  F(pageinfo);
+  if (ninstances) {
+    SEGMENT(seg2);
+    F(textreg);
+    F(syminsts);
+    jbig2enc_tobuffer(&ctx, ret + offset);
+    offset += jbig2enc_datasize(&ctx);
+  }
+  if (opts.end_of_page) {
+    SEGMENT(endseg);
+  }
+  jbig2enc_dealloc(&ctx);
+  if (totalsize != offset) abort();
+  if (opts.segnum) *opts.segnum = segnum;
+
+  *length = offset;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Renumber the segments of pieces from segnum, where some of them refer to
+// others (the halftone regions of a page to its pattern dictionary). The
+// segments referred to are renumbered too, and as the size of each of their
+// numbers depends on the number of the segment (7.2.5), the headers are
+// written again into a new buffer, with the pieces which point into the old one
+// moved to match.
+// -----------------------------------------------------------------------------
+static unsigned
+renumber_referring_pieces(struct jbig2_pieces *pieces, unsigned segnum) {
+  const u8 *const old = pieces->headers;
+  const size_t old_size = pieces->headers_size;
+  // each of at most four numbers referred to grows by at most three bytes
+  u8 *const ret = (u8 *) malloc(old_size + 12 * pieces->nsegments);
+  int *const old_segments = (int *) malloc(pieces->nsegments * sizeof(int));
+  memcpy(old_segments, pieces->segments, pieces->nsegments * sizeof(int));
+  size_t in = 0, offset = 0;
+  unsigned first = 0;
+  for (int i = 0; i < pieces->nsegments; ++i) {
+    const size_t at = old_segments[i];
+    memcpy(ret + offset, old + in, at - in);
+    offset += at - in;
+    Segment seg;
+    size_t header_size;
+    if (!read_segment_header(old, old_size, at, &seg, &header_size)) abort();
+    if (i == 0) first = seg.number;
+    seg.number = seg.number - first + segnum;
+    for (int j = 0; j < seg.nreferred; ++j) {
+      seg.referred[j] = seg.referred[j] - first + segnum;
+    }
+    pieces->segments[i] = offset;
+    SEGMENT(seg);
+    in = at + header_size;
+  }
+  memcpy(ret + offset, old + in, old_size - in);
+  offset += old_size - in;
+
+  // the pieces of the headers, in order, start and end between the headers,
+  // each moved by as much as those before it grew
+  int k = 0;
+  for (int i = 0; i < pieces->npieces; ++i) {
+    struct jbig2_piece *const piece = &pieces->pieces[i];
+    if (piece->data < old || piece->data >= old + old_size) continue;
+    const size_t start = piece->data - old, end = start + piece->size;
+    while (k < pieces->nsegments && (size_t) old_segments[k] < start) ++k;
+    const size_t new_start = start + (k < pieces->nsegments
+                                      ? pieces->segments[k] - old_segments[k]
+                                      : offset - old_size);
+    while (k < pieces->nsegments && (size_t) old_segments[k] < end) ++k;
+    const size_t new_end = end + (k < pieces->nsegments
+                                  ? pieces->segments[k] - old_segments[k]
+                                  : offset - old_size);
+    piece->data = ret + new_start;
+    piece->size = new_end - new_start;
+    pieces->length += new_end - new_start - (end - start);
+  }
+  free(old_segments);
+  free(pieces->headers);
+  pieces->headers = ret;
+  pieces->headers_size = offset;
+  return segnum + pieces->nsegments;
+}
+
+// see comments in .h file
+unsigned
+jbig2_renumber_pieces(struct jbig2_pieces *pieces, unsigned segnum) {
+  for (int i = 0; i < pieces->nsegments; ++i) {
+    struct jbig2_segment seg;
+    memcpy(&seg, pieces->headers + pieces->segments[i], sizeof(seg));
+    if (seg.segment_count) return renumber_referring_pieces(pieces, segnum);
+  }
+  for (int i = 0; i < pieces->nsegments; ++i) {
+    u8 *const p = pieces->headers + pieces->segments[i];
+    struct jbig2_segment seg;
+    memcpy(&seg, p, sizeof(seg));
+    seg.number = htonl(segnum);
+    segnum++;
+    memcpy(p, &seg, sizeof(seg));
+  }
+  return segnum;
+}
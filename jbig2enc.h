@@ -39,8 +39,59 @@
 #else
 #include <stdint.h>
 #endif
+#include <stddef.h>
+#include <stdlib.h>
 
 struct Pix;
+struct L_RowReader;
+struct jbig2enc_ctx;
+struct jbig2enc_stats;
+struct jbig2_stripe;
+struct jbig2_classifier;
+struct jbig2_instance;
+
+// -----------------------------------------------------------------------------
+// Timing the phases of encoding a page (see times in jbig2_generic_options).
+// The wall and CPU times spent in each phase are added up in nanoseconds. The
+// CPU time of a phase includes that of any threads it was split between
+// (--stripes, or scaling up with several threads) as well as the thread which
+// ran it.
+// -----------------------------------------------------------------------------
+enum jbig2_phase {
+  JBIG2_PHASE_READ,  // reading and decoding the image
+  JBIG2_PHASE_COLORMAP,  // removing a colormap
+  JBIG2_PHASE_GRAY,  // converting colour to gray (or straight to 1 bpp)
+  JBIG2_PHASE_THRESHOLD,  // thresholding, and scaling for -2, -4 and -s
+  JBIG2_PHASE_ENCODE,  // coding the regions
+  JBIG2_PHASE_OUTPUT,  // writing the output
+  JBIG2_NPHASES
+};
+
+struct jbig2_phase_times {
+  uint64_t wall_ns[JBIG2_NPHASES];
+  uint64_t cpu_ns[JBIG2_NPHASES];
+};
+
+// A moment which a phase is timed from
+struct jbig2_clock {
+  uint64_t wall_ns, cpu_ns;
+};
+
+// Set *mark to now, unless times is NULL
+void
+jbig2_phase_start(const struct jbig2_phase_times *times,
+                  struct jbig2_clock *mark);
+
+// The time now, in nanoseconds from some fixed moment, on the clock which the
+// wall times are measured by (and opts.deadline_ns is given on)
+uint64_t
+jbig2_wall_ns();
+
+// Add the time since *mark to phase of times and set *mark to now, so that
+// the next phase is timed from there. Does nothing if times is NULL.
+void
+jbig2_phase_done(struct jbig2_phase_times *times, int phase,
+                 struct jbig2_clock *mark);
 
 // WARNING: returns a malloced buffer which the caller must free
 // -----------------------------------------------------------------------------
@@ -52,7 +103,8 @@ struct Pix;
 
 // -----------------------------------------------------------------------------
 // Encode an image as a single generic region. This is lossless. It should not
-// be used for images as half-tone coding is not implemented.
+// be used for images of halftones or dither, which take the generic coder most
+// bytes and time: see jbig2_generic_options.halftone for those.
 //
 // see argument comments for jbig2_init
 // duplicate_line_removal: turning this on
@@ -66,6 +118,629 @@ uint8_t *
 jbig2_encode_generic(struct Pix *const bw, const bool full_headers,
                      const int xres, const int yres,
                      const bool duplicate_line_removal,
-                     int *const length);
+                     size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Where the coded stripes of pages (see jbig2_generic_options.nstripes and
+// .stripe_rows) are kept to be used again. The data of a stripe depends on
+// nothing but its rows and how they are coded (its size, template, AT pixel,
+// MMR and TPGD), so each is known by a 128-bit hash of those, key. A page
+// coded again after a small edit then only codes the stripes whose rows the
+// edit changed, the data of the others being copied through as they are.
+//
+// lookup returns true, with the data of the stripe in *data (malloced, which
+// the caller frees) and its size in *size, if it has it. store is given the
+// data of a stripe just coded, to keep or not. Both are called on the threads
+// coding the stripes, several at once.
+// -----------------------------------------------------------------------------
+struct jbig2_stripe_store {
+  bool (*lookup)(void *arg, const uint64_t key[2], uint8_t **data,
+                 size_t *size);
+  void (*store)(void *arg, const uint64_t key[2], const uint8_t *data,
+                size_t size);
+  void *arg;
+};
+
+// -----------------------------------------------------------------------------
+// Options for encoding a page as generic regions. The defaults are those of
+// jbig2_encode_generic.
+// -----------------------------------------------------------------------------
+struct jbig2_generic_options {
+  bool full_headers;  // write a whole JBIG2 file, not just the PDF fragment
+  int xres, yres;  // the resolution to record, or zero for that of the image
+  bool duplicate_line_removal;  // see jbig2_encode_generic
+  // The generic region template (0..3). Templates 1..3 look at fewer pixels,
+  // which makes encoding faster at the cost of a few percent of size.
+  int gbtemplate;
+  // Where the first AT pixel of the template is (see jbig2enc_at_ok), or (0,
+  // 0), which isn't somewhere it can be, for its default location. See
+  // jbig2_search_at.
+  int atx, aty;
+  // Code the regions with MMR (T.6) instead of the arithmetic coder. This is
+  // much faster, both to encode and to decode, but gives larger output.
+  // gbtemplate and duplicate_line_removal are ignored.
+  bool mmr;
+  // Remove the isolated pixels of the page before coding it (lossy, see
+  // jbig2_remove_specks), which changes the image passed in. The pixels of
+  // scanner noise are the least probable ones to code, so this makes the
+  // output smaller, and coding it faster.
+  bool remove_specks;
+  // The page is split into this many horizontal stripes, each coded as its own
+  // generic region at its own offset on the page. The stripes are encoded in
+  // parallel using up to nthreads threads. Each stripe starts again with empty
+  // contexts, so the output grows by about 1% per stripe on a scanned page,
+  // but large pages are encoded many times faster.
+  int nstripes;
+  int nthreads;
+  // Only code the bounding box of the black pixels, leaving the white margins
+  // around it to the default pixel of the page. This saves the time spent
+  // coding the margins of scanned pages.
+  bool crop;
+  // If more than zero, the page is split into separate regions at every run
+  // of at least this many white rows, and only the bands between them are
+  // coded. With crop, each of them is cropped on its own.
+  int split_gap;
+  // If more than zero (and at most 32767), the page is written as a striped
+  // page (7.4.8.5) of stripes of this many rows, the last one maybe fewer. The
+  // regions are split at the end of each stripe, and each stripe is followed
+  // by an end of stripe segment, so a decoder can finish each band of the page
+  // as soon as it has read it. With unknown_height, the height of the page is
+  // written as unknown (0xffffffff), for a source which doesn't know it when
+  // it starts: the decoder takes it from the end of the last stripe.
+  // jbig2_encode_generic_rows and _rows_pieces fail for a striped page.
+  int stripe_rows;
+  bool unknown_height;
+  // If not NULL, the counters of the coders are added to this (see
+  // JBIG2_STATS in jbig2arith.h)
+  struct jbig2enc_stats *stats;
+  // If not NULL, the number of bytes of output for each band of band_rows
+  // rows of the page is added to this, for finding the expensive parts of a
+  // page. It must have room for (height + band_rows - 1) / band_rows entries.
+  uint32_t *band_bytes;
+  int band_rows;
+  // For the pages of a multi-page file (see jbig2_encode_file_header), which
+  // are encoded without full_headers: the page number, whether to end the page
+  // with an end of page segment and, if not NULL, the number of the first
+  // segment, which is advanced past the segments written.
+  int page;
+  bool end_of_page;
+  unsigned *segnum;
+  // If not NULL, the time spent coding is added to this (JBIG2_PHASE_ENCODE),
+  // and by the functions which read the image themselves (_mem and _rows),
+  // that of reading and thresholding it.
+  struct jbig2_phase_times *times;
+  // If not zero, the time (see jbig2_wall_ns) by which the page should be
+  // coded. It is looked at as each stripe starts, so it only saves time with
+  // several stripes (see nstripes): a stripe which the arithmetic coder is
+  // projected to finish too late, at the rate of the stripes of the page coded
+  // so far, is coded with MMR instead, and once the time has passed the
+  // stripes left aren't coded. It is looked at again as each stripe ends, and
+  // if any ends after it (as those started before any rate is known may), the
+  // page fails all the same, and *missed_deadline (if not NULL) is set. So the
+  // page is never coded late, but it may take up to a stripe longer to fail.
+  // It is ignored by _sink, the _rows functions and
+  // jbig2_encode_generic_variants.
+  uint64_t deadline_ns;
+  bool *missed_deadline;
+  // If not NULL, the stripes are looked up in this before they are coded, and
+  // given to it after. A stripe found isn't coded, so it adds nothing to stats
+  // or band_bytes. It is ignored by _sink and the _rows functions, which code
+  // the page as it is read.
+  const struct jbig2_stripe_store *stripe_store;
+  // If not zero, the size in pixels (JBIG2_HALFTONE_MIN_CELL to _MAX_CELL) of
+  // the square cells of halftone regions (6.6). The parts of the page which
+  // look like halftone dots or dither, where a good share of the pixels differ
+  // from their neighbours, are coded as halftone regions instead of generic
+  // ones: a grid of cells, each of which is only coded as its number of black
+  // pixels, to be drawn with the pattern of a dictionary (6.7) for that
+  // number. The patterns are the commonest cells of the page with each number
+  // of black pixels. This is lossy, a cell coming out as the pattern of its
+  // count, but a halftone has far fewer cells than pixels to code. They are
+  // only looked for in the bands of band_rows rows which cost the most bytes
+  // as generic regions (as in band_bytes), estimated from coding a few rows of
+  // each, and the rest of the page is then coded with them left white. It is
+  // only used by jbig2_encode_generic_pieces and _variants.
+  int halftone;
+
+  jbig2_generic_options()
+      : full_headers(true),
+        xres(0),
+        yres(0),
+        duplicate_line_removal(false),
+        gbtemplate(0),
+        atx(0),
+        aty(0),
+        mmr(false),
+        remove_specks(false),
+        nstripes(1),
+        nthreads(1),
+        crop(false),
+        split_gap(0),
+        stripe_rows(0),
+        unknown_height(false),
+        stats(NULL),
+        band_bytes(NULL),
+        band_rows(64),
+        page(1),
+        end_of_page(false),
+        segnum(NULL),
+        times(NULL),
+        deadline_ns(0),
+        missed_deadline(NULL),
+        stripe_store(NULL),
+        halftone(0) {}
+};
+
+// The sizes of the cells of halftone regions which can be coded (see
+// jbig2_generic_options.halftone)
+#define JBIG2_HALFTONE_MIN_CELL 3
+#define JBIG2_HALFTONE_MAX_CELL 8
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic, but with all the options. The length of the data of
+// a segment is 32 bits, so a stripe which would be longer than that (after
+// billions of noisy pixels) is split into more stripes.
+//
+// Returns NULL if bw is NULL, opts.stripe_rows is out of range or
+// opts.deadline_ns was missed.
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_opts(struct Pix *const bw,
+                          const struct jbig2_generic_options &opts,
+                          size_t *const length);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_opts, but instead of returning a buffer, pass the
+// output to sink (with sink_arg as first argument) a block at a time as it is
+// produced, so that the encoded page is never all held in memory. The generic
+// region is written with an unknown length (7.2.7), which some decoders might
+// not support. opts.nstripes is ignored.
+//
+// Returns false iff bw is NULL or opts.stripe_rows is out of range.
+// -----------------------------------------------------------------------------
+bool
+jbig2_encode_generic_sink(struct Pix *const bw,
+                          const struct jbig2_generic_options &opts,
+                          void (*sink)(void *sink_arg, const uint8_t *data,
+                                       size_t size),
+                          void *sink_arg);
+
+// -----------------------------------------------------------------------------
+// A malloced buffer of bytes which frees it when destroyed. It can't be copied,
+// only moved (with C++11) or swapped.
+// -----------------------------------------------------------------------------
+class Jbig2Buffer {
+ public:
+  Jbig2Buffer() : data_(NULL), size_(0) {}
+  // takes ownership of data, which must have come from malloc
+  Jbig2Buffer(uint8_t *data, size_t size) : data_(data), size_(size) {}
+  ~Jbig2Buffer() { free(data_); }
+#if __cplusplus >= 201103L
+  Jbig2Buffer(Jbig2Buffer &&other) : data_(other.data_), size_(other.size_) {
+    other.data_ = NULL;
+    other.size_ = 0;
+  }
+  Jbig2Buffer &operator=(Jbig2Buffer &&other) {
+    swap(other);
+    return *this;
+  }
+#endif
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  void swap(Jbig2Buffer &other) {
+    uint8_t *const data = data_;
+    const size_t size = size_;
+    data_ = other.data_;
+    size_ = other.size_;
+    other.data_ = data;
+    other.size_ = size;
+  }
+
+  // Give up the buffer, which the caller must then free
+  uint8_t *release() {
+    uint8_t *const data = data_;
+    data_ = NULL;
+    size_ = 0;
+    return data;
+  }
+
+ private:
+  Jbig2Buffer(const Jbig2Buffer &);
+  void operator=(const Jbig2Buffer &);
+
+  uint8_t *data_;
+  size_t size_;
+};
+
+// -----------------------------------------------------------------------------
+// An encoder for many pages, one after another, as jbig2_encode_generic_opts.
+// It keeps the context which the first stripe of each page is coded into, and
+// the buffer which the page is written to, so that once they have grown to fit
+// the largest page a page costs no allocation for them: only the parts of the
+// context which were used are cleared for the next one, instead of all of it.
+// The other stripes, when there are several, are coded as before.
+//
+// It isn't safe to use the same encoder from more than one thread at a time.
+// -----------------------------------------------------------------------------
+class Jbig2Encoder {
+ public:
+  Jbig2Encoder();
+  ~Jbig2Encoder();
+
+  // Encode bw. Returns false (with no output) in the cases in which
+  // jbig2_encode_generic_opts returns NULL; otherwise the output is at data()
+  // until the next call to encode, take or reset.
+  bool encode(struct Pix *const bw, const struct jbig2_generic_options &opts);
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Hand the output over to *out (which is emptied first), for keeping after
+  // the next page. Its buffer then has to be allocated again.
+  void take(Jbig2Buffer *const out);
+
+  // Free everything which is kept, as if the encoder was new
+  void reset();
+
+ private:
+  Jbig2Encoder(const Jbig2Encoder &);
+  void operator=(const Jbig2Encoder &);
+
+  struct jbig2enc_ctx *ctx_;  // a flat context, or NULL before the first page
+  const uint8_t *data_;
+  size_t size_;
+};
+
+// -----------------------------------------------------------------------------
+// Make an image bi-level as jbig2 does: a colormap is removed, colour is
+// converted to gray, and gray is thresholded at bw_threshold (0..255), after
+// being scaled up by upsample times if that is 2 or 4, or down by -upsample
+// times if that is -2 to -8. Scaling down averages each square of pixels (see
+// pixScaleGrayAreaThresh), and rounds the size up. A 1 bpp image is returned as
+// it is (as a new reference). source is not destroyed. The scaling up is split
+// between up to nthreads threads.
+//
+// Returns NULL on error.
+// -----------------------------------------------------------------------------
+struct Pix *
+jbig2_threshold(struct Pix *const source, int bw_threshold, int upsample,
+                int nthreads);
+
+// The width or height of a gray image of size pixels once jbig2_threshold has
+// scaled it by upsample
+int
+jbig2_scaled_size(int size, int upsample);
+
+// As jbig2_threshold, adding the time spent in each phase to times
+struct Pix *
+jbig2_threshold_timed(struct Pix *const source, int bw_threshold,
+                      int upsample, int nthreads,
+                      struct jbig2_phase_times *times);
+
+// As jbig2_threshold_timed, but *source is destroyed and set to NULL, even on
+// error. If that was the last reference to a gray image which isn't scaled up,
+// the image is thresholded in its own buffer, which saves making a second one.
+struct Pix *
+jbig2_threshold_in_place(struct Pix **const source, int bw_threshold,
+                         int upsample, int nthreads,
+                         struct jbig2_phase_times *times);
+
+// -----------------------------------------------------------------------------
+// Remove the isolated pixels of the 1 bpp image bw, in place: a black pixel
+// none of whose eight neighbours is black is made white, and a white one all
+// of whose neighbours are black is made black, the pixels outside the image
+// counting as white. Each row is worked out from the row above and the row
+// below a word (32 pixels) at a time, with a few shifts and ands. This is the
+// least of despeckling, the specks of several pixels being left, but it is
+// cheap and takes most of the noise off a scan; it also takes the single
+// pixels of the lightest and darkest parts of a halftone. Doing it again
+// changes nothing.
+// -----------------------------------------------------------------------------
+void
+jbig2_remove_specks(struct Pix *const bw);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_opts, but for a PNG, PNM or gzip-compressed PNM image
+// held in memory (such as an image stream taken out of a PDF), which is made
+// bi-level with jbig2_threshold, scaling up with opts.nthreads threads. The
+// image is decoded straight from data, without any temporary file. If the page
+// is coded as a single region, and isn't scaled up by several threads, it is
+// read and coded a row at a time (see jbig2_encode_generic_rows).
+//
+// Returns NULL if the image cannot be read.
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_mem(const uint8_t *data, size_t size, int bw_threshold,
+                         int upsample,
+                         const struct jbig2_generic_options &opts,
+                         size_t *const length);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_mem, but for an image being read a row at a time
+// (see rowReaderCreateMem in Leptonica). It is made bi-level as by
+// jbig2_threshold and coded as each row is read, so that only a few rows of it
+// are ever held in memory: this is for pages too big to hold whole. The page
+// is coded as a single generic region, so opts.nstripes and opts.nthreads are
+// ignored. rr must not have been read from yet.
+//
+// Returns NULL if opts has crop, split_gap or mmr, which need the whole page,
+// or stripe_rows, if the data is too long for the 32-bit length of a segment
+// (which jbig2_encode_generic_opts would split), or on error.
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_rows(struct L_RowReader *rr, int bw_threshold,
+                          int upsample,
+                          const struct jbig2_generic_options &opts,
+                          size_t *const length);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_rows, but with the output passed to sink as by
+// jbig2_encode_generic_sink, so that neither the page nor its output are ever
+// held in memory.
+//
+// Returns false in the same cases, except that this one can write a striped
+// page (see jbig2_generic_options.stripe_rows): each stripe is then coded as a
+// region of its own as its rows are read. After a read error, part of the page
+// has been passed to sink already.
+// -----------------------------------------------------------------------------
+bool
+jbig2_encode_generic_rows_sink(struct L_RowReader *rr, int bw_threshold,
+                               int upsample,
+                               const struct jbig2_generic_options &opts,
+                               void (*sink)(void *sink_arg,
+                                            const uint8_t *data, size_t size),
+                               void *sink_arg);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_rows, but for a bi-level image of h rows of w pixels
+// which the caller holds, at the resolution xres x yres (0 for none). Row y,
+// at rows[y], is (w + 7) / 8 bytes with the leftmost pixel in the most
+// significant bit of the first byte and 1 for black: the rows of a PBM file,
+// of a TIFF page with min-is-white, or of a 1 bit PNG as libpng gives them
+// with png_set_invert_mono. The bits past the end of each row may be
+// anything. No Pix is made of the image, nor copied: each row goes straight
+// into the words the coder looks at (see jbig2enc_rows_code_msb), and the rows
+// are only read, even with opts.remove_specks.
+//
+// Returns NULL in the same cases as jbig2_encode_generic_rows, or if rows is
+// NULL or the image is empty.
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_bits(const uint8_t *const *rows, int w, int h, int xres,
+                          int yres, const struct jbig2_generic_options &opts,
+                          size_t *const length);
+
+// As jbig2_encode_generic_bits, but for rows stride bytes apart from the first
+// at data (stride may be negative, for an image stored bottom up)
+uint8_t *
+jbig2_encode_generic_bytes(const uint8_t *data, ptrdiff_t stride, int w,
+                           int h, int xres, int yres,
+                           const struct jbig2_generic_options &opts,
+                           size_t *const length);
+
+// -----------------------------------------------------------------------------
+// A page encoded in pieces which are to be written one after the other, such as
+// with writev: the headers, and the chunks of output of the coders as they were
+// coded, so that the page is never put together in one buffer and its data is
+// never copied.
+// -----------------------------------------------------------------------------
+struct jbig2_piece {
+  const uint8_t *data;
+  size_t size;
+};
+
+struct jbig2_pieces {
+  struct jbig2_piece *pieces;
+  int npieces;
+  size_t length;  // the total size of the pieces
+  // what the pieces point into, freed by jbig2_free_pieces
+  uint8_t *headers;
+  size_t headers_size;  // the bytes of headers used
+  int *segments;  // the offset in headers of each segment header
+  int nsegments;
+  struct jbig2_stripe *stripes;
+  int nstripes;
+};
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_opts, but with the output in pieces, which give the
+// same bytes. Returns false iff bw is NULL, opts.stripe_rows is out of range
+// or opts.deadline_ns was missed; otherwise the pieces must be freed with
+// jbig2_free_pieces.
+// -----------------------------------------------------------------------------
+bool
+jbig2_encode_generic_pieces(struct Pix *const bw,
+                            const struct jbig2_generic_options &opts,
+                            struct jbig2_pieces *pieces);
+
+// -----------------------------------------------------------------------------
+// As jbig2_encode_generic_rows, but with the output in pieces as by
+// jbig2_encode_generic_pieces. Returns false in the same cases, with nothing
+// to free.
+// -----------------------------------------------------------------------------
+bool
+jbig2_encode_generic_rows_pieces(struct L_RowReader *rr, int bw_threshold,
+                                 int upsample,
+                                 const struct jbig2_generic_options &opts,
+                                 struct jbig2_pieces *pieces);
+
+void
+jbig2_free_pieces(struct jbig2_pieces *pieces);
+
+// -----------------------------------------------------------------------------
+// An estimate of the size of a page coded as a generic region (see
+// jbig2_estimate_generic)
+// -----------------------------------------------------------------------------
+struct jbig2_estimate {
+  uint64_t bytes;  // the estimated size of the output
+  uint64_t low, high;  // about a 95% confidence interval around bytes
+  int bands;  // the number of bands of rows the page was split into
+  int sampled;  // the number of them which were coded, or 0 if it all was
+};
+
+// -----------------------------------------------------------------------------
+// Estimate the size of the output of jbig2_encode_generic_opts for bw without
+// coding all of it. The page is split into bands of 64 rows and one band in
+// sample_every is coded, after 16 rows above it which warm up the contexts.
+// The total is extrapolated from their mean, with a confidence interval from
+// their spread. A page with too few bands to sample is coded in full, which
+// gives the exact size. Only the template and its AT pixel, TPGD and the
+// options for the headers are used: the page is taken as a single region, and
+// not MMR coded.
+// Returns false iff bw is NULL.
+// -----------------------------------------------------------------------------
+bool
+jbig2_estimate_generic(struct Pix *const bw,
+                       const struct jbig2_generic_options &opts,
+                       int sample_every, struct jbig2_estimate *est);
+
+// -----------------------------------------------------------------------------
+// Find where the first AT pixel of opts.gbtemplate codes bw in the fewest
+// bytes, trying every location of it which the coder allows (see
+// jbig2enc_at_ok) on the same sample of bands of rows, as
+// jbig2_estimate_generic codes them, on up to opts.nthreads threads. The
+// bands are sampled so that the search codes about effort times as many rows
+// as the page has (effort at least 1), shared between the threads; a page of
+// fewer than 64 rows is coded in full for each location. On a page of
+// halftone dots or dither, a pixel a period of the pattern away can take a
+// good part off the size; on text, the default location is as good as any.
+//
+// Sets *atx and *aty to the location found, for opts.atx and .aty: (0, 0) if
+// the default location is as small as any. Returns false iff bw is NULL.
+// -----------------------------------------------------------------------------
+bool
+jbig2_search_at(struct Pix *const bw, const struct jbig2_generic_options &opts,
+                int effort, int *atx, int *aty);
+
+// -----------------------------------------------------------------------------
+// Encoding a page several ways, to keep the smallest
+// -----------------------------------------------------------------------------
+struct jbig2_variant {
+  int bw_threshold;
+  bool duplicate_line_removal;
+  int gbtemplate;
+  bool count_black;  // whether to count the black pixels of the image
+  // set by jbig2_encode_generic_variants: the page encoded this way, the
+  // size of the thresholded image and, if count_black, its black pixels
+  struct jbig2_pieces pieces;
+  int width, height;
+  uint64_t black;
+};
+
+// -----------------------------------------------------------------------------
+// Encode the page source as by jbig2_encode_generic_pieces in each of the
+// nvariants ways, with the other options taken from opts. The source is read
+// once: it is thresholded as by jbig2_threshold, scaled by upsample, once
+// for each threshold of the variants (converted to gray just once and, when
+// scaled up, with each row interpolated just once for all the thresholds),
+// and the variants are then encoded in parallel using up to nthreads threads,
+// each with its own coder. (Each variant is coded on a single thread, so
+// opts.nthreads is ignored.)
+//
+// Returns the index of the smallest variant, or -1 if source couldn't be
+// thresholded or opts.stripe_rows is out of range. The pieces of all the
+// variants must be freed with jbig2_free_pieces, whether or not this failed.
+// -----------------------------------------------------------------------------
+int
+jbig2_encode_generic_variants(struct Pix *const source, int upsample,
+                              const struct jbig2_generic_options &opts,
+                              struct jbig2_variant *variants, int nvariants,
+                              int nthreads);
+
+// -----------------------------------------------------------------------------
+// Multi-page files
+//
+// A file of several pages is the output of jbig2_encode_file_header, then
+// that of each page (encoded with full_headers false, end_of_page true, page
+// the page number from 1 and all using the same segnum counter), and last
+// that of jbig2_encode_end_of_file with the final segment number.
+//
+// WARNING: these return a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_file_header(int npages, size_t *const length);
+
+uint8_t *
+jbig2_encode_end_of_file(unsigned segnum, size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Renumber the segments of a page encoded by jbig2_encode_generic_opts (not by
+// _sink) so that they start at segnum, and return the number after the last.
+// This allows pages to be encoded independently (each with its own segnum
+// counter) and then put together in order.
+// -----------------------------------------------------------------------------
+unsigned
+jbig2_renumber_segments(uint8_t *data, size_t length, unsigned segnum);
+
+// As jbig2_renumber_segments, for a page encoded in pieces
+unsigned
+jbig2_renumber_pieces(struct jbig2_pieces *pieces, unsigned segnum);
+
+// -----------------------------------------------------------------------------
+// Merge whole JBIG2 files, such as the parts of a document whose ranges of
+// pages were encoded on different machines, into one file of all their pages,
+// without coding anything again. The pages of each file follow those of the
+// file before, its segments are numbered on from there (and so are those
+// they refer to), and the merged file has a single header, with the total
+// number of pages, and end of file. Only the headers of the segments are
+// written again: the pieces of the output (see jbig2_encode_generic_pieces)
+// point into files for their data, so the files must be kept until the pieces
+// are written.
+//
+// Returns the number of files merged, which is less than nfiles if the one
+// after them isn't a sequential JBIG2 file whose segments are numbered one
+// after the other, have headers of the short form and data of known length
+// (as files written by jbig2 without --stream are): then there's nothing to
+// free. Otherwise the pieces must be freed with jbig2_free_pieces.
+// -----------------------------------------------------------------------------
+int
+jbig2_merge_files(const uint8_t *const *files, const size_t *lengths,
+                  int nfiles, struct jbig2_pieces *pieces);
+
+// -----------------------------------------------------------------------------
+// Symbol coding
+//
+// The pages of a batch are classified with one jbig2_classifier (see
+// jbig2sym.h), so that the symbols of all of them go in a single dictionary
+// which isn't associated with any page: in a file of its own this comes before
+// the pages, and in PDF it is the JBIG2Globals stream. Each page is then a
+// text region of instances of the symbols. This is lossy: every instance is
+// drawn with the first component of its class.
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// Encode the symbol dictionary of all the symbols of classifier as segment
+// segnum. This numbers the symbols, so it must be done before the pages are
+// encoded. Returns NULL if the data is too long for the 32-bit length of a
+// segment.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_symbol_dict(struct jbig2_classifier *classifier, unsigned segnum,
+                         size_t *const length);
+
+// -----------------------------------------------------------------------------
+// Encode a page of width x height pixels at bw_xres x bw_yres dpi, with the
+// given instances of the symbols of classifier, as a text region which refers
+// to the dictionary segment dict_segnum. The page info and the end of page are
+// written as for jbig2_encode_generic_opts, but full_headers is ignored, and
+// opts.segnum should start after dict_segnum. Of the other options, only xres,
+// yres and times are used. Returns NULL as jbig2_encode_symbol_dict does.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_symbol_page(const struct jbig2_classifier *classifier,
+                         const struct jbig2_instance *instances,
+                         int ninstances, int width, int height, int bw_xres,
+                         int bw_yres, unsigned dict_segnum,
+                         const struct jbig2_generic_options &opts,
+                         size_t *const length);
 
 #endif  // JBIG2ENC_JBIG2_H__
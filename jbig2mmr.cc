@@ -0,0 +1,417 @@
+// MMR (ITU-T T.6, "G4") coding of generic regions.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jbig2mmr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define u32 uint32_t
+#define u16 uint16_t
+#define u8  uint8_t
+
+// C++ doesn't have C99 restricted pointers, but GCC does allow __restrict__
+#if !defined(WIN32)
+#define restrict __restrict__
+#else
+#define restrict
+#endif
+
+// -----------------------------------------------------------------------------
+// The code tables from T.4. Each entry is the code (in the low bits) and its
+// length in bits. Makeup codes are for multiples of 64 starting with 64 for
+// the colour-specific ones and 1792 for the shared extended ones.
+// -----------------------------------------------------------------------------
+struct mmr_code {
+  u16 code;
+  u8 length;
+};
+
+static const struct mmr_code white_terminating[64] = {
+  {0x035,  8}, {0x007,  6}, {0x007,  4}, {0x008,  4}, {0x00b,  4}, {0x00c,  4},
+  {0x00e,  4}, {0x00f,  4}, {0x013,  5}, {0x014,  5}, {0x007,  5}, {0x008,  5},
+  {0x008,  6}, {0x003,  6}, {0x034,  6}, {0x035,  6}, {0x02a,  6}, {0x02b,  6},
+  {0x027,  7}, {0x00c,  7}, {0x008,  7}, {0x017,  7}, {0x003,  7}, {0x004,  7},
+  {0x028,  7}, {0x02b,  7}, {0x013,  7}, {0x024,  7}, {0x018,  7}, {0x002,  8},
+  {0x003,  8}, {0x01a,  8}, {0x01b,  8}, {0x012,  8}, {0x013,  8}, {0x014,  8},
+  {0x015,  8}, {0x016,  8}, {0x017,  8}, {0x028,  8}, {0x029,  8}, {0x02a,  8},
+  {0x02b,  8}, {0x02c,  8}, {0x02d,  8}, {0x004,  8}, {0x005,  8}, {0x00a,  8},
+  {0x00b,  8}, {0x052,  8}, {0x053,  8}, {0x054,  8}, {0x055,  8}, {0x024,  8},
+  {0x025,  8}, {0x058,  8}, {0x059,  8}, {0x05a,  8}, {0x05b,  8}, {0x04a,  8},
+  {0x04b,  8}, {0x032,  8}, {0x033,  8}, {0x034,  8},
+};
+
+static const struct mmr_code white_makeup[27] = {
+  {0x01b,  5}, {0x012,  5}, {0x017,  6}, {0x037,  7}, {0x036,  8}, {0x037,  8},
+  {0x064,  8}, {0x065,  8}, {0x068,  8}, {0x067,  8}, {0x0cc,  9}, {0x0cd,  9},
+  {0x0d2,  9}, {0x0d3,  9}, {0x0d4,  9}, {0x0d5,  9}, {0x0d6,  9}, {0x0d7,  9},
+  {0x0d8,  9}, {0x0d9,  9}, {0x0da,  9}, {0x0db,  9}, {0x098,  9}, {0x099,  9},
+  {0x09a,  9}, {0x018,  6}, {0x09b,  9},
+};
+
+static const struct mmr_code black_terminating[64] = {
+  {0x037, 10}, {0x002,  3}, {0x003,  2}, {0x002,  2}, {0x003,  3}, {0x003,  4},
+  {0x002,  4}, {0x003,  5}, {0x005,  6}, {0x004,  6}, {0x004,  7}, {0x005,  7},
+  {0x007,  7}, {0x004,  8}, {0x007,  8}, {0x018,  9}, {0x017, 10}, {0x018, 10},
+  {0x008, 10}, {0x067, 11}, {0x068, 11}, {0x06c, 11}, {0x037, 11}, {0x028, 11},
+  {0x017, 11}, {0x018, 11}, {0x0ca, 12}, {0x0cb, 12}, {0x0cc, 12}, {0x0cd, 12},
+  {0x068, 12}, {0x069, 12}, {0x06a, 12}, {0x06b, 12}, {0x0d2, 12}, {0x0d3, 12},
+  {0x0d4, 12}, {0x0d5, 12}, {0x0d6, 12}, {0x0d7, 12}, {0x06c, 12}, {0x06d, 12},
+  {0x0da, 12}, {0x0db, 12}, {0x054, 12}, {0x055, 12}, {0x056, 12}, {0x057, 12},
+  {0x064, 12}, {0x065, 12}, {0x052, 12}, {0x053, 12}, {0x024, 12}, {0x037, 12},
+  {0x038, 12}, {0x027, 12}, {0x028, 12}, {0x058, 12}, {0x059, 12}, {0x02b, 12},
+  {0x02c, 12}, {0x05a, 12}, {0x066, 12}, {0x067, 12},
+};
+
+static const struct mmr_code black_makeup[27] = {
+  {0x00f, 10}, {0x0c8, 12}, {0x0c9, 12}, {0x05b, 12}, {0x033, 12}, {0x034, 12},
+  {0x035, 12}, {0x06c, 13}, {0x06d, 13}, {0x04a, 13}, {0x04b, 13}, {0x04c, 13},
+  {0x04d, 13}, {0x072, 13}, {0x073, 13}, {0x074, 13}, {0x075, 13}, {0x076, 13},
+  {0x077, 13}, {0x052, 13}, {0x053, 13}, {0x054, 13}, {0x055, 13}, {0x05a, 13},
+  {0x05b, 13}, {0x064, 13}, {0x065, 13},
+};
+
+static const struct mmr_code ext_makeup[13] = {
+  {0x008, 11}, {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12}, {0x014, 12},
+  {0x015, 12}, {0x016, 12}, {0x017, 12}, {0x01c, 12}, {0x01d, 12}, {0x01e, 12},
+  {0x01f, 12},
+};
+
+static const struct mmr_code pass_code = {0x1, 4};  // 0001
+static const struct mmr_code horizontal_code = {0x1, 3};  // 001
+// indexed by b1 - a1 + 3: VR3, VR2, VR1, V0, VL1, VL2, VL3
+static const struct mmr_code vertical_codes[7] = {
+  {0x03, 7}, {0x03, 6}, {0x3, 3}, {0x1, 1}, {0x2, 3}, {0x02, 6}, {0x02, 7},
+};
+static const struct mmr_code eol_code = {0x001, 12};
+
+// -----------------------------------------------------------------------------
+// Bits are collected MSB first in acc and passed to the context a byte at a
+// time.
+// -----------------------------------------------------------------------------
+struct mmr_writer {
+  struct jbig2enc_ctx *ctx;
+  u32 acc;
+  int bits;  // number of bits in the low end of acc
+};
+
+static inline void
+put_code(struct mmr_writer *restrict w, const struct mmr_code &code) {
+  w->acc = (w->acc << code.length) | code.code;
+  w->bits += code.length;
+  while (w->bits >= 8) {
+    w->bits -= 8;
+    jbig2enc_putbyte(w->ctx, w->acc >> w->bits);
+  }
+}
+
+// Write the codes for a run of length run of the colour (1 for black)
+static void
+put_span(struct mmr_writer *restrict w, int run, int color) {
+  const struct mmr_code *const terminating =
+      color ? black_terminating : white_terminating;
+  const struct mmr_code *const makeup = color ? black_makeup : white_makeup;
+
+  while (run >= 2560) {
+    put_code(w, ext_makeup[(2560 - 1792) / 64]);
+    run -= 2560;
+  }
+  if (run >= 64) {
+    const int m = run & ~63;
+    put_code(w, m < 1792 ? makeup[m / 64 - 1] : ext_makeup[(m - 1792) / 64]);
+    run -= m;
+  }
+  put_code(w, terminating[run]);
+}
+
+// -----------------------------------------------------------------------------
+// Returns the first pixel at or after x which isn't of the given colour, or w
+// if there isn't one. This skips whole words of the colour at a time.
+// -----------------------------------------------------------------------------
+static inline int
+find_change(const u32 *restrict row, int w, int x, int color) {
+  if (x >= w) return w;
+  const u32 flip = color ? 0xffffffff : 0;
+  const int words = (w + 31) >> 5;
+  int i = x >> 5;
+  u32 word = (row[i] ^ flip) & (0xffffffff >> (x & 31));
+  while (!word) {
+    if (++i == words) return w;
+    word = row[i] ^ flip;
+  }
+  // the pad bits are zero, so for black they look like a change past the end
+  const int p = i * 32 + __builtin_clz(word);
+  return p < w ? p : w;
+}
+
+// -----------------------------------------------------------------------------
+// Code one row against the reference (previous) row with the 2D coding modes
+// of T.6. a0 is the start of the current run and color is its colour; a1 and
+// b1, b2 are the changing pixels of the coding and reference rows as in T.4.
+// -----------------------------------------------------------------------------
+static void
+encode_row(struct mmr_writer *restrict w, const u32 *restrict ref,
+           const u32 *restrict cur, int width) {
+  int a0 = 0, color = 0;
+  int a1 = find_change(cur, width, 0, 0);
+  int b1 = find_change(ref, width, 0, 0);
+
+  for (;;) {
+    const int b2 = find_change(ref, width, b1, !color);
+    if (b2 < a1) {
+      put_code(w, pass_code);
+      a0 = b2;
+    } else if (b1 - a1 >= -3 && b1 - a1 <= 3) {
+      put_code(w, vertical_codes[b1 - a1 + 3]);
+      a0 = a1;
+      color = !color;
+    } else {
+      const int a2 = find_change(cur, width, a1, !color);
+      put_code(w, horizontal_code);
+      put_span(w, a1 - a0, color);
+      put_span(w, a2 - a1, !color);
+      a0 = a2;
+    }
+    if (a0 >= width) break;
+
+    a1 = find_change(cur, width, a0, color);
+    b1 = find_change(ref, width, find_change(ref, width, a0, !color), color);
+  }
+}
+
+// see comments in .h file
+void
+jbig2enc_mmrimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
+                  int mx, int my) {
+  const u32 *restrict data = (u32 *) idata;
+  const int words_per_row = (mx + 31) / 32;
+  // the reference row for the first row is all white
+  u32 *const white = (u32 *) calloc(words_per_row, sizeof(u32));
+
+  struct mmr_writer w;
+  w.ctx = ctx;
+  w.acc = 0;
+  w.bits = 0;
+
+#ifdef JBIG2_STATS
+  ctx->stats.rows += my;
+#endif
+  for (int y = 0; y < my; ++y) {
+    encode_row(&w, y ? &data[(y - 1) * words_per_row] : white,
+               &data[y * words_per_row], mx);
+    if (ctx->band_bytes) jbig2enc_endrow(ctx, y, my);
+  }
+
+  // EOFB, then pad to a byte
+  put_code(&w, eol_code);
+  put_code(&w, eol_code);
+  if (w.bits) {
+    const struct mmr_code pad = {0, (u8) (8 - w.bits)};
+    put_code(&w, pad);
+  }
+  jbig2enc_flush(ctx);
+
+  free(white);
+}
+
+// -----------------------------------------------------------------------------
+// Decoding, for reading G4 pages of TIFF files. The codes are looked up in
+// tables indexed by the next kRunBits (or kModeBits) bits of the data, which
+// are made from the code tables above, so that the decoder and the encoder
+// can't disagree.
+// -----------------------------------------------------------------------------
+static const int kRunBits = 13;  // the longest run code (black makeup)
+static const int kModeBits = 7;  // the longest mode code (VR3 and VL3)
+
+struct mmr_entry {
+  u16 value;  // the run length, or the mode
+  u8 length;  // of the code, or 0 if no code starts with these bits
+};
+
+enum { MODE_PASS = 7, MODE_HORIZONTAL = 8 };  // 0 to 6 are vertical modes
+
+struct mmr_reader {
+  const u8 *data, *end;
+  bool lsb_first;  // for a TIFF FillOrder of 2
+  uint64_t acc;  // the next bits in the top end
+  int bits;
+  int past_end;  // the number of zero bytes read after the data
+  struct mmr_entry runs[2][1 << kRunBits];  // white and black
+  struct mmr_entry modes[1 << kModeBits];
+};
+
+static void
+add_entry(struct mmr_entry *table, int table_bits,
+          const struct mmr_code &code, int value) {
+  const int shift = table_bits - code.length;
+  for (int i = 0; i < 1 << shift; ++i) {
+    table[(code.code << shift) | i].value = value;
+    table[(code.code << shift) | i].length = code.length;
+  }
+}
+
+static void
+init_reader(struct mmr_reader *r, const u8 *data, size_t size,
+            bool lsb_first) {
+  r->data = data;
+  r->end = data + size;
+  r->lsb_first = lsb_first;
+  r->acc = 0;
+  r->bits = 0;
+  r->past_end = 0;
+  memset(r->runs, 0, sizeof(r->runs));
+  memset(r->modes, 0, sizeof(r->modes));
+  for (int color = 0; color < 2; ++color) {
+    const struct mmr_code *const terminating =
+        color ? black_terminating : white_terminating;
+    const struct mmr_code *const makeup = color ? black_makeup : white_makeup;
+    for (int i = 0; i < 64; ++i) {
+      add_entry(r->runs[color], kRunBits, terminating[i], i);
+    }
+    for (int i = 0; i < 27; ++i) {
+      add_entry(r->runs[color], kRunBits, makeup[i], (i + 1) * 64);
+    }
+    for (int i = 0; i < 13; ++i) {
+      add_entry(r->runs[color], kRunBits, ext_makeup[i], 1792 + i * 64);
+    }
+  }
+  add_entry(r->modes, kModeBits, pass_code, MODE_PASS);
+  add_entry(r->modes, kModeBits, horizontal_code, MODE_HORIZONTAL);
+  for (int i = 0; i < 7; ++i) {
+    add_entry(r->modes, kModeBits, vertical_codes[i], i);
+  }
+}
+
+static inline u8
+reverse_bits(u8 b) {
+  b = (b >> 4) | (b << 4);
+  b = ((b >> 2) & 0x33) | ((b & 0x33) << 2);
+  return ((b >> 1) & 0x55) | ((b & 0x55) << 1);
+}
+
+// Returns the next n bits (at most kRunBits), without using them
+static inline u32
+peek_bits(struct mmr_reader *restrict r, int n) {
+  while (r->bits <= 56) {
+    u8 b = 0;
+    if (r->data < r->end) {
+      b = *r->data++;
+      if (r->lsb_first) b = reverse_bits(b);
+    } else {
+      ++r->past_end;
+    }
+    r->acc |= (uint64_t) b << (56 - r->bits);
+    r->bits += 8;
+  }
+  return r->acc >> (64 - n);
+}
+
+static inline void
+skip_bits(struct mmr_reader *restrict r, int n) {
+  r->acc <<= n;
+  r->bits -= n;
+}
+
+// Reads the codes of a run of the colour (1 for black), returning its length
+// or -1 if there isn't a valid code, or the run is longer than max
+static int
+get_span(struct mmr_reader *restrict r, int color, int max) {
+  int run = 0;
+  for (;;) {
+    const struct mmr_entry &e = r->runs[color][peek_bits(r, kRunBits)];
+    if (!e.length) return -1;
+    skip_bits(r, e.length);
+    run += e.value;
+    if (run > max) return -1;
+    if (e.value < 64) return run;
+  }
+}
+
+// Make the pixels from x0 up to x1 of row black
+static inline void
+set_span(u32 *restrict row, int x0, int x1) {
+  if (x0 >= x1) return;
+  const int i0 = x0 >> 5, i1 = (x1 - 1) >> 5;
+  const u32 first = 0xffffffff >> (x0 & 31);
+  const u32 last = 0xffffffff << (31 - ((x1 - 1) & 31));
+  if (i0 == i1) {
+    row[i0] |= first & last;
+    return;
+  }
+  row[i0] |= first;
+  for (int i = i0 + 1; i < i1; ++i) row[i] = 0xffffffff;
+  row[i1] |= last;
+}
+
+// -----------------------------------------------------------------------------
+// Decode one row coded by encode_row, finding a0, a1, b1 and b2 as it does.
+// Returns false if the codes are not valid.
+// -----------------------------------------------------------------------------
+static bool
+decode_row(struct mmr_reader *restrict r, const u32 *restrict ref,
+           u32 *restrict cur, int width) {
+  int a0 = 0, color = 0;
+  int b1 = find_change(ref, width, 0, 0);
+
+  for (;;) {
+    const int b2 = find_change(ref, width, b1, !color);
+    const struct mmr_entry &e = r->modes[peek_bits(r, kModeBits)];
+    if (!e.length) return false;  // an EOL, or an extension
+    skip_bits(r, e.length);
+    if (e.value == MODE_PASS) {
+      if (color) set_span(cur, a0, b2);
+      a0 = b2;
+    } else if (e.value == MODE_HORIZONTAL) {
+      const int run1 = get_span(r, color, width - a0);
+      if (run1 < 0) return false;
+      const int run2 = get_span(r, !color, width - a0 - run1);
+      if (run2 < 0) return false;
+      if (color) {
+        set_span(cur, a0, a0 + run1);
+      } else {
+        set_span(cur, a0 + run1, a0 + run1 + run2);
+      }
+      a0 += run1 + run2;
+    } else {
+      const int a1 = b1 - e.value + 3;
+      if (a1 < a0 || a1 > width) return false;
+      if (color) set_span(cur, a0, a1);
+      a0 = a1;
+      color = !color;
+    }
+    if (a0 >= width) return true;
+
+    b1 = find_change(ref, width, find_change(ref, width, a0, !color), color);
+  }
+}
+
+// see comments in .h file
+bool
+jbig2_mmr_decode(const uint8_t *data, size_t size, bool lsb_first,
+                 uint32_t *rows, int words_per_row, int mx, int my) {
+  struct mmr_reader *const r =
+      (struct mmr_reader *) malloc(sizeof(struct mmr_reader));
+  if (!r) return false;
+  init_reader(r, data, size, lsb_first);
+  u32 *const white = (u32 *) calloc(words_per_row, sizeof(u32));
+  bool ok = white != NULL;
+  for (int y = 0; ok && y < my; ++y) {
+    ok = decode_row(r, y ? &rows[(y - 1) * words_per_row] : white,
+                    &rows[y * words_per_row], mx) &&
+         r->past_end * 8 - r->bits <= 0;
+  }
+  free(white);
+  free(r);
+  return ok;
+}
@@ -0,0 +1,48 @@
+// MMR (ITU-T T.6, "G4") coding of generic regions.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2MMR_H__
+#define JBIG2ENC_JBIG2MMR_H__
+
+#include "jbig2arith.h"
+
+// -----------------------------------------------------------------------------
+// Code a 1bpp packed image (Leptonica's format, as for jbig2enc_bitimage) with
+// MMR and append the result to the output of ctx, ending with an EOFB and
+// padding to a whole byte. The arithmetic coder state of ctx isn't used, so
+// don't call jbig2enc_final afterwards; in sink mode the output is already
+// passed on when this returns.
+//
+// This is much faster than arithmetic coding (and faster to decode) but the
+// output is larger.
+//
+// *The pad bits at the end of each line must be zero.*
+// -----------------------------------------------------------------------------
+void jbig2enc_mmrimage(struct jbig2enc_ctx *__restrict__ ctx,
+                       const uint8_t *__restrict__ data, int mx, int my);
+
+// -----------------------------------------------------------------------------
+// Decode size bytes of MMR data, as coded by jbig2enc_mmrimage or in a TIFF
+// strip with compression 4 (with the bits of each byte in reverse order if
+// lsb_first, for a FillOrder of 2), into my rows of mx pixels in Leptonica's
+// format, words_per_row words apart. The rows must be zero to start with;
+// only the black pixels are set. Anything after the last row is ignored.
+//
+// Returns false if the data runs out or isn't valid (uncompressed mode, as
+// allowed by T6Options in TIFF, isn't supported either).
+// -----------------------------------------------------------------------------
+bool jbig2_mmr_decode(const uint8_t *data, size_t size, bool lsb_first,
+                      uint32_t *rows, int words_per_row, int mx, int my);
+
+#endif  // JBIG2ENC_JBIG2MMR_H__
@@ -64,6 +64,10 @@ struct Segment {
   int retain_bits;
   unsigned page;  // page number
   unsigned len;   // length of trailing data
+  // the segments this one refers to: at most four, as then they fit in the
+  // short form of the header (7.2.4)
+  int nreferred;
+  unsigned referred[4];
 
   Segment()
       : number(0),
@@ -71,7 +75,16 @@ struct Segment {
         deferred_non_retain(0),
         retain_bits(0),
         page(0),
-        len(0) {}
+        len(0),
+        nreferred(0) {}
+
+  // ---------------------------------------------------------------------------
+  // Return the size of each referred to segment number, which depends on the
+  // number of this segment (7.2.5)
+  // ---------------------------------------------------------------------------
+  unsigned referred_size() const {
+    return number <= 256 ? 1 : number <= 65536 ? 2 : 4;
+  }
 
   // ---------------------------------------------------------------------------
   // Return the size of the segment page association field for this segment.
@@ -87,7 +100,8 @@ struct Segment {
   unsigned size() const {
     const int pagesize = page_size();
 
-    return sizeof(struct jbig2_segment) + pagesize + sizeof(u32);
+    return sizeof(struct jbig2_segment) + nreferred * referred_size() +
+           pagesize + sizeof(u32);
   }
 
   // ---------------------------------------------------------------------------
@@ -103,7 +117,7 @@ struct Segment {
     s.deferred_non_retain = deferred_non_retain;
     s.retain_bits = retain_bits;
 #undef F
-    s.segment_count = 0;
+    s.segment_count = nreferred;
 
     const int pagesize = page_size();
     if (pagesize == 4) s.page_assoc_size = 1;
@@ -116,6 +130,16 @@ struct Segment {
     memcpy(&buf[j], &__i, sizeof(type)); \
     j += sizeof(type)
 
+    for (int i = 0; i < nreferred; ++i) {
+      if (referred_size() == 1) {
+        APPEND(u8, referred[i]);
+      } else if (referred_size() == 2) {
+        APPEND(u16, htons(referred[i]));
+      } else {
+        APPEND(u32, htonl(referred[i]));
+      }
+    }
+
     if (pagesize == 4) {
       APPEND(u32, htonl(page));
     } else {
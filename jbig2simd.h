@@ -0,0 +1,115 @@
+/* The SIMD kernels to use, chosen at run time from what the processor has.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef JBIG2ENC_JBIG2SIMD_H__
+#define JBIG2ENC_JBIG2SIMD_H__
+
+/* This is included by the C code of Leptonica, libpng and zlib as well as by
+ * jbig2, so each of them keeps its own copy of the level; they all come to the
+ * same answer.
+ *
+ * SSE2 and NEON kernels are compiled where they are part of the target (as
+ * SSE2 is on x86-64, and NEON on AArch64), and AVX2 kernels wherever the
+ * compiler can build them for a function (with the target attribute), so that
+ * a portable binary still uses them on a processor which has AVX2.
+ *
+ * The environment variable JBIG2_SIMD can lower the level, for benchmarking:
+ * it is one of scalar, sse2 (or neon, the same level on ARM) and avx2. A
+ * level above what the processor has is ignored. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIMD_SCALAR 0
+#define SIMD_SSE2   1   /* the SSE2 kernels on x86 */
+#define SIMD_NEON   1   /* the NEON kernels on ARM */
+#define SIMD_AVX2   2
+
+#if !defined(NO_SIMD_AVX2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || \
+     defined(__clang__))
+#define SIMD_AVX2_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static inline int
+simd_detect_level(void)
+{
+int          level, forced;
+const char  *env;
+#ifdef SIMD_AVX2_KERNELS
+unsigned int eax, ebx, ecx, edx, xcr0lo, xcr0hi;
+#endif
+
+    level = SIMD_SCALAR;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    level = SIMD_SSE2;
+#endif
+#ifdef SIMD_AVX2_KERNELS
+        /* AVX2 needs the OS to save the ymm registers (OSXSAVE, and the
+         * SSE and AVX state in XCR0) as well as the instructions */
+    if (level == SIMD_SSE2 && __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+        (ecx & (1u << 27)) && (ecx & (1u << 28))) {
+        __asm__ volatile ("xgetbv" : "=a" (xcr0lo), "=d" (xcr0hi) : "c" (0));
+        (void)xcr0hi;
+        if ((xcr0lo & 6) == 6 && __get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if (ebx & (1u << 5))
+                level = SIMD_AVX2;
+        }
+    }
+#endif
+
+    if ((env = getenv("JBIG2_SIMD")) != NULL) {
+        if (strcmp(env, "scalar") == 0)
+            forced = SIMD_SCALAR;
+        else if (strcmp(env, "sse2") == 0 || strcmp(env, "neon") == 0)
+            forced = SIMD_SSE2;
+        else if (strcmp(env, "avx2") == 0)
+            forced = SIMD_AVX2;
+        else
+            forced = level;
+        if (forced < level)
+            level = forced;
+    }
+    return level;
+}
+
+    /* The level of the kernels to use: SIMD_SCALAR, SIMD_SSE2 (SIMD_NEON)
+     * or SIMD_AVX2.  It is the same on every thread: threads which find it
+     * at the same time all store the same value, atomically so that none
+     * of them reads it half written. */
+static inline int
+simd_level(void)
+{
+static int  level = -1;
+int         found;
+
+#if defined(__GNUC__)
+    found = __atomic_load_n(&level, __ATOMIC_RELAXED);
+    if (found < 0) {
+        found = simd_detect_level();
+        __atomic_store_n(&level, found, __ATOMIC_RELAXED);
+    }
+#else
+    if ((found = level) < 0)
+        level = found = simd_detect_level();
+#endif
+    return found;
+}
+
+#endif  /* JBIG2ENC_JBIG2SIMD_H__ */
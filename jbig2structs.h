@@ -25,7 +25,10 @@ enum {
   segment_imm_generic_region = 38,
   segment_page_information = 48,
   segment_imm_text_region =  6,
+  segment_pattern_dict = 16,
+  segment_imm_halftone_region = 22,
   segment_end_of_page = 49,
+  segment_end_of_stripe = 50,
   segment_end_of_file = 51
 };
 
@@ -174,6 +177,53 @@ struct jbig2_text_region {
 } PACKED;
 
 
+struct jbig2_pattern_dict {
+#ifndef _BIG_ENDIAN
+  u8 hdmmr : 1;
+  u8 hdtemplate : 2;
+  u8 reserved : 5;
+#else
+  u8 reserved : 5;
+  u8 hdtemplate : 2;
+  u8 hdmmr : 1;
+#endif
+  u8 hdpw;
+  u8 hdph;
+  u32 graymax;
+  // the AT pixels of the collective bitmap are fixed (6.7.5)
+} PACKED;
+
+struct jbig2_halftone_region {
+  u32 width;
+  u32 height;
+  u32 x;
+  u32 y;
+  u8 comb_operator;
+
+#ifndef _BIG_ENDIAN
+  u8 hmmr : 1;
+  u8 htemplate : 2;
+  u8 henableskip : 1;
+  u8 hcombop : 3;
+  u8 hdefpixel : 1;
+#else
+  u8 hdefpixel : 1;
+  u8 hcombop : 3;
+  u8 henableskip : 1;
+  u8 htemplate : 2;
+  u8 hmmr : 1;
+#endif
+
+  // the grid: its size in cells, and where it starts and steps from the
+  // top left of the region, in 1/256ths of a pixel (6.6.5.1)
+  u32 hgw;
+  u32 hgh;
+  u32 hgx;
+  u32 hgy;
+  u16 hrx;
+  u16 hry;
+} PACKED;
+
 struct jbig2_text_region_atflags {
   signed char a1x, a1y, a2x, a2y;
 } PACKED;
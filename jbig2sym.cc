@@ -0,0 +1,381 @@
+// Symbol classification and coding of symbol dictionaries and text regions.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2arith.h"
+#include "jbig2comps.h"
+#include "jbig2sym.h"
+
+#define u64 uint64_t
+#define u32 uint32_t
+#define u8  uint8_t
+
+// how far the threshold is raised towards one for a symbol which is all black
+static const double kWeight = 0.5;
+// the largest difference in width or height of symbols which are compared
+static const int kMaxSizeDiff = 2;
+
+// see comments in .h file
+void
+jbig2_classifier_init(struct jbig2_classifier *classifier, float threshold) {
+  memset(classifier, 0, sizeof(*classifier));
+  classifier->threshold = threshold;
+}
+
+// see comments in .h file
+void
+jbig2_classifier_free(struct jbig2_classifier *classifier) {
+  for (int i = 0; i < classifier->nsymbols; ++i) {
+    free(classifier->symbols[i].data);
+  }
+  free(classifier->symbols);
+  free(classifier->buckets);
+  memset(classifier, 0, sizeof(*classifier));
+}
+
+static unsigned
+bucket_of(const struct jbig2_classifier *classifier, int w, int h) {
+  return ((u32) w * 2654435761u ^ (u32) h * 40503u) &
+         (classifier->nbuckets - 1);
+}
+
+// Keep about one symbol per bucket. The buckets are filled again in the order
+// the symbols were added, so each still has the newest first.
+static bool
+grow_buckets(struct jbig2_classifier *classifier) {
+  const int n = classifier->nbuckets ? classifier->nbuckets * 2 : 256;
+  int *const buckets = (int *) malloc(n * sizeof(int));
+  if (!buckets) return false;
+  free(classifier->buckets);
+  classifier->buckets = buckets;
+  classifier->nbuckets = n;
+  for (int i = 0; i < n; ++i) buckets[i] = -1;
+  for (int i = 0; i < classifier->nsymbols; ++i) {
+    struct jbig2_symbol *const sym = &classifier->symbols[i];
+    const unsigned b = bucket_of(classifier, sym->w, sym->h);
+    sym->next = buckets[b];
+    buckets[b] = i;
+  }
+  return true;
+}
+
+// Returns the 32 pixels of a row starting at pixel x, which may be negative.
+// Pixels outside of the row are zero.
+static inline u32
+row_bits(const u32 *row, int x, int wpl) {
+  const int i = x >> 5;  // arithmetic shift: floor for negative x
+  const u64 hi = i >= 0 && i < wpl ? row[i] : 0;
+  const u64 lo = i + 1 >= 0 && i + 1 < wpl ? row[i + 1] : 0;
+  return (u32) (((hi << 32 | lo) << (x & 31)) >> 32);
+}
+
+// -----------------------------------------------------------------------------
+// A component being classified: its bitmap, in the layout of a symbol
+// -----------------------------------------------------------------------------
+struct candidate {
+  int w, h, wpl;
+  int npixels;
+  double cx, cy;
+  const u32 *data;
+};
+
+// -----------------------------------------------------------------------------
+// Returns true if c matches sym (see jbig2_classify), setting *dx, *dy to where
+// the top left corner of sym goes relative to that of c
+// -----------------------------------------------------------------------------
+static bool
+matches(const struct jbig2_classifier *classifier,
+        const struct jbig2_symbol *sym, const struct candidate *c, int *dx,
+        int *dy) {
+  const double threshold =
+      classifier->threshold + (1.0 - classifier->threshold) * kWeight *
+      sym->npixels / ((double) sym->w * sym->h);
+  // there can't be more pixels in both than in the smaller one
+  const double need = threshold * c->npixels * sym->npixels;
+  const double most = c->npixels < sym->npixels ? c->npixels : sym->npixels;
+  if (most * most < need) return false;
+
+  *dx = (int) floor(c->cx - sym->cx + 0.5);
+  *dy = (int) floor(c->cy - sym->cy + 0.5);
+  const int swpl = (sym->w + 31) / 32;
+  const int y0 = *dy > 0 ? *dy : 0;
+  const int y1 = c->h < sym->h + *dy ? c->h : sym->h + *dy;
+  u64 both = 0;
+  for (int y = y0; y < y1; ++y) {
+    const u32 *const row = c->data + y * c->wpl;
+    const u32 *const srow = sym->data + (y - *dy) * swpl;
+    for (int i = 0; i < c->wpl; ++i) {
+      both += __builtin_popcount(row[i] & row_bits(srow, i * 32 - *dx, swpl));
+    }
+  }
+  return (double) both * both >= need;
+}
+
+// -----------------------------------------------------------------------------
+// Returns the first symbol which c matches, looking at those of its own size
+// first and then at those of sizes further and further from it, or -1
+// -----------------------------------------------------------------------------
+static int
+find_match(const struct jbig2_classifier *classifier,
+           const struct candidate *c, int *dx, int *dy) {
+  if (!classifier->nbuckets) return -1;
+  for (int d = 0; d <= 2 * kMaxSizeDiff; ++d) {
+    for (int dh = -kMaxSizeDiff; dh <= kMaxSizeDiff; ++dh) {
+      for (int dw = -kMaxSizeDiff; dw <= kMaxSizeDiff; ++dw) {
+        const int w = c->w + dw, h = c->h + dh;
+        if (abs(dw) + abs(dh) != d || w < 1 || h < 1) continue;
+        for (int s = classifier->buckets[bucket_of(classifier, w, h)]; s >= 0;
+             s = classifier->symbols[s].next) {
+          const struct jbig2_symbol *const sym = &classifier->symbols[s];
+          if (sym->w == w && sym->h == h &&
+              matches(classifier, sym, c, dx, dy)) {
+            return s;
+          }
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+// Add c as a new symbol. Returns its number, or -1 if we ran out of memory.
+static int
+add_symbol(struct jbig2_classifier *classifier, const struct candidate *c) {
+  if (classifier->nsymbols >= classifier->nbuckets &&
+      !grow_buckets(classifier)) {
+    return -1;
+  }
+  if (classifier->nsymbols == classifier->symbols_size) {
+    const int size = classifier->symbols_size ? classifier->symbols_size * 2
+                                              : 256;
+    struct jbig2_symbol *const symbols = (struct jbig2_symbol *)
+        realloc(classifier->symbols, size * sizeof(*symbols));
+    if (!symbols) return -1;
+    classifier->symbols = symbols;
+    classifier->symbols_size = size;
+  }
+  u32 *const data = (u32 *) malloc(c->wpl * c->h * sizeof(u32));
+  if (!data) return -1;
+  memcpy(data, c->data, c->wpl * c->h * sizeof(u32));
+
+  const int i = classifier->nsymbols++;
+  struct jbig2_symbol *const sym = &classifier->symbols[i];
+  sym->w = c->w;
+  sym->h = c->h;
+  sym->npixels = c->npixels;
+  sym->cx = c->cx;
+  sym->cy = c->cy;
+  sym->data = data;
+  sym->index = -1;
+  const unsigned b = bucket_of(classifier, c->w, c->h);
+  sym->next = classifier->buckets[b];
+  classifier->buckets[b] = i;
+  return i;
+}
+
+// see comments in .h file
+bool
+jbig2_classify(struct jbig2_classifier *classifier, PIX *bw,
+               struct jbig2_instance **instances, int *ninstances) {
+  *instances = NULL;
+  *ninstances = 0;
+  struct jbig2_components comps;
+  if (!jbig2_find_components(bw, 8, &comps)) return false;
+  struct jbig2_instance *const out = (struct jbig2_instance *)
+      malloc((comps.ncomps ? comps.ncomps : 1) * sizeof(*out));
+  u32 *scratch = NULL;
+  size_t scratch_size = 0;
+  bool ok = out != NULL;
+
+  for (int i = 0; ok && i < comps.ncomps; ++i) {
+    const struct jbig2_component *const comp = &comps.comps[i];
+    struct candidate c;
+    c.w = comp->w;
+    c.h = comp->h;
+    c.wpl = (comp->w + 31) / 32;
+    c.npixels = comp->npixels;
+    const size_t words = (size_t) c.wpl * c.h;
+    if (words > scratch_size) {
+      free(scratch);
+      scratch_size = words * 2;
+      scratch = (u32 *) malloc(scratch_size * sizeof(u32));
+      if (!scratch) {
+        ok = false;
+        break;
+      }
+    }
+    memset(scratch, 0, words * sizeof(u32));
+    jbig2_draw_component(&comps, i, scratch, c.wpl);
+    c.data = scratch;
+    double sumx = 0, sumy = 0;
+    for (int r = comp->first_run; r < comp->first_run + comp->nruns; ++r) {
+      const struct jbig2_run *const run = &comps.runs[r];
+      const int n = run->x1 - run->x0;
+      sumx += 0.5 * n * (run->x0 + run->x1 - 1 - 2 * comp->x);
+      sumy += (double) n * (run->y - comp->y);
+    }
+    c.cx = sumx / c.npixels;
+    c.cy = sumy / c.npixels;
+
+    int dx = 0, dy = 0;
+    int symbol = find_match(classifier, &c, &dx, &dy);
+    if (symbol < 0) {
+      symbol = add_symbol(classifier, &c);
+      dx = dy = 0;
+      if (symbol < 0) ok = false;
+    }
+    out[i].symbol = symbol;
+    out[i].x = comp->x + dx;
+    out[i].y = comp->y + dy;
+  }
+
+  free(scratch);
+  if (ok) {
+    *instances = out;
+    *ninstances = comps.ncomps;
+  } else {
+    free(out);
+  }
+  jbig2_free_components(&comps);
+  return ok;
+}
+
+// -----------------------------------------------------------------------------
+// The symbols in the order they are coded in the dictionary
+// -----------------------------------------------------------------------------
+struct coded_symbol {
+  int h, w;
+  int symbol;
+};
+
+static int
+compare_coded(const void *a, const void *b) {
+  const struct coded_symbol *const x = (const struct coded_symbol *) a;
+  const struct coded_symbol *const y = (const struct coded_symbol *) b;
+  if (x->h != y->h) return x->h < y->h ? -1 : 1;
+  if (x->w != y->w) return x->w < y->w ? -1 : 1;
+  return x->symbol < y->symbol ? -1 : x->symbol > y->symbol;
+}
+
+// see comments in .h file
+void
+jbig2enc_symbol_table(struct jbig2enc_ctx *ctx,
+                      struct jbig2_classifier *classifier) {
+  const int n = classifier->nsymbols;
+  struct coded_symbol *const order = (struct coded_symbol *)
+      malloc((n ? n : 1) * sizeof(*order));
+  for (int i = 0; i < n; ++i) {
+    order[i].h = classifier->symbols[i].h;
+    order[i].w = classifier->symbols[i].w;
+    order[i].symbol = i;
+  }
+  qsort(order, n, sizeof(*order), compare_coded);
+
+  // each height class is the change in height, then the change in width and
+  // the bitmap of each symbol, ending with an OOB
+  int height = 0;
+  for (int k = 0; k < n;) {
+    jbig2enc_int(ctx, JBIG2_IADH, order[k].h - height);
+    height = order[k].h;
+    int width = 0;
+    for (; k < n && order[k].h == height; ++k) {
+      struct jbig2_symbol *const sym = &classifier->symbols[order[k].symbol];
+      sym->index = k;
+      jbig2enc_int(ctx, JBIG2_IADW, sym->w - width);
+      width = sym->w;
+      jbig2enc_bitimage(ctx, (const u8 *) sym->data, sym->w, sym->h, false);
+    }
+    jbig2enc_oob(ctx, JBIG2_IADW);
+  }
+  // the export flags are runs of symbols which are not exported and which are,
+  // in turn: none which aren't, then all of them
+  if (n) {
+    jbig2enc_int(ctx, JBIG2_IAEX, 0);
+    jbig2enc_int(ctx, JBIG2_IAEX, n);
+  }
+  free(order);
+}
+
+// -----------------------------------------------------------------------------
+// An instance as it is placed in a text region: s and t are the column and row
+// of its bottom left corner, and strip the strip which t is in
+// -----------------------------------------------------------------------------
+struct placed {
+  int strip, s, t;
+  int w, id;
+};
+
+static int
+compare_placed(const void *a, const void *b) {
+  const struct placed *const x = (const struct placed *) a;
+  const struct placed *const y = (const struct placed *) b;
+  if (x->strip != y->strip) return x->strip < y->strip ? -1 : 1;
+  if (x->s != y->s) return x->s < y->s ? -1 : 1;
+  if (x->t != y->t) return x->t < y->t ? -1 : 1;
+  return x->id < y->id ? -1 : x->id > y->id;
+}
+
+// see comments in .h file
+void
+jbig2enc_text_region(struct jbig2enc_ctx *ctx,
+                     const struct jbig2_classifier *classifier,
+                     const struct jbig2_instance *instances, int ninstances,
+                     int logsbstrips) {
+  const int strips = 1 << logsbstrips;
+  struct placed *const p = (struct placed *)
+      malloc((ninstances ? ninstances : 1) * sizeof(*p));
+  for (int i = 0; i < ninstances; ++i) {
+    const struct jbig2_symbol *const sym =
+        &classifier->symbols[instances[i].symbol];
+    p[i].s = instances[i].x;
+    p[i].t = instances[i].y + sym->h - 1;
+    // floor(t / strips), as the top row of a symbol may be above the page
+    p[i].strip = p[i].t >= 0 ? p[i].t >> logsbstrips
+                             : -((-p[i].t - 1) >> logsbstrips) - 1;
+    p[i].w = sym->w;
+    p[i].id = sym->index;
+  }
+  qsort(p, ninstances, sizeof(*p), compare_placed);
+
+  int symcodelen = 0;
+  while ((1 << symcodelen) < classifier->nsymbols) symcodelen++;
+
+  // the strip is coded in units of strips, and the first value is negated
+  jbig2enc_int(ctx, JBIG2_IADT, 0);
+  int strip = 0, firsts = 0;
+  for (int k = 0; k < ninstances;) {
+    jbig2enc_int(ctx, JBIG2_IADT, p[k].strip - strip);
+    strip = p[k].strip;
+    // the first instance of a strip is placed from the first of the last one,
+    // and the others from the right hand side of the one before them
+    jbig2enc_int(ctx, JBIG2_IAFS, p[k].s - firsts);
+    firsts = p[k].s;
+    int curs = firsts;
+    for (bool first = true; k < ninstances && p[k].strip == strip;
+         ++k, first = false) {
+      if (!first) jbig2enc_int(ctx, JBIG2_IADS, p[k].s - curs);
+      if (strips > 1) jbig2enc_int(ctx, JBIG2_IAIT, p[k].t - strip * strips);
+      jbig2enc_iaid(ctx, symcodelen, p[k].id);
+      curs = p[k].s + p[k].w - 1;
+    }
+    jbig2enc_oob(ctx, JBIG2_IADS);
+  }
+  free(p);
+}
@@ -0,0 +1,98 @@
+// Symbol classification and coding of symbol dictionaries and text regions.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2SYM_H__
+#define JBIG2ENC_JBIG2SYM_H__
+
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+struct Pix;
+struct jbig2enc_ctx;
+
+// A class of connected components, which are all drawn with its first one
+struct jbig2_symbol {
+  int w, h;
+  int npixels;
+  double cx, cy;  // the centroid, from the top left corner
+  uint32_t *data;  // (w + 31) / 32 words per row, with zero pad bits
+  int next;  // the next symbol in the same bucket, or -1
+  int index;  // its number in the symbol dictionary (see jbig2enc_symbol_table)
+};
+
+// A symbol drawn on a page with its top left corner at x, y
+struct jbig2_instance {
+  int symbol;
+  int x, y;
+};
+
+// -----------------------------------------------------------------------------
+// The classes found so far on the pages of a batch, so that they can all share
+// one symbol dictionary. The symbols are kept in buckets by their size, and a
+// component is only compared with the ones of about its size.
+// -----------------------------------------------------------------------------
+struct jbig2_classifier {
+  float threshold;  // see jbig2_classify
+  struct jbig2_symbol *symbols;
+  int nsymbols, symbols_size;
+  int *buckets;  // the last symbol added to each bucket, or -1
+  int nbuckets;  // a power of two
+};
+
+// threshold is that of jbig2_classify, as given by -t
+void jbig2_classifier_init(struct jbig2_classifier *classifier,
+                           float threshold);
+
+void jbig2_classifier_free(struct jbig2_classifier *classifier);
+
+// -----------------------------------------------------------------------------
+// Classify the 8-connected components of the 1 bpp image bw, adding a symbol
+// for each one which doesn't match any found so far, and set *instances (which
+// the caller must free) to where each symbol appears on the page.
+//
+// A component is only compared with the symbols which are within two pixels of
+// its width and height, and whose number of pixels doesn't rule out a match.
+// It matches if, with their centroids lined up, the square of the number of
+// pixels in both over the product of their numbers of pixels is at least the
+// threshold, raised towards one for dense symbols (as Leptonica's correlation
+// classifier does with a weight factor of 0.5).
+//
+// Returns false if we ran out of memory.
+// -----------------------------------------------------------------------------
+bool jbig2_classify(struct jbig2_classifier *classifier, struct Pix *bw,
+                    struct jbig2_instance **instances, int *ninstances);
+
+// -----------------------------------------------------------------------------
+// Code all the symbols of classifier as the data of a symbol dictionary which
+// exports them all, with generic template 0 and the default AT pixels. The
+// symbols are numbered (see jbig2_symbol.index) in the order they are coded,
+// which is by height and then by width.
+// -----------------------------------------------------------------------------
+void jbig2enc_symbol_table(struct jbig2enc_ctx *ctx,
+                           struct jbig2_classifier *classifier);
+
+// -----------------------------------------------------------------------------
+// Code instances as the data of a text region which refers to the dictionary
+// of jbig2enc_symbol_table, with strips of 1 << logsbstrips rows and the
+// bottom left corner of the symbols as the reference corner
+// -----------------------------------------------------------------------------
+void jbig2enc_text_region(struct jbig2enc_ctx *ctx,
+                          const struct jbig2_classifier *classifier,
+                          const struct jbig2_instance *instances,
+                          int ninstances, int logsbstrips);
+
+#endif  // JBIG2ENC_JBIG2SYM_H__
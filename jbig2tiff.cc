@@ -0,0 +1,398 @@
+// Reading the bi-level pages of TIFF files, without libtiff.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <allheaders.h>
+#include <pix.h>
+
+#include "jbig2mmr.h"
+#include "jbig2tiff.h"
+
+#define u32 uint32_t
+#define u16 uint16_t
+#define u8  uint8_t
+
+// The tags and values of TIFF 6.0 which are looked at
+enum {
+  TAG_IMAGE_WIDTH = 256,
+  TAG_IMAGE_LENGTH = 257,
+  TAG_BITS_PER_SAMPLE = 258,
+  TAG_COMPRESSION = 259,
+  TAG_PHOTOMETRIC = 262,
+  TAG_FILL_ORDER = 266,
+  TAG_STRIP_OFFSETS = 273,
+  TAG_SAMPLES_PER_PIXEL = 277,
+  TAG_ROWS_PER_STRIP = 278,
+  TAG_STRIP_BYTE_COUNTS = 279,
+  TAG_X_RESOLUTION = 282,
+  TAG_Y_RESOLUTION = 283,
+  TAG_RESOLUTION_UNIT = 296,
+  TAG_TILE_WIDTH = 322,
+};
+
+enum {
+  TYPE_BYTE = 1,
+  TYPE_SHORT = 3,
+  TYPE_LONG = 4,
+  TYPE_RATIONAL = 5,
+};
+
+enum {
+  COMPRESSION_NONE = 1,
+  COMPRESSION_G4 = 4,
+  COMPRESSION_PACKBITS = 32773,
+};
+
+// A directory entry is a tag, a type, a count and the value or its offset
+static const int kEntrySize = 12;
+
+struct tiff_file {
+  const u8 *data;
+  size_t size;
+  bool big_endian;
+};
+
+static inline u16
+get16(const struct tiff_file *t, size_t offset) {
+  const u8 *const p = t->data + offset;
+  return t->big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static inline u32
+get32(const struct tiff_file *t, size_t offset) {
+  const u8 *const p = t->data + offset;
+  return t->big_endian
+             ? ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+             : p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+}
+
+// Returns true iff the size bytes at offset are in the file
+static inline bool
+in_file(const struct tiff_file *t, size_t offset, size_t size) {
+  return offset <= t->size && size <= t->size - offset;
+}
+
+// -----------------------------------------------------------------------------
+// Set *value to the index-th value of the BYTE, SHORT or LONG entry at offset
+// (or to the numerator over the denominator of a RATIONAL). Returns false if
+// the entry isn't of those types, or hasn't so many values.
+// -----------------------------------------------------------------------------
+static bool
+get_value(const struct tiff_file *t, size_t entry, u32 index, double *value) {
+  const u16 type = get16(t, entry + 2);
+  const u32 count = get32(t, entry + 4);
+  const int size = type == TYPE_BYTE ? 1
+                   : type == TYPE_SHORT ? 2
+                   : type == TYPE_LONG ? 4
+                   : type == TYPE_RATIONAL ? 8
+                   : 0;
+  if (!size || index >= count) return false;
+  // the values are in the entry if they fit in its four bytes
+  size_t offset = entry + 8;
+  if ((uint64_t) count * size > 4) offset = get32(t, entry + 8);
+  if (!in_file(t, offset, (uint64_t) count * size)) return false;
+  offset += (size_t) index * size;
+  if (type == TYPE_BYTE) {
+    *value = t->data[offset];
+  } else if (type == TYPE_SHORT) {
+    *value = get16(t, offset);
+  } else if (type == TYPE_LONG) {
+    *value = get32(t, offset);
+  } else {
+    const u32 denominator = get32(t, offset + 4);
+    *value = denominator ? (double) get32(t, offset) / denominator : 0;
+  }
+  return true;
+}
+
+static bool
+get_u32(const struct tiff_file *t, size_t entry, u32 index, u32 *value) {
+  double v;
+  if (!get_value(t, entry, index, &v)) return false;
+  *value = (u32) v;
+  return true;
+}
+
+static bool
+open_tiff(const u8 *data, size_t size, struct tiff_file *t) {
+  if (size < 8) return false;
+  t->data = data;
+  t->size = size;
+  if (data[0] == 'I' && data[1] == 'I') {
+    t->big_endian = false;
+  } else if (data[0] == 'M' && data[1] == 'M') {
+    t->big_endian = true;
+  } else {
+    return false;
+  }
+  return get16(t, 2) == 42;
+}
+
+// Returns the offset of the entry count of the directory at offset, if all of
+// it and the offset of the next one are in the file, and otherwise 0
+static size_t
+directory_entries(const struct tiff_file *t, u32 offset, int *nentries) {
+  if (!in_file(t, offset, 2)) return 0;
+  *nentries = get16(t, offset);
+  if (!in_file(t, offset, 2 + (size_t) *nentries * kEntrySize + 4)) return 0;
+  return offset + 2;
+}
+
+// see comments in .h file
+int
+jbig2_tiff_pages(const uint8_t *data, size_t size, uint32_t **ifds) {
+  struct tiff_file t;
+  if (!open_tiff(data, size, &t)) return 0;
+  u32 *offsets = NULL;
+  int n = 0, offsets_size = 0;
+  for (u32 offset = get32(&t, 4); offset; ) {
+    int nentries;
+    const size_t entries = directory_entries(&t, offset, &nentries);
+    // every directory takes at least six bytes, so a longer chain loops
+    if (!entries || (size_t) n >= size / 6) {
+      free(offsets);
+      return 0;
+    }
+    if (n == offsets_size) {
+      offsets_size = offsets_size ? offsets_size * 2 : 16;
+      u32 *const grown =
+          (u32 *) realloc(offsets, offsets_size * sizeof(u32));
+      if (!grown) {
+        free(offsets);
+        return 0;
+      }
+      offsets = grown;
+    }
+    offsets[n++] = offset;
+    offset = get32(&t, entries + (size_t) nentries * kEntrySize);
+  }
+  *ifds = offsets;
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// The fields of a page which say how to decode it
+// -----------------------------------------------------------------------------
+struct tiff_page {
+  u32 width, height;
+  u32 bits_per_sample, samples_per_pixel;
+  u32 compression, photometric, fill_order;
+  u32 rows_per_strip;
+  size_t strip_offsets, strip_byte_counts;  // the entries, or 0
+  double xres, yres;
+  u32 resolution_unit;
+  bool tiled;
+};
+
+static bool
+read_directory(const struct tiff_file *t, u32 ifd, struct tiff_page *page) {
+  memset(page, 0, sizeof(*page));
+  page->bits_per_sample = 1;
+  page->samples_per_pixel = 1;
+  page->compression = COMPRESSION_NONE;
+  page->fill_order = 1;
+  page->rows_per_strip = 0xffffffff;
+  page->resolution_unit = 2;  // inches
+  int nentries;
+  const size_t entries = directory_entries(t, ifd, &nentries);
+  if (!entries) return false;
+  for (int i = 0; i < nentries; ++i) {
+    const size_t entry = entries + (size_t) i * kEntrySize;
+    bool ok = true;
+    switch (get16(t, entry)) {
+      case TAG_IMAGE_WIDTH: ok = get_u32(t, entry, 0, &page->width); break;
+      case TAG_IMAGE_LENGTH: ok = get_u32(t, entry, 0, &page->height); break;
+      case TAG_BITS_PER_SAMPLE:
+        ok = get_u32(t, entry, 0, &page->bits_per_sample);
+        break;
+      case TAG_COMPRESSION:
+        ok = get_u32(t, entry, 0, &page->compression);
+        break;
+      case TAG_PHOTOMETRIC:
+        ok = get_u32(t, entry, 0, &page->photometric);
+        break;
+      case TAG_FILL_ORDER: ok = get_u32(t, entry, 0, &page->fill_order); break;
+      case TAG_STRIP_OFFSETS: page->strip_offsets = entry; break;
+      case TAG_SAMPLES_PER_PIXEL:
+        ok = get_u32(t, entry, 0, &page->samples_per_pixel);
+        break;
+      case TAG_ROWS_PER_STRIP:
+        ok = get_u32(t, entry, 0, &page->rows_per_strip);
+        break;
+      case TAG_STRIP_BYTE_COUNTS: page->strip_byte_counts = entry; break;
+      case TAG_X_RESOLUTION: ok = get_value(t, entry, 0, &page->xres); break;
+      case TAG_Y_RESOLUTION: ok = get_value(t, entry, 0, &page->yres); break;
+      case TAG_RESOLUTION_UNIT:
+        ok = get_u32(t, entry, 0, &page->resolution_unit);
+        break;
+      case TAG_TILE_WIDTH: page->tiled = true; break;
+    }
+    if (!ok) return false;
+  }
+  return true;
+}
+
+static inline u8
+reverse_bits(u8 b) {
+  b = (b >> 4) | (b << 4);
+  b = ((b >> 2) & 0x33) | ((b & 0x33) << 2);
+  return ((b >> 1) & 0x55) | ((b & 0x55) << 1);
+}
+
+// -----------------------------------------------------------------------------
+// Copy rows of bytes of data (most significant bit first, unless lsb_first)
+// into the rows of Leptonica's format, one whole output word at a time
+// -----------------------------------------------------------------------------
+static void
+put_bytes(const u8 *data, int row_bytes, int nrows, bool lsb_first, u32 *rows,
+          int words_per_row) {
+  for (int y = 0; y < nrows; ++y) {
+    const u8 *const in = data + (size_t) y * row_bytes;
+    u32 *const out = rows + (size_t) y * words_per_row;
+    for (int i = 0; i < words_per_row; ++i) {
+      u32 word = 0;
+      for (int k = 0; k < 4; ++k) {
+        const int j = i * 4 + k;
+        const u8 b = j < row_bytes ? in[j] : 0;
+        word = (word << 8) | (lsb_first ? reverse_bits(b) : b);
+      }
+      out[i] = word;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Unpack size bytes of PackBits data into out, which takes out_size bytes.
+// Returns false unless the data fill it exactly.
+// -----------------------------------------------------------------------------
+static bool
+unpack_bits(const u8 *data, size_t size, u8 *out, size_t out_size) {
+  size_t i = 0, n = 0;
+  while (i < size && n < out_size) {
+    const int header = (signed char) data[i++];
+    if (header >= 0) {
+      const size_t count = header + 1;
+      if (count > size - i || count > out_size - n) return false;
+      memcpy(out + n, data + i, count);
+      i += count;
+      n += count;
+    } else if (header != -128) {
+      const size_t count = 1 - header;
+      if (i == size || count > out_size - n) return false;
+      memset(out + n, data[i++], count);
+      n += count;
+    }
+  }
+  return n == out_size;
+}
+
+// Decode one strip of nrows rows into rows
+static bool
+decode_strip(const struct tiff_page *page, const u8 *data, size_t size,
+             int nrows, u32 *rows, int words_per_row) {
+  const bool lsb_first = page->fill_order == 2;
+  if (page->compression == COMPRESSION_G4) {
+    return jbig2_mmr_decode(data, size, lsb_first, rows, words_per_row,
+                            page->width, nrows);
+  }
+  const int row_bytes = (page->width + 7) / 8;
+  const size_t strip_bytes = (size_t) row_bytes * nrows;
+  if (page->compression == COMPRESSION_NONE) {
+    if (size < strip_bytes) return false;
+    put_bytes(data, row_bytes, nrows, lsb_first, rows, words_per_row);
+    return true;
+  }
+  u8 *const unpacked = (u8 *) malloc(strip_bytes);
+  if (!unpacked) return false;
+  const bool ok = unpack_bits(data, size, unpacked, strip_bytes);
+  if (ok) put_bytes(unpacked, row_bytes, nrows, lsb_first, rows, words_per_row);
+  free(unpacked);
+  return ok;
+}
+
+// see comments in .h file
+bool
+jbig2_tiff_size(const uint8_t *data, size_t size, uint32_t ifd,
+                uint32_t *width, uint32_t *height) {
+  struct tiff_file t;
+  struct tiff_page page;
+  if (!open_tiff(data, size, &t) || !read_directory(&t, ifd, &page) ||
+      !page.width || !page.height) {
+    return false;
+  }
+  *width = page.width;
+  *height = page.height;
+  return true;
+}
+
+struct Pix *
+jbig2_tiff_read(const uint8_t *data, size_t size, uint32_t ifd) {
+  struct tiff_file t;
+  struct tiff_page page;
+  if (!open_tiff(data, size, &t) || !read_directory(&t, ifd, &page)) {
+    return NULL;
+  }
+  if (page.bits_per_sample != 1 || page.samples_per_pixel != 1 ||
+      page.photometric > 1 || page.tiled || !page.strip_offsets ||
+      !page.strip_byte_counts || page.fill_order < 1 || page.fill_order > 2 ||
+      (page.compression != COMPRESSION_NONE &&
+       page.compression != COMPRESSION_G4 &&
+       page.compression != COMPRESSION_PACKBITS)) {
+    return NULL;
+  }
+  if (!page.width || !page.height || page.width > 1 << 24 ||
+      page.height > 1 << 24) {
+    return NULL;
+  }
+  if (!page.rows_per_strip || page.rows_per_strip > page.height) {
+    page.rows_per_strip = page.height;
+  }
+
+  PIX *pix = pixCreate(page.width, page.height, 1);
+  if (!pix) return NULL;
+  const int words_per_row = pix->wpl;
+  u32 *const rows = pix->data;
+  bool ok = true;
+  for (u32 y = 0, strip = 0; ok && y < page.height;
+       y += page.rows_per_strip, ++strip) {
+    const u32 nrows = page.height - y < page.rows_per_strip
+                          ? page.height - y : page.rows_per_strip;
+    u32 offset, length;
+    ok = get_u32(&t, page.strip_offsets, strip, &offset) &&
+         get_u32(&t, page.strip_byte_counts, strip, &length) &&
+         in_file(&t, offset, length) &&
+         decode_strip(&page, data + offset, length, nrows,
+                      rows + (size_t) y * words_per_row, words_per_row);
+  }
+  if (!ok) {
+    pixDestroy(&pix);
+    return NULL;
+  }
+
+  // with a photometric interpretation of BlackIsZero, the zero bits are black
+  if (page.photometric == 1) {
+    for (size_t i = 0; i < (size_t) words_per_row * page.height; ++i) {
+      rows[i] = ~rows[i];
+    }
+  }
+  pixSetPadBits(pix, 0);
+  if (page.resolution_unit == 2 || page.resolution_unit == 3) {
+    const double scale = page.resolution_unit == 3 ? 2.54 : 1;
+    pix->xres = (int) (page.xres * scale + 0.5);
+    pix->yres = (int) (page.yres * scale + 0.5);
+  }
+  return pix;
+}
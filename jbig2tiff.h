@@ -0,0 +1,58 @@
+// Reading the bi-level pages of TIFF files, without libtiff.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2TIFF_H__
+#define JBIG2ENC_JBIG2TIFF_H__
+
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+#include <sys/types.h>
+
+struct Pix;
+
+// -----------------------------------------------------------------------------
+// Find the pages (image file directories) of the TIFF file of size bytes held
+// in data. Only the chain of directories is followed: the pages themselves
+// are not looked at until they are read, so this is quick however many pages
+// there are.
+//
+// Returns the number of pages, and sets *ifds (which the caller must free) to
+// the offset of the directory of each. Returns 0 if this isn't a TIFF file
+// (BigTIFF isn't supported), or the chain of directories is broken.
+// -----------------------------------------------------------------------------
+int jbig2_tiff_pages(const uint8_t *data, size_t size, uint32_t **ifds);
+
+// -----------------------------------------------------------------------------
+// Decode the page of the TIFF file in data whose directory is at offset ifd
+// (as found by jbig2_tiff_pages) straight into a 1 bpp Pix, with its
+// resolution. The page must be bi-level (one sample of one bit per pixel), in
+// strips which are uncompressed, PackBits or CCITT G4 (T.6) compressed, with
+// either fill order.
+//
+// Returns NULL if the page is of any other kind, or its data are broken.
+// -----------------------------------------------------------------------------
+struct Pix *jbig2_tiff_read(const uint8_t *data, size_t size, uint32_t ifd);
+
+// -----------------------------------------------------------------------------
+// Find the size in pixels of the page of the TIFF file in data whose directory
+// is at offset ifd, without decoding it. Returns false if the directory can't
+// be read.
+// -----------------------------------------------------------------------------
+bool jbig2_tiff_size(const uint8_t *data, size_t size, uint32_t ifd,
+                     uint32_t *width, uint32_t *height);
+
+#endif  // JBIG2ENC_JBIG2TIFF_H__
@@ -0,0 +1,65 @@
+// Static tracepoints around the phases of encoding a page.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2TRACE_H__
+#define JBIG2ENC_JBIG2TRACE_H__
+
+// Build with USDT probes (SystemTap SDT, which needs <sys/sdt.h>). Without
+// this the tracepoints are compiled out. A probe is a nop until a tracer is
+// attached, such as bpftrace:
+//
+//   bpftrace -e 'usdt:./jbig2:jbig2:page__done { printf("%d %d\n", arg0, arg3); }'
+//
+//#define JBIG2_USDT
+
+// The probes of provider jbig2, and their arguments. Pages are numbered from
+// zero, as in the messages of jbig2. The colormap, threshold, bitimage and
+// final probes don't know the page: colormap and threshold fire on the thread
+// which fired its decode__done, and bitimage and final, which are per stripe,
+// on one of the threads the page was split between (see --stripes). A page
+// read row by row (see start_rows in jbig2.cc) has no decode, colormap or
+// threshold probes, since all of that is done as it is coded.
+//
+//   page__start(page)  a page starts to be read (for --pipeline, on the
+//                      thread which reads ahead)
+//   decode__start(page), decode__done(page, width, height, depth)
+//   colormap__start(width, height, depth), colormap__done(width, height, depth)
+//   threshold__start(width, height), threshold__done(width, height)
+//                      from the gray image, scaling for -2, -4 and -s
+//   bitimage__start(width, height), bitimage__done(width, height, bytes)
+//                      coding a stripe with the arithmetic coder (or MMR)
+//   final__done(bytes) the data of a stripe, flushed by jbig2enc_final
+//   output__start(page), output__done(page, bytes)
+//   page__done(page, width, height, bytes)  a page is written
+//
+// The sizes are in pixels and the bytes are of the output, so far as it is
+// known: bitimage__done gives what was coded before the flush.
+
+#ifdef JBIG2_USDT
+#include <sys/sdt.h>
+#define JBIG2_TRACE1(name, a) DTRACE_PROBE1(jbig2, name, a)
+#define JBIG2_TRACE2(name, a, b) DTRACE_PROBE2(jbig2, name, a, b)
+#define JBIG2_TRACE3(name, a, b, c) DTRACE_PROBE3(jbig2, name, a, b, c)
+#define JBIG2_TRACE4(name, a, b, c, d) DTRACE_PROBE4(jbig2, name, a, b, c, d)
+#else
+// the arguments are not evaluated, but count as used
+#define JBIG2_TRACE1(name, a) do { (void) sizeof(a); } while (0)
+#define JBIG2_TRACE2(name, a, b) do { (void) sizeof((a), (b)); } while (0)
+#define JBIG2_TRACE3(name, a, b, c) \
+  do { (void) sizeof((a), (b), (c)); } while (0)
+#define JBIG2_TRACE4(name, a, b, c, d) \
+  do { (void) sizeof((a), (b), (c), (d)); } while (0)
+#endif
+
+#endif  // JBIG2ENC_JBIG2TRACE_H__
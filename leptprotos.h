@@ -14,14 +14,20 @@ LEPT_DLL LEPTONICA_EXTERN l_int32 pixcmapGetColor ( PIXCMAP *cmap, l_int32 index
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixcmapHasColor ( PIXCMAP *cmap, l_int32 *pcolor );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixcmapToArrays ( PIXCMAP *cmap, l_int32 **prmap, l_int32 **pgmap, l_int32 **pbmap );
 LEPT_DLL extern PIX * pixThresholdToBinary ( PIX *pixs, l_int32 thresh );
+LEPT_DLL extern l_int32 pixThresholdToBinaryInPlace ( PIX *pixs, l_int32 thresh );
 LEPT_DLL LEPTONICA_EXTERN void thresholdToBinaryLow ( l_uint32 *datad, l_int32 w, l_int32 h, l_int32 wpld, l_uint32 *datas, l_int32 d, l_int32 wpls, l_int32 thresh );
-LEPT_DLL LEPTONICA_EXTERN void thresholdToBinaryLineLow ( l_uint32 *lined, l_int32 w, l_uint32 *lines, l_int32 d, l_int32 thresh );
+LEPT_DLL extern void thresholdToBinaryLineLow ( l_uint32 *lined, l_int32 w, l_uint32 *lines, l_int32 d, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN void thresholdRGBToBinaryLineLow ( l_uint32 *lined, l_int32 w, l_uint32 *lines, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN void thresholdGray16ToBinaryLineLow ( l_uint32 *lined, l_int32 w, const l_uint8 *lines, l_int32 thresh );
 LEPT_DLL extern JBCLASSER * jbCorrelationInitWithoutComponents ( l_int32 components, l_int32 maxwidth, l_int32 maxheight, l_float32 thresh, l_float32 weightfactor );
 LEPT_DLL extern l_int32 jbAddPage ( JBCLASSER *classer, PIX *pixs );
 LEPT_DLL extern void jbClasserDestroy ( JBCLASSER **pclasser );
 LEPT_DLL extern l_int32 jbGetLLCorners ( JBCLASSER *classer );
 LEPT_DLL extern l_int32 numaGetIValue ( NUMA *na, l_int32 index, l_int32 *pival );
-LEPT_DLL LEPTONICA_EXTERN PIX * pixCreate ( l_int32 width, l_int32 height, l_int32 depth );
+LEPT_DLL extern void setPixMemoryManager ( void * ( *allocator ) ( size_t ), void ( *deallocator ) ( void * ) );
+LEPT_DLL extern void setPixMemoryReallocator ( void * ( *reallocator ) ( void *, size_t ) );
+LEPT_DLL extern l_int32 setPixDataAlignment ( l_int32 align, l_int32 alignrows, size_t hugesize );
+LEPT_DLL extern PIX * pixCreate ( l_int32 width, l_int32 height, l_int32 depth );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixCreateNoInit ( l_int32 width, l_int32 height, l_int32 depth );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixCreateTemplate ( PIX *pixs );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixCreateTemplateNoInit ( PIX *pixs );
@@ -30,6 +36,7 @@ LEPT_DLL extern PIX * pixClone ( PIX *pixs );
 LEPT_DLL extern void pixDestroy ( PIX **ppix );
 LEPT_DLL extern PIX * pixCopy ( PIX *pixd, PIX *pixs );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixResizeImageData ( PIX *pixd, PIX *pixs );
+LEPT_DLL LEPTONICA_EXTERN l_int32 pixShrinkImageData ( PIX *pix );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixCopyColormap ( PIX *pixd, PIX *pixs );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixSizesEqual ( PIX *pix1, PIX *pix2 );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixGetWidth ( PIX *pix );
@@ -47,8 +54,8 @@ LEPT_DLL LEPTONICA_EXTERN l_int32 pixGetXRes ( PIX *pix );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixSetXRes ( PIX *pix, l_int32 res );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixGetYRes ( PIX *pix );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixSetYRes ( PIX *pix, l_int32 res );
-LEPT_DLL LEPTONICA_EXTERN l_int32 pixCopyResolution ( PIX *pixd, PIX *pixs );
-LEPT_DLL LEPTONICA_EXTERN l_int32 pixScaleResolution ( PIX *pix, l_float32 xscale, l_float32 yscale );
+LEPT_DLL extern l_int32 pixCopyResolution ( PIX *pixd, PIX *pixs );
+LEPT_DLL extern l_int32 pixScaleResolution ( PIX *pix, l_float32 xscale, l_float32 yscale );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixGetInputFormat ( PIX *pix );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixSetInputFormat ( PIX *pix, l_int32 informat );
 LEPT_DLL LEPTONICA_EXTERN l_int32 pixCopyInputFormat ( PIX *pixd, PIX *pixs );
@@ -64,13 +71,33 @@ LEPT_DLL LEPTONICA_EXTERN l_int32 pixSetPixel ( PIX *pix, l_int32 x, l_int32 y,
 LEPT_DLL extern l_int32 pixSetPadBits ( PIX *pix, l_int32 val );
 LEPT_DLL extern PIX * pixRemoveBorder ( PIX *pixs, l_int32 npix );
 LEPT_DLL LEPTONICA_EXTERN l_int32 composeRGBPixel ( l_int32 rval, l_int32 gval, l_int32 bval, l_uint32 *ppixel );
+LEPT_DLL LEPTONICA_EXTERN l_int32 lineEndianByteSwap ( l_uint32 *datad, l_uint32 *datas, l_int32 wpl );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixInvert ( PIX *pixd, PIX *pixs );
 LEPT_DLL extern l_int32 pixCountPixels ( PIX *pix, l_int32 *pcount, l_int32 *tab8 );
 LEPT_DLL extern void pixaDestroy ( PIXA **ppixa );
 LEPT_DLL extern PIX * pixRemoveColormap ( PIX *pixs, l_int32 type );
+LEPT_DLL extern PIX * pixConvertCmapToBinary ( PIX *pixs, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN l_int32 makeCmapBinaryLut ( PIXCMAP *cmap, l_int32 d, l_int32 thresh, l_uint32 *lut );
+LEPT_DLL LEPTONICA_EXTERN void cmapToBinaryLine ( l_uint32 *lined, l_int32 w, const l_uint32 *lines, l_int32 d, const l_uint32 *lut );
+LEPT_DLL LEPTONICA_EXTERN l_int32 makeCmapGrayLut ( PIXCMAP *cmap, l_uint8 *lut );
 LEPT_DLL extern PIX * pixConvertRGBToGrayFast ( PIX *pixs );
-LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStreamPng ( FILE *fp );
+LEPT_DLL extern PIX * pixConvertRGBToBinaryFast ( PIX *pixs, l_int32 thresh );
+LEPT_DLL extern PIX * pixReadStreamPng ( FILE *fp );
+LEPT_DLL extern void l_pngSetTrustedInput ( l_int32 flag );
+LEPT_DLL LEPTONICA_EXTERN PIX * pixReadMemPng ( const l_uint8 *cdata, size_t size );
+LEPT_DLL LEPTONICA_EXTERN PIX * pixReadMemPngThresh ( const l_uint8 *cdata, size_t size, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN l_int32 readHeaderMemPng ( const l_uint8 *cdata, size_t size, l_int32 *pw, l_int32 *ph, l_int32 *pd, l_int32 *piscmap );
+LEPT_DLL LEPTONICA_EXTERN struct PngRows * pngRowsCreateMem ( const l_uint8 *cdata, size_t size, L_ROWREADER *rr );
+LEPT_DLL LEPTONICA_EXTERN l_int32 pngRowsRead ( struct PngRows *pr, l_uint32 *line );
+LEPT_DLL LEPTONICA_EXTERN l_int32 pngRowsReadThresh ( struct PngRows *pr, l_uint32 *lined, l_int32 thresh );
+LEPT_DLL LEPTONICA_EXTERN void pngRowsDestroy ( struct PngRows **ppr );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStreamPnm ( FILE *fp );
+LEPT_DLL LEPTONICA_EXTERN PIX * pixReadMemPnm ( const l_uint8 *cdata, size_t size );
+LEPT_DLL LEPTONICA_EXTERN PIX * pixReadMemPnmGz ( const l_uint8 *cdata, size_t size );
+LEPT_DLL LEPTONICA_EXTERN l_int32 readHeaderMemPnm ( const l_uint8 *cdata, size_t size, l_int32 *pw, l_int32 *ph, l_int32 *pd );
+LEPT_DLL LEPTONICA_EXTERN struct PnmRows * pnmRowsCreateMem ( const l_uint8 *cdata, size_t size, L_ROWREADER *rr );
+LEPT_DLL LEPTONICA_EXTERN l_int32 pnmRowsRead ( struct PnmRows *pr, l_uint32 *line );
+LEPT_DLL LEPTONICA_EXTERN void pnmRowsDestroy ( struct PnmRows **ppr );
 LEPT_DLL LEPTONICA_EXTERN l_int32 freadHeaderPnm ( FILE *fp, PIX **ppix, l_int32 *pwidth, l_int32 *pheight, l_int32 *pdepth, l_int32 *ptype, l_int32 *pbps, l_int32 *pspp );
 LEPT_DLL extern PTA * ptaCreate ( l_int32 n );
 LEPT_DLL extern void ptaDestroy ( PTA **ppta );
@@ -78,13 +105,28 @@ LEPT_DLL extern l_int32 ptaAddPt ( PTA *pta, l_float32 x, l_float32 y );
 LEPT_DLL extern PIX * pixRead ( const char *filename );
 LEPT_DLL LEPTONICA_EXTERN PIX * pixReadStream ( FILE *fp, l_int32 hint );
 LEPT_DLL extern l_int32 findFileFormatStream ( FILE *fp, l_int32 *pformat );
-LEPT_DLL LEPTONICA_EXTERN l_int32 findFileFormatBuffer ( const l_uint8 *buf, l_int32 *pformat );
+LEPT_DLL extern l_int32 findFileFormatBuffer ( const l_uint8 *buf, l_int32 *pformat );
+LEPT_DLL extern PIX * pixReadMem ( const l_uint8 *data, size_t size );
+LEPT_DLL extern PIX * pixReadMemThresh ( const l_uint8 *data, size_t size, l_int32 thresh );
+LEPT_DLL extern l_int32 pixReadHeaderMem ( const l_uint8 *data, size_t size, l_int32 *pformat, l_int32 *pw, l_int32 *ph, l_int32 *pd, l_int32 *piscmap );
+LEPT_DLL extern L_ROWREADER * rowReaderCreateMem ( const l_uint8 *data, size_t size );
+LEPT_DLL extern l_int32 rowReaderReadBinary ( L_ROWREADER *rr, l_uint32 *lined, l_int32 thresh );
+LEPT_DLL extern l_int32 rowReaderReadGray ( L_ROWREADER *rr, l_uint32 *lined );
+LEPT_DLL extern void rowReaderDestroy ( L_ROWREADER **prr );
 LEPT_DLL extern l_int32 pixRasterop ( PIX *pixd, l_int32 dx, l_int32 dy, l_int32 dw, l_int32 dh, l_int32 op, PIX *pixs, l_int32 sx, l_int32 sy );
 LEPT_DLL LEPTONICA_EXTERN void rasteropUniLow ( l_uint32 *datad, l_int32 dpixw, l_int32 dpixh, l_int32 depth, l_int32 dwpl, l_int32 dx, l_int32 dy, l_int32 dw, l_int32 dh, l_int32 op );
 LEPT_DLL extern PIX * pixScaleGray2xLIThresh ( PIX *pixs, l_int32 thresh );
 LEPT_DLL extern PIX * pixScaleGray4xLIThresh ( PIX *pixs, l_int32 thresh );
-LEPT_DLL LEPTONICA_EXTERN void scaleGray2xLILineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag );
-LEPT_DLL LEPTONICA_EXTERN void scaleGray4xLILineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag );
+LEPT_DLL extern PIX * pixScaleGrayAreaThresh ( PIX *pixs, l_int32 factor, l_int32 thresh );
+LEPT_DLL extern void scaleGray2xLILineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag );
+LEPT_DLL extern void scaleGray4xLILineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag );
+LEPT_DLL extern void scaleGray2xLIThreshLow ( l_uint32 *datad, l_int32 wpld, l_uint32 *datas, l_int32 ws, l_int32 hs, l_int32 wpls, l_int32 thresh, l_int32 first, l_int32 last );
+LEPT_DLL extern void scaleGray2xLIThreshLineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag, l_int32 thresh );
+LEPT_DLL extern void scaleGray4xLIThreshLow ( l_uint32 *datad, l_int32 wpld, l_uint32 *datas, l_int32 ws, l_int32 hs, l_int32 wpls, l_int32 thresh, l_int32 first, l_int32 last );
+LEPT_DLL extern void scaleGray4xLIThreshLineLow ( l_uint32 *lined, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag, l_int32 thresh );
+LEPT_DLL extern void scaleGray2xLIMultiThreshLineLow ( l_uint32 **lineds, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag, const l_int32 *threshs, l_int32 n );
+LEPT_DLL extern void scaleGray4xLIMultiThreshLineLow ( l_uint32 **lineds, l_int32 wpld, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 lastlineflag, const l_int32 *threshs, l_int32 n );
+LEPT_DLL extern void scaleGrayAreaThreshLineLow ( l_uint32 *lined, l_int32 wd, l_uint32 *lines, l_int32 ws, l_int32 wpls, l_int32 nrows, l_int32 factor, l_int32 thresh );
 LEPT_DLL LEPTONICA_EXTERN l_int32 returnErrorInt ( const char *msg, const char *procname, l_int32 ival );
 LEPT_DLL LEPTONICA_EXTERN void * returnErrorPtr ( const char *msg, const char *procname, void *pval );
 LEPT_DLL LEPTONICA_EXTERN void l_error ( const char *msg, const char *procname );
@@ -37,6 +37,7 @@
  *       struct DPix
  *       struct PixComp
  *       struct PixaComp
+ *       struct L_RowReader
  *
  *   Contains definitions for:
  *       Colors for RGB
@@ -558,6 +559,33 @@ struct PixaComp
 typedef struct PixaComp PIXAC;
 
 
+/*-------------------------------------------------------------------------*
+ *                 L_RowReader: reading an image row by row                *
+ *-------------------------------------------------------------------------*/
+struct L_RowReader
+{
+    l_int32              w;           /* width in pixels                   */
+    l_int32              h;           /* height in pixels                  */
+    l_int32              d;           /* depth of the decoded rows         */
+    l_int32              xres;        /* image res (ppi) in x direction    */
+    l_int32              yres;        /* image res (ppi) in y direction    */
+    l_int32              binary;      /* 1 if the image is bi-level, so    */
+                                      /*   that it has no gray rows        */
+    struct PixColormap  *colormap;    /* colormap (may be null)            */
+    l_int32              gray16;      /* 1 if png rows of 16 bpp gray,     */
+                                      /*   read as 8 bpp or thresholded    */
+    l_int32              nread;       /* number of rows read so far        */
+    l_int32              wpl;         /* 32-bit words/line of line         */
+    l_uint32            *line;        /* the last row, as in a pix         */
+    l_uint32            *binlut;      /* cmap: src byte to binary bits     */
+    l_int32              binthresh;   /* threshold binlut was made for     */
+    l_uint8             *graylut;     /* cmap: index to gray value         */
+    struct PngRows      *png;         /* png decoder, if png               */
+    struct PnmRows      *pnm;         /* pnm parser, if pnm                */
+};
+typedef struct L_RowReader L_ROWREADER;
+
+
 /*-------------------------------------------------------------------------*
  *                         Access and storage flags                        *
  *-------------------------------------------------------------------------*/
@@ -31,7 +31,10 @@
  *    Pix memory management (allows custom allocator and deallocator)
  *          static void  *pix_malloc()
  *          static void   pix_free()
+ *          static void  *pix_shrink()
  *          void          setPixMemoryManager()
+ *          void          setPixMemoryReallocator()
+ *          l_int32       setPixDataAlignment()
  *
  *    Pix creation
  *          PIX          *pixCreate()
@@ -48,6 +51,7 @@
  *    Pix copy
  *          PIX          *pixCopy()
  *          l_int32       pixResizeImageData()
+ *          l_int32       pixShrinkImageData()
  *          l_int32       pixCopyColormap()
  *          l_int32       pixSizesEqual()
  *          l_int32       pixTransferAllData()
@@ -170,6 +174,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "allheaders.h"
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 static void pixFree(PIX *pix);
 
@@ -189,18 +197,49 @@ struct PixMemoryManager
 {
     void     *(*allocator)(size_t);
     void      (*deallocator)(void *);
+    void     *(*reallocator)(void *, size_t);  /* null if it can't shrink */
 };
 
 static struct PixMemoryManager  pix_mem_manager = {
     &malloc,
-    &free
+    &free,
+    &realloc
 };
-    
+
+    /* Alignment of the data (see setPixDataAlignment()) */
+static l_int32  pix_data_align = 0;  /* in bytes; 0 for the allocator's */
+static l_int32  pix_align_rows = 0;  /* pad wpl of images of d > 1 */
+static size_t   pix_huge_size = 0;   /* madvise larger buffers; 0 for none */
+
+    /* With an alignment, the pointer returned by the allocator is
+     * kept just in front of the data, for pix_free(). */
 static void *
 pix_malloc(size_t  size)
 {
 #ifndef _MSC_VER
-    return (*pix_mem_manager.allocator)(size);
+void      *raw;
+l_uint8   *data;
+
+    if (pix_data_align == 0)
+        return (*pix_mem_manager.allocator)(size);
+    raw = (*pix_mem_manager.allocator)(size + sizeof(void *) +
+                                       pix_data_align - 1);
+    if (!raw)
+        return NULL;
+    data = (l_uint8 *)(((size_t)raw + sizeof(void *) + pix_data_align - 1) &
+                       ~(size_t)(pix_data_align - 1));
+    ((void **)data)[-1] = raw;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (pix_huge_size && size >= pix_huge_size) {
+        size_t  page, start, end;
+        page = sysconf(_SC_PAGESIZE);
+        start = ((size_t)data + page - 1) & ~(page - 1);
+        end = ((size_t)data + size) & ~(page - 1);
+        if (end > start)
+            madvise((void *)start, end - start, MADV_HUGEPAGE);
+    }
+#endif  /* __linux__ && MADV_HUGEPAGE */
+    return data;
 #else  /* _MSC_VER */
     /* Under MSVC++, pix_mem_manager is initialized after a call
      * to pix_malloc.  Just ignore the custom allocator feature. */
@@ -212,6 +251,8 @@ static void
 pix_free(void  *ptr)
 {
 #ifndef _MSC_VER
+    if (pix_data_align != 0 && ptr)
+        ptr = ((void **)ptr)[-1];
     (*pix_mem_manager.deallocator)(ptr);
     return;
 #else  /* _MSC_VER */
@@ -222,6 +263,128 @@ pix_free(void  *ptr)
 #endif  /* _MSC_VER */
 }
 
+    /* Shrink the data at ptr, which was allocated with pix_malloc(),
+     * to size bytes.  The data is left where it is, and as large, if
+     * the allocator can't shrink it.  With an alignment, the raw
+     * allocation keeps its padding, so that if it moves, the data can
+     * be moved back onto the boundary. */
+static void *
+pix_shrink(void    *ptr,
+           size_t   size)
+{
+#ifndef _MSC_VER
+void      *raw, *newraw;
+l_uint8   *data;
+size_t     offset;
+
+    if (!pix_mem_manager.reallocator || !ptr)
+        return ptr;
+    if (pix_data_align == 0) {
+        data = (l_uint8 *)(*pix_mem_manager.reallocator)(ptr, size);
+        return data ? data : ptr;
+    }
+    raw = ((void **)ptr)[-1];
+    offset = (l_uint8 *)ptr - (l_uint8 *)raw;
+    newraw = (*pix_mem_manager.reallocator)(raw, size + sizeof(void *) +
+                                            pix_data_align - 1);
+    if (!newraw)
+        return ptr;
+    data = (l_uint8 *)(((size_t)newraw + sizeof(void *) + pix_data_align - 1) &
+                       ~(size_t)(pix_data_align - 1));
+    if (data != (l_uint8 *)newraw + offset)
+        memmove(data, (l_uint8 *)newraw + offset, size);
+    ((void **)data)[-1] = newraw;
+    return data;
+#else  /* _MSC_VER */
+    return ptr;
+#endif  /* _MSC_VER */
+}
+
+/*!
+ *  setPixMemoryManager()
+ *
+ *      Input: allocator (<optional>; use null to skip)
+ *             deallocator (<optional>; use null to skip)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Use this to change the alloc and/or dealloc functions;
+ *          e.g., setPixMemoryManager(my_malloc, my_free).
+ *      (2) Call it before any pix have been allocated, because the
+ *          data of a pix must be freed by the deallocator that matches
+ *          its allocator.
+ */
+LEPTONICA_REAL_EXPORT void
+setPixMemoryManager(void  *(*allocator)(size_t),
+                    void   (*deallocator)(void *))
+{
+    if (allocator) pix_mem_manager.allocator = allocator;
+    if (deallocator) pix_mem_manager.deallocator = deallocator;
+    if (allocator || deallocator) pix_mem_manager.reallocator = NULL;
+    return;
+}
+
+
+/*!
+ *  setPixMemoryReallocator()
+ *
+ *      Input: reallocator (<optional>; use null for none)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) This is used by pixShrinkImageData() to give back the end
+ *          of a buffer which an operation in place has made smaller.
+ *          It is called as realloc() would be, with a pointer from the
+ *          allocator and a size no larger than it was allocated with.
+ *      (2) The default is realloc().  setPixMemoryManager() removes
+ *          it, as realloc() can't be used on memory from another
+ *          allocator, so call this after that.  Without a reallocator
+ *          the buffers are never shrunk.
+ */
+LEPTONICA_REAL_EXPORT void
+setPixMemoryReallocator(void  *(*reallocator)(void *, size_t))
+{
+    pix_mem_manager.reallocator = reallocator;
+    return;
+}
+
+
+/*!
+ *  setPixDataAlignment()
+ *
+ *      Input: align (in bytes: a power of 2, or 0 for the alignment
+ *                    given by the allocator)
+ *             alignrows (1 to also pad the rows of images of more than
+ *                        1 bpp so that each starts on that boundary)
+ *             hugesize (data buffers of at least this size are backed
+ *                       by huge pages where possible; 0 for none)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Aligned rows let SIMD kernels use aligned loads and stores,
+ *          and huge pages cut the TLB misses of walking large images.
+ *          Huge pages are only used with an alignment, and only on
+ *          Linux (with madvise(MADV_HUGEPAGE)).
+ *      (2) The rows of 1 bpp images are not padded: the JBIG2 coder
+ *          reads them packed, straight from the data.
+ *      (3) As with setPixMemoryManager(), call this before any pix
+ *          have been allocated.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+setPixDataAlignment(l_int32  align,
+                    l_int32  alignrows,
+                    size_t   hugesize)
+{
+    PROCNAME("setPixDataAlignment");
+
+    if (align < 0 || (align & (align - 1)) != 0)
+        return ERROR_INT("align not a power of 2", procName, 1);
+    pix_data_align = align;
+    pix_align_rows = align > 4 ? alignrows : 0;
+    pix_huge_size = align ? hugesize : 0;
+    return 0;
+}
+
 /*--------------------------------------------------------------------*
  *                              Pix Creation                          *
  *--------------------------------------------------------------------*/
@@ -232,7 +395,7 @@ pix_free(void  *ptr)
  *      Return: pixd (with data allocated and initialized to 0),
  *                    or null on error
  */
-LEPTONICA_EXPORT PIX *
+LEPTONICA_REAL_EXPORT PIX *
 pixCreate(l_int32  width,
           l_int32  height,
           l_int32  depth)
@@ -373,6 +536,10 @@ PIX     *pixd;
     pixSetHeight(pixd, height);
     pixSetDepth(pixd, depth);
     wpl = (width * depth + 31) / 32;
+    if (pix_align_rows && depth > 1) {
+        l_int32  alignwords = pix_data_align / 4;
+        wpl = (wpl + alignwords - 1) / alignwords * alignwords;
+    }
     pixSetWpl(pixd, wpl);
 
     pixd->refcount = 1;
@@ -604,6 +771,38 @@ l_uint32  *data;
 }
 
 
+/*!
+ *  pixShrinkImageData()
+ *
+ *      Input:  pix (whose data has been made smaller in place)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) After the width, depth or wpl of pix have been reduced by
+ *          an operation which rewrote its data in its own buffer, this
+ *          gives back the end of the buffer, beyond 4 * wpl * h bytes.
+ *          The data keeps its contents, but it may move.
+ *      (2) If the allocator can't shrink it (see
+ *          setPixMemoryReallocator()), the buffer is left as it is.
+ */
+LEPTONICA_EXPORT l_int32
+pixShrinkImageData(PIX  *pix)
+{
+l_uint32  *data;
+
+    PROCNAME("pixShrinkImageData");
+
+    if (!pix)
+        return ERROR_INT("pix not defined", procName, 1);
+    if ((data = pixGetData(pix)) == NULL)
+        return ERROR_INT("pix has no data", procName, 1);
+    pix->data = (l_uint32 *)pix_shrink(data,
+                                       4 * (size_t)pixGetWpl(pix) *
+                                       pixGetHeight(pix));
+    return 0;
+}
+
+
 /*!
  *  pixCopyColormap()
  *
@@ -886,7 +1085,7 @@ pixSetYRes(PIX     *pix,
 }
 
 
-LEPTONICA_EXPORT l_int32
+LEPTONICA_REAL_EXPORT l_int32
 pixCopyResolution(PIX  *pixd,
                   PIX  *pixs)
 {
@@ -905,7 +1104,7 @@ pixCopyResolution(PIX  *pixd,
 }
 
 
-LEPTONICA_EXPORT l_int32
+LEPTONICA_REAL_EXPORT l_int32
 pixScaleResolution(PIX       *pix,
                    l_float32  xscale,
                    l_float32  yscale)
@@ -79,7 +79,6 @@
  *
  *      Conversion between big and little endians
  *           PIX        *pixEndianByteSwapNew()
- *           l_int32     pixEndianByteSwap()
  *           l_int32     lineEndianByteSwap()
  *           PIX        *pixEndianTwoByteSwapNew()
  *           l_int32     pixEndianTwoByteSwap()
@@ -283,3 +282,62 @@ composeRGBPixel(l_int32    rval,
               (bval << L_BLUE_SHIFT);
     return 0;
 }
+
+
+/*-------------------------------------------------------------*
+ *             Conversion between big and little endians       *
+ *-------------------------------------------------------------*/
+/*!
+ *  lineEndianByteSwap()
+ *
+ *      Input   datad (dest byte array data, reordered on little-endians)
+ *              datas (a src line of pix data)
+ *              wpl (number of 32 bit words in the line)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This is used on little-endian platforms to swap
+ *          the bytes within each word in the line of image data.
+ *          Bytes 0 <==> 3 and 1 <==> 2 are swapped in the dest
+ *          byte array data8d, relative to the pix data in datas.
+ *      (2) The bytes represent 8 bit pixel values.  They are swapped
+ *          for little endians so that when the dest array (char *)datad
+ *          is addressed by bytes, the pixels are chosen sequentially
+ *          from left to right in the image.
+ *      (3) datad may be the same as datas.  The loop is in a form
+ *          which compilers turn into (vector) byte swaps.
+ */
+LEPTONICA_EXPORT l_int32
+lineEndianByteSwap(l_uint32  *datad,
+                   l_uint32  *datas,
+                   l_int32    wpl)
+{
+#ifndef L_BIG_ENDIAN
+l_int32   j;
+l_uint32  word;
+#endif  /* ~L_BIG_ENDIAN */
+
+    PROCNAME("lineEndianByteSwap");
+
+    if (!datad || !datas)
+        return ERROR_INT("datad and datas not both defined", procName, 1);
+
+#ifdef L_BIG_ENDIAN
+
+    if (datad != datas)
+        memcpy((char *)datad, (char *)datas, 4 * wpl);
+    return 0;
+
+#else   /* L_LITTLE_ENDIAN */
+
+    for (j = 0; j < wpl; j++) {
+        word = datas[j];
+        datad[j] = (word >> 24) |
+                   ((word >> 8) & 0x0000ff00) |
+                   ((word << 8) & 0x00ff0000) |
+                   (word << 24);
+    }
+    return 0;
+
+#endif   /* L_BIG_ENDIAN */
+}
@@ -25,6 +25,12 @@
  *      Conversion from colormap to full color or grayscale
  *           PIX        *pixRemoveColormap()
  *
+ *      Conversion from colormap to binary
+ *           PIX        *pixConvertCmapToBinary()
+ *           l_int32     makeCmapBinaryLut()
+ *           void        cmapToBinaryLine()
+ *           l_int32     makeCmapGrayLut()
+ *
  *      Add colormap losslessly (8 to 8)
  *           l_int32     pixAddGrayColormap8()
  *           PIX        *pixAddMinimalGrayColormap8()
@@ -35,6 +41,9 @@
  *           PIX        *pixConvertRGBToGrayFast()
  *           PIX        *pixConvertRGBToGrayMinMax()
  *
+ *      Conversion from RGB color to binary
+ *           PIX        *pixConvertRGBToBinaryFast()
+ *
  *      Conversion from grayscale to colormap
  *           PIX        *pixConvertGrayToColormap()  -- 2, 4, 8 bpp
  *           PIX        *pixConvertGrayToColormap8()  -- 8 bpp only
@@ -400,6 +409,217 @@ PIX       *pixd;
 }
 
 
+/*-------------------------------------------------------------*
+ *               Conversion from colormap to binary            *
+ *-------------------------------------------------------------*/
+/*!
+ *  pixConvertCmapToBinary()
+ *
+ *      Input:  pixs (1, 2, 4 or 8 bpp, with colormap)
+ *              thresh (threshold value)
+ *      Return: 1 bpp pix, or null on error
+ *
+ *  Notes:
+ *      (1) This gives the same result as removing the colormap with
+ *          REMOVE_CMAP_BASED_ON_SRC, converting rgb to gray with
+ *          pixConvertRGBToGrayFast(), and thresholding with
+ *          pixThresholdToBinary(), but without making the 8 or 32 bpp
+ *          intermediate images.  A 1 bpp pixs with a gray colormap
+ *          is not thresholded; it is inverted if the first color is
+ *          black, as by pixRemoveColormap().
+ *      (2) The binary value of each colormap entry is found once,
+ *          from the green component if the colormap has color and
+ *          from the weighted gray value otherwise.  Pixel values
+ *          beyond the colormap are taken as black, as the full color
+ *          conversion leaves them.  These are then combined into a
+ *          table from each src byte to the 1, 2, 4 or 8 dest bits
+ *          of the pixels in it.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixConvertCmapToBinary(PIX     *pixs,
+                       l_int32  thresh)
+{
+l_int32    i, w, h, d, wpls, wpld;
+l_uint32   lut[256];
+l_uint32  *datas, *datad;
+PIXCMAP   *cmap;
+PIX       *pixd;
+
+    PROCNAME("pixConvertCmapToBinary");
+
+    if (!pixs)
+        return (PIX *)ERROR_PTR("pixs not defined", procName, NULL);
+    if ((cmap = pixGetColormap(pixs)) == NULL)
+        return (PIX *)ERROR_PTR("pixs has no colormap", procName, NULL);
+    pixGetDimensions(pixs, &w, &h, &d);
+    if (d != 1 && d != 2 && d != 4 && d != 8)
+        return (PIX *)ERROR_PTR("pixs must be {1,2,4,8} bpp", procName, NULL);
+    if (thresh < 0 || thresh > 256)
+        return (PIX *)ERROR_PTR("thresh not in [0 ... 256]", procName, NULL);
+    if (makeCmapBinaryLut(cmap, d, thresh, lut))
+        return (PIX *)ERROR_PTR("lut not made", procName, NULL);
+
+    if ((pixd = pixCreateNoInit(w, h, 1)) == NULL)
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    pixCopyResolution(pixd, pixs);
+    datas = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
+    datad = pixGetData(pixd);
+    wpld = pixGetWpl(pixd);
+    for (i = 0; i < h; i++)
+        cmapToBinaryLine(datad + i * wpld, w, datas + i * wpls, d, lut);
+
+    return pixd;
+}
+
+
+/*!
+ *  makeCmapBinaryLut()
+ *
+ *      Input:  cmap (of a 1, 2, 4 or 8 bpp image)
+ *              d (depth of the image)
+ *              thresh (threshold value, in [0 ... 256])
+ *              lut (<return> 256 entries)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This makes the table used by cmapToBinaryLine(): entry i
+ *          holds the binary values of the 8 / d pixels of a src byte
+ *          of value i, in its low bits.  See pixConvertCmapToBinary()
+ *          for the binary value of each colormap entry.
+ */
+LEPTONICA_EXPORT l_int32
+makeCmapBinaryLut(PIXCMAP   *cmap,
+                  l_int32    d,
+                  l_int32    thresh,
+                  l_uint32  *lut)
+{
+l_int32   i, k, ncolors, colorfound, npix, val;
+l_int32  *rmap, *gmap, *bmap;
+l_uint8   bitval[256];
+
+    PROCNAME("makeCmapBinaryLut");
+
+    if ((ncolors = pixcmapGetCount(cmap)) == 0)
+        return ERROR_INT("colormap is empty", procName, 1);
+    if (pixcmapToArrays(cmap, &rmap, &gmap, &bmap))
+        return ERROR_INT("colormap arrays not made", procName, 1);
+    pixcmapHasColor(cmap, &colorfound);
+    for (i = 0; i < (1 << d); i++) {
+        if (d == 1 && !colorfound)
+            bitval[i] = (rmap[0] == 0) ? !i : i;
+        else if (i >= ncolors)
+            bitval[i] = (0 < thresh);
+        else if (colorfound)
+            bitval[i] = (gmap[i] < thresh);
+        else
+            bitval[i] = ((rmap[i] + 2 * gmap[i] + bmap[i]) / 4 < thresh);
+    }
+    FREE(rmap);
+    FREE(gmap);
+    FREE(bmap);
+
+        /* Binary values of the 8 / d pixels in each src byte */
+    npix = 8 / d;
+    for (i = 0; i < 256; i++) {
+        lut[i] = 0;
+        for (k = 1; k <= npix; k++) {
+            val = (i >> (8 - k * d)) & ((1 << d) - 1);
+            lut[i] = (lut[i] << 1) | bitval[val];
+        }
+    }
+    return 0;
+}
+
+
+/*!
+ *  cmapToBinaryLine()
+ *
+ *      Input:  lined (line of a 1 bpp pix)
+ *              w (width)
+ *              lines (line of a 1, 2, 4 or 8 bpp colormapped pix)
+ *              d (depth of lines)
+ *              lut (from makeCmapBinaryLut())
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) The pad bits of lined are cleared.
+ */
+LEPTONICA_EXPORT void
+cmapToBinaryLine(l_uint32        *lined,
+                 l_int32          w,
+                 const l_uint32  *lines,
+                 l_int32          d,
+                 const l_uint32  *lut)
+{
+l_int32   j, npix, nbytes, nbits, count, extra;
+l_uint32  dword;
+
+    npix = 8 / d;
+    nbytes = (w * d + 7) / 8;
+    extra = w & 31;
+    dword = 0;
+    for (j = 0, nbits = 0, count = 0; j < nbytes; j++) {
+        dword = (dword << npix) | lut[GET_DATA_BYTE(lines, j)];
+        nbits += npix;
+        if (nbits == 32) {
+            lined[count++] = dword;
+            dword = 0;
+            nbits = 0;
+        }
+    }
+    if (nbits)
+        lined[count] = dword << (32 - nbits);
+    if (extra)  /* clear the pad bits */
+        lined[(w + 31) / 32 - 1] &= 0xffffffff << (32 - extra);
+}
+
+
+/*!
+ *  makeCmapGrayLut()
+ *
+ *      Input:  cmap
+ *              lut (<return> 256 entries)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Entry i is the gray value that a pixel of value i gets when
+ *          the colormap is removed with REMOVE_CMAP_BASED_ON_SRC and
+ *          any color is taken to gray with pixConvertRGBToGrayFast():
+ *          the green component if the colormap has color, and the
+ *          weighted gray value otherwise.  As in
+ *          pixConvertCmapToBinary(), values beyond the colormap are
+ *          taken as black.
+ */
+LEPTONICA_EXPORT l_int32
+makeCmapGrayLut(PIXCMAP  *cmap,
+                l_uint8  *lut)
+{
+l_int32   i, ncolors, colorfound;
+l_int32  *rmap, *gmap, *bmap;
+
+    PROCNAME("makeCmapGrayLut");
+
+    if ((ncolors = pixcmapGetCount(cmap)) == 0)
+        return ERROR_INT("colormap is empty", procName, 1);
+    if (pixcmapToArrays(cmap, &rmap, &gmap, &bmap))
+        return ERROR_INT("colormap arrays not made", procName, 1);
+    pixcmapHasColor(cmap, &colorfound);
+    for (i = 0; i < 256; i++) {
+        if (i >= ncolors)
+            lut[i] = 0;
+        else if (colorfound)
+            lut[i] = gmap[i];
+        else
+            lut[i] = (rmap[i] + 2 * gmap[i] + bmap[i]) / 4;
+    }
+    FREE(rmap);
+    FREE(gmap);
+    FREE(bmap);
+    return 0;
+}
+
+
 /*-------------------------------------------------------------*
  *            Conversion from RGB color to grayscale           *
  *-------------------------------------------------------------*/
@@ -452,3 +672,57 @@ PIX       *pixd;
 
     return pixd;
 }
+
+
+/*-------------------------------------------------------------*
+ *              Conversion from RGB color to binary            *
+ *-------------------------------------------------------------*/
+
+/*!
+ *  pixConvertRGBToBinaryFast()
+ *
+ *      Input:  pix (32 bpp RGB)
+ *              thresh (threshold value)
+ *      Return: 1 bpp pix, or null on error
+ *
+ *  Notes:
+ *      (1) This gives the same result as
+ *              pixThresholdToBinary(pixConvertRGBToGrayFast(pixs), thresh)
+ *          but in one pass, without the intermediate 8 bpp image.
+ *      (2) Pixels with a green component less than thresh are set
+ *          to 1 (black).
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixConvertRGBToBinaryFast(PIX     *pixs,
+                          l_int32  thresh)
+{
+l_int32    i, w, h, wpls, wpld;
+l_uint32  *datas, *lines, *datad, *lined;
+PIX       *pixd;
+
+    PROCNAME("pixConvertRGBToBinaryFast");
+
+    if (!pixs)
+        return (PIX *)ERROR_PTR("pixs not defined", procName, NULL);
+    if (pixGetDepth(pixs) != 32)
+        return (PIX *)ERROR_PTR("pixs not 32 bpp", procName, NULL);
+    if (thresh < 0 || thresh > 256)
+        return (PIX *)ERROR_PTR("thresh not in [0 ... 256]", procName, NULL);
+
+    pixGetDimensions(pixs, &w, &h, NULL);
+    datas = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
+    if ((pixd = pixCreateNoInit(w, h, 1)) == NULL)
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    pixCopyResolution(pixd, pixs);
+    datad = pixGetData(pixd);
+    wpld = pixGetWpl(pixd);
+
+    for (i = 0; i < h; i++) {
+        lines = datas + i * wpls;
+        lined = datad + i * wpld;
+        thresholdRGBToBinaryLineLow(lined, w, lines, thresh);
+    }
+
+    return pixd;
+}
@@ -1865,6 +1865,11 @@ extern PNG_EXPORT(void,png_read_row) PNGARG((png_structp png_ptr,
    png_bytep display_row));
 #endif
 
+#ifndef PNG_NO_SEQUENTIAL_READ_SUPPORTED
+/* Read a row of data as it is stored, without transformations. */
+extern PNG_EXPORT(png_bytep,png_read_raw_row) PNGARG((png_structp png_ptr));
+#endif
+
 #ifndef PNG_NO_SEQUENTIAL_READ_SUPPORTED
 /* Read the whole image into memory at once. */
 extern PNG_EXPORT(void,png_read_image) PNGARG((png_structp png_ptr,
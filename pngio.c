@@ -18,6 +18,10 @@
  *                     
  *    Read png from file
  *          PIX        *pixReadStreamPng()
+ *          static PIX *pixReadPngGeneric()
+ *          static l_int32 pngReadRows()
+ *          static void pngFinishRow()
+ *          static void pngPutRgbRow()
  *          l_int32     readHeaderPng()
  *          l_int32     freadHeaderPng()
  *          l_int32     sreadHeaderPng()
@@ -36,11 +40,19 @@
  *          void        l_pngSetStripAlpha()
  *          void        l_pngSetWriteAlpha()
  *          void        l_pngSetZlibCompression()
+ *          void        l_pngSetTrustedInput()
  *
- *    Read/write to memory   [not on windows]
+ *    Read/write to memory
  *          PIX        *pixReadMemPng()
+ *          PIX        *pixReadMemPngThresh()
+ *          l_int32     readHeaderMemPng()
  *          l_int32     pixWriteMemPng()
  *
+ *    Read from memory a row at a time
+ *          struct PngRows  *pngRowsCreateMem()
+ *          l_int32          pngRowsRead()
+ *          void             pngRowsDestroy()
+ *
  *    Documentation: libpng.txt and example.c
  *
  *    On input (decompression from file), palette color images
@@ -63,6 +75,9 @@
  *        16 bit sample down to 8 bps:
  *         - For 16 bps rgb (16 bps, 3 spp) --> 32 bpp rgb Pix
  *         - For 16 bps gray (16 bps, 1 spp) --> 8 bpp grayscale Pix
+ *        except that 16 bps gray which is thresholded as it is read
+ *        (see pixReadMemPngThresh()) is thresholded from the 16 bps
+ *        rows, which is the same but saves the pass that strips them.
  *    (2) var_PNG_STRIP_ALPHA: default is TRUE.  This does not copy
  *        the alpha channel to the pix:
  *         - For 8 bps rgba (8 bps, 4 spp) --> 32 bpp rgb Pix
@@ -70,6 +85,10 @@
  *        an RGB png file with 3 spp.  If set to TRUE, this generates
  *        an RGBA png file with 4 spp, and writes the alpha channel.
  *    These are set with accessors.
+ *    (4) var_PNG_TRUSTED_INPUT: default is FALSE.  If set to TRUE, the
+ *        CRCs of ancillary chunks are neither computed nor checked,
+ *        for input which is known to be intact.  Critical chunks
+ *        are always checked.
  *
  *    Two convenience functions are included for reading the alpha
  *    channel (if it exists) into the pix, and for writing out the
@@ -113,6 +132,47 @@
 static l_int32   var_PNG_STRIP_16_TO_8 = 1;
     /* strip alpha on reading png; default is for stripping */
 static l_int32   var_PNG_STRIP_ALPHA = 1;
+    /* skip the CRCs of ancillary chunks on reading; default is to check */
+static l_int32   var_PNG_TRUSTED_INPUT = 0;
+
+    /* The data and read position for reading png from memory */
+struct PngMemIO {
+    const l_uint8  *data;
+    size_t          size;
+    size_t          next;
+};
+
+    /* How the rows of a png file, as they are stored, are put in a pix
+     * (see pngGetFormat()) */
+struct PngFormat {
+    l_int32      w, h;
+    l_int32      pixbits;     /* bits/pixel in the file */
+    l_int32      bps;         /* bytes/sample in the file (1 if < 8 bits) */
+    l_int32      d, wpl, spp; /* of the pix */
+    l_int32      interlaced;
+    l_int32      invert;      /* 1 to invert a 1 bpp image */
+    png_uint_32  rowbytes;    /* of the rows in the file */
+};
+
+static PIX *pixReadPngGeneric(FILE *fp, struct PngMemIO *memio,
+                              l_int32 thresh);
+static void memioPngReadData(png_structp png_ptr, png_bytep outdata,
+                             png_size_t len);
+static l_int32 pngIsGray16(png_structp png_ptr, png_infop info_ptr);
+static void pngGetFormat(png_structp png_ptr, png_infop info_ptr,
+                         l_int32 gray16, struct PngFormat *fmt);
+static l_int32 pngReadRows(png_structp png_ptr, png_infop info_ptr,
+                           l_uint32 *data, l_int32 wpl,
+                           const struct PngFormat *fmt, l_int32 thresh,
+                           l_int32 gray16);
+static void pngPutPassRow(png_bytep dst, const png_byte *src, l_int32 n,
+                          l_int32 x0, l_int32 dx, l_int32 pixbits);
+static void pngPutRow(l_uint32 *line, const png_byte *row,
+                      const struct PngFormat *fmt);
+static void pngFinishRow(l_uint32 *line, l_int32 w, l_int32 wpl,
+                         l_int32 invert);
+static void pngPutRgbRow(l_uint32 *line, const png_byte *rowptr, l_int32 w,
+                         l_int32 spp, l_int32 stride, l_int32 bps);
 
 #ifndef  NO_CONSOLE_IO
 #define  DEBUG     0
@@ -134,37 +194,61 @@ static l_int32   var_PNG_STRIP_ALPHA = 1;
  *      (2) To do sequential reads of png format images from a stream,
  *          use pixReadStreamPng()
  */
-LEPTONICA_EXPORT PIX *
+LEPTONICA_REAL_EXPORT PIX *
 pixReadStreamPng(FILE  *fp)
 {
-l_uint8      rval, gval, bval;
-l_int32      i, j, k;
-l_int32      wpl, d, spp, cindex;
-l_uint32     png_transforms;
-l_uint32    *data, *line, *ppixel;
-int          num_palette, num_text;
-png_byte     bit_depth, color_type, channels;
-png_uint_32  w, h, rowbytes;
-png_uint_32  xres, yres;
-png_bytep    rowptr;
-png_bytep   *row_pointers;
-png_structp  png_ptr;
-png_infop    info_ptr, end_info;
-png_colorp   palette;
-png_textp    text_ptr;  /* ptr to text_chunk */
-PIX         *pix;
-PIXCMAP     *cmap;
-
     PROCNAME("pixReadStreamPng");
 
     if (!fp)
         return (PIX *)ERROR_PTR("fp not defined", procName, NULL);
+    return pixReadPngGeneric(fp, NULL, -1);
+}
+
+
+/*!
+ *  pixReadPngGeneric()
+ *
+ *      Input:  fp (stream; or null to read from memio)
+ *              memio (data in memory; used if fp is null)
+ *              thresh (threshold for 8 bpp gray; -1 for none)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) If thresh is in [0 ... 256], an 8 bpp grayscale image
+ *          (which is not interlaced and has no colormap) is thresholded
+ *          to 1 bpp as each row is decoded, exactly as by
+ *          pixThresholdToBinary(), so the 8 bpp image is never made.
+ *          So is a 16 bpp one, which isn't stripped to 8 bpp first
+ *          (see pngIsGray16()).
+ */
+static PIX *
+pixReadPngGeneric(FILE              *fp,
+                  struct PngMemIO  *memio,
+                  l_int32           thresh)
+{
+l_uint8           rval, gval, bval;
+l_int32           d, cindex, fused, gray16;
+int               num_palette, num_text;
+png_byte          color_type;
+png_uint_32       xres, yres;
+png_structp       png_ptr;
+png_infop         info_ptr, end_info;
+png_colorp        palette;
+png_textp         text_ptr;  /* ptr to text_chunk */
+struct PngFormat  fmt;
+PIX              *pix;
+PIXCMAP          *cmap;
+
+    PROCNAME("pixReadPngGeneric");
+
     pix = NULL;
 
         /* Allocate the 3 data structures */
     if ((png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
                    (png_voidp)NULL, NULL, NULL)) == NULL)
         return (PIX *)ERROR_PTR("png_ptr not made", procName, NULL);
+    if (var_PNG_TRUSTED_INPUT)
+        png_set_crc_action(png_ptr, PNG_CRC_DEFAULT, PNG_CRC_QUIET_USE);
 
     if ((info_ptr = png_create_info_struct(png_ptr)) == NULL) {
         png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
@@ -182,45 +266,31 @@ PIXCMAP     *cmap;
         return (PIX *)ERROR_PTR("internal png error", procName, NULL);
     }
 
-    png_init_io(png_ptr, fp);
+    if (fp)
+        png_init_io(png_ptr, fp);
+    else
+        png_set_read_fn(png_ptr, memio, memioPngReadData);
 
         /* ---------------------------------------------------------- *
-         *  Set the transforms flags.  Whatever happens here,
-         *  NEVER invert 1 bpp using PNG_TRANSFORM_INVERT_MONO.
+         *  No transforms are set: the rows are read as they are
+         *  stored (see pngReadRows()), and stripped as they are put
+         *  in the pix.  Whatever happens here, NEVER invert 1 bpp
+         *  using png_set_invert_mono().
          * ---------------------------------------------------------- */
-        /* To strip 16 --> 8 bit depth, use PNG_TRANSFORM_STRIP_16 */
-    if (var_PNG_STRIP_16_TO_8 == 1)   /* our default */
-        png_transforms = PNG_TRANSFORM_STRIP_16;
-    else
-        png_transforms = PNG_TRANSFORM_IDENTITY;
-        /* To remove alpha channel, use PNG_TRANSFORM_STRIP_ALPHA */
-    if (var_PNG_STRIP_ALPHA == 1)   /* our default */
-        png_transforms |= PNG_TRANSFORM_STRIP_ALPHA;
-
-        /* Read it */
-    png_read_png(png_ptr, info_ptr, png_transforms, NULL);
-
-    row_pointers = png_get_rows(png_ptr, info_ptr);
-    w = png_get_image_width(png_ptr, info_ptr);
-    h = png_get_image_height(png_ptr, info_ptr);
-    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-    rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    png_read_info(png_ptr, info_ptr);
+    gray16 = thresh >= 0 && thresh <= 256 &&
+             pngIsGray16(png_ptr, info_ptr);
+    pngGetFormat(png_ptr, info_ptr, gray16, &fmt);
     color_type = png_get_color_type(png_ptr, info_ptr);
-    channels = png_get_channels(png_ptr, info_ptr);
-    spp = channels;
+    d = fmt.d;
 
-    if (spp == 1)
-        d = bit_depth;
-    else if (spp == 2) {
-        d = 2 * bit_depth;
+    if (fmt.spp == 2)
         L_WARNING("there shouldn't be 2 spp!", procName);
-    }
-    else  /* spp == 3 (rgb), spp == 4 (rgba) */
-        d = 4 * bit_depth;
 
         /* Remove if/when this is implemented for all bit_depths */
-    if (spp == 3 && bit_depth != 8) {
-        fprintf(stderr, "Help: spp = 3 and depth = %d != 8\n!!", bit_depth);
+    if (fmt.spp == 3 && d != 32) {
+        fprintf(stderr, "Help: spp = 3 and depth = %d != 8\n!!", d / 4);
+        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
         return (PIX *)ERROR_PTR("not implemented for this depth",
             procName, NULL);
     }
@@ -239,47 +309,15 @@ PIXCMAP     *cmap;
     else
         cmap = NULL;
 
-    if ((pix = pixCreate(w, h, d)) == NULL) {
+    fused = gray16 ||
+            (thresh >= 0 && thresh <= 256 && fmt.spp == 1 && d == 8 &&
+             !cmap && !fmt.interlaced);
+    if ((pix = pixCreate(fmt.w, fmt.h, fused ? 1 : d)) == NULL) {
         png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
         return (PIX *)ERROR_PTR("pix not made", procName, NULL);
     }
-    wpl = pixGetWpl(pix);
-    data = pixGetData(pix);
     pixSetColormap(pix, cmap);
 
-    if (spp == 1) {   /* copy straight from buffer to pix */
-        for (i = 0; i < h; i++) {
-            line = data + i * wpl;
-            rowptr = row_pointers[i];
-            for (j = 0; j < rowbytes; j++) {
-                SET_DATA_BYTE(line, j, rowptr[j]);
-            }
-        }
-    }
-    else  {   /* spp == 3 or spp == 4 */
-        for (i = 0; i < h; i++) {
-            ppixel = data + i * wpl;
-            rowptr = row_pointers[i];
-            for (j = k = 0; j < w; j++) {
-                SET_DATA_BYTE(ppixel, COLOR_RED, rowptr[k++]);
-                SET_DATA_BYTE(ppixel, COLOR_GREEN, rowptr[k++]);
-                SET_DATA_BYTE(ppixel, COLOR_BLUE, rowptr[k++]);
-                if (spp == 4)
-                    SET_DATA_BYTE(ppixel, L_ALPHA_CHANNEL, rowptr[k++]);
-                ppixel++;
-            }
-        }
-    }
-
-#if  DEBUG
-    if (cmap) {
-        for (i = 0; i < 16; i++) {
-            fprintf(stderr, "[%d] = %d\n", i,
-                   ((l_uint8 *)(cmap->array))[i]);
-        }
-    }
-#endif  /* DEBUG */
-
         /* If there is no colormap, PNG defines black = 0 and
          * white = 1 by default for binary monochrome.  Therefore,
          * since we use the opposite definition, we must invert
@@ -302,12 +340,27 @@ PIXCMAP     *cmap;
          *     if black = 0, white = 1 (255)
          *          0, 0, 0, 0, 255, 255, 255, 0
          * So we test the first byte to see if it is 0;
-         * if so, invert the data.  */
-    if (d == 1 && (!cmap || (cmap && ((l_uint8 *)(cmap->array))[0] == 0x0))) {
-/*        fprintf(stderr, "Inverting binary data on png read\n"); */
-        pixInvert(pix, pix);
+         * if so, invert the data.  This is done on each row as it
+         * is put in the pix, rather than with pixInvert() afterwards. */
+    fmt.invert = d == 1 &&
+             (!cmap || (cmap && ((l_uint8 *)(cmap->array))[0] == 0x0));
+
+    if (pngReadRows(png_ptr, info_ptr, pixGetData(pix), pixGetWpl(pix), &fmt,
+                    fused ? thresh : -1, gray16)) {
+        pixDestroy(&pix);
+        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+        return (PIX *)ERROR_PTR("internal png error", procName, NULL);
     }
 
+#if  DEBUG
+    if (cmap) {
+        for (i = 0; i < 16; i++) {
+            fprintf(stderr, "[%d] = %d\n", i,
+                   ((l_uint8 *)(cmap->array))[i]);
+        }
+    }
+#endif  /* DEBUG */
+
     xres = png_get_x_pixels_per_meter(png_ptr, info_ptr);
     yres = png_get_y_pixels_per_meter(png_ptr, info_ptr);
     pixSetXRes(pix, (l_int32)((l_float32)xres / 39.37 + 0.5));  /* to ppi */
@@ -322,6 +375,742 @@ PIXCMAP     *cmap;
     return pix;
 }
 
+
+
+/*!
+ *  pngIsGray16()
+ *
+ *      Input:  png_ptr, info_ptr (after png_read_info(), before any
+ *              transforms are set)
+ *      Return: 1 if the image is 16 bpp gray, without alpha and not
+ *              interlaced, so that it can be thresholded straight from
+ *              its 16 bpp rows (see thresholdGray16ToBinaryLineLow());
+ *              else 0
+ */
+static l_int32
+pngIsGray16(png_structp  png_ptr,
+            png_infop    info_ptr)
+{
+    return png_get_bit_depth(png_ptr, info_ptr) == 16 &&
+           png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_GRAY &&
+           png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE;
+}
+
+
+/*!
+ *  pngGetFormat()
+ *
+ *      Input:  png_ptr, info_ptr (after png_read_info(), with no
+ *              transforms set)
+ *              gray16 (1 if a 16 bpp gray image is thresholded from
+ *              its 16 bpp rows; see pngIsGray16())
+ *              fmt (to fill in; fmt->invert is left to the caller)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) The pix is what libpng would make with png_set_strip_16()
+ *          (except with gray16) and png_set_strip_alpha(), as set by
+ *          var_PNG_STRIP_16_TO_8 and var_PNG_STRIP_ALPHA, but the rows
+ *          are read as they are stored (see png_read_raw_row()), and
+ *          stripped by pngPutRow() as they are put in it.
+ */
+static void
+pngGetFormat(png_structp        png_ptr,
+             png_infop          info_ptr,
+             l_int32            gray16,
+             struct PngFormat  *fmt)
+{
+l_int32   depth;
+png_byte  bit_depth, color_type, channels;
+
+    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    color_type = png_get_color_type(png_ptr, info_ptr);
+    channels = png_get_channels(png_ptr, info_ptr);
+    fmt->w = png_get_image_width(png_ptr, info_ptr);
+    fmt->h = png_get_image_height(png_ptr, info_ptr);
+    fmt->pixbits = bit_depth * channels;
+    fmt->bps = (bit_depth == 16) ? 2 : 1;
+    fmt->rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    fmt->interlaced = png_get_interlace_type(png_ptr, info_ptr) !=
+                      PNG_INTERLACE_NONE;
+    fmt->invert = 0;
+
+    fmt->spp = channels;
+    if (var_PNG_STRIP_ALPHA == 1 && (color_type & PNG_COLOR_MASK_ALPHA))
+        fmt->spp--;
+    depth = bit_depth;
+    if (var_PNG_STRIP_16_TO_8 == 1 && bit_depth == 16 && !gray16)
+        depth = 8;
+    if (fmt->spp == 1)
+        fmt->d = depth;
+    else if (fmt->spp == 2)
+        fmt->d = 2 * depth;
+    else  /* spp == 3 (rgb), spp == 4 (rgba) */
+        fmt->d = 4 * depth;
+    fmt->wpl = (fmt->w * fmt->d + 31) / 32;
+}
+
+
+/*!
+ *  pngReadRows()
+ *
+ *      Input:  png_ptr, info_ptr (after png_read_info(), with no
+ *              transforms set)
+ *              data, wpl (of the pix made for the image)
+ *              fmt (of the image; see pngGetFormat())
+ *              thresh (for an 8 bpp gray image and 1 bpp pix; else -1)
+ *              gray16 (1 if, with thresh, the rows are 16 bpp gray)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This decodes the image into the pix a row at a time, with
+ *          png_read_raw_row(), so that each row is put in the pix
+ *          straight from the libpng row buffer, without the libpng
+ *          transforms or a copy to a row of our own.  With thresh,
+ *          each 8 bpp row goes through a buffer and is thresholded
+ *          into the 1 bpp pix; with gray16, each 16 bpp row is
+ *          thresholded straight from the libpng buffer.
+ *      (2) An interlaced image is read whole, a pass at a time, into
+ *          an image of the rows as they are stored, and then each row
+ *          is put in the pix.
+ *      (3) The rest of the file is read too, for the text chunks
+ *          after the image data.
+ *      (4) This has its own setjmp for png errors, so that the buffers
+ *          can be freed; the caller must not make any png call which
+ *          can fail after it.
+ */
+static l_int32
+pngReadRows(png_structp              png_ptr,
+            png_infop                info_ptr,
+            l_uint32                *data,
+            l_int32                  wpl,
+            const struct PngFormat  *fmt,
+            l_int32                  thresh,
+            l_int32                  gray16)
+{
+    /* Where each pass of an interlaced image starts, and its step */
+static const l_int32  pass_x0[7] = {0, 4, 0, 2, 0, 1, 0};
+static const l_int32  pass_dx[7] = {8, 8, 4, 4, 2, 2, 1};
+static const l_int32  pass_y0[7] = {0, 0, 4, 0, 2, 0, 1};
+static const l_int32  pass_dy[7] = {8, 8, 8, 4, 4, 2, 2};
+l_int32             i, n, pass, w, h;
+l_uint32           *line;
+png_bytep           row;
+png_bytep volatile  rowbuf, image;  /* kept across the longjmp */
+
+    w = fmt->w;
+    h = fmt->h;
+
+        /* The buffers are set up before the setjmp, so that they are
+         * known if a png error returns through it */
+    rowbuf = NULL;
+    image = NULL;
+    if (thresh >= 0 && !gray16)
+        rowbuf = (png_bytep)MALLOC(4 * ((w + 3) / 4));
+    else if (fmt->interlaced)
+        image = (png_bytep)CALLOC(h, fmt->rowbytes);
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        FREE(rowbuf);
+        FREE(image);
+        return 1;
+    }
+
+    if (image) {
+        for (pass = 0; pass < 7; pass++) {
+            n = (w + pass_dx[pass] - 1 - pass_x0[pass]) / pass_dx[pass];
+            for (i = pass_y0[pass]; n > 0 && i < h; i += pass_dy[pass]) {
+                pngPutPassRow(image + (size_t)i * fmt->rowbytes,
+                              png_read_raw_row(png_ptr), n, pass_x0[pass],
+                              pass_dx[pass], fmt->pixbits);
+            }
+        }
+        for (i = 0; i < h; i++)
+            pngPutRow(data + i * wpl, image + (size_t)i * fmt->rowbytes, fmt);
+    }
+    else {
+        for (i = 0; i < h; i++) {
+            row = png_read_raw_row(png_ptr);
+            line = data + i * wpl;
+            if (gray16) {
+                thresholdGray16ToBinaryLineLow(line, w, row, 256 * thresh);
+            }
+            else if (thresh >= 0) {
+                pngPutRow((l_uint32 *)rowbuf, row, fmt);
+                thresholdToBinaryLineLow(line, w, (l_uint32 *)rowbuf, 8,
+                                         thresh);
+            }
+            else {
+                pngPutRow(line, row, fmt);
+            }
+        }
+    }
+    png_read_end(png_ptr, info_ptr);
+
+    FREE(rowbuf);
+    FREE(image);
+    return 0;
+}
+
+
+/*!
+ *  pngPutPassRow()
+ *
+ *      Input:  dst (row of the whole image, as stored in the file)
+ *              src (row of a pass of an interlaced image)
+ *              n (number of pixels in src)
+ *              x0, dx (column of the first pixel of src in dst, and
+ *              the step between them)
+ *              pixbits (bits/pixel)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Pixels of less than 8 bits are or'd into dst, which must
+ *          start out clear.
+ */
+static void
+pngPutPassRow(png_bytep        dst,
+              const png_byte  *src,
+              l_int32          n,
+              l_int32          x0,
+              l_int32          dx,
+              l_int32          pixbits)
+{
+l_int32  j, x, nbytes, sbit, dbit, mask;
+
+    if (pixbits >= 8) {
+        nbytes = pixbits / 8;
+        for (j = 0, x = x0; j < n; j++, x += dx)
+            memcpy(dst + x * nbytes, src + j * nbytes, nbytes);
+        return;
+    }
+    mask = (1 << pixbits) - 1;
+    for (j = 0, x = x0; j < n; j++, x += dx) {
+        sbit = j * pixbits;
+        dbit = x * pixbits;
+        dst[dbit >> 3] |= ((src[sbit >> 3] >> (8 - pixbits - (sbit & 7))) &
+                           mask) << (8 - pixbits - (dbit & 7));
+    }
+}
+
+
+/*!
+ *  pngPutRow()
+ *
+ *      Input:  line (of a pix of fmt->d bpp)
+ *              row (a png row, as stored in the file)
+ *              fmt (of the image; see pngGetFormat())
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) This puts the row in the pix as libpng would with the
+ *          strip transforms of pngGetFormat(), followed by
+ *          pngFinishRow() or pngPutRgbRow().  A 16 bit sample is
+ *          stripped to its high byte, as by png_set_strip_16().
+ */
+static void
+pngPutRow(l_uint32                *line,
+          const png_byte          *row,
+          const struct PngFormat  *fmt)
+{
+l_int32    j, k, nbytes;
+png_bytep  bytes;
+
+    if (fmt->spp >= 3) {
+        pngPutRgbRow(line, row, fmt->w, fmt->spp, fmt->pixbits / 8,
+                     fmt->bps);
+        return;
+    }
+    if (fmt->d == fmt->pixbits) {
+        memcpy(line, row, fmt->rowbytes);
+    }
+    else if (fmt->spp == 1) {  /* 16 bit samples or alpha stripped */
+        bytes = (png_bytep)line;
+        nbytes = fmt->pixbits / 8;
+        for (j = 0; j < fmt->w; j++)
+            bytes[j] = row[j * nbytes];
+    }
+    else {
+        bytes = (png_bytep)line;
+        nbytes = fmt->pixbits / 8;
+        for (j = 0; j < fmt->w; j++, row += nbytes) {
+            for (k = 0; k < fmt->spp; k++)
+                *bytes++ = row[k * fmt->bps];
+        }
+    }
+    pngFinishRow(line, fmt->w * fmt->d, fmt->wpl, fmt->invert);
+}
+
+
+/*!
+ *  pngFinishRow()
+ *
+ *      Input:  line (of a pix, holding a decoded png row of 1 spp)
+ *              nbits (number of image bits in the line)
+ *              wpl (words/line)
+ *              invert (1 to invert the image bits; else 0)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) The bytes are put in pix order, and with invert, the
+ *          nbits image bits are inverted, leaving the pad bits of
+ *          the last word as they are, as pixInvert() would.
+ */
+static void
+pngFinishRow(l_uint32  *line,
+             l_int32    nbits,
+             l_int32    wpl,
+             l_int32    invert)
+{
+l_int32  j, fullwords, extra;
+
+    lineEndianByteSwap(line, line, wpl);
+    if (!invert)
+        return;
+    fullwords = nbits >> 5;
+    extra = nbits & 31;
+    for (j = 0; j < fullwords; j++)
+        line[j] = ~line[j];
+    if (extra)
+        line[fullwords] ^= 0xffffffff << (32 - extra);
+    return;
+}
+
+
+/*!
+ *  pngPutRgbRow()
+ *
+ *      Input:  line (of a 32 bpp pix)
+ *              rowptr (a png row of rgb or rgba samples, as stored)
+ *              w (width)
+ *              spp (3 or 4, of the pix)
+ *              stride (bytes/pixel of the row)
+ *              bps (bytes/sample of the row: 2 for 16 bit samples, of
+ *              which the high byte is taken)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) With spp == 3, the alpha sample of an rgba row is dropped.
+ */
+static void
+pngPutRgbRow(l_uint32        *line,
+             const png_byte  *rowptr,
+             l_int32          w,
+             l_int32          spp,
+             l_int32          stride,
+             l_int32          bps)
+{
+l_int32  j;
+
+    if (spp == 4) {
+        for (j = 0; j < w; j++, rowptr += stride) {
+            line[j] = ((l_uint32)rowptr[0] << L_RED_SHIFT) |
+                      ((l_uint32)rowptr[bps] << L_GREEN_SHIFT) |
+                      ((l_uint32)rowptr[2 * bps] << L_BLUE_SHIFT) |
+                      ((l_uint32)rowptr[3 * bps] << L_ALPHA_SHIFT);
+        }
+    }
+    else if (stride == 3) {  /* 8 bps rgb */
+        for (j = 0; j < w; j++, rowptr += 3) {
+            line[j] = ((l_uint32)rowptr[0] << L_RED_SHIFT) |
+                      ((l_uint32)rowptr[1] << L_GREEN_SHIFT) |
+                      ((l_uint32)rowptr[2] << L_BLUE_SHIFT);
+        }
+    }
+    else {
+        for (j = 0; j < w; j++, rowptr += stride) {
+            line[j] = ((l_uint32)rowptr[0] << L_RED_SHIFT) |
+                      ((l_uint32)rowptr[bps] << L_GREEN_SHIFT) |
+                      ((l_uint32)rowptr[2 * bps] << L_BLUE_SHIFT);
+        }
+    }
+}
+
+
+/*---------------------------------------------------------------------*
+ *                    Setting flags for special modes                  *
+ *---------------------------------------------------------------------*/
+/*!
+ *  l_pngSetTrustedInput()
+ *
+ *      Input:  flag (1 to skip the CRCs of ancillary chunks; 0 to check)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) For input that is known to be intact, such as files made by
+ *          the caller.  A bad CRC in a critical chunk is still an error.
+ *      (2) As for all the special flags, set it before starting threads.
+ */
+LEPTONICA_REAL_EXPORT void
+l_pngSetTrustedInput(l_int32  flag)
+{
+    var_PNG_TRUSTED_INPUT = flag;
+}
+
+
+/*---------------------------------------------------------------------*
+ *                         Read/write to memory                        *
+ *---------------------------------------------------------------------*/
+/*!
+ *  pixReadMemPng()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) The data is handed to libpng directly through a read
+ *          function, so no stream or temporary file is used, and
+ *          this works on all systems.
+ */
+LEPTONICA_EXPORT PIX *
+pixReadMemPng(const l_uint8  *cdata,
+              size_t          size)
+{
+struct PngMemIO  memio;
+
+    PROCNAME("pixReadMemPng");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+    memio.data = cdata;
+    memio.size = size;
+    memio.next = 0;
+    return pixReadPngGeneric(NULL, &memio, -1);
+}
+
+
+/*!
+ *  pixReadMemPngThresh()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *              thresh (threshold value, in [0 ... 256])
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) As pixReadMemPng(), except that an 8 or 16 bpp grayscale
+ *          image without a colormap is thresholded to 1 bpp while it
+ *          is decoded; the result is that of pixThresholdToBinary() on
+ *          the 8 bpp image pixReadMemPng() makes, but that is never
+ *          held in memory.  Interlaced images are read as by
+ *          pixReadMemPng().
+ */
+LEPTONICA_EXPORT PIX *
+pixReadMemPngThresh(const l_uint8  *cdata,
+                    size_t          size,
+                    l_int32         thresh)
+{
+struct PngMemIO  memio;
+
+    PROCNAME("pixReadMemPngThresh");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+    memio.data = cdata;
+    memio.size = size;
+    memio.next = 0;
+    return pixReadPngGeneric(NULL, &memio, thresh);
+}
+
+
+/*!
+ *  readHeaderMemPng()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *              &w, &h, &d (<return> width, height and depth of the pix
+ *                          that pixReadMemPng() would make)
+ *              &iscmap (<optional return> 1 if the pix would have a
+ *                       colormap; else 0)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Only the IHDR chunk is looked at, which must come first.
+ *          The depth is that of pngGetFormat() with the default
+ *          flags: 16 bit samples are stripped to 8 bits, and alpha
+ *          is dropped.
+ */
+LEPTONICA_EXPORT l_int32
+readHeaderMemPng(const l_uint8  *cdata,
+                 size_t          size,
+                 l_int32        *pw,
+                 l_int32        *ph,
+                 l_int32        *pd,
+                 l_int32        *piscmap)
+{
+l_int32  bit_depth, color_type;
+
+    PROCNAME("readHeaderMemPng");
+
+    if (piscmap) *piscmap = 0;
+    if (!cdata || !pw || !ph || !pd)
+        return ERROR_INT("input ptr(s) not defined", procName, 1);
+    if (size < 29 || memcmp(cdata + 12, "IHDR", 4))
+        return ERROR_INT("no IHDR chunk", procName, 1);
+
+    *pw = (l_int32)((l_uint32)cdata[16] << 24 | (l_uint32)cdata[17] << 16 |
+                    (l_uint32)cdata[18] << 8 | cdata[19]);
+    *ph = (l_int32)((l_uint32)cdata[20] << 24 | (l_uint32)cdata[21] << 16 |
+                    (l_uint32)cdata[22] << 8 | cdata[23]);
+    if (*pw <= 0 || *ph <= 0)
+        return ERROR_INT("invalid sizes", procName, 1);
+    bit_depth = cdata[24];
+    color_type = cdata[25];
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        if (piscmap) *piscmap = 1;
+        *pd = bit_depth;
+    }
+    else if (color_type & PNG_COLOR_MASK_COLOR)
+        *pd = 32;
+    else
+        *pd = (bit_depth == 16) ? 8 : bit_depth;
+    return 0;
+}
+
+
+/*---------------------------------------------------------------------*
+ *                  Read from memory a row at a time                   *
+ *---------------------------------------------------------------------*/
+    /* The state of a png image being read a row at a time */
+struct PngRows {
+    png_structp      png_ptr;
+    png_infop        info_ptr;
+    png_infop        end_info;
+    struct PngMemIO   memio;
+    struct PngFormat  fmt;        /* of the rows stripped to 8 bpp */
+    l_int32           gray16;     /* 16 bpp gray, also read unstripped */
+    l_int32           nread;      /* rows read so far */
+};
+
+/*!
+ *  pngRowsCreateMem()
+ *
+ *      Input:  cdata (const; png-encoded)
+ *              size (of data)
+ *              rr (row reader, to fill in with the image parameters)
+ *      Return: row decoder, or null if the image can't be read a row
+ *              at a time, or on error
+ *
+ *  Notes:
+ *      (1) The rows are decoded as by pixReadMemPng(), into a line of
+ *          the pix it would make: rr->w, rr->h, rr->d, rr->xres,
+ *          rr->yres and rr->colormap (which rr then owns) are set.
+ *      (2) Interlaced images, and those that aren't 1, 2, 4 or 8 bpp
+ *          with a colormap, or 1, 8 or 32 bpp without, are not done.
+ *          The text chunks are not read.
+ *      (3) A 16 bpp gray image (see pngIsGray16()) is read as 8 bpp,
+ *          but rr->gray16 is set, and its rows can be read with
+ *          pngRowsReadThresh() to threshold them from 16 bpp, or else
+ *          are stripped by pngRowsRead().
+ */
+LEPTONICA_EXPORT struct PngRows *
+pngRowsCreateMem(const l_uint8  *cdata,
+                 size_t          size,
+                 L_ROWREADER    *rr)
+{
+l_int32          d, cindex, gray16;
+int              num_palette;
+png_byte         color_type;
+png_uint_32      xres, yres;
+png_colorp       palette;
+PIXCMAP         *cmap;
+struct PngRows  *pr;
+
+    PROCNAME("pngRowsCreateMem");
+
+    if (!cdata || !rr)
+        return (struct PngRows *)ERROR_PTR("cdata or rr not defined",
+                                           procName, NULL);
+    if ((pr = (struct PngRows *)CALLOC(1, sizeof(struct PngRows))) == NULL)
+        return (struct PngRows *)ERROR_PTR("pr not made", procName, NULL);
+    pr->memio.data = cdata;
+    pr->memio.size = size;
+    pr->memio.next = 0;
+
+    if ((pr->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                       (png_voidp)NULL, NULL, NULL)) == NULL ||
+        (pr->info_ptr = png_create_info_struct(pr->png_ptr)) == NULL ||
+        (pr->end_info = png_create_info_struct(pr->png_ptr)) == NULL) {
+        pngRowsDestroy(&pr);
+        return (struct PngRows *)ERROR_PTR("png structs not made",
+                                           procName, NULL);
+    }
+    if (var_PNG_TRUSTED_INPUT)
+        png_set_crc_action(pr->png_ptr, PNG_CRC_DEFAULT, PNG_CRC_QUIET_USE);
+    if (setjmp(png_jmpbuf(pr->png_ptr))) {
+        pngRowsDestroy(&pr);
+        return (struct PngRows *)ERROR_PTR("internal png error",
+                                           procName, NULL);
+    }
+    png_set_read_fn(pr->png_ptr, &pr->memio, memioPngReadData);
+
+        /* As in pixReadPngGeneric(), with no transforms set */
+    png_read_info(pr->png_ptr, pr->info_ptr);
+    gray16 = var_PNG_STRIP_16_TO_8 == 1 &&
+             pngIsGray16(pr->png_ptr, pr->info_ptr);
+    pngGetFormat(pr->png_ptr, pr->info_ptr, 0, &pr->fmt);
+    color_type = png_get_color_type(pr->png_ptr, pr->info_ptr);
+    d = pr->fmt.d;
+    cmap = NULL;
+    if (color_type == PNG_COLOR_TYPE_PALETTE ||
+        color_type == PNG_COLOR_MASK_PALETTE) {
+        if (d != 1 && d != 2 && d != 4 && d != 8)
+            pr->fmt.interlaced = 1;  /* not done */
+    }
+    else if (d != 1 && d != 8 && d != 32)
+        pr->fmt.interlaced = 1;  /* not done */
+    if (pr->fmt.interlaced || (pr->fmt.spp != 1 && pr->fmt.spp != 3 &&
+                               pr->fmt.spp != 4)) {
+        pngRowsDestroy(&pr);
+        return NULL;
+    }
+    pr->gray16 = gray16;
+    xres = png_get_x_pixels_per_meter(pr->png_ptr, pr->info_ptr);
+    yres = png_get_y_pixels_per_meter(pr->png_ptr, pr->info_ptr);
+
+        /* There are no more png calls that can fail here */
+    if (color_type == PNG_COLOR_TYPE_PALETTE ||
+        color_type == PNG_COLOR_MASK_PALETTE) {
+        png_get_PLTE(pr->png_ptr, pr->info_ptr, &palette, &num_palette);
+        cmap = pixcmapCreate(d);
+        for (cindex = 0; cindex < num_palette; cindex++) {
+            pixcmapAddColor(cmap, palette[cindex].red,
+                            palette[cindex].green, palette[cindex].blue);
+        }
+    }
+        /* See pixReadPngGeneric() */
+    pr->fmt.invert = d == 1 &&
+                     (!cmap || ((l_uint8 *)(cmap->array))[0] == 0x0);
+
+    rr->w = pr->fmt.w;
+    rr->h = pr->fmt.h;
+    rr->d = d;
+    rr->xres = (l_int32)((l_float32)xres / 39.37 + 0.5);  /* to ppi */
+    rr->yres = (l_int32)((l_float32)yres / 39.37 + 0.5);  /* to ppi */
+    rr->colormap = cmap;
+    rr->gray16 = gray16;
+    return pr;
+}
+
+
+/*!
+ *  pngRowsRead()
+ *
+ *      Input:  pr (row decoder)
+ *              line (of a pix of the size and depth of the image)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This decodes the next row into line, as pngReadRows() does,
+ *          straight from the libpng row buffer.
+ *          After the last row, the rest of the file is read, so that
+ *          an error in it is found as it is by pixReadMemPng().
+ *      (2) The rows of a 16 bpp gray image keep the high byte of each
+ *          sample, as png_set_strip_16() does.
+ */
+LEPTONICA_EXPORT l_int32
+pngRowsRead(struct PngRows  *pr,
+            l_uint32        *line)
+{
+    PROCNAME("pngRowsRead");
+
+    if (!pr || !line)
+        return ERROR_INT("pr or line not defined", procName, 1);
+    if (pr->nread >= pr->fmt.h)
+        return ERROR_INT("no more rows", procName, 1);
+    if (setjmp(png_jmpbuf(pr->png_ptr)))
+        return ERROR_INT("internal png error", procName, 1);
+
+    pngPutRow(line, png_read_raw_row(pr->png_ptr), &pr->fmt);
+    if (++pr->nread == pr->fmt.h)
+        png_read_end(pr->png_ptr, pr->info_ptr);
+    return 0;
+}
+
+
+/*!
+ *  pngRowsReadThresh()
+ *
+ *      Input:  pr (row decoder, of a 16 bpp gray image)
+ *              lined (line of a 1 bpp pix of the size of the image)
+ *              thresh (threshold value, in [0 ... 256])
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This decodes the next row and thresholds it into lined,
+ *          with zero pad bits: the result is that of pngRowsRead()
+ *          and thresholdToBinaryLineLow(), without the 8 bpp row.
+ */
+LEPTONICA_EXPORT l_int32
+pngRowsReadThresh(struct PngRows  *pr,
+                  l_uint32        *lined,
+                  l_int32          thresh)
+{
+    PROCNAME("pngRowsReadThresh");
+
+    if (!pr || !lined)
+        return ERROR_INT("pr or lined not defined", procName, 1);
+    if (!pr->gray16)
+        return ERROR_INT("not 16 bpp gray", procName, 1);
+    if (pr->nread >= pr->fmt.h)
+        return ERROR_INT("no more rows", procName, 1);
+    if (setjmp(png_jmpbuf(pr->png_ptr)))
+        return ERROR_INT("internal png error", procName, 1);
+
+    thresholdGray16ToBinaryLineLow(lined, pr->fmt.w,
+                                   png_read_raw_row(pr->png_ptr),
+                                   256 * thresh);
+    if (++pr->nread == pr->fmt.h)
+        png_read_end(pr->png_ptr, pr->info_ptr);
+    return 0;
+}
+
+
+/*!
+ *  pngRowsDestroy()
+ *
+ *      Input:  &pr (<will be set to null>)
+ *      Return: void
+ */
+LEPTONICA_EXPORT void
+pngRowsDestroy(struct PngRows  **ppr)
+{
+struct PngRows  *pr;
+
+    if (!ppr || (pr = *ppr) == NULL)
+        return;
+    if (pr->png_ptr)
+        png_destroy_read_struct(&pr->png_ptr,
+                                pr->info_ptr ? &pr->info_ptr : NULL,
+                                pr->end_info ? &pr->end_info : NULL);
+    FREE(pr);
+    *ppr = NULL;
+}
+
+
+/*!
+ *  memioPngReadData()
+ *
+ *  Notes:
+ *      (1) This is the libpng read function for pixReadMemPng().
+ *          Reading past the end of the data is a png error, which
+ *          returns through the setjmp in pixReadPngGeneric().
+ */
+static void
+memioPngReadData(png_structp  png_ptr,
+                 png_bytep    outdata,
+                 png_size_t   len)
+{
+struct PngMemIO  *memio;
+
+    memio = (struct PngMemIO *)png_get_io_ptr(png_ptr);
+    if (len > memio->size - memio->next)
+        png_error(png_ptr, "read past end of data");
+    memcpy(outdata, memio->data + memio->next, len);
+    memio->next += len;
+}
+
 /* --------------------------------------------*/
 #endif  /* HAVE_LIBPNG */
 /* --------------------------------------------*/
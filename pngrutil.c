@@ -2926,6 +2926,156 @@ png_do_read_interlace(png_structp png_ptr)
 }
 #endif /* PNG_READ_INTERLACING_SUPPORTED */
 
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+/* SSE2 versions of the filters for 1, 3 and 4 byte pixels (8 bit gray, RGB
+ * and RGBA).  They give the same bytes as the loops in png_read_filter_row(),
+ * which does the rest.
+ *
+ * Sub is a prefix sum of the bytes bpp apart.  A block of 16 bytes is summed
+ * in place by adding itself shifted by bpp, 2 * bpp, 4 * bpp, ... bytes, after
+ * adding the last pixel of the previous block to its first bytes.  Avg and
+ * Paeth depend on the pixel just decoded, so these do one pixel at a time,
+ * with its bytes side by side.  Avg is the rounded-up average less the carry
+ * bit; Paeth is done in 16 bits, picking whichever of a, b and c has the
+ * smallest distance, in that order of preference.  Up is done 16 bytes at a
+ * time for any pixel size.  They are used if simd_level() allows SSE2.
+ */
+#include <emmintrin.h>
+#include "jbig2simd.h"
+
+static __m128i
+png_load_pixel(png_bytep p, png_uint_32 bpp)
+{
+   /* put together in a register: going through memory would stall */
+   png_uint_32 v = (png_uint_32)p[0] | ((png_uint_32)p[1] << 8) |
+                   ((png_uint_32)p[2] << 16);
+
+   if (bpp == 4)
+      v |= (png_uint_32)p[3] << 24;
+   return _mm_cvtsi32_si128((int)v);
+}
+
+static void
+png_store_pixel(png_bytep p, __m128i v, png_uint_32 bpp)
+{
+   png_uint_32 x = (png_uint_32)_mm_cvtsi128_si32(v);
+
+   p[0] = (png_byte)x;
+   p[1] = (png_byte)(x >> 8);
+   p[2] = (png_byte)(x >> 16);
+   if (bpp == 4)
+      p[3] = (png_byte)(x >> 24);
+}
+
+/* Returns the number of bytes done: a multiple of 16 */
+static png_uint_32
+png_read_filter_row_sub_sse2(png_bytep row, png_uint_32 rowbytes,
+   png_uint_32 bpp)
+{
+   __m128i last = _mm_setzero_si128();   /* the previous block, decoded */
+   png_uint_32 i;
+
+   for (i = 0; i + 16 <= rowbytes; i += 16)
+   {
+      __m128i x = _mm_loadu_si128((__m128i *)(row + i));
+      if (bpp == 1)
+      {
+         x = _mm_add_epi8(x, _mm_srli_si128(last, 15));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      }
+      else if (bpp == 3)
+      {
+         x = _mm_add_epi8(x, _mm_srli_si128(last, 13));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 12));
+      }
+      else
+      {
+         x = _mm_add_epi8(x, _mm_srli_si128(last, 12));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      }
+      _mm_storeu_si128((__m128i *)(row + i), x);
+      last = x;
+   }
+   return i;
+}
+
+static void
+png_read_filter_row_up_sse2(png_bytep row, png_bytep prev_row,
+   png_uint_32 rowbytes)
+{
+   png_uint_32 i;
+
+   for (i = 0; i + 16 <= rowbytes; i += 16)
+   {
+      __m128i x = _mm_loadu_si128((__m128i *)(row + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(prev_row + i));
+      _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+   }
+   for (; i < rowbytes; i++)
+      row[i] = (png_byte)(row[i] + prev_row[i]);
+}
+
+static void
+png_read_filter_row_avg_sse2(png_bytep row, png_bytep prev_row,
+   png_uint_32 rowbytes, png_uint_32 bpp)
+{
+   const __m128i one = _mm_set1_epi8(1);
+   __m128i a = _mm_setzero_si128();   /* the pixel to the left, decoded */
+   png_uint_32 i;
+
+   for (i = 0; i < rowbytes; i += bpp)
+   {
+      __m128i b = png_load_pixel(prev_row + i, bpp);
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                                 _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(png_load_pixel(row + i, bpp), avg);
+      png_store_pixel(row + i, a, bpp);
+   }
+}
+
+static void
+png_read_filter_row_paeth_sse2(png_bytep row, png_bytep prev_row,
+   png_uint_32 rowbytes, png_uint_32 bpp)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero;   /* left and upper left, as 16 bit lanes */
+   png_uint_32 i;
+
+   for (i = 0; i < rowbytes; i += bpp)
+   {
+      __m128i b = _mm_unpacklo_epi8(png_load_pixel(prev_row + i, bpp), zero);
+      __m128i x = _mm_unpacklo_epi8(png_load_pixel(row + i, bpp), zero);
+      __m128i pa = _mm_sub_epi16(b, c);          /* |p - a| = |b - c| */
+      __m128i pb = _mm_sub_epi16(a, c);          /* |p - b| = |a - c| */
+      __m128i pc = _mm_add_epi16(pa, pb);        /* |p - c| */
+      __m128i smallest, pred;
+
+      pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+      pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+      pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+      smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+      /* a if pa is smallest, else b if pb is, else c */
+      pred = _mm_cmpeq_epi16(smallest, pb);
+      pred = _mm_or_si128(_mm_and_si128(pred, b), _mm_andnot_si128(pred, c));
+      smallest = _mm_cmpeq_epi16(smallest, pa);
+      pred = _mm_or_si128(_mm_and_si128(smallest, a),
+                          _mm_andnot_si128(smallest, pred));
+
+      /* the sum is kept to a byte in each lane for the next pixel */
+      a = _mm_and_si128(_mm_add_epi16(x, pred), _mm_set1_epi16(0xff));
+      png_store_pixel(row + i, _mm_packus_epi16(a, a), bpp);
+      c = b;
+   }
+}
+#endif /* __SSE2__ && !PNG_NO_SSE2_FILTERS */
+
 void /* PRIVATE */
 png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
    png_bytep prev_row, int filter)
@@ -2944,6 +3094,23 @@ png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
          png_bytep rp = row + bpp;
          png_bytep lp = row;
 
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+         if ((bpp == 1 || bpp == 3 || bpp == 4) && istop >= 16 &&
+             simd_level() >= SIMD_SSE2)
+         {
+            /* finish the bytes left over from the blocks of 16 */
+            png_uint_32 done = png_read_filter_row_sub_sse2(row, istop, bpp);
+            rp = row + done;
+            lp = rp - bpp;
+            for (i = done; i < istop; i++)
+            {
+               *rp = (png_byte)(((int)(*rp) + (int)(*lp++)) & 0xff);
+               rp++;
+            }
+            break;
+         }
+#endif
+
          for (i = bpp; i < istop; i++)
          {
             *rp = (png_byte)(((int)(*rp) + (int)(*lp++)) & 0xff);
@@ -2958,6 +3125,14 @@ png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
          png_bytep rp = row;
          png_bytep pp = prev_row;
 
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+         if (simd_level() >= SIMD_SSE2)
+         {
+            png_read_filter_row_up_sse2(row, prev_row, istop);
+            break;
+         }
+#endif
+
          for (i = 0; i < istop; i++)
          {
             *rp = (png_byte)(((int)(*rp) + (int)(*pp++)) & 0xff);
@@ -2974,6 +3149,15 @@ png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
          png_uint_32 bpp = (row_info->pixel_depth + 7) >> 3;
          png_uint_32 istop = row_info->rowbytes - bpp;
 
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+         if ((bpp == 3 || bpp == 4) && simd_level() >= SIMD_SSE2)
+         {
+            png_read_filter_row_avg_sse2(row, prev_row, row_info->rowbytes,
+                                         bpp);
+            break;
+         }
+#endif
+
          for (i = 0; i < bpp; i++)
          {
             *rp = (png_byte)(((int)(*rp) +
@@ -2999,6 +3183,15 @@ png_read_filter_row(png_structp png_ptr, png_row_infop row_info, png_bytep row,
          png_uint_32 bpp = (row_info->pixel_depth + 7) >> 3;
          png_uint_32 istop=row_info->rowbytes - bpp;
 
+#if defined(__SSE2__) && !defined(PNG_NO_SSE2_FILTERS)
+         if ((bpp == 3 || bpp == 4) && simd_level() >= SIMD_SSE2)
+         {
+            png_read_filter_row_paeth_sse2(row, prev_row, row_info->rowbytes,
+                                           bpp);
+            break;
+         }
+#endif
+
          for (i = 0; i < bpp; i++)
          {
             *rp = (png_byte)(((int)(*rp) + (int)(*pp++)) & 0xff);
@@ -3097,11 +3290,11 @@ png_read_finish_row(png_structp png_ptr)
                png_pass_ystart[png_ptr->pass]) /
                png_pass_yinc[png_ptr->pass];
             if (!(png_ptr->num_rows))
-               continue;
+               continue;  /* the while () below must skip it too */
          }
          else  /* if (png_ptr->transformations & PNG_INTERLACE) */
             break;
-      } while (png_ptr->iwidth == 0);
+      } while (png_ptr->iwidth == 0 || png_ptr->num_rows == 0);
 
       if (png_ptr->pass < 7)
          return;
@@ -23,14 +23,30 @@
  *          l_int32          pixWriteStreamPnm()
  *          l_int32          pixWriteStreamAsciiPnm()
  *
- *      Read/write to memory   [not on windows]
+ *      Read/write to memory
  *          PIX             *pixReadMemPnm()
- *          l_int32          sreadHeaderPnm()
+ *          PIX             *pixReadMemPnmGz()
+ *          l_int32          readHeaderMemPnm()
  *          l_int32          pixWriteMemPnm()
  *
+ *      Read from memory a row at a time
+ *          struct PnmRows  *pnmRowsCreateMem()
+ *          l_int32          pnmRowsRead()
+ *          void             pnmRowsDestroy()
+ *
  *      Local helpers
  *          static l_int32   pnmReadNextAsciiValue();
  *          static l_int32   pnmSkipCommentLines();
+ *          static l_int32   sreadHeaderPnmPos();
+ *          static l_int32   pnmMemReadInt();
+ *          static void      pnmMemSkipWhitespace();
+ *          static l_int32   pnmMemSkipCommentLines();
+ *          static void      pnmFinishBitLine();
+ *          static void      pnmGetRawLineSize();
+ *          static void      pnmConvertRawLine();
+ *          static l_int32   pnmGzOpen();
+ *          static size_t    pnmGzRead();
+ *          static void      pnmGzClose();
  *       
  *      These are here by popular demand, with the help of Mattias
  *      Kregert (mattias@kregert.se), who provided the first implementation.
@@ -69,6 +85,7 @@
 
 #include <string.h>
 #include "allheaders.h"
+#include "zlib.h"
 
 /* --------------------------------------------*/
 #if  USE_PNMIO   /* defined in environ.h */
@@ -77,6 +94,32 @@
 
 static l_int32 pnmReadNextAsciiValue(FILE  *fp, l_int32 *pval);
 static l_int32 pnmSkipCommentLines(FILE  *fp);
+static l_int32 sreadHeaderPnmPos(const l_uint8 *cdata, size_t size,
+                                 size_t *ppos, PIX **ppix, l_int32 *pwidth,
+                                 l_int32 *pheight, l_int32 *pdepth,
+                                 l_int32 *ptype);
+static l_int32 pnmMemReadInt(const l_uint8 *cdata, size_t size,
+                             size_t *ppos, l_int32 *pval);
+static void pnmMemSkipWhitespace(const l_uint8 *cdata, size_t size,
+                                 size_t *ppos);
+static void pnmFinishBitLine(l_uint32 *line, l_int32 w);
+static void pnmGetRawLineSize(l_int32 w, l_int32 d, l_int32 type,
+                              l_int32 *pnsamples, l_int32 *psamplesize);
+static void pnmConvertRawLine(l_uint32 *line, const l_uint8 *buf, l_int32 n,
+                              l_int32 d);
+static l_int32 pnmMemSkipCommentLines(const l_uint8 *cdata, size_t size,
+                                      size_t *ppos);
+
+    /* A gzip stream being inflated from memory */
+struct PnmGz {
+    z_stream        zs;
+    const l_uint8  *in;          /* the input not given to zs yet */
+    size_t          inleft;
+    l_int32         done;        /* 1 at the end of the stream or an error */
+};
+static l_int32 pnmGzOpen(struct PnmGz *gz, const l_uint8 *cdata, size_t size);
+static size_t pnmGzRead(struct PnmGz *gz, l_uint8 *out, size_t n);
+static void pnmGzClose(struct PnmGz *gz);
 
     /* a sanity check on the size read from file */
 static const l_int32  MAX_PNM_WIDTH = 100000;
@@ -95,12 +138,12 @@ static const l_int32  MAX_PNM_HEIGHT = 100000;
 LEPTONICA_EXPORT PIX *
 pixReadStreamPnm(FILE  *fp)
 {
-l_uint8    val8, rval8, gval8, bval8;
-l_uint16   val16;
-l_int32    w, h, d, bpl, wpl, i, j, type;
+l_uint8   *buf;
+l_int32    w, h, d, bpl, wpl, i, j, type, nsamples, samplesize;
 l_int32    val, rval, gval, bval;
 l_uint32   rgbval;
 l_uint32  *line, *data;
+size_t     nread;
 PIX       *pix;
 
     PROCNAME("pixReadStreamPnm");
@@ -137,62 +180,34 @@ PIX       *pix;
         return pix;
     }
 
-        /* "raw" format for 1 bpp */
+        /* "raw" format for 1 bpp: the bits are already in pix order,
+         * so each line is read straight into the pix */
     if (type == 4) {
-        bpl = (d * w + 7) / 8;
+        bpl = (w + 7) / 8;
         for (i = 0; i < h; i++) {
             line = data + i * wpl;
-            for (j = 0; j < bpl; j++) {
-                if (fread(&val8, 1, 1, fp) != 1)
-                    return (PIX *)ERROR_PTR( "read error in 4", procName, pix);
-                SET_DATA_BYTE(line, j, val8);
-            }
-        }
-        return pix;
-    }
-
-        /* "raw" format for grayscale */
-    if (type == 5) {
-        bpl = (d * w + 7) / 8;
-        for (i = 0; i < h; i++) {
-            line = data + i * wpl;
-            if (d != 16) {
-                for (j = 0; j < w; j++) {
-                    if (fread(&val8, 1, 1, fp) != 1)
-                        return (PIX *)ERROR_PTR( "error in 5", procName, pix);
-                    if (d == 2)
-                        SET_DATA_DIBIT(line, j, val8);
-                    else if (d == 4)
-                        SET_DATA_QBIT(line, j, val8);
-                    else  /* d == 8 */
-                        SET_DATA_BYTE(line, j, val8);
-                }
-            }
-            else {  /* d == 16 */
-                for (j = 0; j < w; j++) {
-                    if (fread(&val16, 2, 1, fp) != 1)
-                        return (PIX *)ERROR_PTR( "16 bpp error", procName, pix);
-                    SET_DATA_TWO_BYTES(line, j, val16);
-                }
-            }
+            nread = fread(line, 1, bpl, fp);
+            pnmFinishBitLine(line, w);
+            if (nread != (size_t)bpl)
+                return (PIX *)ERROR_PTR( "read error in 4", procName, pix);
         }
         return pix;
     }
 
-        /* "raw" format, type == 6; rgb */
+        /* Other "raw" formats: read a line at a time and convert it */
+    pnmGetRawLineSize(w, d, type, &nsamples, &samplesize);
+    bpl = nsamples * samplesize;
+    if ((buf = (l_uint8 *)CALLOC(bpl, 1)) == NULL)
+        return (PIX *)ERROR_PTR( "buf not made", procName, pix);
     for (i = 0; i < h; i++) {
-        line = data + i * wpl;
-        for (j = 0; j < wpl; j++) {
-            if (fread(&rval8, 1, 1, fp) != 1)
-                return (PIX *)ERROR_PTR( "read error type 6", procName, pix);
-            if (fread(&gval8, 1, 1, fp) != 1)
-                return (PIX *)ERROR_PTR( "read error type 6", procName, pix);
-            if (fread(&bval8, 1, 1, fp) != 1)
-                return (PIX *)ERROR_PTR( "read error type 6", procName, pix);
-            composeRGBPixel(rval8, gval8, bval8, &rgbval);
-            line[j] = rgbval;
+        nread = fread(buf, 1, bpl, fp);
+        pnmConvertRawLine(data + i * wpl, buf, nread / samplesize, d);
+        if (nread != (size_t)bpl) {
+            FREE(buf);
+            return (PIX *)ERROR_PTR( "read error", procName, pix);
         }
     }
+    FREE(buf);
     return pix;
 }
 
@@ -292,6 +307,438 @@ l_int32  maxval;
 #include "config_auto.h"
 #endif  /* HAVE_CONFIG_H */
 
+/*!
+ *  pixReadMemPnm()
+ *
+ *      Input:  cdata (const; pnm-encoded)
+ *              size (of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) This parses the data in place, without a stream, so it
+ *          works on all systems.  The header is scanned as by
+ *          freadHeaderPnm(), and the result is the same as that of
+ *          pixReadStreamPnm() on the same bytes.
+ */
+LEPTONICA_EXPORT PIX *
+pixReadMemPnm(const l_uint8  *cdata,
+              size_t          size)
+{
+l_int32    w, h, d, bpl, wpl, i, j, type, nsamples, samplesize;
+l_int32    val, rval, gval, bval;
+l_uint32   rgbval;
+l_uint32  *line, *data;
+size_t     pos;
+PIX       *pix;
+
+    PROCNAME("pixReadMemPnm");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+
+    pos = 0;
+    if (sreadHeaderPnmPos(cdata, size, &pos, &pix, &w, &h, &d, &type))
+        return (PIX *)ERROR_PTR( "pix not made", procName, NULL);
+    data = pixGetData(pix);
+    wpl = pixGetWpl(pix);
+
+        /* Old "ascii" format; as pnmReadNextAsciiValue(), a sample
+         * that doesn't parse is read as 0 */
+    if (type <= 3) {
+        for (i = 0; i < h; i++) {
+            for (j = 0; j < w; j++) {
+                if (type == 1 || type == 2) {
+                    pnmMemSkipWhitespace(cdata, size, &pos);
+                    if (pos >= size)
+                        return (PIX *)ERROR_PTR( "read abend", procName, pix);
+                    if (pnmMemReadInt(cdata, size, &pos, &val))
+                        val = 0;
+                    pixSetPixel(pix, j, i, val);
+                }
+                else {  /* type == 3 */
+                    pnmMemSkipWhitespace(cdata, size, &pos);
+                    if (pos >= size)
+                        return (PIX *)ERROR_PTR( "read abend", procName, pix);
+                    if (pnmMemReadInt(cdata, size, &pos, &rval))
+                        rval = 0;
+                    pnmMemSkipWhitespace(cdata, size, &pos);
+                    if (pos >= size)
+                        return (PIX *)ERROR_PTR( "read abend", procName, pix);
+                    if (pnmMemReadInt(cdata, size, &pos, &gval))
+                        gval = 0;
+                    pnmMemSkipWhitespace(cdata, size, &pos);
+                    if (pos >= size)
+                        return (PIX *)ERROR_PTR( "read abend", procName, pix);
+                    if (pnmMemReadInt(cdata, size, &pos, &bval))
+                        bval = 0;
+                    composeRGBPixel(rval, gval, bval, &rgbval);
+                    pixSetPixel(pix, j, i, rgbval);
+                }
+            }
+        }
+        return pix;
+    }
+
+        /* "raw" format for 1 bpp: the bits are already in pix order,
+         * so each line is copied straight into the pix */
+    if (type == 4) {
+        bpl = (w + 7) / 8;
+        for (i = 0; i < h; i++) {
+            line = data + i * wpl;
+            if (size - pos < (size_t)bpl) {
+                memcpy(line, cdata + pos, size - pos);
+                pnmFinishBitLine(line, w);
+                return (PIX *)ERROR_PTR( "read error in 4", procName, pix);
+            }
+            memcpy(line, cdata + pos, bpl);
+            pnmFinishBitLine(line, w);
+            pos += bpl;
+        }
+        return pix;
+    }
+
+        /* Other "raw" formats: convert the lines in place */
+    pnmGetRawLineSize(w, d, type, &nsamples, &samplesize);
+    bpl = nsamples * samplesize;
+    for (i = 0; i < h; i++) {
+        if (size - pos < (size_t)bpl) {
+            pnmConvertRawLine(data + i * wpl, cdata + pos,
+                              (size - pos) / samplesize, d);
+            return (PIX *)ERROR_PTR( "read error", procName, pix);
+        }
+        pnmConvertRawLine(data + i * wpl, cdata + pos, nsamples, d);
+        pos += bpl;
+    }
+    return pix;
+}
+
+
+/*!
+ *  pixReadMemPnmGz()
+ *
+ *      Input:  cdata (const; gzip-compressed pnm)
+ *              size (of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) The data is inflated into a buffer, which is then read with
+ *          pixReadMemPnm().  The size stored at the end of the gzip
+ *          data is taken as a hint for the size of the buffer.
+ *          To read the image without inflating it all at once, use
+ *          pnmRowsCreateMem(), which takes gzip-compressed data too.
+ */
+LEPTONICA_EXPORT PIX *
+pixReadMemPnmGz(const l_uint8  *cdata,
+                size_t          size)
+{
+size_t         capacity, n;
+l_uint8       *buf, *newbuf;
+struct PnmGz   gz;
+PIX           *pix;
+
+    PROCNAME("pixReadMemPnmGz");
+
+    if (!cdata)
+        return (PIX *)ERROR_PTR("cdata not defined", procName, NULL);
+    if (size < 18)
+        return (PIX *)ERROR_PTR("size < 18", procName, NULL);
+    if (pnmGzOpen(&gz, cdata, size))
+        return (PIX *)ERROR_PTR("inflate not started", procName, NULL);
+
+        /* ISIZE, the size of the input mod 2^32, little endian */
+    capacity = (size_t)cdata[size - 4] | (size_t)cdata[size - 3] << 8 |
+               (size_t)cdata[size - 2] << 16 | (size_t)cdata[size - 1] << 24;
+    capacity = capacity + 1 < 65536 ? 65536 : capacity + 1;
+    n = 0;
+    buf = NULL;
+    for (;;) {
+        if ((newbuf = (l_uint8 *)REALLOC(buf, capacity)) == NULL) {
+            FREE(buf);
+            pnmGzClose(&gz);
+            return (PIX *)ERROR_PTR("buffer not made", procName, NULL);
+        }
+        buf = newbuf;
+        n += pnmGzRead(&gz, buf + n, capacity - n);
+        if (gz.done)
+            break;
+        capacity *= 2;
+    }
+    pnmGzClose(&gz);
+
+    if (n < 2 || buf[0] != 'P') {
+        FREE(buf);
+        return (PIX *)ERROR_PTR("not a gzipped pnm", procName, NULL);
+    }
+    pix = pixReadMemPnm(buf, n);
+    FREE(buf);
+    return pix;
+}
+
+
+/*!
+ *  readHeaderMemPnm()
+ *
+ *      Input:  cdata (const; pnm-encoded, or gzip-compressed pnm)
+ *              size (of data)
+ *              &w, &h, &d (<return> width, height and depth of the pix
+ *                          that pixReadMemPnm() would make)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Only the header is read: of gzipped data, only enough is
+ *          inflated for the header, which is taken to be in the first
+ *          1 KB of the image.
+ */
+LEPTONICA_EXPORT l_int32
+readHeaderMemPnm(const l_uint8  *cdata,
+                 size_t          size,
+                 l_int32        *pw,
+                 l_int32        *ph,
+                 l_int32        *pd)
+{
+l_uint8        buf[1024];
+l_int32        type;
+size_t         n, pos;
+struct PnmGz   gz;
+
+    PROCNAME("readHeaderMemPnm");
+
+    if (!cdata || !pw || !ph || !pd)
+        return ERROR_INT("input ptr(s) not defined", procName, 1);
+    pos = 0;
+    if (size < 2 || cdata[0] != 0x1f || cdata[1] != 0x8b)
+        return sreadHeaderPnmPos(cdata, size, &pos, NULL, pw, ph, pd, &type);
+
+    if (size < 18)
+        return ERROR_INT("size < 18", procName, 1);
+    if (pnmGzOpen(&gz, cdata, size))
+        return ERROR_INT("inflate not started", procName, 1);
+    n = 0;
+    while (n < sizeof(buf) && !gz.done)
+        n += pnmGzRead(&gz, buf + n, sizeof(buf) - n);
+    pnmGzClose(&gz);
+    return sreadHeaderPnmPos(buf, n, &pos, NULL, pw, ph, pd, &type);
+}
+
+
+/*--------------------------------------------------------------------*
+ *                  Read from memory a row at a time                  *
+ *--------------------------------------------------------------------*/
+    /* The state of a "raw" pnm image being read a row at a time.  For
+     * a gzipped image, data is a window of the inflated bytes, which
+     * is refilled from gz as the rows are read (see pnmRowsFill()). */
+struct PnmRows {
+    const l_uint8  *data;
+    size_t          size;
+    size_t          pos;         /* of the next row */
+    l_int32         w, d, type, wpl;
+    l_int32         nsamples, samplesize;
+    l_int32         truncated;   /* 1 once the data has run out */
+    struct PnmGz   *gz;          /* null unless the data is gzipped */
+    l_uint8        *window;      /* data, for a gzipped image */
+    size_t          capacity;    /* of window */
+};
+
+    /* the bytes inflated at a time, beyond those of a row */
+static const size_t  PNM_GZ_WINDOW = 65536;
+
+
+/*!
+ *  pnmRowsFill()
+ *
+ *      Input:  pr (row parser)
+ *              need (bytes wanted from pr->pos on)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) For a gzipped image, if fewer than need bytes are left in
+ *          the window, the bytes left are moved to its start and the
+ *          rest of it is inflated.  Fewer are left only at the end of
+ *          the data (or on an error in it), as for a truncated file.
+ */
+static void
+pnmRowsFill(struct PnmRows  *pr,
+            size_t           need)
+{
+size_t  left;
+
+    if (!pr->gz || pr->size - pr->pos >= need || pr->gz->done)
+        return;
+    left = pr->size - pr->pos;
+    memmove(pr->window, pr->window + pr->pos, left);
+    pr->size = left + pnmGzRead(pr->gz, pr->window + left,
+                                pr->capacity - left);
+    pr->pos = 0;
+}
+
+/*!
+ *  pnmRowsCreateMem()
+ *
+ *      Input:  cdata (const; pnm-encoded)
+ *              size (of data)
+ *              rr (row reader, to fill in with the image parameters)
+ *      Return: row parser, or null if the image can't be read a row
+ *              at a time, or on error
+ *
+ *  Notes:
+ *      (1) The rows are read as by pixReadMemPnm(), into a line of
+ *          the pix it would make; rr->w, rr->h, rr->d, rr->xres and
+ *          rr->yres are set.
+ *      (2) Only "raw" 1, 8 bpp and rgb images are done.
+ */
+LEPTONICA_EXPORT struct PnmRows *
+pnmRowsCreateMem(const l_uint8  *cdata,
+                 size_t          size,
+                 L_ROWREADER    *rr)
+{
+l_int32          w, h, d, type;
+size_t           pos;
+struct PnmRows  *pr;
+
+    PROCNAME("pnmRowsCreateMem");
+
+    if (!cdata || !rr)
+        return (struct PnmRows *)ERROR_PTR("cdata or rr not defined",
+                                           procName, NULL);
+    if ((pr = (struct PnmRows *)CALLOC(1, sizeof(struct PnmRows))) == NULL)
+        return (struct PnmRows *)ERROR_PTR("pr not made", procName, NULL);
+    pr->data = cdata;
+    pr->size = size;
+
+        /* Gzipped: the header has to be in the first window */
+    if (size >= 2 && cdata[0] == 0x1f && cdata[1] == 0x8b) {
+        pr->gz = (struct PnmGz *)CALLOC(1, sizeof(struct PnmGz));
+        pr->capacity = PNM_GZ_WINDOW;
+        pr->window = (l_uint8 *)MALLOC(pr->capacity);
+        if (!pr->gz || !pr->window || pnmGzOpen(pr->gz, cdata, size)) {
+            FREE(pr->gz);
+            pr->gz = NULL;
+            pnmRowsDestroy(&pr);
+            return (struct PnmRows *)ERROR_PTR("inflate not started",
+                                               procName, NULL);
+        }
+        pr->data = pr->window;
+        pr->size = pnmGzRead(pr->gz, pr->window, pr->capacity);
+    }
+
+    pos = 0;
+    if (sreadHeaderPnmPos(pr->data, pr->size, &pos, NULL, &w, &h, &d,
+                          &type)) {
+        pnmRowsDestroy(&pr);
+        return (struct PnmRows *)ERROR_PTR("invalid header", procName, NULL);
+    }
+    if (pr->gz && pos == pr->size && !pr->gz->done) {
+        pnmRowsDestroy(&pr);
+        return (struct PnmRows *)ERROR_PTR("header too long", procName, NULL);
+    }
+    if (type <= 3 || (d != 1 && d != 8 && d != 32)) {
+        pnmRowsDestroy(&pr);
+        return NULL;  /* not done */
+    }
+    pr->pos = pos;
+    pr->w = w;
+    pr->d = d;
+    pr->type = type;
+    pr->wpl = (w * d + 31) / 32;
+    pnmGetRawLineSize(w, d, type, &pr->nsamples, &pr->samplesize);
+
+        /* the window must hold a whole row */
+    if (pr->gz &&
+        pr->capacity < (size_t)pr->nsamples * pr->samplesize + PNM_GZ_WINDOW) {
+        pr->capacity = (size_t)pr->nsamples * pr->samplesize + PNM_GZ_WINDOW;
+        if ((pr->window = (l_uint8 *)REALLOC(pr->window, pr->capacity))
+            == NULL) {
+            pnmRowsDestroy(&pr);
+            return (struct PnmRows *)ERROR_PTR("window not made", procName,
+                                               NULL);
+        }
+        pr->data = pr->window;
+    }
+
+    rr->w = w;
+    rr->h = h;
+    rr->d = d;
+    rr->xres = 0;
+    rr->yres = 0;
+    return pr;
+}
+
+
+/*!
+ *  pnmRowsRead()
+ *
+ *      Input:  pr (row parser)
+ *              line (of a pix of the size and depth of the image)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) As in pixReadMemPnm(), if the data runs out, the error is
+ *          reported, and the rest of the image is white (0).
+ */
+LEPTONICA_EXPORT l_int32
+pnmRowsRead(struct PnmRows  *pr,
+            l_uint32        *line)
+{
+size_t  bpl, left;
+
+    PROCNAME("pnmRowsRead");
+
+    if (!pr || !line)
+        return ERROR_INT("pr or line not defined", procName, 1);
+
+    bpl = (size_t)pr->nsamples * pr->samplesize;
+    pnmRowsFill(pr, bpl);
+    left = pr->size - pr->pos;
+    if (left < bpl) {
+        if (!pr->truncated)
+            L_ERROR("read error", procName);
+        pr->truncated = 1;
+        memset(line, 0, 4 * pr->wpl);
+        if (pr->type == 4) {
+            memcpy(line, pr->data + pr->pos, left);
+            pnmFinishBitLine(line, pr->w);
+        }
+        else {
+            pnmConvertRawLine(line, pr->data + pr->pos,
+                              left / pr->samplesize, pr->d);
+        }
+        pr->pos = pr->size;
+        return 0;
+    }
+
+    if (pr->type == 4) {  /* any bytes after these are pad bits */
+        memcpy(line, pr->data + pr->pos, bpl);
+        pnmFinishBitLine(line, pr->w);
+    }
+    else {
+        pnmConvertRawLine(line, pr->data + pr->pos, pr->nsamples, pr->d);
+    }
+    pr->pos += bpl;
+    return 0;
+}
+
+
+/*!
+ *  pnmRowsDestroy()
+ *
+ *      Input:  &pr (<will be set to null>)
+ *      Return: void
+ */
+LEPTONICA_EXPORT void
+pnmRowsDestroy(struct PnmRows  **ppr)
+{
+    if (!ppr || !*ppr)
+        return;
+    if ((*ppr)->gz) {
+        pnmGzClose((*ppr)->gz);
+        FREE((*ppr)->gz);
+    }
+    FREE((*ppr)->window);
+    FREE(*ppr);
+    *ppr = NULL;
+}
+
+
 /*--------------------------------------------------------------------*
  *                          Static helpers                            *
  *--------------------------------------------------------------------*/
@@ -363,6 +810,398 @@ l_int32  c;
     return 0;
 }
 
+
+
+/*!
+ *  sreadHeaderPnmPos()
+ *
+ *      Input:  cdata, size
+ *              &pos (<return> offset of the first byte after the header)
+ *              &pix (<optional return> use null to return only header data)
+ *              &width, &height, &depth, &type (<return>)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) This is freadHeaderPnm() on memory: as in the fscanf() formats
+ *          used there, each of the numbers may be preceded by whitespace,
+ *          and all whitespace after each line is skipped.
+ */
+static l_int32
+sreadHeaderPnmPos(const l_uint8  *cdata,
+                  size_t          size,
+                  size_t         *ppos,
+                  PIX           **ppix,
+                  l_int32        *pwidth,
+                  l_int32        *pheight,
+                  l_int32        *pdepth,
+                  l_int32        *ptype)
+{
+l_int32  w, h, d, type;
+l_int32  maxval;
+
+    PROCNAME("sreadHeaderPnmPos");
+
+    if (!pwidth || !pheight || !pdepth || !ptype)
+        return ERROR_INT("input ptr(s) not defined", procName, 1);
+
+    if (*ppos >= size || cdata[*ppos] != 'P')
+        return ERROR_INT("invalid read for type", procName, 1);
+    (*ppos)++;
+    if (pnmMemReadInt(cdata, size, ppos, &type))
+        return ERROR_INT("invalid read for type", procName, 1);
+    pnmMemSkipWhitespace(cdata, size, ppos);
+    if (type < 1 || type > 6)
+        return ERROR_INT("invalid pnm file", procName, 1);
+
+    if (pnmMemSkipCommentLines(cdata, size, ppos))
+        return ERROR_INT("no data in file", procName, 1);
+
+    if (pnmMemReadInt(cdata, size, ppos, &w) ||
+        pnmMemReadInt(cdata, size, ppos, &h))
+        return ERROR_INT("invalid read for w,h", procName, 1);
+    pnmMemSkipWhitespace(cdata, size, ppos);
+    if (w <= 0 || h <= 0 || w > MAX_PNM_WIDTH || h > MAX_PNM_HEIGHT)
+        return ERROR_INT("invalid sizes", procName, 1);
+
+        /* Get depth of pix */
+    if (type == 1 || type == 4)
+        d = 1;
+    else if (type == 2 || type == 5) {
+        if (pnmMemReadInt(cdata, size, ppos, &maxval))
+            return ERROR_INT("invalid read for maxval (2,5)", procName, 1);
+        pnmMemSkipWhitespace(cdata, size, ppos);
+        if (maxval == 3)
+            d = 2;
+        else if (maxval == 15)
+            d = 4;
+        else if (maxval == 255)
+            d = 8;
+        else if (maxval == 0xffff)
+            d = 16;
+        else {
+            fprintf(stderr, "maxval = %d\n", maxval);
+            return ERROR_INT("invalid maxval", procName, 1);
+        }
+    }
+    else {  /* type == 3 || type == 6; this is rgb  */
+        if (pnmMemReadInt(cdata, size, ppos, &maxval))
+            return ERROR_INT("invalid read for maxval (3,6)", procName, 1);
+        pnmMemSkipWhitespace(cdata, size, ppos);
+        if (maxval != 255)
+            L_WARNING_INT("unexpected maxval = %d", procName, maxval);
+        d = 32;
+    }
+    *pwidth = w;
+    *pheight = h;
+    *pdepth = d;
+    *ptype = type;
+
+    if (!ppix)
+        return 0;
+
+    if ((*ppix = pixCreate(w, h, d)) == NULL)  /* return pix initialized to 0 */
+        return ERROR_INT( "pix not made", procName, 1);
+    return 0;
+}
+
+
+/*!
+ *  pnmMemReadInt()
+ *
+ *      Return: 0 if OK, 1 if there is no number at *ppos
+ *
+ *  Notes:
+ *      (1) As fscanf("%d"), this skips whitespace and reads an
+ *          optionally signed decimal number.  On error, *ppos is
+ *          left at the first byte that isn't whitespace.
+ */
+static l_int32
+pnmMemReadInt(const l_uint8  *cdata,
+              size_t          size,
+              size_t         *ppos,
+              l_int32        *pval)
+{
+size_t   pos;
+l_int32  neg, val;
+
+    pnmMemSkipWhitespace(cdata, size, ppos);
+    pos = *ppos;
+    neg = 0;
+    if (pos < size && (cdata[pos] == '-' || cdata[pos] == '+'))
+        neg = (cdata[pos++] == '-');
+    if (pos >= size || cdata[pos] < '0' || cdata[pos] > '9')
+        return 1;
+    val = 0;
+    while (pos < size && cdata[pos] >= '0' && cdata[pos] <= '9')
+        val = 10 * val + (cdata[pos++] - '0');
+    *pval = neg ? -val : val;
+    *ppos = pos;
+    return 0;
+}
+
+
+/*!
+ *  pnmMemSkipWhitespace()
+ *
+ *  Notes:
+ *      (1) This skips the bytes that isspace() is true of in the "C"
+ *          locale, as a whitespace directive of fscanf() does.
+ */
+static void
+pnmMemSkipWhitespace(const l_uint8  *cdata,
+                     size_t          size,
+                     size_t         *ppos)
+{
+l_int32  c;
+
+    while (*ppos < size) {
+        c = cdata[*ppos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\v' && c != '\f' &&
+            c != '\r')
+            break;
+        (*ppos)++;
+    }
+}
+
+
+/*!
+ *  pnmMemSkipCommentLines()
+ *
+ *      Return: 0 if OK, 1 on end of data
+ *
+ *  Notes:
+ *      (1) This is pnmSkipCommentLines() on memory.
+ */
+static l_int32
+pnmMemSkipCommentLines(const l_uint8  *cdata,
+                       size_t          size,
+                       size_t         *ppos)
+{
+    if (*ppos >= size)
+        return 1;
+    while (cdata[*ppos] == '#') {
+        while (cdata[*ppos] != '\n') {  /* this entire line */
+            if (++(*ppos) >= size)
+                return 1;
+        }
+        if (++(*ppos) >= size)
+            return 1;
+    }
+    return 0;
+}
+
+
+
+/*!
+ *  pnmFinishBitLine()
+ *
+ *      Input:  line (of a 1 bpp pix, holding the bytes of a P4 line;
+ *                    zero after them)
+ *              w (width of pix)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) P4 lines are packed MSB first with 1 for black, as a 1 bpp
+ *          pix is, so only the byte order of the words needs fixing.
+ *          The loop is in a form which compilers turn into (vector)
+ *          byte swaps.
+ *      (2) The pad bits after the last pixel are cleared, as they
+ *          can be anything in the file.
+ */
+static void
+pnmFinishBitLine(l_uint32  *line,
+                 l_int32    w)
+{
+l_int32  nwords;
+
+    nwords = (w + 31) / 32;
+    lineEndianByteSwap(line, line, nwords);
+    if (w & 31)
+        line[nwords - 1] &= ~(0xffffffff >> (w & 31));
+}
+
+
+/*!
+ *  pnmGetRawLineSize()
+ *
+ *      Input:  w, d, type (of the image)
+ *              &nsamples (<return> number of samples in a line)
+ *              &samplesize (<return> size of each sample, in bytes)
+ *
+ *  Notes:
+ *      (1) For 1 bpp (type 4), a "sample" is a byte of 8 pixels
+ *          (but see pnmFinishBitLine()).
+ */
+static void
+pnmGetRawLineSize(l_int32   w,
+                  l_int32   d,
+                  l_int32   type,
+                  l_int32  *pnsamples,
+                  l_int32  *psamplesize)
+{
+    if (type == 4) {
+        *pnsamples = (w + 7) / 8;
+        *psamplesize = 1;
+    }
+    else {
+        *pnsamples = w;
+        *psamplesize = (d == 32) ? 3 : (d == 16) ? 2 : 1;
+    }
+}
+
+
+/*!
+ *  pnmConvertRawLine()
+ *
+ *      Input:  line (of the pix)
+ *              buf (raw pnm data of the line)
+ *              n (number of samples to convert; see pnmGetRawLineSize())
+ *              d (depth of pix)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) This puts the samples of a line of "raw" pnm data in the
+ *          pix, a word at a time.  The rest of the word holding the
+ *          last sample is cleared.
+ *      (2) As for all reads of 16 bpp pnm here, the samples are taken
+ *          in the byte order of the machine.
+ */
+static void
+pnmConvertRawLine(l_uint32       *line,
+                  const l_uint8  *buf,
+                  l_int32         n,
+                  l_int32         d)
+{
+l_int32   j, k, spw, nfull, mask;
+l_uint16  val16[2];
+l_uint32  word;
+
+    if (d == 1 || d == 8) {  /* bytes, MSB first in each word */
+        nfull = n / 4;
+        for (j = 0; j < nfull; j++, buf += 4) {
+            line[j] = ((l_uint32)buf[0] << 24) | ((l_uint32)buf[1] << 16) |
+                      ((l_uint32)buf[2] << 8) | (l_uint32)buf[3];
+        }
+        if (n & 3) {
+            word = 0;
+            for (k = 0; k < (n & 3); k++)
+                word |= (l_uint32)buf[k] << (24 - 8 * k);
+            line[nfull] = word;
+        }
+    }
+    else if (d == 2 || d == 4) {  /* one sample in each byte */
+        spw = 32 / d;
+        mask = (1 << d) - 1;
+        for (j = 0; j < n; j += spw) {
+            word = 0;
+            for (k = 0; k < spw && j + k < n; k++)
+                word |= (l_uint32)(buf[j + k] & mask) << (32 - d * (k + 1));
+            line[j / spw] = word;
+        }
+    }
+    else if (d == 16) {
+        for (j = 0; j + 1 < n; j += 2, buf += 4) {
+            memcpy(val16, buf, 4);
+            line[j / 2] = ((l_uint32)val16[0] << 16) | val16[1];
+        }
+        if (n & 1) {
+            memcpy(val16, buf, 2);
+            line[n / 2] = (l_uint32)val16[0] << 16;
+        }
+    }
+    else {  /* d == 32; rgb */
+        for (j = 0; j < n; j++, buf += 3) {
+            line[j] = ((l_uint32)buf[0] << L_RED_SHIFT) |
+                      ((l_uint32)buf[1] << L_GREEN_SHIFT) |
+                      ((l_uint32)buf[2] << L_BLUE_SHIFT);
+        }
+    }
+}
+
+
+/*!
+ *  pnmGzOpen()
+ *
+ *      Input:  gz (to set up)
+ *              cdata, size (the gzip data, which must stay valid)
+ *      Return: 0 if OK, 1 on error
+ */
+static l_int32
+pnmGzOpen(struct PnmGz   *gz,
+          const l_uint8  *cdata,
+          size_t          size)
+{
+    memset(gz, 0, sizeof(*gz));
+    gz->in = cdata;
+    gz->inleft = size;
+        /* 16 + the largest window: a gzip header and trailer, only */
+    return inflateInit2(&gz->zs, 16 + MAX_WBITS) != Z_OK;
+}
+
+
+/*!
+ *  pnmGzRead()
+ *
+ *      Input:  gz (being inflated)
+ *              out (buffer for n bytes)
+ *              n (bytes wanted)
+ *      Return: the number of bytes inflated into out
+ *
+ *  Notes:
+ *      (1) Fewer than n bytes are inflated only at the end of the
+ *          stream, or on an error in it, which is reported; gz->done
+ *          is then set.  zlib takes at most 4 GB at a time, so the
+ *          input is given to it in pieces.
+ */
+static size_t
+pnmGzRead(struct PnmGz  *gz,
+          l_uint8       *out,
+          size_t         n)
+{
+size_t   got, chunk;
+l_int32  ret;
+
+    PROCNAME("pnmGzRead");
+
+    got = 0;
+    while (got < n && !gz->done) {
+        if (gz->zs.avail_in == 0 && gz->inleft > 0) {
+            chunk = gz->inleft < 0x40000000 ? gz->inleft : 0x40000000;
+            gz->zs.next_in = (Bytef *)gz->in;
+            gz->zs.avail_in = (uInt)chunk;
+            gz->in += chunk;
+            gz->inleft -= chunk;
+        }
+        chunk = n - got < 0x40000000 ? n - got : 0x40000000;
+        gz->zs.next_out = out + got;
+        gz->zs.avail_out = (uInt)chunk;
+        ret = inflate(&gz->zs, Z_NO_FLUSH);
+        got += chunk - gz->zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            gz->done = 1;
+        }
+        else if (ret != Z_OK) {
+            if (ret != Z_BUF_ERROR || gz->inleft > 0 || gz->zs.avail_in > 0)
+                L_ERROR("gzip data error", procName);
+            gz->done = 1;  /* truncated, or in error */
+        }
+    }
+    return got;
+}
+
+
+/*!
+ *  pnmGzClose()
+ *
+ *      Input:  gz (set up by pnmGzOpen())
+ *      Return: void
+ */
+static void
+pnmGzClose(struct PnmGz  *gz)
+{
+    inflateEnd(&gz->zs);
+}
+
 /* --------------------------------------------*/
 #endif  /* USE_PNMIO */
 /* --------------------------------------------*/
@@ -36,8 +36,16 @@
  *
  *      Read from memory
  *           PIX       *pixReadMem()
+ *           PIX       *pixReadMemThresh()
  *           l_int32    pixReadHeaderMem()
  *
+ *      Read from memory a row at a time
+ *           L_ROWREADER  *rowReaderCreateMem()
+ *           l_int32       rowReaderReadBinary()
+ *           l_int32       rowReaderReadGray()
+ *           void          rowReaderDestroy()
+ *           static l_int32  rowReaderNextLine()
+ *
  *      Test function for I/O with different formats 
  *           l_int32    ioFormatTest()
  */
@@ -271,7 +279,7 @@ l_int32  format;
  *      (2) For tiff files, this returns IFF_TIFF.  The specific tiff
  *          compression is then determined using findTiffCompression().
  */
-LEPTONICA_EXPORT l_int32
+LEPTONICA_REAL_EXPORT l_int32
 findFileFormatBuffer(const l_uint8  *buf,
                      l_int32        *pformat)
 {
@@ -369,11 +377,408 @@ l_uint16  twobytepw;
         return 0;
     }
 
+        /* Check for the gzip magic number; what is inside isn't
+         * known until it is inflated */
+    if (buf[0] == 0x1f && buf[1] == 0x8b) {
+        *pformat = IFF_GZIP;
+        return 0;
+    }
+
         /* File format identifier not found; unknown */
     return 1;
 }
 
 
+/*---------------------------------------------------------------------*
+ *                            Read from memory                         *
+ *---------------------------------------------------------------------*/
+/*!
+ *  pixReadMem()
+ *
+ *      Input:  data (const; encoded)
+ *              datasize (size of data)
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) This is a variation of pixReadStream(), where the data
+ *          is read from a memory buffer rather than a file.
+ *      (2) Only png, pnm and gzipped pnm are supported; the data is
+ *          decoded in place, without a stream or temporary file.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReadMem(const l_uint8  *data,
+           size_t          size)
+{
+l_int32  format;
+PIX     *pix;
+
+    PROCNAME("pixReadMem");
+
+    if (!data)
+        return (PIX *)ERROR_PTR("data not defined", procName, NULL);
+    if (size < 12)
+        return (PIX *)ERROR_PTR("size < 12", procName, NULL);
+    pix = NULL;
+
+    findFileFormatBuffer(data, &format);
+    switch (format)
+    {
+    case IFF_PNG:
+        if ((pix = pixReadMemPng(data, size)) == NULL)
+            return (PIX *)ERROR_PTR("png: no pix returned", procName, NULL);
+        break;
+
+    case IFF_PNM:
+        if ((pix = pixReadMemPnm(data, size)) == NULL)
+            return (PIX *)ERROR_PTR("pnm: no pix returned", procName, NULL);
+        break;
+
+    case IFF_GZIP:
+        if ((pix = pixReadMemPnmGz(data, size)) == NULL)
+            return (PIX *)ERROR_PTR("pnm.gz: no pix returned", procName, NULL);
+        format = IFF_PNM;
+        break;
+
+    case IFF_UNKNOWN:
+    default:
+        return (PIX *)ERROR_PTR("Unknown format: no pix returned",
+                procName, NULL);
+        break;
+    }
+
+    if (pix)
+        pixSetInputFormat(pix, format);
+    return pix;
+}
+
+
+/*!
+ *  pixReadMemThresh()
+ *
+ *      Input:  data (const; encoded)
+ *              datasize (size of data)
+ *              thresh (threshold value, in [0 ... 256])
+ *      Return: pix, or null on error
+ *
+ *  Notes:
+ *      (1) As pixReadMem(), except that an 8 bpp grayscale png is
+ *          thresholded to 1 bpp as it is decoded (see
+ *          pixReadMemPngThresh()).  The result is then the same as
+ *          that of pixThresholdToBinary() on the image, but the 8 bpp
+ *          image is never made.  Other images are read as they are.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixReadMemThresh(const l_uint8  *data,
+                 size_t          size,
+                 l_int32         thresh)
+{
+l_int32  format;
+PIX     *pix;
+
+    PROCNAME("pixReadMemThresh");
+
+    if (!data)
+        return (PIX *)ERROR_PTR("data not defined", procName, NULL);
+    if (size < 12)
+        return (PIX *)ERROR_PTR("size < 12", procName, NULL);
+
+    findFileFormatBuffer(data, &format);
+    if (format != IFF_PNG)
+        return pixReadMem(data, size);
+    if ((pix = pixReadMemPngThresh(data, size, thresh)) == NULL)
+        return (PIX *)ERROR_PTR("png: no pix returned", procName, NULL);
+    pixSetInputFormat(pix, format);
+    return pix;
+}
+
+
+/*!
+ *  pixReadHeaderMem()
+ *
+ *      Input:  data (const; encoded)
+ *              datasize (size of data)
+ *              &format (<return> file format: IFF_PNG, IFF_PNM or
+ *                       IFF_GZIP)
+ *              &w, &h, &d (<return> width, height and depth of the pix
+ *                          that pixReadMem() would make)
+ *              &iscmap (<optional return> 1 if it would have a
+ *                       colormap; else 0)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) Only the header is read, to find how big the image is
+ *          without decoding it (see readHeaderMemPng() and
+ *          readHeaderMemPnm()).  Of gzipped pnm, only the start is
+ *          inflated.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+pixReadHeaderMem(const l_uint8  *data,
+                 size_t          size,
+                 l_int32        *pformat,
+                 l_int32        *pw,
+                 l_int32        *ph,
+                 l_int32        *pd,
+                 l_int32        *piscmap)
+{
+    PROCNAME("pixReadHeaderMem");
+
+    if (piscmap) *piscmap = 0;
+    if (!data || !pformat || !pw || !ph || !pd)
+        return ERROR_INT("input ptr(s) not defined", procName, 1);
+    if (size < 12)
+        return ERROR_INT("size < 12", procName, 1);
+
+    findFileFormatBuffer(data, pformat);
+    switch (*pformat)
+    {
+    case IFF_PNG:
+        return readHeaderMemPng(data, size, pw, ph, pd, piscmap);
+    case IFF_PNM:
+    case IFF_GZIP:
+        return readHeaderMemPnm(data, size, pw, ph, pd);
+    default:
+        return ERROR_INT("unknown format", procName, 1);
+    }
+}
+
+
+/*---------------------------------------------------------------------*
+ *                  Read from memory a row at a time                   *
+ *---------------------------------------------------------------------*/
+static l_int32 rowReaderNextLine(L_ROWREADER *rr);
+
+/*!
+ *  rowReaderCreateMem()
+ *
+ *      Input:  data (const; encoded)
+ *              datasize (size of data)
+ *      Return: row reader, or null if the image can't be read a row
+ *              at a time, or on error
+ *
+ *  Notes:
+ *      (1) This reads a png or pnm (or gzipped pnm, which is inflated
+ *          as it is read) image a row at a time, so that
+ *          only a few rows of it are ever held in memory.  The rows
+ *          can be read as 1 bpp (rowReaderReadBinary()) or, unless the
+ *          image is bi-level, as 8 bpp gray (rowReaderReadGray()),
+ *          and they are then exactly the lines of the pix that
+ *          jbig2 would make from pixReadMem() with pixRemoveColormap(),
+ *          pixConvertRGBToGrayFast() and pixThresholdToBinary().
+ *      (2) Images that are not read this way (interlaced png,
+ *          "ascii" pnm, and 2, 4 and 16 bpp without a colormap) return
+ *          null without an error message; read them with pixReadMem().
+ *      (3) data must stay valid until the reader is destroyed.
+ */
+LEPTONICA_REAL_EXPORT L_ROWREADER *
+rowReaderCreateMem(const l_uint8  *data,
+                   size_t          size)
+{
+l_int32       format, colorfound;
+L_ROWREADER  *rr;
+
+    PROCNAME("rowReaderCreateMem");
+
+    if (!data)
+        return (L_ROWREADER *)ERROR_PTR("data not defined", procName, NULL);
+    if (size < 12)
+        return (L_ROWREADER *)ERROR_PTR("size < 12", procName, NULL);
+
+    findFileFormatBuffer(data, &format);
+    if (format != IFF_PNG && format != IFF_PNM && format != IFF_GZIP)
+        return NULL;
+    if ((rr = (L_ROWREADER *)CALLOC(1, sizeof(L_ROWREADER))) == NULL)
+        return (L_ROWREADER *)ERROR_PTR("rr not made", procName, NULL);
+    if (format == IFF_PNG)
+        rr->png = pngRowsCreateMem(data, size, rr);
+    else
+        rr->pnm = pnmRowsCreateMem(data, size, rr);
+    if (!rr->png && !rr->pnm) {
+        rowReaderDestroy(&rr);
+        return NULL;
+    }
+
+    rr->wpl = (rr->w * rr->d + 31) / 32;
+    rr->line = (l_uint32 *)CALLOC(rr->wpl, sizeof(l_uint32));
+    rr->binthresh = -1;
+    colorfound = 0;
+    if (rr->colormap) {
+        pixcmapHasColor(rr->colormap, &colorfound);
+        rr->graylut = (l_uint8 *)MALLOC(256);
+        rr->binlut = (l_uint32 *)MALLOC(256 * sizeof(l_uint32));
+        if (makeCmapGrayLut(rr->colormap, rr->graylut)) {
+            rowReaderDestroy(&rr);
+            return (L_ROWREADER *)ERROR_PTR("gray lut not made",
+                                            procName, NULL);
+        }
+    }
+    rr->binary = rr->d == 1 && !colorfound;
+    return rr;
+}
+
+
+/*!
+ *  rowReaderReadBinary()
+ *
+ *      Input:  rr (row reader)
+ *              lined (line of a 1 bpp pix of the size of the image)
+ *              thresh (threshold value, in [0 ... 256]; ignored if
+ *                      the image is bi-level)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) The next row is put in lined, with zero pad bits.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+rowReaderReadBinary(L_ROWREADER  *rr,
+                    l_uint32     *lined,
+                    l_int32       thresh)
+{
+l_int32  w, extra;
+
+    PROCNAME("rowReaderReadBinary");
+
+    if (!rr || !lined)
+        return ERROR_INT("rr or lined not defined", procName, 1);
+    if (!rr->binary && (thresh < 0 || thresh > 256))
+        return ERROR_INT("thresh not in [0 ... 256]", procName, 1);
+    if (rr->colormap && rr->binthresh != thresh) {
+        if (makeCmapBinaryLut(rr->colormap, rr->d, thresh, rr->binlut))
+            return ERROR_INT("binary lut not made", procName, 1);
+        rr->binthresh = thresh;
+    }
+    if (rr->gray16) {  /* the 16 bpp row is thresholded as it is */
+        if (rr->nread >= rr->h || pngRowsReadThresh(rr->png, lined, thresh))
+            return ERROR_INT("row not read", procName, 1);
+        rr->nread++;
+        return 0;
+    }
+    if (rowReaderNextLine(rr))
+        return ERROR_INT("row not read", procName, 1);
+
+    w = rr->w;
+    if (rr->colormap) {
+        cmapToBinaryLine(lined, w, rr->line, rr->d, rr->binlut);
+        return 0;
+    }
+    if (rr->d == 1)
+        memcpy(lined, rr->line, 4 * rr->wpl);
+    else if (rr->d == 8)
+        thresholdToBinaryLineLow(lined, w, rr->line, 8, thresh);
+    else
+        thresholdRGBToBinaryLineLow(lined, w, rr->line, thresh);
+    extra = w & 31;
+    if (extra)  /* clear the pad bits */
+        lined[(w + 31) / 32 - 1] &= 0xffffffff << (32 - extra);
+    return 0;
+}
+
+
+/*!
+ *  rowReaderReadGray()
+ *
+ *      Input:  rr (row reader, of an image that isn't bi-level)
+ *              lined (line of an 8 bpp pix of the size of the image)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) The next row is put in lined; the bytes after the last
+ *          pixel are cleared.
+ */
+LEPTONICA_REAL_EXPORT l_int32
+rowReaderReadGray(L_ROWREADER  *rr,
+                  l_uint32     *lined)
+{
+l_int32    j, w, d, val;
+l_uint32  *lines;
+
+    PROCNAME("rowReaderReadGray");
+
+    if (!rr || !lined)
+        return ERROR_INT("rr or lined not defined", procName, 1);
+    if (rr->binary)
+        return ERROR_INT("image is bi-level", procName, 1);
+    if (rowReaderNextLine(rr))
+        return ERROR_INT("row not read", procName, 1);
+
+    w = rr->w;
+    d = rr->d;
+    lines = rr->line;
+    if (!rr->colormap && d == 8) {
+        memcpy(lined, lines, 4 * rr->wpl);
+        return 0;
+    }
+    lined[(w + 3) / 4 - 1] = 0;
+    if (!rr->colormap) {  /* d == 32 */
+        for (j = 0; j < w; j++) {
+            val = (lines[j] >> L_GREEN_SHIFT) & 0xff;
+            SET_DATA_BYTE(lined, j, val);
+        }
+        return 0;
+    }
+    for (j = 0; j < w; j++) {
+        if (d == 8)
+            val = GET_DATA_BYTE(lines, j);
+        else if (d == 4)
+            val = GET_DATA_QBIT(lines, j);
+        else if (d == 2)
+            val = GET_DATA_DIBIT(lines, j);
+        else
+            val = GET_DATA_BIT(lines, j);
+        SET_DATA_BYTE(lined, j, rr->graylut[val]);
+    }
+    return 0;
+}
+
+
+/*!
+ *  rowReaderDestroy()
+ *
+ *      Input:  &rr (<will be set to null>)
+ *      Return: void
+ */
+LEPTONICA_REAL_EXPORT void
+rowReaderDestroy(L_ROWREADER  **prr)
+{
+L_ROWREADER  *rr;
+
+    if (!prr || (rr = *prr) == NULL)
+        return;
+    pngRowsDestroy(&rr->png);
+    pnmRowsDestroy(&rr->pnm);
+    pixcmapDestroy(&rr->colormap);
+    FREE(rr->line);
+    FREE(rr->binlut);
+    FREE(rr->graylut);
+    FREE(rr);
+    *prr = NULL;
+}
+
+
+/*!
+ *  rowReaderNextLine()
+ *
+ *      Input:  rr (row reader)
+ *      Return: 0 if OK, 1 on error
+ *
+ *  Notes:
+ *      (1) The next row is decoded into rr->line.  The last word is
+ *          cleared first, so that the pixels after the end of the
+ *          row are zero, as they are in a new pix.
+ */
+static l_int32
+rowReaderNextLine(L_ROWREADER  *rr)
+{
+    if (rr->nread >= rr->h)
+        return 1;
+    rr->line[rr->wpl - 1] = 0;
+    if (rr->png ? pngRowsRead(rr->png, rr->line)
+                : pnmRowsRead(rr->pnm, rr->line))
+        return 1;
+    rr->nread++;
+    return 0;
+}
+
+
 /*---------------------------------------------------------------------*
  *             Test function for I/O with different formats            *
  *---------------------------------------------------------------------*/
@@ -79,6 +79,9 @@
  *               PIX    *pixScaleGray4xLIThresh()
  *               PIX    *pixScaleGray4xLIDither()
  *
+ *         Area downscale followed by binarization
+ *               PIX    *pixScaleGrayAreaThresh()
+ *
  *         Grayscale downscaling using min and max
  *               PIX    *pixScaleGrayMinMax()
  *               PIX    *pixScaleGrayMinMax2()
@@ -113,14 +116,15 @@ extern l_float32  AlphaMaskBorderVals[2];
  *  Notes:
  *      (1) This does 2x upscale on pixs, using linear interpolation,
  *          followed by thresholding to binary.
- *      (2) Buffers are used to avoid making a large grayscale image.
+ *      (2) Each pair of binary dest lines is made directly from the
+ *          src lines, so no grayscale image or line buffer is made.
  */
 LEPTONICA_REAL_EXPORT PIX *
 pixScaleGray2xLIThresh(PIX     *pixs,
                        l_int32  thresh)
 {
-l_int32    i, ws, hs, hsm, wd, hd, wpls, wplb, wpld;
-l_uint32  *datas, *datad, *lines, *lined, *lineb;
+l_int32    ws, hs, wd, hd, wpls, wpld;
+l_uint32  *datas, *datad;
 PIX       *pixd;
 
     PROCNAME("pixScaleGray2xLIThresh");
@@ -138,15 +142,9 @@ PIX       *pixd;
     pixGetDimensions(pixs, &ws, &hs, NULL);
     wd = 2 * ws;
     hd = 2 * hs;
-    hsm = hs - 1;
     datas = pixGetData(pixs);
     wpls = pixGetWpl(pixs);
 
-        /* Make line buffer for 2 lines of virtual intermediate image */
-    wplb = (wd + 3) / 4;
-    if ((lineb = (l_uint32 *)CALLOC(2 * wplb, sizeof(l_uint32))) == NULL)
-        return (PIX *)ERROR_PTR("lineb not made", procName, NULL);
-
         /* Make dest binary image */
     if ((pixd = pixCreate(wd, hd, 1)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
@@ -155,23 +153,8 @@ PIX       *pixd;
     wpld = pixGetWpl(pixd);
     datad = pixGetData(pixd);
 
-        /* Do all but last src line */
-    for (i = 0; i < hsm; i++) {
-        lines = datas + i * wpls;
-        lined = datad + 2 * i * wpld;  /* do 2 dest lines at a time */
-        scaleGray2xLILineLow(lineb, wplb, lines, ws, wpls, 0);
-        thresholdToBinaryLineLow(lined, wd, lineb, 8, thresh);
-        thresholdToBinaryLineLow(lined + wpld, wd, lineb + wplb, 8, thresh);
-    }
-
-        /* Do last src line */
-    lines = datas + hsm * wpls;
-    lined = datad + 2 * hsm * wpld;
-    scaleGray2xLILineLow(lineb, wplb, lines, ws, wpls, 1);
-    thresholdToBinaryLineLow(lined, wd, lineb, 8, thresh);
-    thresholdToBinaryLineLow(lined + wpld, wd, lineb + wplb, 8, thresh);
+    scaleGray2xLIThreshLow(datad, wpld, datas, ws, hs, wpls, thresh, 0, hs);
 
-    FREE(lineb);
     return pixd;
 }
 
@@ -189,18 +172,15 @@ PIX       *pixd;
  *  Notes:
  *      (1) This does 4x upscale on pixs, using linear interpolation,
  *          followed by thresholding to binary.
- *      (2) Buffers are used to avoid making a large grayscale image.
- *      (3) If a full 4x expanded grayscale image can be kept in memory,
- *          this function is only about 10% faster than separately doing
- *          a linear interpolation to a large grayscale image, followed
- *          by thresholding to binary.
+ *      (2) Each group of 4 binary dest lines is made directly from the
+ *          src lines, so no grayscale image or line buffer is made.
  */
 LEPTONICA_REAL_EXPORT PIX *
 pixScaleGray4xLIThresh(PIX     *pixs,
                        l_int32  thresh)
 {
-l_int32    i, j, ws, hs, hsm, wd, hd, wpls, wplb, wpld;
-l_uint32  *datas, *datad, *lines, *lined, *lineb;
+l_int32    ws, hs, wd, hd, wpls, wpld;
+l_uint32  *datas, *datad;
 PIX       *pixd;
 
     PROCNAME("pixScaleGray4xLIThresh");
@@ -218,15 +198,9 @@ PIX       *pixd;
     pixGetDimensions(pixs, &ws, &hs, NULL);
     wd = 4 * ws;
     hd = 4 * hs;
-    hsm = hs - 1;
     datas = pixGetData(pixs);
     wpls = pixGetWpl(pixs);
 
-        /* Make line buffer for 4 lines of virtual intermediate image */
-    wplb = (wd + 3) / 4;
-    if ((lineb = (l_uint32 *)CALLOC(4 * wplb, sizeof(l_uint32))) == NULL)
-        return (PIX *)ERROR_PTR("lineb not made", procName, NULL);
-
         /* Make dest binary image */
     if ((pixd = pixCreate(wd, hd, 1)) == NULL)
         return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
@@ -235,26 +209,78 @@ PIX       *pixd;
     wpld = pixGetWpl(pixd);
     datad = pixGetData(pixd);
 
-        /* Do all but last src line */
-    for (i = 0; i < hsm; i++) {
-        lines = datas + i * wpls;
-        lined = datad + 4 * i * wpld;  /* do 4 dest lines at a time */
-        scaleGray4xLILineLow(lineb, wplb, lines, ws, wpls, 0);
-        for (j = 0; j < 4; j++) {
-            thresholdToBinaryLineLow(lined + j * wpld, wd,
-                                     lineb + j * wplb, 8, thresh);
-        }
-    }
+    scaleGray4xLIThreshLow(datad, wpld, datas, ws, hs, wpls, thresh, 0, hs);
+
+    return pixd;
+}
+
+
+/*------------------------------------------------------------------*
+ *              Area downscale followed by binarization             *
+ *------------------------------------------------------------------*/
+/*!
+ *  pixScaleGrayAreaThresh()
+ *
+ *      Input:  pixs (8 bpp)
+ *              factor (integer reduction, between 2 and 8)
+ *              thresh  (between 0 and 256)
+ *      Return: pixd (1 bpp), or null on error
+ *
+ *  Notes:
+ *      (1) This reduces pixs by factor in each direction, averaging
+ *          each square of factor x factor pixels, and thresholds the
+ *          averages to binary.  The dest is the size of pixs over
+ *          factor, rounded up: the blocks at the right and bottom
+ *          edges are averaged over the pixels that they have.
+ *      (2) Each binary dest line is made directly from its src lines
+ *          (see scaleGrayAreaThreshLineLow()), so as with the
+ *          upscaling functions, no grayscale image or line buffer is
+ *          made.
+ */
+LEPTONICA_REAL_EXPORT PIX *
+pixScaleGrayAreaThresh(PIX     *pixs,
+                       l_int32  factor,
+                       l_int32  thresh)
+{
+l_int32    i, ws, hs, wd, hd, wpls, wpld;
+l_uint32  *datas, *datad;
+PIX       *pixd;
+
+    PROCNAME("pixScaleGrayAreaThresh");
+
+    if (!pixs)
+        return (PIX *)ERROR_PTR("pixs not defined", procName, NULL);
+    if (pixGetDepth(pixs) != 8)
+        return (PIX *)ERROR_PTR("pixs must be 8 bpp", procName, NULL);
+    if (factor < 2 || factor > 8)
+        return (PIX *)ERROR_PTR("factor must be in [2, ... 8]",
+            procName, NULL);
+    if (thresh < 0 || thresh > 256)
+        return (PIX *)ERROR_PTR("thresh must be in [0, ... 256]",
+            procName, NULL);
+    if (pixGetColormap(pixs))
+        L_WARNING("pixs has colormap", procName);
+
+    pixGetDimensions(pixs, &ws, &hs, NULL);
+    wd = (ws + factor - 1) / factor;
+    hd = (hs + factor - 1) / factor;
+    datas = pixGetData(pixs);
+    wpls = pixGetWpl(pixs);
+
+        /* Make dest binary image */
+    if ((pixd = pixCreateNoInit(wd, hd, 1)) == NULL)
+        return (PIX *)ERROR_PTR("pixd not made", procName, NULL);
+    pixCopyResolution(pixd, pixs);
+    pixScaleResolution(pixd, 1.0 / factor, 1.0 / factor);
+    wpld = pixGetWpl(pixd);
+    datad = pixGetData(pixd);
 
-        /* Do last src line */
-    lines = datas + hsm * wpls;
-    lined = datad + 4 * hsm * wpld;
-    scaleGray4xLILineLow(lineb, wplb, lines, ws, wpls, 1);
-    for (j = 0; j < 4; j++) {
-        thresholdToBinaryLineLow(lined + j * wpld, wd,
-                                 lineb + j * wplb, 8, thresh);
+    for (i = 0; i < hd; i++) {
+        scaleGrayAreaThreshLineLow(datad + i * wpld, wd,
+                                   datas + i * factor * wpls, ws, wpls,
+                                   L_MIN(factor, hs - i * factor), factor,
+                                   thresh);
     }
 
-    FREE(lineb);
     return pixd;
 }
@@ -35,6 +35,17 @@
  *                  void       scaleGray4xLILow()
  *                  void       scaleGray4xLILineLow()
  *
+ *         Grayscale (interpolated) scaling followed by binarization
+ *                  void       scaleGray2xLIThreshLow()
+ *                  void       scaleGray2xLIThreshLineLow()
+ *                  void       scaleGray4xLIThreshLow()
+ *                  void       scaleGray4xLIThreshLineLow()
+ *                  void       scaleGray2xLIMultiThreshLineLow()
+ *                  void       scaleGray4xLIMultiThreshLineLow()
+ *
+ *         Grayscale area reduction followed by binarization
+ *                  void       scaleGrayAreaThreshLineLow()
+ *
  *         Grayscale and color scaling by closest pixel sampling
  *                  l_int32    scaleBySamplingLow()
  *
@@ -85,6 +96,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "allheaders.h"
+#include "jbig2simd.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  /* __SSE2__ */
 
 #ifndef  NO_CONSOLE_IO
 #define  DEBUG_OVERFLOW   0
@@ -107,7 +123,7 @@
  *              lastlineflag  (1 if last src line; 0 otherwise)
  *      Return: void
  */
-LEPTONICA_EXPORT void
+LEPTONICA_REAL_EXPORT void
 scaleGray2xLILineLow(l_uint32  *lined,
                      l_int32    wpld,
                      l_uint32  *lines,
@@ -261,7 +277,7 @@ l_uint32   words, wordsp, wordd, worddp;
  *              lastlineflag  (1 if last src line; 0 otherwise)
  *      Return: void
  */
-LEPTONICA_EXPORT void
+LEPTONICA_REAL_EXPORT void
 scaleGray4xLILineLow(l_uint32  *lined,
                      l_int32    wpld,
                      l_uint32  *lines,
@@ -378,3 +394,697 @@ l_uint32  *linesp, *linedp1, *linedp2, *linedp3;
         
     return;
 }
+
+
+/*------------------------------------------------------------------*
+ *     2x and 4x linear interpolated gray scaling and binarization  *
+ *------------------------------------------------------------------*/
+#if defined(__SSE2__)
+    /* 8 pixels, starting at a word, as 16 bit values in pixel order */
+static __m128i
+scaleGrayLoad8(const l_uint32  *words)
+{
+__m128i  v;
+
+    v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)words),
+                          _mm_setzero_si128());
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+    /* The 8 pixels after the first pixel of v, given the next 8 in vnext */
+static __m128i
+scaleGrayNext8(__m128i  v,
+               __m128i  vnext)
+{
+    return _mm_or_si128(_mm_srli_si128(v, 2), _mm_slli_si128(vnext, 14));
+}
+
+    /* Dest word from 32 comparison results of 16 bits, in pixel order */
+static l_uint32
+scaleGrayPackBits32(__m128i  c0,
+                    __m128i  c1,
+                    __m128i  c2,
+                    __m128i  c3)
+{
+l_uint32  word;
+
+    word = (l_uint32)_mm_movemask_epi8(_mm_packs_epi16(c0, c1)) |
+           ((l_uint32)_mm_movemask_epi8(_mm_packs_epi16(c2, c3)) << 16);
+        /* Pixel i is in bit i; reverse to put pixel 0 in the MSB */
+    word = ((word >> 1) & 0x55555555) | ((word & 0x55555555) << 1);
+    word = ((word >> 2) & 0x33333333) | ((word & 0x33333333) << 2);
+    word = ((word >> 4) & 0x0f0f0f0f) | ((word & 0x0f0f0f0f) << 4);
+    return (word >> 24) | ((word >> 8) & 0xff00) |
+           ((word << 8) & 0xff0000) | (word << 24);
+}
+#endif  /* __SSE2__ */
+
+
+/*!
+ *  scaleGray2xLIThreshLow()
+ *
+ *      Input:  datad (of 1 bpp dest, 2 * ws by 2 * hs)
+ *              wpld
+ *              datas (of 8 bpp src)
+ *              ws, hs
+ *              wpls
+ *              thresh  (between 0 and 256)
+ *              first, last (range of src lines to do: first <= i < last)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Each src line only gives its own 2 dest lines, so disjoint
+ *          ranges of src lines can be done at the same time.
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGray2xLIThreshLow(l_uint32  *datad,
+                       l_int32    wpld,
+                       l_uint32  *datas,
+                       l_int32    ws,
+                       l_int32    hs,
+                       l_int32    wpls,
+                       l_int32    thresh,
+                       l_int32    first,
+                       l_int32    last)
+{
+l_int32  i;
+
+    for (i = first; i < last; i++) {
+        scaleGray2xLIThreshLineLow(datad + 2 * i * wpld, wpld,
+                                   datas + i * wpls, ws, wpls,
+                                   i == hs - 1, thresh);
+    }
+    return;
+}
+
+
+/*!
+ *  scaleGray2xLIThreshLineLow()
+ *
+ *      Input:  lined   (ptr to top destline, to be made from current src line)
+ *              wpld
+ *              lines   (ptr to current src line)
+ *              ws
+ *              wpls
+ *              lastlineflag  (1 if last src line; 0 otherwise)
+ *              thresh  (between 0 and 256)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) This makes the 2 binary dest lines of scaleGray2xLILineLow()
+ *          followed by thresholdToBinaryLineLow(), without the gray
+ *          lines in between.
+ *      (2) The last src pixel (and the last src line) are interpolated
+ *          with themselves, which gives the same values as the
+ *          replication done in scaleGray2xLILineLow().
+ *      (3) With SSE2, 16 src pixels make each pair of dest words.
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGray2xLIThreshLineLow(l_uint32  *lined,
+                           l_int32    wpld,
+                           l_uint32  *lines,
+                           l_int32    ws,
+                           l_int32    wpls,
+                           l_int32    lastlineflag,
+                           l_int32    thresh)
+{
+l_int32    j, jd, wsm, s1, s2, s3, s4;
+l_uint32   word0, word1;
+l_uint32  *linesp, *linedp;
+#if defined(__SSE2__)
+__m128i    vthresh, a, b, c, ap, bp, cp, t0, t1, n0, n1;
+__m128i    e0, o0, e1, o1, e2, o2, e3, o3;
+#endif  /* __SSE2__ */
+
+    wsm = ws - 1;
+    linesp = (lastlineflag) ? lines : lines + wpls;
+    linedp = lined + wpld;
+    j = 0;
+
+#if defined(__SSE2__)
+    if (simd_level() >= SIMD_SSE2) {
+            /* s1 and s2 are in a and its next pixels, s3 and s4 in ap */
+        vthresh = _mm_set1_epi16(thresh);
+        a = ap = _mm_setzero_si128();
+        if (ws >= 24) {
+            a = scaleGrayLoad8(lines);
+            ap = scaleGrayLoad8(linesp);
+        }
+        for (; j + 24 <= ws; j += 16) {
+            b = scaleGrayLoad8(lines + j / 4 + 2);
+            c = scaleGrayLoad8(lines + j / 4 + 4);
+            bp = scaleGrayLoad8(linesp + j / 4 + 2);
+            cp = scaleGrayLoad8(linesp + j / 4 + 4);
+
+                /* Src pixels 0 - 7 */
+            n0 = scaleGrayNext8(a, b);
+            t0 = _mm_add_epi16(a, ap);
+            t1 = _mm_add_epi16(n0, scaleGrayNext8(ap, bp));
+            e0 = _mm_cmplt_epi16(a, vthresh);
+            o0 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(a, n0), 1),
+                                 vthresh);
+            e1 = _mm_cmplt_epi16(_mm_srli_epi16(t0, 1), vthresh);
+            o1 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(t0, t1), 2),
+                                 vthresh);
+
+                /* Src pixels 8 - 15 */
+            n1 = scaleGrayNext8(b, c);
+            t0 = _mm_add_epi16(b, bp);
+            t1 = _mm_add_epi16(n1, scaleGrayNext8(bp, cp));
+            e2 = _mm_cmplt_epi16(b, vthresh);
+            o2 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(b, n1), 1),
+                                 vthresh);
+            e3 = _mm_cmplt_epi16(_mm_srli_epi16(t0, 1), vthresh);
+            o3 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(t0, t1), 2),
+                                 vthresh);
+
+            lined[j / 16] = scaleGrayPackBits32(
+                _mm_unpacklo_epi16(e0, o0), _mm_unpackhi_epi16(e0, o0),
+                _mm_unpacklo_epi16(e2, o2), _mm_unpackhi_epi16(e2, o2));
+            linedp[j / 16] = scaleGrayPackBits32(
+                _mm_unpacklo_epi16(e1, o1), _mm_unpackhi_epi16(e1, o1),
+                _mm_unpacklo_epi16(e3, o3), _mm_unpackhi_epi16(e3, o3));
+            a = c;
+            ap = cp;
+        }
+    }
+#endif  /* __SSE2__ */
+
+        /* The rest, a pixel at a time; j is a multiple of 16 here */
+    word0 = word1 = 0;
+    for (jd = 2 * j; j < ws; j++, jd += 2) {
+        s1 = GET_DATA_BYTE(lines, j);
+        s3 = GET_DATA_BYTE(linesp, j);
+        if (j < wsm) {
+            s2 = GET_DATA_BYTE(lines, j + 1);
+            s4 = GET_DATA_BYTE(linesp, j + 1);
+        }
+        else {
+            s2 = s1;
+            s4 = s3;
+        }
+        word0 |= (((s1 - thresh) >> 31) & 1) << (31 - (jd & 31));
+        word0 |= ((((s1 + s2) / 2 - thresh) >> 31) & 1) << (30 - (jd & 31));
+        word1 |= ((((s1 + s3) / 2 - thresh) >> 31) & 1) << (31 - (jd & 31));
+        word1 |= ((((s1 + s2 + s3 + s4) / 4 - thresh) >> 31) & 1) <<
+                 (30 - (jd & 31));
+        if ((jd & 31) == 30) {
+            lined[jd >> 5] = word0;
+            linedp[jd >> 5] = word1;
+            word0 = word1 = 0;
+        }
+    }
+    if (jd & 31) {
+        lined[jd >> 5] = word0;
+        linedp[jd >> 5] = word1;
+    }
+    return;
+}
+
+
+/*!
+ *  scaleGray4xLIThreshLow()
+ *
+ *      Input:  datad (of 1 bpp dest, 4 * ws by 4 * hs)
+ *              wpld
+ *              datas (of 8 bpp src)
+ *              ws, hs
+ *              wpls
+ *              thresh  (between 0 and 256)
+ *              first, last (range of src lines to do: first <= i < last)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) As for scaleGray2xLIThreshLow(), disjoint ranges of src
+ *          lines can be done at the same time.
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGray4xLIThreshLow(l_uint32  *datad,
+                       l_int32    wpld,
+                       l_uint32  *datas,
+                       l_int32    ws,
+                       l_int32    hs,
+                       l_int32    wpls,
+                       l_int32    thresh,
+                       l_int32    first,
+                       l_int32    last)
+{
+l_int32  i;
+
+    for (i = first; i < last; i++) {
+        scaleGray4xLIThreshLineLow(datad + 4 * i * wpld, wpld,
+                                   datas + i * wpls, ws, wpls,
+                                   i == hs - 1, thresh);
+    }
+    return;
+}
+
+
+/*!
+ *  scaleGray4xLIThreshLineLow()
+ *
+ *      Input:  lined   (ptr to top destline, to be made from current src line)
+ *              wpld
+ *              lines   (ptr to current src line)
+ *              ws
+ *              wpls
+ *              lastlineflag  (1 if last src line; 0 otherwise)
+ *              thresh  (between 0 and 256)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) This makes the 4 binary dest lines of scaleGray4xLILineLow()
+ *          followed by thresholdToBinaryLineLow(), without the gray
+ *          lines in between.
+ *      (2) Dest pixel (r, c) of each 4x4 block is
+ *              ((4 - c) * v + c * vn) / 16
+ *          with v = (4 - r) * s1 + r * s3 and vn = (4 - r) * s2 + r * s4,
+ *          which is what scaleGray4xLILineLow() computes.  As for 2x,
+ *          the last src pixel and line are interpolated with themselves.
+ *      (3) With SSE2, 8 src pixels make each group of 4 dest words.
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGray4xLIThreshLineLow(l_uint32  *lined,
+                           l_int32    wpld,
+                           l_uint32  *lines,
+                           l_int32    ws,
+                           l_int32    wpls,
+                           l_int32    lastlineflag,
+                           l_int32    thresh)
+{
+l_int32    j, jd, r, c, wsm, s1, s2, s3, s4, v, vn;
+l_uint32   word[4];
+l_uint32  *linesp;
+#if defined(__SSE2__)
+__m128i    vthresh, a, b, ap, bp, n, np, vt, vnt, x01, x23, y01, y23;
+__m128i    c0, c1, c2, c3;
+#endif  /* __SSE2__ */
+
+    wsm = ws - 1;
+    linesp = (lastlineflag) ? lines : lines + wpls;
+    j = 0;
+
+#if defined(__SSE2__)
+    if (simd_level() >= SIMD_SSE2) {
+        vthresh = _mm_set1_epi16(thresh);
+        a = ap = _mm_setzero_si128();
+        if (ws >= 16) {
+            a = scaleGrayLoad8(lines);
+            ap = scaleGrayLoad8(linesp);
+        }
+        for (; j + 16 <= ws; j += 8) {
+            b = scaleGrayLoad8(lines + j / 4 + 2);
+            bp = scaleGrayLoad8(linesp + j / 4 + 2);
+            n = scaleGrayNext8(a, b);
+            np = scaleGrayNext8(ap, bp);
+            for (r = 0; r < 4; r++) {
+                vt = _mm_add_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(4 - r)),
+                                   _mm_mullo_epi16(ap, _mm_set1_epi16(r)));
+                vnt = _mm_add_epi16(_mm_mullo_epi16(n, _mm_set1_epi16(4 - r)),
+                                    _mm_mullo_epi16(np, _mm_set1_epi16(r)));
+                c0 = _mm_cmplt_epi16(_mm_srli_epi16(vt, 2), vthresh);
+                c1 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(
+                         _mm_add_epi16(vt, _mm_add_epi16(vt, vt)), vnt), 4),
+                         vthresh);
+                c2 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(vt, vnt), 3),
+                                     vthresh);
+                c3 = _mm_cmplt_epi16(_mm_srli_epi16(_mm_add_epi16(
+                         vt, _mm_add_epi16(vnt, _mm_add_epi16(vnt, vnt))), 4),
+                         vthresh);
+                    /* Interleave to dest pixel order */
+                x01 = _mm_unpacklo_epi16(c0, c1);
+                x23 = _mm_unpacklo_epi16(c2, c3);
+                y01 = _mm_unpackhi_epi16(c0, c1);
+                y23 = _mm_unpackhi_epi16(c2, c3);
+                lined[r * wpld + j / 8] = scaleGrayPackBits32(
+                    _mm_unpacklo_epi32(x01, x23), _mm_unpackhi_epi32(x01, x23),
+                    _mm_unpacklo_epi32(y01, y23), _mm_unpackhi_epi32(y01, y23));
+            }
+            a = b;
+            ap = bp;
+        }
+    }
+#endif  /* __SSE2__ */
+
+        /* The rest, a pixel at a time; j is a multiple of 8 here */
+    word[0] = word[1] = word[2] = word[3] = 0;
+    for (jd = 4 * j; j < ws; j++, jd += 4) {
+        s1 = GET_DATA_BYTE(lines, j);
+        s3 = GET_DATA_BYTE(linesp, j);
+        if (j < wsm) {
+            s2 = GET_DATA_BYTE(lines, j + 1);
+            s4 = GET_DATA_BYTE(linesp, j + 1);
+        }
+        else {
+            s2 = s1;
+            s4 = s3;
+        }
+        for (r = 0; r < 4; r++) {
+            v = (4 - r) * s1 + r * s3;
+            vn = (4 - r) * s2 + r * s4;
+            for (c = 0; c < 4; c++) {
+                word[r] |= (((((4 - c) * v + c * vn) / 16 - thresh) >> 31) &
+                            1) << (31 - c - (jd & 31));
+            }
+        }
+        if ((jd & 31) == 28) {
+            for (r = 0; r < 4; r++) {
+                lined[r * wpld + (jd >> 5)] = word[r];
+                word[r] = 0;
+            }
+        }
+    }
+    if (jd & 31) {
+        for (r = 0; r < 4; r++)
+            lined[r * wpld + (jd >> 5)] = word[r];
+    }
+    return;
+}
+
+/*!
+ *  scaleGray2xLIMultiThreshLineLow()
+ *
+ *      Input:  lineds  (ptrs to the top destline of each of n dest images)
+ *              wpld    (of each dest image)
+ *              lines   (ptr to current src line)
+ *              ws
+ *              wpls
+ *              lastlineflag  (1 if last src line; 0 otherwise)
+ *              threshs (n thresholds, each between 0 and 256)
+ *              n
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Each dest image gets the 2 lines that
+ *          scaleGray2xLIThreshLineLow() makes with its threshold, but
+ *          with SSE2 the interpolated values are found once for all
+ *          of them.
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGray2xLIMultiThreshLineLow(l_uint32       **lineds,
+                                l_int32          wpld,
+                                l_uint32        *lines,
+                                l_int32          ws,
+                                l_int32          wpls,
+                                l_int32          lastlineflag,
+                                const l_int32   *threshs,
+                                l_int32          n)
+{
+l_int32    j, js, jd, k, wsm, s1, s2, s3, s4, thresh;
+l_uint32   word0, word1;
+l_uint32  *linesp, *lined, *linedp;
+#if defined(__SSE2__)
+l_int32    i;
+__m128i    vthresh, a, b, c, ap, bp, cp, t0, t1, n0, n1;
+__m128i    e0, o0, e1, o1, e2, o2, e3, o3, v[8];
+#endif  /* __SSE2__ */
+
+    wsm = ws - 1;
+    linesp = (lastlineflag) ? lines : lines + wpls;
+    j = 0;
+
+#if defined(__SSE2__)
+    if (simd_level() >= SIMD_SSE2) {
+        a = ap = _mm_setzero_si128();
+        if (ws >= 24) {
+            a = scaleGrayLoad8(lines);
+            ap = scaleGrayLoad8(linesp);
+        }
+        for (; j + 24 <= ws; j += 16) {
+            b = scaleGrayLoad8(lines + j / 4 + 2);
+            c = scaleGrayLoad8(lines + j / 4 + 4);
+            bp = scaleGrayLoad8(linesp + j / 4 + 2);
+            cp = scaleGrayLoad8(linesp + j / 4 + 4);
+
+                /* The values of scaleGray2xLIThreshLineLow(), before
+                 * they are compared, in dest pixel order */
+            n0 = scaleGrayNext8(a, b);
+            t0 = _mm_add_epi16(a, ap);
+            t1 = _mm_add_epi16(n0, scaleGrayNext8(ap, bp));
+            e0 = a;
+            o0 = _mm_srli_epi16(_mm_add_epi16(a, n0), 1);
+            e1 = _mm_srli_epi16(t0, 1);
+            o1 = _mm_srli_epi16(_mm_add_epi16(t0, t1), 2);
+            n1 = scaleGrayNext8(b, c);
+            t0 = _mm_add_epi16(b, bp);
+            t1 = _mm_add_epi16(n1, scaleGrayNext8(bp, cp));
+            e2 = b;
+            o2 = _mm_srli_epi16(_mm_add_epi16(b, n1), 1);
+            e3 = _mm_srli_epi16(t0, 1);
+            o3 = _mm_srli_epi16(_mm_add_epi16(t0, t1), 2);
+            v[0] = _mm_unpacklo_epi16(e0, o0);
+            v[1] = _mm_unpackhi_epi16(e0, o0);
+            v[2] = _mm_unpacklo_epi16(e2, o2);
+            v[3] = _mm_unpackhi_epi16(e2, o2);
+            v[4] = _mm_unpacklo_epi16(e1, o1);
+            v[5] = _mm_unpackhi_epi16(e1, o1);
+            v[6] = _mm_unpacklo_epi16(e3, o3);
+            v[7] = _mm_unpackhi_epi16(e3, o3);
+
+            for (k = 0; k < n; k++) {
+                vthresh = _mm_set1_epi16(threshs[k]);
+                for (i = 0; i < 2; i++) {
+                    lineds[k][i * wpld + j / 16] = scaleGrayPackBits32(
+                        _mm_cmplt_epi16(v[4 * i], vthresh),
+                        _mm_cmplt_epi16(v[4 * i + 1], vthresh),
+                        _mm_cmplt_epi16(v[4 * i + 2], vthresh),
+                        _mm_cmplt_epi16(v[4 * i + 3], vthresh));
+                }
+            }
+            a = c;
+            ap = cp;
+        }
+    }
+#endif  /* __SSE2__ */
+
+        /* The rest, a pixel at a time for each dest image; j is a
+         * multiple of 16 here */
+    for (k = 0; k < n; k++) {
+        thresh = threshs[k];
+        lined = lineds[k];
+        linedp = lined + wpld;
+        word0 = word1 = 0;
+        for (js = j, jd = 2 * j; js < ws; js++, jd += 2) {
+            s1 = GET_DATA_BYTE(lines, js);
+            s3 = GET_DATA_BYTE(linesp, js);
+            if (js < wsm) {
+                s2 = GET_DATA_BYTE(lines, js + 1);
+                s4 = GET_DATA_BYTE(linesp, js + 1);
+            }
+            else {
+                s2 = s1;
+                s4 = s3;
+            }
+            word0 |= (((s1 - thresh) >> 31) & 1) << (31 - (jd & 31));
+            word0 |= ((((s1 + s2) / 2 - thresh) >> 31) & 1) <<
+                     (30 - (jd & 31));
+            word1 |= ((((s1 + s3) / 2 - thresh) >> 31) & 1) <<
+                     (31 - (jd & 31));
+            word1 |= ((((s1 + s2 + s3 + s4) / 4 - thresh) >> 31) & 1) <<
+                     (30 - (jd & 31));
+            if ((jd & 31) == 30) {
+                lined[jd >> 5] = word0;
+                linedp[jd >> 5] = word1;
+                word0 = word1 = 0;
+            }
+        }
+        if (jd & 31) {
+            lined[jd >> 5] = word0;
+            linedp[jd >> 5] = word1;
+        }
+    }
+    return;
+}
+
+
+/*!
+ *  scaleGray4xLIMultiThreshLineLow()
+ *
+ *      Input:  lineds  (ptrs to the top destline of each of n dest images)
+ *              wpld    (of each dest image)
+ *              lines   (ptr to current src line)
+ *              ws
+ *              wpls
+ *              lastlineflag  (1 if last src line; 0 otherwise)
+ *              threshs (n thresholds, each between 0 and 256)
+ *              n
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) As scaleGray2xLIMultiThreshLineLow(), for the 4 lines of
+ *          scaleGray4xLIThreshLineLow().
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGray4xLIMultiThreshLineLow(l_uint32       **lineds,
+                                l_int32          wpld,
+                                l_uint32        *lines,
+                                l_int32          ws,
+                                l_int32          wpls,
+                                l_int32          lastlineflag,
+                                const l_int32   *threshs,
+                                l_int32          n)
+{
+l_int32    j, js, jd, k, r, c, wsm, s1, s2, s3, s4, v, vn, thresh;
+l_uint32   word[4];
+l_uint32  *linesp, *lined;
+#if defined(__SSE2__)
+__m128i    vthresh, a, b, ap, bp, nx, np, vt, vnt, x01, x23, y01, y23;
+__m128i    c0, c1, c2, c3, vals[16];
+#endif  /* __SSE2__ */
+
+    wsm = ws - 1;
+    linesp = (lastlineflag) ? lines : lines + wpls;
+    j = 0;
+
+#if defined(__SSE2__)
+    if (simd_level() >= SIMD_SSE2) {
+        a = ap = _mm_setzero_si128();
+        if (ws >= 16) {
+            a = scaleGrayLoad8(lines);
+            ap = scaleGrayLoad8(linesp);
+        }
+        for (; j + 16 <= ws; j += 8) {
+            b = scaleGrayLoad8(lines + j / 4 + 2);
+            bp = scaleGrayLoad8(linesp + j / 4 + 2);
+            nx = scaleGrayNext8(a, b);
+            np = scaleGrayNext8(ap, bp);
+
+                /* The values of scaleGray4xLIThreshLineLow(), before
+                 * they are compared, in dest pixel order */
+            for (r = 0; r < 4; r++) {
+                vt = _mm_add_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(4 - r)),
+                                   _mm_mullo_epi16(ap, _mm_set1_epi16(r)));
+                vnt = _mm_add_epi16(_mm_mullo_epi16(nx, _mm_set1_epi16(4 - r)),
+                                    _mm_mullo_epi16(np, _mm_set1_epi16(r)));
+                c0 = _mm_srli_epi16(vt, 2);
+                c1 = _mm_srli_epi16(_mm_add_epi16(
+                         _mm_add_epi16(vt, _mm_add_epi16(vt, vt)), vnt), 4);
+                c2 = _mm_srli_epi16(_mm_add_epi16(vt, vnt), 3);
+                c3 = _mm_srli_epi16(_mm_add_epi16(
+                         vt, _mm_add_epi16(vnt, _mm_add_epi16(vnt, vnt))), 4);
+                x01 = _mm_unpacklo_epi16(c0, c1);
+                x23 = _mm_unpacklo_epi16(c2, c3);
+                y01 = _mm_unpackhi_epi16(c0, c1);
+                y23 = _mm_unpackhi_epi16(c2, c3);
+                vals[4 * r] = _mm_unpacklo_epi32(x01, x23);
+                vals[4 * r + 1] = _mm_unpackhi_epi32(x01, x23);
+                vals[4 * r + 2] = _mm_unpacklo_epi32(y01, y23);
+                vals[4 * r + 3] = _mm_unpackhi_epi32(y01, y23);
+            }
+
+            for (k = 0; k < n; k++) {
+                vthresh = _mm_set1_epi16(threshs[k]);
+                for (r = 0; r < 4; r++) {
+                    lineds[k][r * wpld + j / 8] = scaleGrayPackBits32(
+                        _mm_cmplt_epi16(vals[4 * r], vthresh),
+                        _mm_cmplt_epi16(vals[4 * r + 1], vthresh),
+                        _mm_cmplt_epi16(vals[4 * r + 2], vthresh),
+                        _mm_cmplt_epi16(vals[4 * r + 3], vthresh));
+                }
+            }
+            a = b;
+            ap = bp;
+        }
+    }
+#endif  /* __SSE2__ */
+
+        /* The rest, a pixel at a time for each dest image; j is a
+         * multiple of 8 here */
+    for (k = 0; k < n; k++) {
+        thresh = threshs[k];
+        lined = lineds[k];
+        word[0] = word[1] = word[2] = word[3] = 0;
+        for (js = j, jd = 4 * j; js < ws; js++, jd += 4) {
+            s1 = GET_DATA_BYTE(lines, js);
+            s3 = GET_DATA_BYTE(linesp, js);
+            if (js < wsm) {
+                s2 = GET_DATA_BYTE(lines, js + 1);
+                s4 = GET_DATA_BYTE(linesp, js + 1);
+            }
+            else {
+                s2 = s1;
+                s4 = s3;
+            }
+            for (r = 0; r < 4; r++) {
+                v = (4 - r) * s1 + r * s3;
+                vn = (4 - r) * s2 + r * s4;
+                for (c = 0; c < 4; c++) {
+                    word[r] |= (((((4 - c) * v + c * vn) / 16 - thresh) >>
+                                 31) & 1) << (31 - c - (jd & 31));
+                }
+            }
+            if ((jd & 31) == 28) {
+                for (r = 0; r < 4; r++) {
+                    lined[r * wpld + (jd >> 5)] = word[r];
+                    word[r] = 0;
+                }
+            }
+        }
+        if (jd & 31) {
+            for (r = 0; r < 4; r++)
+                lined[r * wpld + (jd >> 5)] = word[r];
+        }
+    }
+    return;
+}
+
+/*------------------------------------------------------------------*
+ *      Grayscale area reduction followed by binarization           *
+ *------------------------------------------------------------------*/
+/*!
+ *  scaleGrayAreaThreshLineLow()
+ *
+ *      Input:  lined   (ptr to dest line, of wd pixels)
+ *              wd      (dest width: ws / factor, rounded up)
+ *              lines   (ptr to the first of nrows src lines)
+ *              ws      (src width)
+ *              wpls    (src wpl)
+ *              nrows   (src lines to average: factor, or fewer at the
+ *                       bottom of the image)
+ *              factor  (reduction)
+ *              thresh  (between 0 and 256)
+ *      Return: void
+ *
+ *  Notes:
+ *      (1) Each dest pixel is 1 if the average of its block of factor
+ *          by nrows src pixels is less than thresh.  The blocks at the
+ *          right edge are narrower when ws isn't a multiple of factor,
+ *          and are averaged over the pixels that they have.
+ *      (2) Each block is summed straight from the src lines, so the
+ *          reduced gray line is never made.
+ */
+LEPTONICA_REAL_EXPORT void
+scaleGrayAreaThreshLineLow(l_uint32  *lined,
+                           l_int32    wd,
+                           l_uint32  *lines,
+                           l_int32    ws,
+                           l_int32    wpls,
+                           l_int32    nrows,
+                           l_int32    factor,
+                           l_int32    thresh)
+{
+l_int32    i, j, j0, jd, jend, sum;
+l_uint32   dword;
+l_uint32  *line;
+
+    dword = 0;
+    for (jd = 0; jd < wd; jd++) {
+        j0 = jd * factor;
+        jend = L_MIN(j0 + factor, ws);
+        sum = 0;
+        for (i = 0, line = lines; i < nrows; i++, line += wpls) {
+            for (j = j0; j < jend; j++)
+                sum += GET_DATA_BYTE(line, j);
+        }
+        if (sum < thresh * nrows * (jend - j0))
+            dword |= 0x80000000 >> (jd & 31);
+        if ((jd & 31) == 31) {
+            lined[jd / 32] = dword;
+            dword = 0;
+        }
+    }
+    if (wd & 31)
+        lined[wd / 32] = dword;
+    return;
+}